@@ -27,6 +27,13 @@
 
 #include <string.h>
 
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "google/ads/googleads/v11/services/google_ads_service.upbdefs.h"
 #include "google/protobuf/descriptor.pb.h"
 #include "google/protobuf/dynamic_message.h"
@@ -36,6 +43,8 @@
 #include "benchmarks/descriptor.upbdefs.h"
 #include "benchmarks/descriptor_sv.pb.h"
 #include "upb/def.hpp"
+#include "upb/mini_table.hpp"
+#include "upb/msg_internal.h"
 
 upb_StringView descriptor = benchmarks_descriptor_proto_upbdefinit.descriptor;
 namespace protobuf = ::google::protobuf;
@@ -72,6 +81,86 @@ static void BM_ArenaInitialBlockOneAlloc(benchmark::State& state) {
 }
 BENCHMARK(BM_ArenaInitialBlockOneAlloc);
 
+// Fuse and free from many threads at once.  Each group is private to one
+// thread, so this measures how well fuse/free scale when no external locking
+// is required.
+static void BM_ArenaFuseFree(benchmark::State& state) {
+  for (auto _ : state) {
+    upb_Arena* a = upb_Arena_New();
+    upb_Arena* b = upb_Arena_New();
+    upb_Arena_Fuse(a, b);
+    upb_Arena_Free(a);
+    upb_Arena_Free(b);
+  }
+}
+BENCHMARK(BM_ArenaFuseFree)->ThreadRange(1, 32);
+
+// Like an RPC server that fuses a request arena with a response arena created
+// by a different worker: arenas are handed between threads through a small set
+// of shared slots, then fused and freed on the receiving thread, so fuse and
+// free race on groups whose members live on other threads.
+static void BM_ArenaFuseFreeCrossThread(benchmark::State& state) {
+  static std::atomic<upb_Arena*> slots[16];
+  size_t slot = std::hash<std::thread::id>()(std::this_thread::get_id());
+  for (auto _ : state) {
+    upb_Arena* a = upb_Arena_New();
+    upb_Arena* b = upb_Arena_New();
+    upb_Arena* other = slots[slot++ % 16].exchange(b);
+    if (other) {
+      upb_Arena_Fuse(a, other);
+      upb_Arena_Free(other);
+    }
+    upb_Arena_Free(a);
+  }
+}
+BENCHMARK(BM_ArenaFuseFreeCrossThread)->ThreadRange(1, 32);
+
+enum BlockAllocMode {
+  GlobalAlloc,
+  ThreadCacheAlloc,
+  MmapAlloc,
+  HugePageAlloc,
+};
+
+static upb_alloc* GetBlockAlloc(BlockAllocMode mode) {
+  switch (mode) {
+    case GlobalAlloc:
+      return &upb_alloc_global;
+    case ThreadCacheAlloc:
+      return &upb_alloc_threadcache;
+    case MmapAlloc:
+      return &upb_alloc_mmap;
+    case HugePageAlloc:
+      return &upb_alloc_hugepage;
+  }
+  return nullptr;
+}
+
+// BM_ArenaOneAlloc, but from many threads at once and optionally growing the
+// arena through several blocks, which is where contention on the global
+// allocator hurts most.  The argument is the number of bytes allocated from
+// each arena.
+template <BlockAllocMode Mode>
+static void BM_ArenaAllocThreaded(benchmark::State& state) {
+  upb_alloc* alloc = GetBlockAlloc(Mode);
+  for (auto _ : state) {
+    upb_Arena* arena = upb_Arena_Init(NULL, 0, alloc);
+    for (int64_t i = 0; i < state.range(0); i += 256) {
+      upb_Arena_Malloc(arena, 256);
+    }
+    upb_Arena_Free(arena);
+  }
+  upb_alloc_threadcache_flush();
+}
+BENCHMARK_TEMPLATE(BM_ArenaAllocThreaded, GlobalAlloc)
+    ->Arg(1)
+    ->Arg(64 << 10)
+    ->ThreadRange(1, 32);
+BENCHMARK_TEMPLATE(BM_ArenaAllocThreaded, ThreadCacheAlloc)
+    ->Arg(1)
+    ->Arg(64 << 10)
+    ->ThreadRange(1, 32);
+
 enum LoadDescriptorMode {
   NoLayout,
   WithLayout,
@@ -234,6 +323,243 @@ BENCHMARK_TEMPLATE(BM_Parse_Upb_FileDesc, UseArena, Alias);
 BENCHMARK_TEMPLATE(BM_Parse_Upb_FileDesc, InitBlock, Copy);
 BENCHMARK_TEMPLATE(BM_Parse_Upb_FileDesc, InitBlock, Alias);
 
+// Parses a single large payload: many copies of the descriptor back to back,
+// which merge into one FileDescriptorProto.  The argument is the number of
+// copies.  At the larger size the arena grows to hundreds of megabytes, so
+// this measures how the block allocator copes with page faults and TLB misses.
+template <BlockAllocMode Mode>
+static void BM_Parse_Upb_LargePayload(benchmark::State& state) {
+  std::string payload;
+  for (int64_t i = 0; i < state.range(0); i++) {
+    payload.append(descriptor.data, descriptor.size);
+  }
+  for (auto _ : state) {
+    upb_Arena* arena = upb_Arena_Init(NULL, 0, GetBlockAlloc(Mode));
+    upb_benchmark_FileDescriptorProto* set =
+        upb_benchmark_FileDescriptorProto_parse(payload.data(), payload.size(),
+                                                arena);
+    if (!set) {
+      printf("Failed to parse.\n");
+      exit(1);
+    }
+    upb_Arena_Free(arena);
+  }
+  state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK_TEMPLATE(BM_Parse_Upb_LargePayload, GlobalAlloc)
+    ->Arg(16)
+    ->Arg(4096);
+BENCHMARK_TEMPLATE(BM_Parse_Upb_LargePayload, MmapAlloc)->Arg(16)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_Parse_Upb_LargePayload, HugePageAlloc)
+    ->Arg(16)
+    ->Arg(4096);
+
+// Builds a MiniTable with |fields|, which must be in field number order, and
+// the given message modifiers.  The benchmarks below use this for schemas that
+// exercise one path each, rather than adding a .proto for every one.
+struct FieldSpec {
+  upb_FieldType type;
+  uint32_t number;
+  uint64_t modifiers;
+};
+
+static upb_MiniTable* BuildTable(upb_Arena* arena,
+                                 std::initializer_list<FieldSpec> fields,
+                                 uint64_t msg_mod = 0) {
+  upb::MtDataEncoder e;
+  e.StartMessage(msg_mod);
+  for (const FieldSpec& f : fields) e.PutField(f.type, f.number, f.modifiers);
+  upb::Status status;
+  upb_MiniTable* table =
+      upb_MiniTable_Build(e.data().data(), e.data().size(),
+                          kUpb_MiniTablePlatform_Native, arena, status.ptr());
+  if (!table) {
+    printf("Failed to build MiniTable.\n");
+    exit(1);
+  }
+  return table;
+}
+
+static void PutVarint(std::string* out, uint64_t val) {
+  for (; val >= 0x80; val >>= 7) {
+    out->push_back(static_cast<char>(0x80 | (val & 0x7f)));
+  }
+  out->push_back(static_cast<char>(val));
+}
+
+static void PutDelimited(std::string* out, uint32_t number,
+                         const std::string& data) {
+  PutVarint(out, (number << 3) | kUpb_WireType_Delimited);
+  PutVarint(out, data.size());
+  *out += data;
+}
+
+static void SetSubMessage(upb_MiniTable* table, uint32_t number,
+                          const upb_MiniTable* sub) {
+  upb_MiniTable_SetSubMessage(table,
+                              const_cast<upb_MiniTable_Field*>(
+                                  upb_MiniTable_FindFieldByNumber(table,
+                                                                  number)),
+                              sub);
+}
+
+// Parses |payload| for benchmarks that measure encoding.
+static upb_Message* ParseOrDie(const std::string& payload,
+                               const upb_MiniTable* table, upb_Arena* arena,
+                               int options = 0) {
+  upb_Message* msg = _upb_Message_New(table, arena);
+  if (upb_Decode(payload.data(), payload.size(), msg, table, NULL, options,
+                 arena) != kUpb_DecodeStatus_Ok) {
+    printf("Failed to parse.\n");
+    exit(1);
+  }
+  return msg;
+}
+
+// Returns field 1 holding 4096 packed varints that are each |len| bytes long.
+// The low bits vary so that zigzag decoding flips between signs.
+static std::string PackedVarintPayload(int len) {
+  int bits = 7 * (len - 1);
+  std::string packed;
+  for (int i = 0; i < 4096; i++) {
+    PutVarint(&packed, (1ULL << bits) | (i & ((1ULL << bits) - 1)));
+  }
+  std::string payload;
+  PutVarint(&payload, (1 << 3) | kUpb_WireType_Delimited);
+  PutVarint(&payload, packed.size());
+  return payload + packed;
+}
+
+// Parses a message whose only field is a packed repeated integer of the given
+// type holding 4096 elements.  The argument is the encoded length of each
+// varint in bytes, which is what decides how much work the packed varint
+// kernels save over decoding one element at a time.
+template <upb_FieldType Type>
+static void BM_Parse_Upb_PackedVarint(benchmark::State& state) {
+  upb::Arena table_arena;
+  upb_MiniTable* table = BuildTable(
+      table_arena.ptr(),
+      {{Type, 1, kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked}});
+  std::string payload = PackedVarintPayload(state.range(0));
+
+  for (auto _ : state) {
+    upb_Arena* arena = upb_Arena_New();
+    upb_Message* msg = _upb_Message_New(table, arena);
+    if (upb_Decode(payload.data(), payload.size(), msg, table, NULL, 0,
+                   arena) != kUpb_DecodeStatus_Ok) {
+      printf("Failed to parse.\n");
+      exit(1);
+    }
+    upb_Arena_Free(arena);
+  }
+  state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK_TEMPLATE(BM_Parse_Upb_PackedVarint, kUpb_FieldType_Int32)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(5);
+BENCHMARK_TEMPLATE(BM_Parse_Upb_PackedVarint, kUpb_FieldType_SInt32)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(5);
+BENCHMARK_TEMPLATE(BM_Parse_Upb_PackedVarint, kUpb_FieldType_Int64)
+    ->Arg(1)
+    ->Arg(5)
+    ->Arg(10);
+BENCHMARK_TEMPLATE(BM_Parse_Upb_PackedVarint, kUpb_FieldType_SInt64)
+    ->Arg(1)
+    ->Arg(5)
+    ->Arg(10);
+
+// Serializes the same messages as BM_Parse_Upb_PackedVarint.
+template <upb_FieldType Type>
+static void BM_Serialize_Upb_PackedVarint(benchmark::State& state) {
+  upb::Arena arena;
+  upb_MiniTable* table = BuildTable(
+      arena.ptr(),
+      {{Type, 1, kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked}});
+  upb_Message* msg =
+      ParseOrDie(PackedVarintPayload(state.range(0)), table, arena.ptr());
+
+  size_t size;
+  for (auto _ : state) {
+    upb_Arena* enc_arena = upb_Arena_New();
+    char* data;
+    if (upb_Encode(msg, table, 0, enc_arena, &data, &size) !=
+        kUpb_EncodeStatus_Ok) {
+      printf("Failed to serialize.\n");
+      exit(1);
+    }
+    upb_Arena_Free(enc_arena);
+  }
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK_TEMPLATE(BM_Serialize_Upb_PackedVarint, kUpb_FieldType_Int32)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(5);
+BENCHMARK_TEMPLATE(BM_Serialize_Upb_PackedVarint, kUpb_FieldType_SInt32)
+    ->Arg(1)
+    ->Arg(2)
+    ->Arg(5);
+BENCHMARK_TEMPLATE(BM_Serialize_Upb_PackedVarint, kUpb_FieldType_Int64)
+    ->Arg(1)
+    ->Arg(5)
+    ->Arg(10);
+BENCHMARK_TEMPLATE(BM_Serialize_Upb_PackedVarint, kUpb_FieldType_SInt64)
+    ->Arg(1)
+    ->Arg(5)
+    ->Arg(10);
+
+enum Utf8Text { Ascii, Mixed, Cjk };
+
+// Parses a message whose only field is a repeated proto3 string holding 64
+// strings, so that every string is checked for valid UTF-8.  The argument is
+// the minimum length of each string in bytes.  Mixed text is mostly ASCII with
+// an accented letter every ten characters, CJK text is all three-byte
+// characters.
+template <Utf8Text Text>
+static void BM_Parse_Upb_Utf8String(benchmark::State& state) {
+  upb::Arena table_arena;
+  upb_MiniTable* table =
+      BuildTable(table_arena.ptr(),
+                 {{kUpb_FieldType_String, 1, kUpb_FieldModifier_IsRepeated}},
+                 kUpb_MessageModifier_ValidateUtf8);
+
+  std::string str;
+  for (int i = 0; str.size() < static_cast<size_t>(state.range(0)); i++) {
+    if (Text == Cjk) {
+      str += "\xe6\x96\x87";  // U+6587
+    } else if (Text == Mixed && i % 10 == 9) {
+      str += "\xc3\xa9";  // U+00E9
+    } else {
+      str += static_cast<char>('a' + i % 26);
+    }
+  }
+  std::string payload;
+  for (int i = 0; i < 64; i++) {
+    PutVarint(&payload, (1 << 3) | kUpb_WireType_Delimited);
+    PutVarint(&payload, str.size());
+    payload += str;
+  }
+
+  for (auto _ : state) {
+    upb_Arena* arena = upb_Arena_New();
+    upb_Message* msg = _upb_Message_New(table, arena);
+    if (upb_Decode(payload.data(), payload.size(), msg, table, NULL,
+                   kUpb_DecodeOption_AliasString,
+                   arena) != kUpb_DecodeStatus_Ok) {
+      printf("Failed to parse.\n");
+      exit(1);
+    }
+    upb_Arena_Free(arena);
+  }
+  state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK_TEMPLATE(BM_Parse_Upb_Utf8String, Ascii)->Arg(16)->Arg(64)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_Parse_Upb_Utf8String, Mixed)->Arg(16)->Arg(64)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_Parse_Upb_Utf8String, Cjk)->Arg(16)->Arg(64)->Arg(1024);
+
 template <ArenaMode AMode, class P>
 struct Proto2Factory;
 
@@ -332,3 +658,291 @@ static void BM_SerializeDescriptor_Upb(benchmark::State& state) {
   state.SetBytesProcessed(total);
 }
 BENCHMARK(BM_SerializeDescriptor_Upb);
+
+enum SizeMode {
+  // upb_Encode() on its own, the baseline.
+  Encode,
+  // upb_Message_ByteSize() on its own.
+  ByteSize,
+  // upb_Message_ByteSizeCached() followed by upb_EncodeCached().
+  CachedEncode,
+};
+
+template <SizeMode Mode>
+static size_t SizeOrEncode(const upb_Message* msg, const upb_MiniTable* table,
+                           upb_Arena* arena) {
+  size_t size;
+  upb_EncodeStatus status;
+  if (Mode == Encode) {
+    char* data;
+    status = upb_Encode(msg, table, 0, arena, &data, &size);
+  } else if (Mode == ByteSize) {
+    status = upb_Message_ByteSize(msg, table, 0, &size);
+  } else {
+    upb_EncodeSizeCache* cache;
+    char* data;
+    status = upb_Message_ByteSizeCached(msg, table, 0, arena, &cache, &size);
+    if (status == kUpb_EncodeStatus_Ok) {
+      status = upb_EncodeCached(msg, table, cache, arena, &data, &size);
+    }
+  }
+  if (status != kUpb_EncodeStatus_Ok) {
+    printf("Failed to serialize.\n");
+    exit(1);
+  }
+  return size;
+}
+
+template <SizeMode Mode>
+static void BM_ByteSizeDescriptor_Upb(benchmark::State& state) {
+  int64_t total = 0;
+  upb::Arena arena;
+  upb_benchmark_FileDescriptorProto* set =
+      upb_benchmark_FileDescriptorProto_parse(descriptor.data, descriptor.size,
+                                              arena.ptr());
+  if (!set) {
+    printf("Failed to parse.\n");
+    exit(1);
+  }
+  for (auto _ : state) {
+    upb_Arena* enc_arena = upb_Arena_Init(buf, sizeof(buf), NULL);
+    total += SizeOrEncode<Mode>(
+        set, &upb_benchmark_FileDescriptorProto_msginit, enc_arena);
+    upb_Arena_Free(enc_arena);
+  }
+  state.SetBytesProcessed(total);
+}
+BENCHMARK_TEMPLATE(BM_ByteSizeDescriptor_Upb, Encode);
+BENCHMARK_TEMPLATE(BM_ByteSizeDescriptor_Upb, ByteSize);
+BENCHMARK_TEMPLATE(BM_ByteSizeDescriptor_Upb, CachedEncode);
+
+// A synthetic tree of messages, each with a few scalars, a string and a packed
+// array.  The argument is the number of children of each interior node; the
+// tree is four levels deep.
+template <SizeMode Mode>
+static void BM_ByteSizeTree_Upb(benchmark::State& state) {
+  upb::Arena arena;
+  upb_MiniTable* table = BuildTable(
+      arena.ptr(),
+      {{kUpb_FieldType_Int64, 1, 0},
+       {kUpb_FieldType_String, 2, 0},
+       {kUpb_FieldType_Message, 3, kUpb_FieldModifier_IsRepeated},
+       {kUpb_FieldType_Int32, 4,
+        kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked},
+       {kUpb_FieldType_Double, 5, 0}});
+  SetSubMessage(table, 3, table);
+
+  std::function<std::string(int)> node = [&](int depth) {
+    std::string ret;
+    PutVarint(&ret, (1 << 3) | kUpb_WireType_Varint);
+    PutVarint(&ret, 1ULL << (depth * 13));
+    PutDelimited(&ret, 2, std::string(10 + depth * 20, 'x'));
+    if (depth > 0) {
+      std::string child = node(depth - 1);
+      for (int i = 0; i < state.range(0); i++) PutDelimited(&ret, 3, child);
+    }
+    std::string packed;
+    for (int i = 0; i < 16; i++) PutVarint(&packed, i * 1000);
+    PutDelimited(&ret, 4, packed);
+    ret.push_back((5 << 3) | kUpb_WireType_64Bit);
+    ret.append(8, '\x3f');
+    return ret;
+  };
+  std::string payload = node(3);
+  upb_Message* msg = ParseOrDie(payload, table, arena.ptr());
+
+  for (auto _ : state) {
+    upb_Arena* enc_arena = upb_Arena_New();
+    SizeOrEncode<Mode>(msg, table, enc_arena);
+    upb_Arena_Free(enc_arena);
+  }
+  state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK_TEMPLATE(BM_ByteSizeTree_Upb, Encode)->Arg(2)->Arg(8);
+BENCHMARK_TEMPLATE(BM_ByteSizeTree_Upb, ByteSize)->Arg(2)->Arg(8);
+BENCHMARK_TEMPLATE(BM_ByteSizeTree_Upb, CachedEncode)->Arg(2)->Arg(8);
+
+enum OutputMode {
+  // upb_Encode() into an arena, the baseline.
+  ArenaOutput,
+  // upb_EncodeToBuffer() into a buffer that is large enough.
+  BufferOutput,
+  // upb_EncodeToSink() in 64 KiB chunks.
+  SinkOutput,
+};
+
+// Encodes a large message: a tree of sub-messages holding 1 KiB strings.  The
+// argument is the approximate encoded size in KiB.
+template <OutputMode Mode>
+static void BM_EncodeLarge_Upb(benchmark::State& state) {
+  upb::Arena arena;
+  upb_MiniTable* table =
+      BuildTable(arena.ptr(),
+                 {{kUpb_FieldType_Message, 1, kUpb_FieldModifier_IsRepeated},
+                  {kUpb_FieldType_Bytes, 2, kUpb_FieldModifier_IsRepeated},
+                  {kUpb_FieldType_Int64, 3, 0}});
+  SetSubMessage(table, 1, table);
+
+  std::string child;
+  for (int i = 0; i < 16; i++) PutDelimited(&child, 2, std::string(1024, 'x'));
+  PutVarint(&child, (3 << 3) | kUpb_WireType_Varint);
+  PutVarint(&child, 123456789);
+  std::string payload;
+  for (int64_t i = 0; i < state.range(0) / 16; i++) {
+    PutDelimited(&payload, 1, child);
+  }
+  upb_Message* msg = ParseOrDie(payload, table, arena.ptr(),
+                                kUpb_DecodeOption_AliasString);
+
+  std::vector<char> out(Mode == SinkOutput ? 64 * 1024 : payload.size());
+  for (auto _ : state) {
+    upb_Arena* enc_arena = upb_Arena_New();
+    upb_EncodeStatus status;
+    if (Mode == ArenaOutput) {
+      char* data;
+      size_t size;
+      status = upb_Encode(msg, table, 0, enc_arena, &data, &size);
+    } else if (Mode == BufferOutput) {
+      size_t size;
+      status = upb_EncodeToBuffer(msg, table, 0, out.data(), out.size(), &size);
+    } else {
+      status = upb_EncodeToSink(
+          msg, table, 0, enc_arena, out.data(), out.size(),
+          [](void* closure, const char* data, size_t size) {
+            benchmark::DoNotOptimize(data);
+            return true;
+          },
+          NULL);
+    }
+    if (status != kUpb_EncodeStatus_Ok) {
+      printf("Failed to serialize.\n");
+      exit(1);
+    }
+    upb_Arena_Free(enc_arena);
+  }
+  state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK_TEMPLATE(BM_EncodeLarge_Upb, ArenaOutput)->Arg(64)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_EncodeLarge_Upb, BufferOutput)->Arg(64)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_EncodeLarge_Upb, SinkOutput)->Arg(64)->Arg(4096);
+
+// Encodes a message holding eight large bytes fields, either copying them with
+// upb_Encode() or referencing them with upb_EncodeToSegments().  The argument
+// is the size of each field in KiB.
+template <bool Segments>
+static void BM_EncodeBlobs_Upb(benchmark::State& state) {
+  upb::Arena arena;
+  upb_MiniTable* table =
+      BuildTable(arena.ptr(),
+                 {{kUpb_FieldType_Bytes, 1, kUpb_FieldModifier_IsRepeated},
+                  {kUpb_FieldType_Int64, 2, 0}});
+
+  std::string payload;
+  std::string blob(state.range(0) * 1024, 'x');
+  for (int i = 0; i < 8; i++) PutDelimited(&payload, 1, blob);
+  upb_Message* msg = ParseOrDie(payload, table, arena.ptr(),
+                                kUpb_DecodeOption_AliasString);
+
+  for (auto _ : state) {
+    upb_Arena* enc_arena = upb_Arena_New();
+    upb_EncodeStatus status;
+    if (Segments) {
+      upb_EncodeSegment* segments;
+      size_t count;
+      status = upb_EncodeToSegments(msg, table, 0, 4096, enc_arena, &segments,
+                                    &count);
+    } else {
+      char* data;
+      size_t size;
+      status = upb_Encode(msg, table, 0, enc_arena, &data, &size);
+    }
+    if (status != kUpb_EncodeStatus_Ok) {
+      printf("Failed to serialize.\n");
+      exit(1);
+    }
+    upb_Arena_Free(enc_arena);
+  }
+  state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK_TEMPLATE(BM_EncodeBlobs_Upb, false)->Arg(64)->Arg(4096);
+BENCHMARK_TEMPLATE(BM_EncodeBlobs_Upb, true)->Arg(64)->Arg(4096);
+
+// Deterministic encoding of a message with one map<K, int32> field holding
+// state.range(0) entries, which is dominated by sorting the map.  With
+// ReuseSorter, every encode shares one upb_EncodeSorter instead of growing
+// fresh sort buffers in its arena.
+template <upb_FieldType KeyType, bool ReuseSorter>
+static void BM_EncodeDeterministicMap_Upb(benchmark::State& state) {
+  upb::Arena arena;
+  upb_MiniTable* table = BuildTable(
+      arena.ptr(),
+      {{kUpb_FieldType_Message, 1, kUpb_FieldModifier_IsRepeated}});
+  upb_MiniTable* entry = upb_MiniTable_BuildMapEntry(
+      KeyType, kUpb_FieldType_Int32, false, kUpb_MiniTablePlatform_Native,
+      arena.ptr());
+  SetSubMessage(table, 1, entry);
+
+  std::string payload;
+  uint64_t x = 88172645463325252ull;
+  for (int i = 0; i < state.range(0); i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    std::string ent;
+    if (KeyType == kUpb_FieldType_String) {
+      PutDelimited(&ent, 1, "key_" + std::to_string(x % 1000000));
+    } else {
+      PutVarint(&ent, (1 << 3) | kUpb_WireType_Varint);
+      PutVarint(&ent, KeyType == kUpb_FieldType_Int32
+                          ? static_cast<uint64_t>(static_cast<int32_t>(x))
+                          : x);
+    }
+    PutVarint(&ent, (2 << 3) | kUpb_WireType_Varint);
+    PutVarint(&ent, i);
+    PutDelimited(&payload, 1, ent);
+  }
+  upb_Message* msg = ParseOrDie(payload, table, arena.ptr());
+  upb_EncodeSorter* sorter = upb_EncodeSorter_New(arena.ptr());
+
+  for (auto _ : state) {
+    upb_Arena* enc_arena = upb_Arena_New();
+    char* data;
+    size_t size;
+    upb_EncodeStatus status =
+        ReuseSorter ? upb_EncodeWithSorter(msg, table,
+                                           kUpb_EncodeOption_Deterministic,
+                                           enc_arena, sorter, &data, &size)
+                    : upb_Encode(msg, table, kUpb_EncodeOption_Deterministic,
+                                 enc_arena, &data, &size);
+    if (status != kUpb_EncodeStatus_Ok) {
+      printf("Failed to serialize.\n");
+      exit(1);
+    }
+    upb_Arena_Free(enc_arena);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_EncodeDeterministicMap_Upb, kUpb_FieldType_Int32, false)
+    ->Arg(8)
+    ->Arg(64)
+    ->Arg(4096);
+BENCHMARK_TEMPLATE(BM_EncodeDeterministicMap_Upb, kUpb_FieldType_Int32, true)
+    ->Arg(8)
+    ->Arg(64)
+    ->Arg(4096);
+BENCHMARK_TEMPLATE(BM_EncodeDeterministicMap_Upb, kUpb_FieldType_Int64, false)
+    ->Arg(8)
+    ->Arg(64)
+    ->Arg(4096);
+BENCHMARK_TEMPLATE(BM_EncodeDeterministicMap_Upb, kUpb_FieldType_Int64, true)
+    ->Arg(8)
+    ->Arg(64)
+    ->Arg(4096);
+BENCHMARK_TEMPLATE(BM_EncodeDeterministicMap_Upb, kUpb_FieldType_String, false)
+    ->Arg(8)
+    ->Arg(64)
+    ->Arg(4096);
+BENCHMARK_TEMPLATE(BM_EncodeDeterministicMap_Upb, kUpb_FieldType_String, true)
+    ->Arg(8)
+    ->Arg(64)
+    ->Arg(4096);
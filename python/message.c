@@ -1236,15 +1236,20 @@ static PyObject* PyUpb_Message_ParseFromString(PyObject* self, PyObject* arg) {
 }
 
 static PyObject* PyUpb_Message_ByteSize(PyObject* self, PyObject* args) {
-  // TODO(https://github.com/protocolbuffers/upb/issues/462): At the moment upb
-  // does not have a "byte size" function, so we just serialize to string and
-  // get the size of the string.
-  PyObject* subargs = PyTuple_New(0);
-  PyObject* serialized = PyUpb_Message_SerializeToString(self, subargs, NULL);
-  Py_DECREF(subargs);
-  if (!serialized) return NULL;
-  size_t size = PyBytes_Size(serialized);
-  Py_DECREF(serialized);
+  upb_Message* msg = PyUpb_Message_GetIfReified(self);
+  if (!msg) return PyLong_FromSize_t(0);
+
+  const upb_MessageDef* msgdef = _PyUpb_Message_GetMsgdef(self);
+  const upb_MiniTable* layout = upb_MessageDef_MiniTable(msgdef);
+  size_t size;
+  // Python does not currently have any effective limit on serialization depth.
+  upb_EncodeStatus status = upb_Message_ByteSize(
+      msg, layout, UPB_ENCODE_MAXDEPTH(UINT32_MAX), &size);
+  if (status != kUpb_EncodeStatus_Ok) {
+    PyUpb_ModuleState* state = PyUpb_ModuleState_Get();
+    PyErr_Format(state->encode_error_class, "Failed to compute proto size");
+    return NULL;
+  }
   return PyLong_FromSize_t(size);
 }
 
@@ -25,9 +25,20 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* For MAP_ANONYMOUS and madvise(), which strict C99 mode hides. */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include "upb/alloc.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 // Must be last.
 #include "upb/port_def.inc"
@@ -45,3 +56,274 @@ static void* upb_global_allocfunc(upb_alloc* alloc, void* ptr, size_t oldsize,
 }
 
 upb_alloc upb_alloc_global = {&upb_global_allocfunc};
+
+/* upb_alloc_threadcache *****************************************************/
+
+/* Blocks are rounded up to a power of two between 2^kMinClass and 2^kMaxClass
+ * bytes (including our header).  Larger blocks bypass the cache.  Each thread
+ * caches at most UPB_THREADCACHE_MAX_BYTES of free blocks. */
+#ifndef UPB_THREADCACHE_MAX_BYTES
+#define UPB_THREADCACHE_MAX_BYTES (4 << 20)
+#endif
+
+enum {
+  kUpb_ThreadCache_MinClass = 8,  /* 256 bytes */
+  kUpb_ThreadCache_MaxClass = 20, /* 1 MiB */
+  kUpb_ThreadCache_NoClass = 0,
+};
+
+#ifdef UPB_THREAD_LOCAL
+
+/* Every block is prefixed by a header that records its size class, since
+ * upb_free() does not pass the size. */
+typedef struct {
+  uint32_t size_class;
+} upb_ThreadCache_Header;
+
+static const size_t upb_threadcache_hdr =
+    UPB_ALIGN_MALLOC(sizeof(upb_ThreadCache_Header));
+
+typedef struct upb_ThreadCache_FreeBlock {
+  struct upb_ThreadCache_FreeBlock* next;
+} upb_ThreadCache_FreeBlock;
+
+typedef struct {
+  upb_ThreadCache_FreeBlock* lists[kUpb_ThreadCache_MaxClass + 1];
+  size_t bytes;
+} upb_ThreadCache;
+
+static UPB_THREAD_LOCAL upb_ThreadCache upb_threadcache;
+
+static uint32_t upb_ThreadCache_SizeClass(size_t size) {
+  uint32_t size_class = kUpb_ThreadCache_MinClass;
+  while (((size_t)1 << size_class) < size) {
+    if (++size_class > kUpb_ThreadCache_MaxClass) {
+      return kUpb_ThreadCache_NoClass;
+    }
+  }
+  return size_class;
+}
+
+static void* upb_ThreadCache_Malloc(size_t size) {
+  upb_ThreadCache_Header* hdr;
+  size_t total = size + upb_threadcache_hdr;
+  uint32_t size_class = upb_ThreadCache_SizeClass(total);
+
+  if (size_class == kUpb_ThreadCache_NoClass) {
+    hdr = malloc(total);
+  } else {
+    upb_ThreadCache_FreeBlock* cached = upb_threadcache.lists[size_class];
+    if (cached) {
+      upb_threadcache.lists[size_class] = cached->next;
+      upb_threadcache.bytes -= (size_t)1 << size_class;
+      hdr = (upb_ThreadCache_Header*)cached;
+      /* The previous owner (eg. an arena) may have left parts poisoned. */
+      UPB_UNPOISON_MEMORY_REGION(hdr, (size_t)1 << size_class);
+    } else {
+      hdr = malloc((size_t)1 << size_class);
+    }
+  }
+
+  if (!hdr) return NULL;
+  hdr->size_class = size_class;
+  return UPB_PTR_AT(hdr, upb_threadcache_hdr, void);
+}
+
+static void upb_ThreadCache_Free(void* ptr) {
+  upb_ThreadCache_Header* hdr =
+      UPB_PTR_AT(ptr, -(ptrdiff_t)upb_threadcache_hdr, upb_ThreadCache_Header);
+  uint32_t size_class = hdr->size_class;
+  size_t bytes = (size_t)1 << size_class;
+
+  if (size_class == kUpb_ThreadCache_NoClass ||
+      upb_threadcache.bytes + bytes > UPB_THREADCACHE_MAX_BYTES) {
+    free(hdr);
+    return;
+  }
+
+  /* Blocks freed on this thread go into this thread's cache, regardless of
+   * which thread allocated them. */
+  upb_ThreadCache_FreeBlock* f = (upb_ThreadCache_FreeBlock*)hdr;
+  f->next = upb_threadcache.lists[size_class];
+  upb_threadcache.lists[size_class] = f;
+  upb_threadcache.bytes += bytes;
+}
+
+static void* upb_threadcache_allocfunc(upb_alloc* alloc, void* ptr,
+                                       size_t oldsize, size_t size) {
+  UPB_UNUSED(alloc);
+  if (size == 0) {
+    if (ptr) upb_ThreadCache_Free(ptr);
+    return NULL;
+  }
+
+  if (ptr) {
+    upb_ThreadCache_Header* hdr = UPB_PTR_AT(
+        ptr, -(ptrdiff_t)upb_threadcache_hdr, upb_ThreadCache_Header);
+    if (hdr->size_class != kUpb_ThreadCache_NoClass &&
+        size + upb_threadcache_hdr <= ((size_t)1 << hdr->size_class)) {
+      return ptr; /* Still fits in the same block. */
+    }
+  }
+
+  void* ret = upb_ThreadCache_Malloc(size);
+  if (ret && ptr) {
+    memcpy(ret, ptr, UPB_MIN(oldsize, size));
+    upb_ThreadCache_Free(ptr);
+  }
+  return ret;
+}
+
+void upb_alloc_threadcache_flush(void) {
+  for (int i = 0; i <= kUpb_ThreadCache_MaxClass; i++) {
+    upb_ThreadCache_FreeBlock* f = upb_threadcache.lists[i];
+    while (f) {
+      upb_ThreadCache_FreeBlock* next = f->next;
+      free(f);
+      f = next;
+    }
+    upb_threadcache.lists[i] = NULL;
+  }
+  upb_threadcache.bytes = 0;
+}
+
+upb_alloc upb_alloc_threadcache = {&upb_threadcache_allocfunc};
+
+#else
+
+/* Without thread-local storage we cannot cache, so this is just malloc. */
+void upb_alloc_threadcache_flush(void) {}
+
+upb_alloc upb_alloc_threadcache = {&upb_global_allocfunc};
+
+#endif
+
+/* upb_alloc_mmap ************************************************************/
+
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifdef MAP_ANONYMOUS
+
+/* Transparent huge pages must be aligned to their size to be used. */
+#ifndef UPB_HUGEPAGE_SIZE
+#define UPB_HUGEPAGE_SIZE (2 << 20)
+#endif
+
+/* Smaller requests go to malloc(): a mapping costs two system calls and at
+ * least a page, which is not worth it for an arena's first few blocks. */
+#ifndef UPB_MMAP_MIN_SIZE
+#define UPB_MMAP_MIN_SIZE (64 << 10)
+#endif
+
+/* Every block is prefixed by a header that records the size of its mapping,
+ * since upb_free() does not pass the size. */
+typedef struct {
+  size_t mapped; /* 0 if the block came from malloc(). */
+} upb_Mmap_Header;
+
+static const size_t upb_mmap_hdr = UPB_ALIGN_MALLOC(sizeof(upb_Mmap_Header));
+
+/* Maps |size| bytes (a multiple of the page size) aligned to |align|, by
+ * mapping enough extra to find an aligned start and unmapping the rest. */
+static void* upb_Mmap_Map(size_t size, size_t align, size_t page) {
+  size_t len = size + (align > page ? align - page : 0);
+  if (len < size) return NULL;
+  char* p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+
+  char* ret = (char*)UPB_ALIGN_UP((uintptr_t)p, align);
+  char* end = p + len;
+  if (ret > p) munmap(p, ret - p);
+  if (end > ret + size) munmap(ret + size, end - (ret + size));
+
+  /* This address range may have belonged to a mapping that was poisoned. */
+  UPB_UNPOISON_MEMORY_REGION(ret, size);
+  return ret;
+}
+
+static void* upb_Mmap_Malloc(size_t size, bool huge) {
+  size_t total = size + upb_mmap_hdr;
+  upb_Mmap_Header* hdr;
+  if (total < size) return NULL;
+
+  if (total < UPB_MMAP_MIN_SIZE) {
+    hdr = malloc(total);
+    if (!hdr) return NULL;
+    hdr->mapped = 0;
+  } else {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapped = UPB_ALIGN_UP(total, page);
+    /* Only blocks that span at least one huge page benefit from aligning
+     * them; the unaligned tail is simply backed by regular pages. */
+    huge = huge && mapped >= UPB_HUGEPAGE_SIZE;
+    hdr = upb_Mmap_Map(mapped, huge ? UPB_HUGEPAGE_SIZE : page, page);
+    if (!hdr) return NULL;
+#ifdef MADV_HUGEPAGE
+    if (huge) madvise(hdr, mapped, MADV_HUGEPAGE);
+#endif
+    hdr->mapped = mapped;
+  }
+
+  return UPB_PTR_AT(hdr, upb_mmap_hdr, void);
+}
+
+static void upb_Mmap_Free(void* ptr) {
+  upb_Mmap_Header* hdr =
+      UPB_PTR_AT(ptr, -(ptrdiff_t)upb_mmap_hdr, upb_Mmap_Header);
+  size_t mapped = hdr->mapped;
+  if (mapped) {
+    UPB_UNPOISON_MEMORY_REGION(hdr, mapped);
+    munmap(hdr, mapped);
+  } else {
+    free(hdr);
+  }
+}
+
+static void* upb_Mmap_Realloc(void* ptr, size_t oldsize, size_t size,
+                              bool huge) {
+  if (size == 0) {
+    if (ptr) upb_Mmap_Free(ptr);
+    return NULL;
+  }
+
+  if (ptr) {
+    upb_Mmap_Header* hdr =
+        UPB_PTR_AT(ptr, -(ptrdiff_t)upb_mmap_hdr, upb_Mmap_Header);
+    if (hdr->mapped && size <= hdr->mapped - upb_mmap_hdr) {
+      return ptr; /* Still fits in the same mapping. */
+    }
+  }
+
+  void* ret = upb_Mmap_Malloc(size, huge);
+  if (ret && ptr) {
+    memcpy(ret, ptr, UPB_MIN(oldsize, size));
+    upb_Mmap_Free(ptr);
+  }
+  return ret;
+}
+
+static void* upb_mmap_allocfunc(upb_alloc* alloc, void* ptr, size_t oldsize,
+                                size_t size) {
+  UPB_UNUSED(alloc);
+  return upb_Mmap_Realloc(ptr, oldsize, size, false);
+}
+
+static void* upb_hugepage_allocfunc(upb_alloc* alloc, void* ptr,
+                                    size_t oldsize, size_t size) {
+  UPB_UNUSED(alloc);
+  return upb_Mmap_Realloc(ptr, oldsize, size, true);
+}
+
+upb_alloc upb_alloc_mmap = {&upb_mmap_allocfunc};
+upb_alloc upb_alloc_hugepage = {&upb_hugepage_allocfunc};
+
+#else
+
+/* Without anonymous mappings these are just malloc. */
+upb_alloc upb_alloc_mmap = {&upb_global_allocfunc};
+upb_alloc upb_alloc_hugepage = {&upb_global_allocfunc};
+
+#endif
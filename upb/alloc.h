@@ -89,6 +89,43 @@ UPB_INLINE void* upb_grealloc(void* ptr, size_t oldsize, size_t size) {
 
 UPB_INLINE void upb_gfree(void* ptr) { upb_free(&upb_alloc_global, ptr); }
 
+/* An allocator for arena blocks that keeps a bounded per-thread cache of freed
+ * blocks in front of malloc(), so that arenas which are repeatedly created and
+ * destroyed can reuse their blocks without touching the global allocator:
+ *
+ *   upb_Arena* arena = upb_Arena_Init(NULL, 0, &upb_alloc_threadcache);
+ *
+ * Blocks are rounded up to a power of two (256 bytes to 1 MiB; larger blocks
+ * are not cached) and are cached by the thread that frees them, up to
+ * UPB_THREADCACHE_MAX_BYTES (default 4 MiB) per thread.  Memory from this
+ * allocator must only be freed with this allocator.
+ *
+ * A thread's cache is not released automatically when the thread exits;
+ * threads that cache blocks should call upb_alloc_threadcache_flush() before
+ * exiting.  If the platform lacks thread-local storage this is plain
+ * malloc(). */
+extern upb_alloc upb_alloc_threadcache;
+
+/* Returns all blocks cached by the calling thread to malloc(). */
+void upb_alloc_threadcache_flush(void);
+
+/* Allocators for arenas that grow to hundreds of megabytes, which obtain
+ * large blocks directly from the OS as anonymous mappings and unmap them when
+ * they are freed, instead of going through malloc():
+ *
+ *   upb_Arena* arena = upb_Arena_Init(NULL, 0, &upb_alloc_hugepage);
+ *
+ * upb_alloc_hugepage additionally aligns blocks of at least
+ * UPB_HUGEPAGE_SIZE (default 2 MiB) to that size and, where supported, marks
+ * them with MADV_HUGEPAGE so that they can be backed by transparent huge
+ * pages, which cuts TLB misses and page faults when the arena is filled.
+ *
+ * Requests below UPB_MMAP_MIN_SIZE (default 64 KiB) still use malloc().
+ * Memory from these allocators must only be freed with the same allocator.
+ * On platforms without mmap() they are plain malloc(). */
+extern upb_alloc upb_alloc_mmap;
+extern upb_alloc upb_alloc_hugepage;
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -27,23 +27,58 @@
 
 #include "upb/arena.h"
 
+#include <string.h>
+
 #include "upb/alloc.h"
 #include "upb/internal/arena.h"
+#include "upb/internal/atomic.h"
 
 // Must be last.
 #include "upb/port_def.inc"
 
-static uint32_t* upb_cleanup_pointer(uintptr_t cleanup_metadata) {
-  return (uint32_t*)(cleanup_metadata & ~0x1);
+static uintptr_t upb_Arena_MakeBlockAlloc(upb_alloc* alloc,
+                                          bool has_initial) {
+  uintptr_t alloc_uint = (uintptr_t)alloc;
+  UPB_ASSERT((alloc_uint & 1) == 0);
+  return alloc_uint | (has_initial ? 1 : 0);
+}
+
+static upb_alloc* upb_Arena_BlockAlloc(upb_Arena* a) {
+  return (upb_alloc*)(a->block_alloc & ~0x1);
+}
+
+static bool upb_Arena_HasInitialBlock(upb_Arena* a) {
+  return a->block_alloc & 0x1;
+}
+
+static bool _upb_Arena_IsTaggedRefcount(uintptr_t parent_or_count) {
+  return (parent_or_count & 1) == 1;
+}
+
+static bool _upb_Arena_IsTaggedPointer(uintptr_t parent_or_count) {
+  return (parent_or_count & 1) == 0;
+}
+
+static uintptr_t _upb_Arena_RefCountFromTagged(uintptr_t parent_or_count) {
+  UPB_ASSERT(_upb_Arena_IsTaggedRefcount(parent_or_count));
+  return parent_or_count >> 1;
+}
+
+static uintptr_t _upb_Arena_TaggedFromRefcount(uintptr_t refcount) {
+  uintptr_t parent_or_count = (refcount << 1) | 1;
+  UPB_ASSERT(_upb_Arena_IsTaggedRefcount(parent_or_count));
+  return parent_or_count;
 }
 
-static bool upb_cleanup_has_initial_block(uintptr_t cleanup_metadata) {
-  return cleanup_metadata & 0x1;
+static upb_Arena* _upb_Arena_PointerFromTagged(uintptr_t parent_or_count) {
+  UPB_ASSERT(_upb_Arena_IsTaggedPointer(parent_or_count));
+  return (upb_Arena*)parent_or_count;
 }
 
-static uintptr_t upb_cleanup_metadata(uint32_t* cleanup,
-                                      bool has_initial_block) {
-  return (uintptr_t)cleanup | has_initial_block;
+static uintptr_t _upb_Arena_TaggedFromPointer(upb_Arena* a) {
+  uintptr_t parent_or_count = (uintptr_t)a;
+  UPB_ASSERT(_upb_Arena_IsTaggedPointer(parent_or_count));
+  return parent_or_count;
 }
 
 struct mem_block {
@@ -61,48 +96,154 @@ typedef struct cleanup_ent {
 static const size_t memblock_reserve =
     UPB_ALIGN_UP(sizeof(mem_block), UPB_MALLOC_ALIGN);
 
-static upb_Arena* arena_findroot(upb_Arena* a) {
-  /* Path splitting keeps time complexity down, see:
-   *   https://en.wikipedia.org/wiki/Disjoint-set_data_structure */
-  while (a->parent != a) {
-    upb_Arena* next = a->parent;
-    a->parent = next->parent;
+typedef struct {
+  upb_Arena* root;
+  uintptr_t tagged_count;
+} upb_ArenaRoot;
+
+static upb_ArenaRoot arena_findroot(upb_Arena* a) {
+  uintptr_t poc = upb_Atomic_Load(&a->parent_or_count, memory_order_acquire);
+  while (_upb_Arena_IsTaggedPointer(poc)) {
+    upb_Arena* next = _upb_Arena_PointerFromTagged(poc);
+    uintptr_t next_poc =
+        upb_Atomic_Load(&next->parent_or_count, memory_order_acquire);
+
+    if (_upb_Arena_IsTaggedPointer(next_poc)) {
+      /* Path splitting keeps time complexity down, see:
+       *   https://en.wikipedia.org/wiki/Disjoint-set_data_structure
+       *
+       * A relaxed store is enough here: `next_poc` is *a* valid ancestor of
+       * `a`, and every thread that races with us will also only ever move
+       * `a`'s parent closer to the root.  The memory orderings that matter
+       * were carried by the acquire loads that discovered the path. */
+      upb_Atomic_Store(&a->parent_or_count, next_poc, memory_order_relaxed);
+    }
     a = next;
+    poc = next_poc;
   }
-  return a;
+  return (upb_ArenaRoot){.root = a, .tagged_count = poc};
 }
 
-static void upb_Arena_addblock(upb_Arena* a, upb_Arena* root, void* ptr,
-                               size_t size) {
-  mem_block* block = ptr;
+/* Makes `block`, which is already on one of our lists, the current block. */
+static void arena_useblock(upb_Arena* a, mem_block* block) {
+  size_t size = block->size;
+
+  /* Whatever is left of the current block can no longer be used. */
+  upb_Atomic_Store(&a->space_wasted,
+                   upb_Atomic_Load(&a->space_wasted, memory_order_relaxed) +
+                       (size_t)(a->head.end - a->head.ptr),
+                   memory_order_relaxed);
 
-  /* The block is for arena |a|, but should appear in the freelist of |root|. */
-  block->next = root->freelist;
-  block->size = (uint32_t)size;
   block->cleanups = 0;
-  root->freelist = block;
-  a->last_size = block->size;
-  if (!root->freelist_tail) root->freelist_tail = block;
+  a->last_size = UPB_MAX(a->last_size, block->size);
 
   a->head.ptr = UPB_PTR_AT(block, memblock_reserve, char);
   a->head.end = UPB_PTR_AT(block, size, char);
-  a->cleanup_metadata = upb_cleanup_metadata(
-      &block->cleanups, upb_cleanup_has_initial_block(a->cleanup_metadata));
+  a->cleanups = &block->cleanups;
 
   UPB_POISON_MEMORY_REGION(a->head.ptr, a->head.end - a->head.ptr);
 }
 
+static void upb_Arena_addblock(upb_Arena* a, void* ptr, size_t size) {
+  mem_block* block = ptr;
+
+  /* Each arena owns its own blocks; fused arenas are linked through `next`. */
+  block->next = a->freelist;
+  block->size = (uint32_t)size;
+  a->freelist = block;
+  arena_useblock(a, block);
+}
+
+/* Only the owning thread writes an arena's counters, so a load and a store
+ * is enough.  The values are relaxed atomics only so that other threads can
+ * sum them safely. */
+static void arena_addspace(upb_Arena* a, size_t bytes, size_t blocks) {
+  upb_Atomic_Store(
+      &a->space_allocated,
+      upb_Atomic_Load(&a->space_allocated, memory_order_relaxed) + bytes,
+      memory_order_relaxed);
+  upb_Atomic_Store(
+      &a->block_count,
+      upb_Atomic_Load(&a->block_count, memory_order_relaxed) + blocks,
+      memory_order_relaxed);
+}
+
+/* Returns false if allocating another |block_size| bytes would take the fused
+ * group containing |a| past its space limit.  Concurrent fuses may cause us to
+ * miss some of the group, so the limit is approximate in that case. */
+static bool arena_checkbudget(upb_Arena* a, size_t block_size) {
+  upb_Arena* root = arena_findroot(a).root;
+  size_t max = upb_Atomic_Load(&root->max_space, memory_order_relaxed);
+  if (UPB_LIKELY(max == SIZE_MAX)) return true;
+
+  size_t total = block_size;
+  bool seen = false;
+  for (upb_Arena* i = root; i; i = upb_Atomic_Load(&i->next,
+                                                    memory_order_acquire)) {
+    total += upb_Atomic_Load(&i->space_allocated, memory_order_relaxed);
+    if (i == a) seen = true;
+  }
+
+  /* The decoder's private copy of an arena is not in the list, and it only
+   * counts what it allocated itself. */
+  if (!seen) {
+    total += upb_Atomic_Load(&a->space_allocated, memory_order_relaxed);
+  }
+
+  return total <= max;
+}
+
 static bool upb_Arena_Allocblock(upb_Arena* a, size_t size) {
-  upb_Arena* root = arena_findroot(a);
-  size_t block_size = UPB_MAX(size, a->last_size * 2) + memblock_reserve;
-  mem_block* block = upb_malloc(root->block_alloc, block_size);
+  /* Prefer a block retained by upb_Arena_Reset().  They are sorted largest
+   * first, so if the first one is too small they all are. */
+  mem_block* spare = a->spare;
+  if (spare && spare->size - memblock_reserve >= size) {
+    a->spare = spare->next;
+    arena_useblock(a, spare);
+    return true;
+  }
+
+  upb_alloc* block_alloc = upb_Arena_BlockAlloc(a);
+  if (!block_alloc) return false; /* Fixed-size arena. */
+
+  size_t next_size = UPB_MIN((size_t)a->last_size * 2, a->max_block_size);
+  size_t block_size = UPB_MAX(size + memblock_reserve, next_size);
+  if (!arena_checkbudget(a, block_size)) return false;
+  mem_block* block = upb_malloc(block_alloc, block_size);
 
   if (!block) return false;
-  upb_Arena_addblock(a, root, block, block_size);
+  arena_addspace(a, block_size, 1);
+  upb_Arena_addblock(a, block, block_size);
   return true;
 }
 
+/* Serves a large allocation from a block of its own.  The block goes on the
+ * freelist so that it is freed with the arena, but the current block remains
+ * the one we bump-allocate from, and last_size is left alone so that the next
+ * regular block is not sized after this one. */
+static void* arena_largealloc(upb_Arena* a, size_t size) {
+  upb_alloc* block_alloc = upb_Arena_BlockAlloc(a);
+  if (!block_alloc) return NULL; /* Fixed-size arena. */
+
+  size_t block_size = size + memblock_reserve;
+  if (block_size < size) return NULL; /* Overflow. */
+  if (!arena_checkbudget(a, block_size)) return NULL;
+  mem_block* block = upb_malloc(block_alloc, block_size);
+  if (!block) return NULL;
+
+  arena_addspace(a, block_size, 1);
+  block->size = (uint32_t)block_size;
+  block->cleanups = 0;
+  block->next = a->freelist;
+  a->freelist = block;
+  return UPB_PTR_AT(block, memblock_reserve, void);
+}
+
 void* _upb_Arena_SlowMalloc(upb_Arena* a, size_t size) {
+  if (size >= a->large_alloc_threshold ||
+      size > a->max_block_size - memblock_reserve) {
+    return arena_largealloc(a, size);
+  }
   if (!upb_Arena_Allocblock(a, size)) return NULL; /* Out of memory. */
   UPB_ASSERT(_upb_ArenaHas(a) >= size);
   return upb_Arena_Malloc(a, size);
@@ -116,6 +257,29 @@ static void* upb_Arena_doalloc(upb_alloc* alloc, void* ptr, size_t oldsize,
 
 /* Public Arena API ***********************************************************/
 
+static void arena_initcommon(upb_Arena* a, upb_alloc* alloc,
+                             bool has_initial) {
+  a->head.alloc.func = &upb_Arena_doalloc;
+  a->block_alloc = upb_Arena_MakeBlockAlloc(alloc, has_initial);
+  a->head.ptr = NULL;
+  a->head.end = NULL;
+  a->cleanups = NULL;
+  a->last_size = 0;
+  a->max_block_size = SIZE_MAX;
+  a->large_alloc_threshold = SIZE_MAX;
+  a->freelist = NULL;
+  a->retained = NULL;
+  a->spare = NULL;
+  a->initial_block = NULL;
+  upb_Atomic_Init(&a->space_allocated, 0);
+  upb_Atomic_Init(&a->space_wasted, 0);
+  upb_Atomic_Init(&a->block_count, 0);
+  upb_Atomic_Init(&a->max_space, SIZE_MAX);
+  upb_Atomic_Init(&a->parent_or_count, _upb_Arena_TaggedFromRefcount(1));
+  upb_Atomic_Init(&a->next, NULL);
+  upb_Atomic_Init(&a->tail, a);
+}
+
 static upb_Arena* arena_initslow(void* mem, size_t n, upb_alloc* alloc) {
   const size_t first_block_overhead = sizeof(upb_Arena) + memblock_reserve;
   upb_Arena* a;
@@ -129,15 +293,9 @@ static upb_Arena* arena_initslow(void* mem, size_t n, upb_alloc* alloc) {
   a = UPB_PTR_AT(mem, n - sizeof(*a), upb_Arena);
   n -= sizeof(*a);
 
-  a->head.alloc.func = &upb_Arena_doalloc;
-  a->block_alloc = alloc;
-  a->parent = a;
-  a->refcount = 1;
-  a->freelist = NULL;
-  a->freelist_tail = NULL;
-  a->cleanup_metadata = upb_cleanup_metadata(NULL, false);
-
-  upb_Arena_addblock(a, a, mem, n);
+  arena_initcommon(a, alloc, false);
+  arena_addspace(a, n + sizeof(*a), 1);
+  upb_Arena_addblock(a, mem, n);
 
   return a;
 }
@@ -163,60 +321,267 @@ upb_Arena* upb_Arena_Init(void* mem, size_t n, upb_alloc* alloc) {
 
   a = UPB_PTR_AT(mem, n - sizeof(*a), upb_Arena);
 
-  a->head.alloc.func = &upb_Arena_doalloc;
-  a->block_alloc = alloc;
-  a->parent = a;
-  a->refcount = 1;
+  arena_initcommon(a, alloc, true);
+  a->initial_block = mem;
   a->last_size = UPB_MAX(128, n);
   a->head.ptr = mem;
   a->head.end = UPB_PTR_AT(mem, n - sizeof(*a), char);
-  a->freelist = NULL;
-  a->cleanup_metadata = upb_cleanup_metadata(NULL, true);
 
   return a;
 }
 
-static void arena_dofree(upb_Arena* a) {
-  mem_block* block = a->freelist;
-  UPB_ASSERT(a->parent == a);
-  UPB_ASSERT(a->refcount == 0);
+upb_Arena* upb_Arena_InitWithPolicy(void* mem, size_t n, upb_alloc* alloc,
+                                    const upb_ArenaGrowthPolicy* policy) {
+  upb_Arena* a = upb_Arena_Init(mem, n, alloc);
+  if (!a || !policy) return a;
+
+  if (policy->max_block_size) {
+    /* Leave room for at least a few small allocations in each block. */
+    a->max_block_size = UPB_MAX(policy->max_block_size, memblock_reserve + 128);
+  }
+  if (policy->large_alloc_threshold) {
+    a->large_alloc_threshold = policy->large_alloc_threshold;
+  }
+  return a;
+}
 
+static void arena_runcleanups(mem_block* block) {
+  if (block->cleanups > 0) {
+    cleanup_ent* end = UPB_PTR_AT(block, block->size, void);
+    cleanup_ent* ptr = end - block->cleanups;
+
+    for (; ptr < end; ptr++) {
+      ptr->cleanup(ptr->ud);
+    }
+  }
+}
+
+static void arena_freeblocks(upb_alloc* block_alloc, mem_block* block) {
   while (block) {
     /* Load first since we are deleting block. */
     mem_block* next = block->next;
+    arena_runcleanups(block);
+    upb_free(block_alloc, block);
+    block = next;
+  }
+}
+
+static void arena_dofree(upb_Arena* a) {
+  UPB_ASSERT(_upb_Arena_RefCountFromTagged(upb_Atomic_Load(
+                 &a->parent_or_count, memory_order_relaxed)) == 1);
+
+  while (a) {
+    /* Load first since the arena itself lives in one of its blocks. */
+    upb_Arena* next_arena = upb_Atomic_Load(&a->next, memory_order_acquire);
+    upb_alloc* block_alloc = upb_Arena_BlockAlloc(a);
+    mem_block* retained = a->retained;
+
+    arena_freeblocks(block_alloc, a->freelist);
+    arena_freeblocks(block_alloc, retained);
+    a = next_arena;
+  }
+}
+
+void upb_Arena_Free(upb_Arena* a) {
+  uintptr_t poc = upb_Atomic_Load(&a->parent_or_count, memory_order_acquire);
+retry:
+  while (_upb_Arena_IsTaggedPointer(poc)) {
+    a = _upb_Arena_PointerFromTagged(poc);
+    poc = upb_Atomic_Load(&a->parent_or_count, memory_order_acquire);
+  }
 
-    if (block->cleanups > 0) {
-      cleanup_ent* end = UPB_PTR_AT(block, block->size, void);
-      cleanup_ent* ptr = end - block->cleanups;
+  /* Read-modify-write operations are more expensive than plain loads, so if
+   * we are the last reference we can skip straight to freeing.  Nobody else
+   * can observe the refcount once it drops to zero. */
+  if (poc == _upb_Arena_TaggedFromRefcount(1)) {
+    arena_dofree(a);
+    return;
+  }
+
+  if (upb_Atomic_CompareExchangeWeak(
+          &a->parent_or_count, &poc,
+          _upb_Arena_TaggedFromRefcount(_upb_Arena_RefCountFromTagged(poc) - 1),
+          memory_order_release, memory_order_acquire)) {
+    /* We were >1 and we decremented it successfully, so we are done. */
+    return;
+  }
+
+  /* Somebody else fused or freed concurrently (or the weak CAS failed
+   * spuriously).  The failed exchange reloaded `poc` for us, and `a` may no
+   * longer be a root, so retry from the top. */
+  goto retry;
+}
+
+/* Returns true if `block` is the block that `a` itself was allocated from by
+ * arena_initslow().  The arena sits directly after that block's usable space,
+ * and the block cannot be freed while the arena is alive. */
+static bool arena_ishomeblock(upb_Arena* a, mem_block* block) {
+  return UPB_PTR_AT(block, block->size, upb_Arena) == a;
+}
 
-      for (; ptr < end; ptr++) {
-        ptr->cleanup(ptr->ud);
+bool upb_Arena_Reset(upb_Arena* a, size_t max_retained) {
+  /* Fusing is permanent, and the other arenas in the group may still be
+   * referencing our memory. */
+  uintptr_t poc = upb_Atomic_Load(&a->parent_or_count, memory_order_acquire);
+  if (poc != _upb_Arena_TaggedFromRefcount(1)) return false;
+  if (upb_Atomic_Load(&a->next, memory_order_acquire) != NULL) return false;
+
+  upb_alloc* block_alloc = upb_Arena_BlockAlloc(a);
+  mem_block* home = NULL;
+  mem_block* pending = NULL;
+  mem_block* lists[2] = {a->freelist, a->retained};
+
+  /* Run all cleanups, and gather every block except the home block (which we
+   * must keep) into a single list of candidates for retention. */
+  for (int i = 0; i < 2; i++) {
+    mem_block* block = lists[i];
+    while (block) {
+      mem_block* next = block->next;
+      arena_runcleanups(block);
+      block->cleanups = 0;
+      if (arena_ishomeblock(a, block)) {
+        home = block;
+      } else {
+        block->next = pending;
+        pending = block;
       }
+      block = next;
     }
+  }
 
-    upb_free(a->block_alloc, block);
-    block = next;
+  /* Greedily retain the largest blocks that fit in the budget, keeping the
+   * spare list sorted largest first.  The number of blocks is logarithmic in
+   * the arena size, so a quadratic selection is fine. */
+  mem_block* spare = NULL;
+  mem_block** spare_tail = &spare;
+  size_t kept_bytes = 0;
+  size_t kept_blocks = 0;
+  while (true) {
+    mem_block** best = NULL;
+    for (mem_block** p = &pending; *p; p = &(*p)->next) {
+      if ((*p)->size <= max_retained &&
+          (!best || (*p)->size > (*best)->size)) {
+        best = p;
+      }
+    }
+    if (!best) break;
+    mem_block* block = *best;
+    *best = block->next;
+    max_retained -= block->size;
+    kept_bytes += block->size;
+    kept_blocks++;
+    block->next = NULL;
+    *spare_tail = block;
+    spare_tail = &block->next;
+  }
+  arena_freeblocks(block_alloc, pending);
+
+  /* The home block is always retained; insert it in sorted position. */
+  if (home) {
+    kept_bytes += home->size + sizeof(*a);
+    kept_blocks++;
+    mem_block** p = &spare;
+    while (*p && (*p)->size >= home->size) p = &(*p)->next;
+    home->next = *p;
+    *p = home;
   }
+
+  a->freelist = NULL;
+  a->retained = spare;
+  a->spare = spare;
+  a->cleanups = NULL;
+  a->last_size = spare ? spare->size : 0;
+  a->head.ptr = NULL;
+  a->head.end = NULL;
+  upb_Atomic_Store(&a->space_allocated, kept_bytes, memory_order_relaxed);
+  upb_Atomic_Store(&a->block_count, kept_blocks, memory_order_relaxed);
+  upb_Atomic_Store(&a->space_wasted, 0, memory_order_relaxed);
+
+  if (a->initial_block) {
+    /* Always start again from the caller's initial block. */
+    a->head.ptr = a->initial_block;
+    a->head.end = (char*)a;
+    a->last_size = UPB_MAX(a->last_size, UPB_MAX(128, _upb_ArenaHas(a)));
+    UPB_POISON_MEMORY_REGION(a->head.ptr, _upb_ArenaHas(a));
+  } else {
+    /* Without an initial block we always have at least the home block. */
+    UPB_ASSERT(home);
+    a->spare = spare->next;
+    arena_useblock(a, spare);
+  }
+
+  return true;
 }
 
-void upb_Arena_Free(upb_Arena* a) {
-  a = arena_findroot(a);
-  if (--a->refcount == 0) arena_dofree(a);
+upb_ArenaCheckpoint upb_Arena_Checkpoint(upb_Arena* a) {
+  upb_ArenaCheckpoint c;
+  c.block = a->freelist;
+  c.spare = a->spare;
+  c.ptr = a->head.ptr;
+  c.end = a->head.end;
+  c.cleanups = a->cleanups;
+  c.cleanup_count = a->cleanups ? *a->cleanups : 0;
+  c.last_size = a->last_size;
+  c.space_wasted = upb_Atomic_Load(&a->space_wasted, memory_order_relaxed);
+  return c;
+}
+
+void upb_Arena_Rollback(upb_Arena* a, const upb_ArenaCheckpoint* c) {
+  upb_alloc* block_alloc = upb_Arena_BlockAlloc(a);
+  size_t freed_bytes = 0;
+  size_t freed_blocks = 0;
+
+  /* New blocks (including dedicated large-allocation blocks) are always pushed
+   * onto the front of the freelist, so everything in front of the checkpointed
+   * block is newer.  Their cleanups are dropped along with them. */
+  while (a->freelist != c->block) {
+    mem_block* block = a->freelist;
+    UPB_ASSERT(block && !arena_ishomeblock(a, block));
+    a->freelist = block->next;
+    freed_bytes += block->size;
+    freed_blocks++;
+    upb_free(block_alloc, block);
+  }
+
+  /* Blocks retained by upb_Arena_Reset() are taken in order, so the ones put
+   * back into use since the checkpoint run from c->spare up to a->spare.  They
+   * become spare again, minus any cleanups registered in them. */
+  for (mem_block* block = c->spare; block != a->spare; block = block->next) {
+    block->cleanups = 0;
+  }
+  a->spare = c->spare;
+
+  /* Cleanups registered in the checkpointed block live at its end, below
+   * c->end, so restoring the count and the end pointer drops them. */
+  if (c->cleanups) *c->cleanups = c->cleanup_count;
+  a->cleanups = c->cleanups;
+  a->head.ptr = c->ptr;
+  a->head.end = c->end;
+  a->last_size = c->last_size;
+  UPB_POISON_MEMORY_REGION(a->head.ptr, a->head.end - a->head.ptr);
+
+  upb_Atomic_Store(
+      &a->space_allocated,
+      upb_Atomic_Load(&a->space_allocated, memory_order_relaxed) - freed_bytes,
+      memory_order_relaxed);
+  upb_Atomic_Store(
+      &a->block_count,
+      upb_Atomic_Load(&a->block_count, memory_order_relaxed) - freed_blocks,
+      memory_order_relaxed);
+  upb_Atomic_Store(&a->space_wasted, c->space_wasted, memory_order_relaxed);
 }
 
 bool upb_Arena_AddCleanup(upb_Arena* a, void* ud, upb_CleanupFunc* func) {
   cleanup_ent* ent;
-  uint32_t* cleanups = upb_cleanup_pointer(a->cleanup_metadata);
 
-  if (!cleanups || _upb_ArenaHas(a) < sizeof(cleanup_ent)) {
+  if (!a->cleanups || _upb_ArenaHas(a) < sizeof(cleanup_ent)) {
     if (!upb_Arena_Allocblock(a, 128)) return false; /* Out of memory. */
     UPB_ASSERT(_upb_ArenaHas(a) >= sizeof(cleanup_ent));
-    cleanups = upb_cleanup_pointer(a->cleanup_metadata);
   }
 
   a->head.end -= sizeof(cleanup_ent);
   ent = (cleanup_ent*)a->head.end;
-  (*cleanups)++;
+  (*a->cleanups)++;
   UPB_UNPOISON_MEMORY_REGION(ent, sizeof(cleanup_ent));
 
   ent->cleanup = func;
@@ -225,34 +590,150 @@ bool upb_Arena_AddCleanup(upb_Arena* a, void* ud, upb_CleanupFunc* func) {
   return true;
 }
 
-bool upb_Arena_Fuse(upb_Arena* a1, upb_Arena* a2) {
-  upb_Arena* r1 = arena_findroot(a1);
-  upb_Arena* r2 = arena_findroot(a2);
+/* Appends the list of arenas starting at `child` to the list of `parent`.
+ * Other threads may be appending to the same list concurrently, so rather than
+ * trusting `tail` we swap our list into the first `next` slot we find empty,
+ * and re-append anything that we displaced in the process. */
+static void arena_fuselists(upb_Arena* parent, upb_Arena* child) {
+  upb_Arena* parent_tail = upb_Atomic_Load(&parent->tail, memory_order_relaxed);
+  do {
+    /* Our tail might be stale, but it will always converge to the true tail. */
+    upb_Arena* parent_tail_next =
+        upb_Atomic_Load(&parent_tail->next, memory_order_relaxed);
+    while (parent_tail_next != NULL) {
+      parent_tail = parent_tail_next;
+      parent_tail_next =
+          upb_Atomic_Load(&parent_tail->next, memory_order_relaxed);
+    }
 
-  if (r1 == r2) return true; /* Already fused. */
+    upb_Arena* displaced =
+        upb_Atomic_Exchange(&parent_tail->next, child, memory_order_relaxed);
+    parent_tail = upb_Atomic_Load(&child->tail, memory_order_relaxed);
 
-  /* Do not fuse initial blocks since we cannot lifetime extend them. */
-  if (upb_cleanup_has_initial_block(r1->cleanup_metadata)) return false;
-  if (upb_cleanup_has_initial_block(r2->cleanup_metadata)) return false;
+    /* If we displaced something that was installed racily, we simply
+     * reinstall it after our new tail. */
+    child = displaced;
+  } while (child != NULL);
 
-  /* Only allow fuse with a common allocator */
-  if (r1->block_alloc != r2->block_alloc) return false;
+  upb_Atomic_Store(&parent->tail, parent_tail, memory_order_relaxed);
+}
 
-  /* We want to join the smaller tree to the larger tree.
-   * So swap first if they are backwards. */
-  if (r1->refcount < r2->refcount) {
-    upb_Arena* tmp = r1;
+/* Attempts a single fuse of the trees containing `a1` and `a2`.  Returns the
+ * new root, or NULL if we raced with another fuse/free and need to retry.  Any
+ * refs that were added to a root but could not be matched by a reparent are
+ * accumulated into `*ref_delta` so that they can be removed later. */
+static upb_Arena* arena_dofuse(upb_Arena* a1, upb_Arena* a2,
+                               uintptr_t* ref_delta) {
+  upb_ArenaRoot r1 = arena_findroot(a1);
+  upb_ArenaRoot r2 = arena_findroot(a2);
+
+  if (r1.root == r2.root) return r1.root; /* Already fused. */
+
+  /* Avoid cycles (and livelock between symmetric fuses) by always fusing into
+   * the root with the lower address. */
+  if ((uintptr_t)r1.root > (uintptr_t)r2.root) {
+    upb_ArenaRoot tmp = r1;
     r1 = r2;
     r2 = tmp;
   }
 
-  /* r1 takes over r2's freelist and refcount. */
-  r1->refcount += r2->refcount;
-  if (r2->freelist_tail) {
-    UPB_ASSERT(r2->freelist_tail->next == NULL);
-    r2->freelist_tail->next = r1->freelist;
-    r1->freelist = r2->freelist;
+  /* The moment we install r1 as the parent of r2, racing frees of arenas in
+   * r2's tree will start decrementing r1's refcount.  So we must transfer
+   * r2's refs to r1 *before* reparenting. */
+  uintptr_t r2_untagged_count = r2.tagged_count & ~1;
+  uintptr_t with_r2_refs = r1.tagged_count + r2_untagged_count;
+  if (!upb_Atomic_CompareExchangeStrong(
+          &r1.root->parent_or_count, &r1.tagged_count, with_r2_refs,
+          memory_order_release, memory_order_acquire)) {
+    return NULL;
+  }
+
+  /* Reparent r2, but only if its refcount is still what we transferred. */
+  if (!upb_Atomic_CompareExchangeStrong(
+          &r2.root->parent_or_count, &r2.tagged_count,
+          _upb_Arena_TaggedFromPointer(r1.root), memory_order_release,
+          memory_order_acquire)) {
+    /* We must remove the excess refs we added to r1 above. */
+    *ref_delta += r2_untagged_count;
+    return NULL;
+  }
+
+  /* The fuse has happened and can no longer fail; splice the lists and let
+   * the tighter of the two space limits apply to the whole group. */
+  arena_fuselists(r1.root, r2.root);
+  size_t r1_max = upb_Atomic_Load(&r1.root->max_space, memory_order_relaxed);
+  size_t r2_max = upb_Atomic_Load(&r2.root->max_space, memory_order_relaxed);
+  while (r2_max < r1_max &&
+         !upb_Atomic_CompareExchangeWeak(&r1.root->max_space, &r1_max, r2_max,
+                                         memory_order_relaxed,
+                                         memory_order_relaxed)) {
+  }
+  return r1.root;
+}
+
+static bool arena_fixuprefs(upb_Arena* new_root, uintptr_t ref_delta) {
+  if (ref_delta == 0) return true; /* No fixup required. */
+  uintptr_t poc =
+      upb_Atomic_Load(&new_root->parent_or_count, memory_order_relaxed);
+  if (_upb_Arena_IsTaggedPointer(poc)) return false;
+  uintptr_t with_refs = poc - ref_delta;
+  UPB_ASSERT(!_upb_Arena_IsTaggedPointer(with_refs));
+  return upb_Atomic_CompareExchangeStrong(&new_root->parent_or_count, &poc,
+                                          with_refs, memory_order_relaxed,
+                                          memory_order_relaxed);
+}
+
+bool upb_Arena_Fuse(upb_Arena* a1, upb_Arena* a2) {
+  if (a1 == a2) return true; /* Trivial fuse. */
+
+  /* Do not fuse initial blocks since we cannot lifetime extend them. */
+  if (upb_Arena_HasInitialBlock(a1)) return false;
+  if (upb_Arena_HasInitialBlock(a2)) return false;
+
+  /* Only allow fuse with a common allocator.  Every member of a fused group
+   * shares the same allocator, so there is no need to look at the roots. */
+  if (a1->block_alloc != a2->block_alloc) return false;
+
+  /* The number of refs we ultimately need to remove from the new root. */
+  uintptr_t ref_delta = 0;
+  while (true) {
+    upb_Arena* new_root = arena_dofuse(a1, a2, &ref_delta);
+    if (new_root != NULL && arena_fixuprefs(new_root, ref_delta)) {
+      return true;
+    }
+  }
+}
+
+void upb_Arena_SetMaxSpaceAllocated(upb_Arena* a, size_t max) {
+  upb_Arena* root = arena_findroot(a).root;
+  upb_Atomic_Store(&root->max_space, max, memory_order_relaxed);
+}
+
+size_t upb_Arena_SpaceAllocated(upb_Arena* a) {
+  size_t total = 0;
+  for (upb_Arena* i = arena_findroot(a).root; i;
+       i = upb_Atomic_Load(&i->next, memory_order_acquire)) {
+    total += upb_Atomic_Load(&i->space_allocated, memory_order_relaxed);
+  }
+  return total;
+}
+
+void upb_Arena_GetStats(upb_Arena* a, upb_ArenaStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (upb_Arena* i = arena_findroot(a).root; i;
+       i = upb_Atomic_Load(&i->next, memory_order_acquire)) {
+    size_t allocated =
+        upb_Atomic_Load(&i->space_allocated, memory_order_relaxed);
+    size_t wasted = upb_Atomic_Load(&i->space_wasted, memory_order_relaxed);
+    size_t unused = (size_t)(i->head.end - i->head.ptr);
+    for (mem_block* b = i->spare; b; b = b->next) unused += b->size;
+    if (i->initial_block) allocated += (size_t)((char*)i - i->initial_block);
+
+    stats->space_allocated +=
+        upb_Atomic_Load(&i->space_allocated, memory_order_relaxed);
+    stats->space_used += allocated - wasted - unused;
+    stats->space_wasted += wasted;
+    stats->block_count +=
+        upb_Atomic_Load(&i->block_count, memory_order_relaxed);
   }
-  r2->parent = r1;
-  return true;
 }
@@ -45,7 +45,10 @@ extern "C" {
  * to be freed.  However the Arena does allow users to register cleanup
  * functions that will run when the arena is destroyed.
  *
- * A upb_Arena is *not* thread-safe.
+ * A upb_Arena is *not* thread-safe for allocation: only one thread may
+ * allocate from (or add cleanups to) a given arena at a time.  However
+ * upb_Arena_Fuse() and upb_Arena_Free() are thread-safe, and may be called on
+ * arenas (or groups of fused arenas) that are being used from other threads.
  *
  * You could write a thread-safe arena allocator that satisfies the
  * upb_alloc interface, but it would not be as efficient for the
@@ -68,9 +71,105 @@ typedef struct {
  * Additional blocks will be allocated from |alloc|.  If |alloc| is NULL, this
  * is a fixed-size arena and cannot grow. */
 upb_Arena* upb_Arena_Init(void* mem, size_t n, upb_alloc* alloc);
+
+/* Controls how an arena sizes the blocks it obtains from its allocator.  By
+ * default each new block is at least twice the size of the largest previous
+ * one, so a single huge allocation makes every later block huge as well.
+ * Zero-initialize and set only the fields you need; zero means "default". */
+typedef struct {
+  /* Geometric growth stops once blocks reach this size (including overhead).
+   * Allocations too big to fit in a block of this size get a dedicated block,
+   * as if they were above large_alloc_threshold. */
+  size_t max_block_size;
+
+  /* Allocations of at least this many bytes that do not fit in the current
+   * block get their own exactly-sized block.  The current block stays in use
+   * for later small allocations, and the size of later blocks is unaffected. */
+  size_t large_alloc_threshold;
+} upb_ArenaGrowthPolicy;
+
+/* Like upb_Arena_Init(), but with a custom growth policy.  |policy| may be
+ * NULL, and is not referenced after this call returns. */
+upb_Arena* upb_Arena_InitWithPolicy(void* mem, size_t n, upb_alloc* alloc,
+                                    const upb_ArenaGrowthPolicy* policy);
 void upb_Arena_Free(upb_Arena* a);
 bool upb_Arena_AddCleanup(upb_Arena* a, void* ud, upb_CleanupFunc* func);
+
+/* Resets the arena so that it can be reused as if it were freshly created:
+ * runs all cleanup functions and invalidates all memory previously allocated
+ * from it.  Instead of being returned to the allocator, the largest blocks
+ * totalling at most |max_retained| bytes are kept and reused for future
+ * allocations, so an arena that is reset between requests stops calling the
+ * block allocator once it has grown to its steady-state size.
+ *
+ * Returns false (and does nothing) if the arena has been fused with another
+ * arena, since the other arenas may still reference its memory. */
+bool upb_Arena_Reset(upb_Arena* a, size_t max_retained);
+
+/* A saved allocation position within an arena; see upb_Arena_Checkpoint().
+ * The members are internal and should not be accessed directly. */
+typedef struct {
+  void *block, *spare;
+  char *ptr, *end;
+  uint32_t* cleanups;
+  uint32_t cleanup_count;
+  uint32_t last_size;
+  size_t space_wasted;
+} upb_ArenaCheckpoint;
+
+/* Records the current allocation position of |a|, so that everything
+ * allocated afterwards can be discarded with upb_Arena_Rollback().  This is
+ * cheap enough to take before every speculative parse. */
+upb_ArenaCheckpoint upb_Arena_Checkpoint(upb_Arena* a);
+
+/* Returns |a| to the state it was in when |c| was taken: memory allocated
+ * since then is invalidated and will be handed out again, blocks allocated
+ * since then are returned to the block allocator (or, if they were retained
+ * by upb_Arena_Reset(), kept for reuse), and cleanup functions registered
+ * since then are dropped without being run.
+ *
+ * |c| must have been taken from |a|, and is invalidated by rolling back to an
+ * earlier checkpoint or by upb_Arena_Reset().  Other arenas fused with |a|
+ * are unaffected, so they must not hold pointers into the discarded memory. */
+void upb_Arena_Rollback(upb_Arena* a, const upb_ArenaCheckpoint* c);
+
 bool upb_Arena_Fuse(upb_Arena* a, upb_Arena* b);
+
+/* Limits the total space that |a|, together with every arena fused with it,
+ * may obtain from its block allocator.  Once the limit would be exceeded,
+ * allocations that need a new block fail (so eg. upb_Decode() returns
+ * kUpb_DecodeStatus_OutOfMemory).  When arenas with limits are fused, the
+ * smallest limit applies to the whole group.  SIZE_MAX means no limit, which
+ * is the default.  The limit is approximate if it races with a fuse. */
+void upb_Arena_SetMaxSpaceAllocated(upb_Arena* a, size_t max);
+
+/* Returns the total space that |a| and every arena fused with it have
+ * obtained from their block allocators and not yet released.  Does not include
+ * user-provided initial blocks.  Safe to call from any thread. */
+size_t upb_Arena_SpaceAllocated(upb_Arena* a);
+
+typedef struct {
+  /* Bytes of blocks obtained from the block allocator (see
+   * upb_Arena_SpaceAllocated()). */
+  size_t space_allocated;
+
+  /* Bytes handed out by the arena, including per-block overhead and any
+   * initial block.  Excludes free space in the current block, unused blocks
+   * retained by upb_Arena_Reset(), and space_wasted. */
+  size_t space_used;
+
+  /* Bytes at the end of blocks that were too small for the allocation that
+   * caused the next block to be allocated, and can no longer be used. */
+  size_t space_wasted;
+
+  /* Number of blocks obtained from the block allocator. */
+  size_t block_count;
+} upb_ArenaStats;
+
+/* Fills |stats| with the totals for |a| and every arena fused with it.  Unlike
+ * upb_Arena_SpaceAllocated(), this inspects the arenas' current blocks, so it
+ * must not race with allocation from any arena in the group. */
+void upb_Arena_GetStats(upb_Arena* a, upb_ArenaStats* stats);
 void* _upb_Arena_SlowMalloc(upb_Arena* a, size_t size);
 
 UPB_INLINE upb_alloc* upb_Arena_Alloc(upb_Arena* a) { return (upb_alloc*)a; }
@@ -0,0 +1,475 @@
+// Copyright (c) 2009-2021, Google LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Google LLC nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "upb/arena.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "upb/decode.h"
+#include "upb/mini_table.hpp"
+#include "upb/msg_internal.h"
+#include "upb/upb.hpp"
+
+namespace {
+
+static void decrement_int(void* ptr) {
+  int* iptr = static_cast<int*>(ptr);
+  (*iptr)--;
+}
+
+TEST(ArenaTest, FuseChain) {
+  int count = 10;
+  std::vector<upb_Arena*> arenas;
+  for (int i = 0; i < 10; i++) {
+    upb_Arena* a = upb_Arena_New();
+    upb_Arena_AddCleanup(a, &count, decrement_int);
+    if (!arenas.empty()) {
+      EXPECT_TRUE(upb_Arena_Fuse(arenas.back(), a));
+    }
+    arenas.push_back(a);
+  }
+
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(10, count);
+    upb_Arena_Free(arenas[i]);
+  }
+  EXPECT_EQ(0, count);
+}
+
+// Fuses and frees from many threads at once.  This is mostly interesting
+// under TSAN, but it also verifies that every cleanup runs exactly once.
+TEST(ArenaTest, FuseFreeRace) {
+  constexpr int kThreads = 8;
+  constexpr int kArenasPerThread = 1000;
+  std::atomic<int> cleanups{0};
+  std::vector<upb_Arena*> arenas(kThreads * kArenasPerThread);
+  for (auto& a : arenas) {
+    a = upb_Arena_New();
+    upb_Arena_AddCleanup(
+        a, &cleanups,
+        [](void* p) { static_cast<std::atomic<int>*>(p)->fetch_add(1); });
+  }
+
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      while (!go) {
+      }
+      // Each thread fuses its own arenas with a neighbour's, then frees its
+      // own, so fuse and free race across threads on the same groups.
+      for (int i = 0; i < kArenasPerThread; i++) {
+        int mine = t * kArenasPerThread + i;
+        int other = ((t + 1) % kThreads) * kArenasPerThread + i;
+        EXPECT_TRUE(upb_Arena_Fuse(arenas[mine], arenas[other]));
+      }
+      for (int i = 0; i < kArenasPerThread; i++) {
+        upb_Arena_Free(arenas[t * kArenasPerThread + i]);
+      }
+    });
+  }
+  go = true;
+  for (auto& t : threads) t.join();
+
+  EXPECT_EQ(kThreads * kArenasPerThread, cleanups.load());
+}
+
+TEST(ArenaTest, ConcurrentFuseIntoOneGroup) {
+  constexpr int kThreads = 8;
+  std::vector<upb_Arena*> arenas(kThreads * 100);
+  for (auto& a : arenas) a = upb_Arena_New();
+
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t]() {
+      while (!go) {
+      }
+      for (size_t i = t; i + 1 < arenas.size(); i += kThreads) {
+        EXPECT_TRUE(upb_Arena_Fuse(arenas[i], arenas[i + 1]));
+      }
+    });
+  }
+  go = true;
+  for (auto& t : threads) t.join();
+
+  // Everything is now one group, so it must stay alive until the last free.
+  int count = 1;
+  upb_Arena_AddCleanup(arenas.front(), &count, decrement_int);
+  for (size_t i = 0; i < arenas.size(); i++) {
+    EXPECT_EQ(1, count);
+    upb_Arena_Free(arenas[i]);
+  }
+  EXPECT_EQ(0, count);
+}
+
+// An allocator that counts live blocks and calls to malloc.
+struct CountingAlloc {
+  upb_alloc alloc;
+  int mallocs = 0;
+  int live = 0;
+  size_t max_request = 0;
+
+  CountingAlloc() { alloc.func = &Func; }
+
+  static void* Func(upb_alloc* alloc, void* ptr, size_t oldsize, size_t size) {
+    CountingAlloc* self = reinterpret_cast<CountingAlloc*>(alloc);
+    if (size == 0) {
+      self->live--;
+    } else if (!ptr) {
+      self->mallocs++;
+      self->live++;
+      self->max_request = std::max(self->max_request, size);
+    }
+    return upb_alloc_global.func(alloc, ptr, oldsize, size);
+  }
+};
+
+static void AllocRequest(upb_Arena* a) {
+  for (int i = 0; i < 100; i++) {
+    ASSERT_NE(nullptr, upb_Arena_Malloc(a, 1000));
+  }
+}
+
+TEST(ArenaTest, ResetReusesBlocks) {
+  CountingAlloc alloc;
+  upb_Arena* arena = upb_Arena_Init(NULL, 0, &alloc.alloc);
+  int count = 1;
+  upb_Arena_AddCleanup(arena, &count, decrement_int);
+  AllocRequest(arena);
+  int grown = alloc.mallocs;
+  EXPECT_GT(grown, 1);
+
+  EXPECT_TRUE(upb_Arena_Reset(arena, SIZE_MAX));
+  EXPECT_EQ(0, count);
+  EXPECT_EQ(grown, alloc.live);
+
+  // Keep growing until a whole "request" fits in the retained blocks.
+  for (int i = 0; i < 3; i++) {
+    AllocRequest(arena);
+    EXPECT_TRUE(upb_Arena_Reset(arena, SIZE_MAX));
+  }
+  int steady = alloc.mallocs;
+  for (int i = 0; i < 10; i++) {
+    AllocRequest(arena);
+    EXPECT_TRUE(upb_Arena_Reset(arena, SIZE_MAX));
+  }
+  EXPECT_EQ(steady, alloc.mallocs);
+
+  upb_Arena_Free(arena);
+  EXPECT_EQ(0, alloc.live);
+}
+
+TEST(ArenaTest, ResetRetainLimit) {
+  CountingAlloc alloc;
+  upb_Arena* arena = upb_Arena_Init(NULL, 0, &alloc.alloc);
+  AllocRequest(arena);
+  EXPECT_GT(alloc.live, 1);
+
+  // Only the block holding the arena itself survives.
+  EXPECT_TRUE(upb_Arena_Reset(arena, 0));
+  EXPECT_EQ(1, alloc.live);
+  AllocRequest(arena);
+
+  upb_Arena_Free(arena);
+  EXPECT_EQ(0, alloc.live);
+}
+
+TEST(ArenaTest, ResetInitialBlock) {
+  CountingAlloc alloc;
+  char buf[1024];
+  upb_Arena* arena = upb_Arena_Init(buf, sizeof(buf), &alloc.alloc);
+  void* first = upb_Arena_Malloc(arena, 8);
+  EXPECT_GE(first, static_cast<void*>(buf));
+  EXPECT_LT(first, static_cast<void*>(buf + sizeof(buf)));
+  AllocRequest(arena);
+
+  EXPECT_TRUE(upb_Arena_Reset(arena, SIZE_MAX));
+  EXPECT_EQ(first, upb_Arena_Malloc(arena, 8));
+
+  upb_Arena_Free(arena);
+  EXPECT_EQ(0, alloc.live);
+}
+
+TEST(ArenaTest, ResetFused) {
+  upb_Arena* arena1 = upb_Arena_New();
+  upb_Arena* arena2 = upb_Arena_New();
+  EXPECT_TRUE(upb_Arena_Fuse(arena1, arena2));
+  EXPECT_FALSE(upb_Arena_Reset(arena1, SIZE_MAX));
+  EXPECT_FALSE(upb_Arena_Reset(arena2, SIZE_MAX));
+  upb_Arena_Free(arena1);
+  upb_Arena_Free(arena2);
+}
+
+TEST(ArenaTest, Rollback) {
+  CountingAlloc alloc;
+  upb_Arena* arena = upb_Arena_Init(NULL, 0, &alloc.alloc);
+  int count = 1;
+  upb_Arena_AddCleanup(arena, &count, decrement_int);
+  upb_Arena_Malloc(arena, 8);
+
+  upb_ArenaCheckpoint c = upb_Arena_Checkpoint(arena);
+  size_t space = upb_Arena_SpaceAllocated(arena);
+  int live = alloc.live;
+  void* first = upb_Arena_Malloc(arena, 8);
+
+  // A failed attempt that spills into several blocks and registers cleanups.
+  int dropped = 1;
+  upb_Arena_AddCleanup(arena, &dropped, decrement_int);
+  AllocRequest(arena);
+  upb_Arena_AddCleanup(arena, &dropped, decrement_int);
+  EXPECT_GT(alloc.live, live);
+
+  upb_Arena_Rollback(arena, &c);
+  EXPECT_EQ(live, alloc.live);
+  EXPECT_EQ(space, upb_Arena_SpaceAllocated(arena));
+  EXPECT_EQ(first, upb_Arena_Malloc(arena, 8));
+
+  // Rolling back again to the same checkpoint is fine.
+  AllocRequest(arena);
+  upb_Arena_Rollback(arena, &c);
+  EXPECT_EQ(live, alloc.live);
+
+  upb_Arena_Free(arena);
+  EXPECT_EQ(0, count);
+  EXPECT_EQ(1, dropped);
+  EXPECT_EQ(0, alloc.live);
+}
+
+TEST(ArenaTest, RollbackAfterReset) {
+  CountingAlloc alloc;
+  upb_Arena* arena = upb_Arena_Init(NULL, 0, &alloc.alloc);
+  upb_Arena_Malloc(arena, 100000);
+  ASSERT_TRUE(upb_Arena_Reset(arena, 1 << 20));
+  size_t space = upb_Arena_SpaceAllocated(arena);
+  int mallocs = alloc.mallocs;
+
+  // Fill the large retained block, then spill into the block that holds the
+  // arena itself, which Reset() kept as a spare.
+  upb_ArenaCheckpoint c = upb_Arena_Checkpoint(arena);
+  void* first = upb_Arena_Malloc(arena, 99990);
+  upb_Arena_Malloc(arena, 200);
+  int dropped = 1;
+  upb_Arena_AddCleanup(arena, &dropped, decrement_int);
+  EXPECT_EQ(mallocs, alloc.mallocs);
+
+  // Both blocks are kept, and are handed out again in the same order.
+  upb_Arena_Rollback(arena, &c);
+  EXPECT_EQ(2, alloc.live);
+  EXPECT_EQ(space, upb_Arena_SpaceAllocated(arena));
+  EXPECT_EQ(first, upb_Arena_Malloc(arena, 99990));
+  upb_Arena_Malloc(arena, 200);
+  EXPECT_EQ(mallocs, alloc.mallocs);
+
+  upb_Arena_Free(arena);
+  EXPECT_EQ(1, dropped);
+  EXPECT_EQ(0, alloc.live);
+}
+
+TEST(ArenaTest, ThreadCacheAlloc) {
+  upb_alloc_threadcache_flush();
+  upb_Arena* arena = upb_Arena_Init(NULL, 0, &upb_alloc_threadcache);
+  AllocRequest(arena);
+  upb_Arena_Free(arena);
+
+  // A fresh arena on the same thread gets its blocks back from the cache.
+  arena = upb_Arena_Init(NULL, 0, &upb_alloc_threadcache);
+  void* block = upb_Arena_Malloc(arena, 8);
+  upb_Arena_Free(arena);
+  arena = upb_Arena_Init(NULL, 0, &upb_alloc_threadcache);
+  EXPECT_EQ(block, upb_Arena_Malloc(arena, 8));
+  upb_Arena_Free(arena);
+
+  // Realloc within and across size classes, and blocks too big to cache.
+  upb_alloc* alloc = &upb_alloc_threadcache;
+  char* p = static_cast<char*>(upb_malloc(alloc, 10));
+  memcpy(p, "123456789", 10);
+  p = static_cast<char*>(upb_realloc(alloc, p, 10, 20));
+  p = static_cast<char*>(upb_realloc(alloc, p, 20, 5000));
+  EXPECT_STREQ("123456789", p);
+  p = static_cast<char*>(upb_realloc(alloc, p, 5000, 10 << 20));
+  EXPECT_STREQ("123456789", p);
+  upb_free(alloc, p);
+
+  upb_alloc_threadcache_flush();
+}
+
+TEST(ArenaTest, MmapAlloc) {
+  for (upb_alloc* alloc : {&upb_alloc_mmap, &upb_alloc_hugepage}) {
+    upb_Arena* arena = upb_Arena_Init(NULL, 0, alloc);
+    for (int i = 0; i < 64; i++) {
+      char* p = static_cast<char*>(upb_Arena_Malloc(arena, 100000));
+      ASSERT_NE(nullptr, p);
+      memset(p, i, 100000);
+    }
+    char* big = static_cast<char*>(upb_Arena_Malloc(arena, 8 << 20));
+    ASSERT_NE(nullptr, big);
+    memset(big, 1, 8 << 20);
+    upb_Arena_Free(arena);
+
+    // Realloc between small (malloc'd) and large (mapped) blocks.
+    char* p = static_cast<char*>(upb_malloc(alloc, 10));
+    memcpy(p, "123456789", 10);
+    p = static_cast<char*>(upb_realloc(alloc, p, 10, 3 << 20));
+    EXPECT_STREQ("123456789", p);
+    p = static_cast<char*>(upb_realloc(alloc, p, 3 << 20, 100));
+    EXPECT_STREQ("123456789", p);
+    upb_free(alloc, p);
+  }
+}
+
+TEST(ArenaTest, Stats) {
+  upb_Arena* arena = upb_Arena_New();
+  upb_ArenaStats stats;
+  upb_Arena_GetStats(arena, &stats);
+  EXPECT_EQ(1, stats.block_count);
+  EXPECT_EQ(stats.space_allocated, upb_Arena_SpaceAllocated(arena));
+
+  size_t before = stats.space_allocated;
+  AllocRequest(arena);
+  upb_Arena_GetStats(arena, &stats);
+  EXPECT_GT(stats.block_count, 1);
+  EXPECT_GT(stats.space_allocated, before);
+  EXPECT_LE(stats.space_used + stats.space_wasted, stats.space_allocated);
+
+  // Fused arenas report the totals for the whole group.
+  upb_Arena* arena2 = upb_Arena_New();
+  size_t total = upb_Arena_SpaceAllocated(arena) +
+                 upb_Arena_SpaceAllocated(arena2);
+  EXPECT_TRUE(upb_Arena_Fuse(arena, arena2));
+  EXPECT_EQ(total, upb_Arena_SpaceAllocated(arena));
+  EXPECT_EQ(total, upb_Arena_SpaceAllocated(arena2));
+
+  upb_Arena_Free(arena);
+  upb_Arena_Free(arena2);
+}
+
+TEST(ArenaTest, MaxSpaceAllocated) {
+  upb_Arena* arena = upb_Arena_New();
+  upb_Arena_SetMaxSpaceAllocated(arena, 16 << 10);
+  EXPECT_EQ(nullptr, upb_Arena_Malloc(arena, 32 << 10));
+  EXPECT_NE(nullptr, upb_Arena_Malloc(arena, 4 << 10));
+  EXPECT_LE(upb_Arena_SpaceAllocated(arena), 16 << 10);
+  upb_Arena_Free(arena);
+
+  // A fixed-size arena can never grow.
+  char buf[1024];
+  arena = upb_Arena_Init(buf, sizeof(buf), nullptr);
+  EXPECT_EQ(nullptr, upb_Arena_Malloc(arena, 2048));
+  upb_Arena_Free(arena);
+}
+
+TEST(ArenaTest, MaxSpaceAllocatedFused) {
+  upb_Arena* arena1 = upb_Arena_New();
+  upb_Arena* arena2 = upb_Arena_New();
+  upb_Arena_SetMaxSpaceAllocated(arena2, 16 << 10);
+  EXPECT_TRUE(upb_Arena_Fuse(arena1, arena2));
+
+  // The smaller limit applies to the whole group, whichever arena allocates.
+  for (int i = 0; i < 4; i++) upb_Arena_Malloc(arena2, 3 << 10);
+  EXPECT_EQ(nullptr, upb_Arena_Malloc(arena1, 8 << 10));
+  EXPECT_LE(upb_Arena_SpaceAllocated(arena1), 16 << 10);
+
+  upb_Arena_Free(arena1);
+  upb_Arena_Free(arena2);
+}
+
+TEST(ArenaTest, GrowthPolicyLargeAlloc) {
+  upb_ArenaGrowthPolicy policy = {};
+  policy.large_alloc_threshold = 4096;
+  upb_Arena* arena = upb_Arena_InitWithPolicy(nullptr, 0, &upb_alloc_global,
+                                              &policy);
+  char* small = static_cast<char*>(upb_Arena_Malloc(arena, 16));
+
+  // The large allocation gets its own block, and small allocations carry on
+  // from the current one.
+  size_t before = upb_Arena_SpaceAllocated(arena);
+  ASSERT_NE(nullptr, upb_Arena_Malloc(arena, 1 << 20));
+  EXPECT_LT(upb_Arena_SpaceAllocated(arena) - before, size_t{(1 << 20) + 256});
+  char* small2 = static_cast<char*>(upb_Arena_Malloc(arena, 16));
+  EXPECT_GT(small2, small);
+  EXPECT_LT(small2, small + 256);
+
+  // Later blocks are not sized after the large allocation.
+  before = upb_Arena_SpaceAllocated(arena);
+  for (int i = 0; i < 64; i++) upb_Arena_Malloc(arena, 64);
+  EXPECT_LT(upb_Arena_SpaceAllocated(arena) - before, size_t{64 << 10});
+
+  upb_Arena_Free(arena);
+}
+
+TEST(ArenaTest, GrowthPolicyMaxBlockSize) {
+  CountingAlloc alloc;
+  upb_ArenaGrowthPolicy policy = {};
+  policy.max_block_size = 8192;
+  upb_Arena* arena = upb_Arena_InitWithPolicy(nullptr, 0, &alloc.alloc,
+                                              &policy);
+  for (int i = 0; i < 1000; i++) upb_Arena_Malloc(arena, 500);
+  EXPECT_LE(alloc.max_request, size_t{8192});
+
+  // Allocations that cannot fit in a capped block get a block of their own.
+  ASSERT_NE(nullptr, upb_Arena_Malloc(arena, 100000));
+  alloc.max_request = 0;
+  for (int i = 0; i < 100; i++) upb_Arena_Malloc(arena, 500);
+  EXPECT_LE(alloc.max_request, size_t{8192});
+
+  upb_Arena_Free(arena);
+  EXPECT_EQ(0, alloc.live);
+}
+
+TEST(ArenaTest, DecodeOverBudget) {
+  upb::Arena table_arena;
+  upb::MtDataEncoder e;
+  e.StartMessage(0);
+  e.PutField(kUpb_FieldType_Bytes, 1, 0);
+  upb_Status status;
+  upb_MiniTable* table =
+      upb_MiniTable_Build(e.data().data(), e.data().size(),
+                          kUpb_MiniTablePlatform_Native, table_arena.ptr(),
+                          &status);
+  ASSERT_NE(nullptr, table);
+
+  // Field 1, length-delimited, 64KiB long.
+  std::string payload("\x0a\x80\x80\x04", 4);
+  payload.append(64 << 10, 'x');
+
+  upb_Arena* arena = upb_Arena_New();
+  upb_Arena_SetMaxSpaceAllocated(arena, 16 << 10);
+  upb_Message* msg = _upb_Message_New(table, arena);
+  ASSERT_NE(nullptr, msg);
+  EXPECT_EQ(kUpb_DecodeStatus_OutOfMemory,
+            upb_Decode(payload.data(), payload.size(), msg, table, nullptr, 0,
+                       arena));
+  upb_Arena_Free(arena);
+}
+
+}  // namespace
@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include "upb/internal/decode.h"
+#include "upb/internal/packed_varint.h"
 #include "upb/upb.h"
 
 // Must be last.
@@ -336,6 +337,52 @@ static const char* decode_readstr(upb_Decoder* d, const char* ptr, int size,
   return ptr + size;
 }
 
+/* Stores the raw bytes of a lazy sub-message field instead of parsing them
+ * (see kUpb_DecodeOption_Lazy).  Returns false if the field must be parsed
+ * normally. */
+static bool decode_tolazy(upb_Decoder* d, const char* ptr,
+                          upb_Message** submsgp, const upb_MiniTable_Sub* subs,
+                          const upb_MiniTable_Field* field, int size) {
+  upb_Message* submsg = *submsgp;
+  _upb_LazyMessage* lazy;
+
+  if (submsg) {
+    if (!_upb_Message_IsLazy(submsg)) return false;
+    /* Merging into a field that is still unparsed: parsing the concatenated
+     * bytes is equivalent to parsing both occurrences in order. */
+    lazy = _upb_Message_GetLazy(submsg);
+    char* data = upb_Arena_Malloc(&d->arena, lazy->data.size + size);
+    if (!data) decode_err(d, kUpb_DecodeStatus_OutOfMemory);
+    memcpy(data, lazy->data.data, lazy->data.size);
+    memcpy(data + lazy->data.size, ptr, size);
+    lazy->data.data = data;
+    lazy->data.size += size;
+    return true;
+  }
+
+  /* UPB_DECODE_MAXDEPTH(0) would mean the default depth, so parse the last
+   * level eagerly. */
+  if (!(d->options & kUpb_DecodeOption_Lazy) || d->depth <= 1) return false;
+  /* Only some of the sub-message's fields are wanted, or all of them are to
+   * be counted, so parse it now. */
+  if (d->proj || d->profile) return false;
+
+  lazy = upb_Arena_Malloc(&d->arena, sizeof(*lazy));
+  if (!lazy) decode_err(d, kUpb_DecodeStatus_OutOfMemory);
+  decode_readstr(d, ptr, size, &lazy->data);
+  lazy->table = subs[field->submsg_index].submsg;
+  lazy->extreg = d->extreg;
+  lazy->arena = d->user_arena;
+  /* The raw bytes live as long as the arena, so strings can always alias.
+   * DiscardUnknown changes what the parsed message holds, so it carries over;
+   * CheckRequired does not look inside lazy fields (see decode.h). */
+  lazy->options = kUpb_DecodeOption_AliasString | kUpb_DecodeOption_Lazy |
+                  (d->options & kUpb_DecodeOption_DiscardUnknown) |
+                  UPB_DECODE_MAXDEPTH(d->depth - 1);
+  *submsgp = _upb_Message_TagLazy(lazy);
+  return true;
+}
+
 UPB_FORCEINLINE
 static const char* decode_tosubmsg2(upb_Decoder* d, const char* ptr,
                                     upb_Message* submsg,
@@ -406,20 +453,24 @@ static void upb_Decode_AddUnknownVarints(upb_Decoder* d, upb_Message* msg,
 }
 
 UPB_NOINLINE
-static bool decode_checkenum_slow(upb_Decoder* d, const char* ptr,
-                                  upb_Message* msg, const upb_MiniTable_Enum* e,
-                                  const upb_MiniTable_Field* field,
-                                  uint32_t v) {
+bool decode_checkenum_slow(upb_Decoder* d, upb_Message* msg,
+                           const upb_MiniTable_Enum* e, uint32_t field_number,
+                           uint32_t v) {
   // OPT: binary search long lists?
   int n = e->value_count;
   for (int i = 0; i < n; i++) {
     if ((uint32_t)e->values[i] == v) return true;
   }
 
+  if (d->options & kUpb_DecodeOption_DiscardUnknown) {
+    d->enum_dropped = msg;  // Checked by decode_tomap().
+    return false;
+  }
+
   // Unrecognized enum goes into unknown fields.
   // For packed fields the tag could be arbitrarily far in the past, so we
   // just re-encode the tag and value here.
-  uint32_t tag = ((uint32_t)field->number << 3) | kUpb_WireType_Varint;
+  uint32_t tag = (field_number << 3) | kUpb_WireType_Varint;
   upb_Decode_AddUnknownVarints(d, msg, tag, v);
   return false;
 }
@@ -432,7 +483,7 @@ static bool decode_checkenum(upb_Decoder* d, const char* ptr, upb_Message* msg,
 
   if (UPB_LIKELY(v < 64) && UPB_LIKELY(((1ULL << v) & e->mask))) return true;
 
-  return decode_checkenum_slow(d, ptr, msg, e, field, v);
+  return decode_checkenum_slow(d, msg, e, field->number, v);
 }
 
 UPB_NOINLINE
@@ -492,6 +543,30 @@ static const char* decode_fixed_packed(upb_Decoder* d, const char* ptr,
   return ptr;
 }
 
+/* Decodes the varints of a packed field that start before d->limit_ptr, as
+ * many at a time as the array has room for. */
+UPB_NOINLINE
+static const char* decode_varint_packed_bulk(upb_Decoder* d, const char* ptr,
+                                             upb_Array* arr,
+                                             const upb_MiniTable_Field* field,
+                                             int lg2) {
+  bool zigzag = field->descriptortype == kUpb_FieldType_SInt32 ||
+                field->descriptortype == kUpb_FieldType_SInt64;
+  while (ptr < d->limit_ptr) {
+    size_t count;
+    if (arr->size == arr->capacity) {
+      decode_reserve(d, arr, UPB_MAX(decode_countvarints(d, ptr), 1));
+    }
+    void* out = UPB_PTR_AT(_upb_array_ptr(arr), arr->size << lg2, void);
+    ptr = _upb_DecodePackedVarints(ptr, d->limit_ptr, out,
+                                   arr->capacity - arr->size, lg2, zigzag,
+                                   &count);
+    if (!ptr) return decode_err(d, kUpb_DecodeStatus_Malformed);
+    arr->size += count;
+  }
+  return ptr;
+}
+
 UPB_FORCEINLINE
 static const char* decode_varint_packed(upb_Decoder* d, const char* ptr,
                                         upb_Array* arr, wireval* val,
@@ -499,8 +574,14 @@ static const char* decode_varint_packed(upb_Decoder* d, const char* ptr,
                                         int lg2) {
   int scale = 1 << lg2;
   int saved_limit = decode_pushlimit(d, ptr, val->size);
+  decode_reserve(d, arr, decode_countvarints(d, ptr));
   char* out = UPB_PTR_AT(_upb_array_ptr(arr), arr->size << lg2, void);
   while (!decode_isdone(d, &ptr)) {
+    if (lg2 != 0 && d->limit_ptr - ptr >= 16) {
+      ptr = decode_varint_packed_bulk(d, ptr, arr, field, lg2);
+      out = UPB_PTR_AT(_upb_array_ptr(arr), arr->size << lg2, void);
+      continue;
+    }
     wireval elem;
     ptr = decode_varint64(d, ptr, &elem.uint64_val);
     decode_munge(field->descriptortype, &elem);
@@ -642,6 +723,12 @@ static const char* decode_tomap(upb_Decoder* d, const char* ptr,
   const char* start = ptr;
   ptr = decode_tosubmsg(d, ptr, &ent.k, subs, field, val->size);
   // check if ent had any unknown fields
+  if (UPB_UNLIKELY(d->enum_dropped == &ent.k)) {
+    // The value was an unrecognized closed enum, which would otherwise have
+    // sent the whole entry to the unknown fields.
+    d->enum_dropped = NULL;
+    return ptr;
+  }
   size_t size;
   upb_Message_GetUnknown(&ent.k, &size);
   if (size != 0) {
@@ -689,6 +776,10 @@ static const char* decode_tomsg(upb_Decoder* d, const char* ptr,
     case OP_SUBMSG: {
       upb_Message** submsgp = mem;
       upb_Message* submsg = *submsgp;
+      if (UPB_UNLIKELY(field->mode & kUpb_LabelFlags_IsLazy) &&
+          decode_tolazy(d, ptr, submsgp, subs, field, val->size)) {
+        return ptr + val->size;
+      }
       if (!submsg) {
         submsg = decode_newsubmsg(d, subs, field);
         *submsgp = submsg;
@@ -744,7 +835,8 @@ static bool decode_tryfastdispatch(upb_Decoder* d, const char** ptr,
                                    upb_Message* msg,
                                    const upb_MiniTable* layout) {
 #if UPB_FASTTABLE
-  if (layout && layout->table_mask != (unsigned char)-1) {
+  if (layout && layout->table_mask != (unsigned char)-1 && !d->proj &&
+      !d->profile) {
     uint16_t tag = fastdecode_loadtag(*ptr);
     intptr_t table = decode_totable(layout);
     *ptr = fastdecode_tagdispatch(d, *ptr, msg, table, 0, tag);
@@ -793,8 +885,10 @@ static void upb_Decoder_AddKnownMessageSetItem(
       _upb_Message_GetOrCreateExtension(msg, item_mt, &d->arena);
   if (UPB_UNLIKELY(!ext)) decode_err(d, kUpb_DecodeStatus_OutOfMemory);
   upb_Message* submsg = decode_newsubmsg(d, &ext->ext->sub, &ext->ext->field);
-  upb_DecodeStatus status = upb_Decode(data, size, submsg, item_mt->sub.submsg,
-                                       d->extreg, d->options, &d->arena);
+  /* Lazy fields would point at our temporary copy of the arena. */
+  upb_DecodeStatus status =
+      upb_Decode(data, size, submsg, item_mt->sub.submsg, d->extreg,
+                 d->options & ~kUpb_DecodeOption_Lazy, &d->arena);
   memcpy(&ext->data, &submsg, sizeof(submsg));
   if (status != kUpb_DecodeStatus_Ok) decode_err(d, status);
 }
@@ -831,7 +925,7 @@ static void upb_Decoder_AddMessageSetItem(upb_Decoder* d, upb_Message* msg,
       _upb_extreg_get(d->extreg, layout, type_id);
   if (item_mt) {
     upb_Decoder_AddKnownMessageSetItem(d, msg, item_mt, data, size);
-  } else {
+  } else if (!(d->options & kUpb_DecodeOption_DiscardUnknown)) {
     upb_Decoder_AddUnknownMessageSetItem(d, msg, type_id, data, size);
   }
 }
@@ -1037,6 +1131,7 @@ static const char* decode_unknown(upb_Decoder* d, const char* ptr,
                                   upb_Message* msg, int field_number,
                                   int wire_type, wireval val) {
   if (field_number == 0) return decode_err(d, kUpb_DecodeStatus_Malformed);
+  if (d->options & kUpb_DecodeOption_DiscardUnknown) msg = NULL;
 
   // Since unknown fields are the uncommon case, we do a little extra work here
   // to walk backwards through the buffer to find the field start.  This frees
@@ -1084,6 +1179,87 @@ static const char* decode_unknown(upb_Decoder* d, const char* ptr,
   return ptr;
 }
 
+/* Counts one occurrence of |field_number| in |layout| for the profile (see
+ * upb_DecodeProfiled()). */
+UPB_NOINLINE
+static void decode_countfield(upb_Decoder* d, const upb_MiniTable* layout,
+                              uint32_t field_number) {
+  upb_DecodeProfile* p = d->profile;
+  upb_inttable* counts;
+  upb_value v;
+
+  if (upb_inttable_lookup(&p->tables, (uintptr_t)layout, &v)) {
+    counts = upb_value_getptr(v);
+  } else {
+    counts = upb_Arena_Malloc(p->arena, sizeof(*counts));
+    if (!counts || !upb_inttable_init(counts, p->arena) ||
+        !upb_inttable_insert(&p->tables, (uintptr_t)layout,
+                             upb_value_ptr(counts), p->arena)) {
+      return;
+    }
+  }
+
+  if (upb_inttable_lookup(counts, field_number, &v)) {
+    upb_inttable_replace(counts, field_number,
+                         upb_value_uint64(upb_value_getuint64(v) + 1));
+  } else {
+    upb_inttable_insert(counts, field_number, upb_value_uint64(1), p->arena);
+  }
+}
+
+UPB_NOINLINE
+void decode_countstat(upb_Decoder* d, const upb_MiniTable* l, size_t ofs) {
+  if (l != d->stats_table) {
+    upb_DecodeStats* s = d->stats;
+    upb_DecodeCounters* c;
+    upb_value v;
+    if (upb_inttable_lookup(&s->tables, (uintptr_t)l, &v)) {
+      c = upb_value_getptr(v);
+    } else {
+      c = upb_Arena_Malloc(s->arena, sizeof(*c));
+      if (!c || !upb_inttable_insert(&s->tables, (uintptr_t)l, upb_value_ptr(c),
+                                     s->arena)) {
+        return;
+      }
+      memset(c, 0, sizeof(*c));
+    }
+    d->stats_table = l;
+    d->stats_counters = c;
+  }
+  (*(uint64_t*)UPB_PTR_AT(d->stats_counters, ofs, char))++;
+}
+
+/* Decodes one field under a projection (see upb_DecodeProjected()).  Fields
+ * outside the projection are skipped without touching |msg|. */
+UPB_NOINLINE
+static const char* decode_projected(upb_Decoder* d, const char* ptr,
+                                    upb_Message* msg,
+                                    const upb_MiniTable* layout,
+                                    const upb_MiniTable_Field* field,
+                                    uint32_t tag) {
+  const upb_DecodeProjection* proj = d->proj;
+  size_t idx = field - layout->fields;
+  if ((tag >> 3) == 0) return decode_err(d, kUpb_DecodeStatus_Malformed);
+  if (field->number == 0 || (field->mode & kUpb_LabelFlags_IsExtension) ||
+      !((proj->selected[idx / 64] >> (idx % 64)) & 1)) {
+    return upb_Decoder_SkipField(d, ptr, tag);
+  }
+
+  wireval val;
+  int op;
+  ptr = decode_wireval(d, ptr, field, tag & 7, &val, &op);
+  if (op >= 0) {
+    /* Sub-messages are parsed under the child projection, or in full. */
+    d->proj = proj->children ? proj->children[idx] : NULL;
+    ptr = decode_known(d, ptr, msg, layout, field, op, &val);
+    d->proj = proj;
+  } else {
+    /* Wire type mismatch: skip the value rather than storing it. */
+    ptr = decode_unknown(d, ptr, NULL, tag >> 3, tag & 7, val);
+  }
+  return ptr;
+}
+
 UPB_NOINLINE
 static const char* decode_msg(upb_Decoder* d, const char* ptr, upb_Message* msg,
                               const upb_MiniTable* layout) {
@@ -1127,7 +1303,16 @@ static const char* decode_msg(upb_Decoder* d, const char* ptr, upb_Message* msg,
       return ptr;
     }
 
+    if (UPB_UNLIKELY(d->profile != NULL) && layout) {
+      decode_countfield(d, layout, field_number);
+    }
+    DECODE_STAT(d, layout, slow_fields);
+
     field = decode_findfield(d, layout, field_number, &last_field_index);
+    if (UPB_UNLIKELY(d->proj != NULL) && layout) {
+      ptr = decode_projected(d, ptr, msg, layout, field, tag);
+      continue;
+    }
     ptr = decode_wireval(d, ptr, field, wire_type, &val, &op);
 
     if (op >= 0) {
@@ -1135,6 +1320,7 @@ static const char* decode_msg(upb_Decoder* d, const char* ptr, upb_Message* msg,
     } else {
       switch (op) {
         case OP_UNKNOWN:
+          DECODE_STAT(d, layout, unknown_fields);
           ptr = decode_unknown(d, ptr, msg, field_number, wire_type, val);
           break;
         case OP_MSGSET_ITEM:
@@ -1154,6 +1340,18 @@ const char* fastdecode_generic(struct upb_Decoder* d, const char* ptr,
                                uint64_t hasbits, uint64_t data) {
   (void)data;
   *(uint32_t*)msg |= hasbits;
+#if UPB_DECODE_STATS
+  if (UPB_UNLIKELY(d->stats != NULL)) {
+    /* Tell an empty slot from a parser that bailed on this field. */
+    const upb_MiniTable* l = decode_totablep(table);
+    size_t idx = (fastdecode_loadtag(ptr) & (uint8_t)table) >> 3;
+    if (l->fasttable[idx].field_parser == &fastdecode_generic) {
+      decode_countstat(d, l, offsetof(upb_DecodeCounters, fallback_noparser));
+    } else {
+      decode_countstat(d, l, offsetof(upb_DecodeCounters, fallback_bailed));
+    }
+  }
+#endif
   return decode_msg(d, ptr, msg, decode_totablep(table));
 }
 
@@ -1167,10 +1365,11 @@ static upb_DecodeStatus decode_top(struct upb_Decoder* d, const char* buf,
   return kUpb_DecodeStatus_Ok;
 }
 
-upb_DecodeStatus upb_Decode(const char* buf, size_t size, void* msg,
-                            const upb_MiniTable* l,
-                            const upb_ExtensionRegistry* extreg, int options,
-                            upb_Arena* arena) {
+static upb_DecodeStatus decode_withhooks(
+    const char* buf, size_t size, void* msg, const upb_MiniTable* l,
+    const upb_DecodeProjection* proj, upb_DecodeProfile* profile,
+    upb_DecodeStats* stats, const upb_ExtensionRegistry* extreg, int options,
+    upb_Arena* arena) {
   upb_Decoder state;
   unsigned depth = (unsigned)options >> 16;
 
@@ -1193,22 +1392,82 @@ upb_DecodeStatus upb_Decode(const char* buf, size_t size, void* msg,
   state.end_group = DECODE_NOGROUP;
   state.options = (uint16_t)options;
   state.missing_required = false;
-  state.arena.head = arena->head;
-  state.arena.last_size = arena->last_size;
-  state.arena.cleanup_metadata = arena->cleanup_metadata;
-  state.arena.parent = arena;
+  state.user_arena = arena;
+  state.proj = proj;
+  state.profile = profile;
+  state.stats = stats;
+  state.stats_table = NULL;
+  state.stats_counters = NULL;
+  state.enum_dropped = NULL;
+  _upb_Arena_SwapIn(&state.arena, arena);
 
   upb_DecodeStatus status = UPB_SETJMP(state.err);
   if (UPB_LIKELY(status == kUpb_DecodeStatus_Ok)) {
     status = decode_top(&state, buf, msg, l);
   }
 
-  arena->head.ptr = state.arena.head.ptr;
-  arena->head.end = state.arena.head.end;
-  arena->cleanup_metadata = state.arena.cleanup_metadata;
+  _upb_Arena_SwapOut(arena, &state.arena);
   return status;
 }
 
+upb_DecodeStatus upb_Decode(const char* buf, size_t size, void* msg,
+                            const upb_MiniTable* l,
+                            const upb_ExtensionRegistry* extreg, int options,
+                            upb_Arena* arena) {
+  return decode_withhooks(buf, size, msg, l, NULL, NULL, NULL, extreg, options,
+                          arena);
+}
+
+upb_DecodeStatus upb_DecodeProjected(const char* buf, size_t size,
+                                     upb_Message* msg,
+                                     const upb_DecodeProjection* p,
+                                     const upb_ExtensionRegistry* extreg,
+                                     int options, upb_Arena* arena) {
+  /* Required fields outside the projection are expected to be missing. */
+  options &= ~kUpb_DecodeOption_CheckRequired;
+  return decode_withhooks(buf, size, msg, p->table, p, NULL, NULL, extreg,
+                          options, arena);
+}
+
+upb_DecodeStatus upb_DecodeProfiled(const char* buf, size_t size,
+                                    upb_Message* msg, const upb_MiniTable* l,
+                                    const upb_ExtensionRegistry* extreg,
+                                    int options, upb_Arena* arena,
+                                    upb_DecodeProfile* p) {
+  upb_DecodeProfile* sampled = NULL;
+  if (p->countdown == 0) {
+    sampled = p;
+    p->countdown = p->sample_every;
+  }
+  p->countdown--;
+  return decode_withhooks(buf, size, msg, l, NULL, sampled, NULL, extreg,
+                          options, arena);
+}
+
+upb_DecodeStatus upb_DecodeWithStats(const char* buf, size_t size,
+                                     upb_Message* msg, const upb_MiniTable* l,
+                                     const upb_ExtensionRegistry* extreg,
+                                     int options, upb_Arena* arena,
+                                     upb_DecodeStats* s) {
+  return decode_withhooks(buf, size, msg, l, NULL, NULL, s, extreg, options,
+                          arena);
+}
+
+upb_Message* _upb_Message_ResolveLazy(upb_Message** field) {
+  const _upb_LazyMessage* lazy = _upb_Message_GetLazy(*field);
+  upb_Message* msg = _upb_Message_New(lazy->table, lazy->arena);
+  if (!msg) return NULL;
+  upb_DecodeStatus status =
+      upb_Decode(lazy->data.data, lazy->data.size, msg, lazy->table,
+                 lazy->extreg, lazy->options, lazy->arena);
+  if (status == kUpb_DecodeStatus_OutOfMemory) return NULL;
+  /* There is no way to report a parse error from an accessor, so a corrupt
+   * lazy field reads as an empty message. */
+  if (status != kUpb_DecodeStatus_Ok) _upb_Message_Clear(msg, lazy->table);
+  *field = msg;
+  return msg;
+}
+
 #undef OP_UNKNOWN
 #undef OP_SKIP
 #undef OP_SCALAR_LG2
@@ -66,6 +66,37 @@ enum {
    *    implemting ParseFromString() semantics.  For MergeFromString(), a
    *    post-parse validation step will always be necessary. */
   kUpb_DecodeOption_CheckRequired = 2,
+
+  /* If set, singular sub-message fields that are marked lazy in the MiniTable
+   * (kUpb_FieldModifier_IsLazy, or [lazy = true] in the .proto file) are not
+   * parsed.  Their raw bytes are stored instead (aliasing the input buffer if
+   * kUpb_DecodeOption_AliasString is also set) and are parsed the first time
+   * the field is read through a generated accessor, upb_MiniTable_GetMessage()
+   * or reflection.  upb_Encode() emits the raw bytes unchanged if the field
+   * was never read, unless an encode option such as
+   * kUpb_EncodeOption_SkipUnknown needs its fields, in which case encoding
+   * reads it.
+   *
+   * IMPORTANT CAVEATS:
+   *
+   * 1. Since the first read writes the parsed message back into its parent,
+   *    a message containing unread lazy fields must not be read or encoded
+   *    with options from several threads at once, even through const
+   *    pointers.
+   *
+   * 2. Errors inside a lazy field are not reported by upb_Decode().  If the
+   *    raw bytes later fail to parse, the field reads as an empty message.
+   *    kUpb_DecodeOption_CheckRequired does not look inside lazy fields. */
+  kUpb_DecodeOption_Lazy = 4,
+
+  /* If set, unknown fields are skipped instead of being stored in the message,
+   * so upb_Encode() will not emit them.  This includes unknown MessageSet
+   * items and unrecognized values of closed enums.  A map entry with unknown
+   * fields is inserted into the map without them, unless its value is an
+   * unrecognized closed enum value, in which case the entry is dropped.
+   * Lazy fields decoded with this option drop their unknown fields too, both
+   * when they are read and when they are encoded. */
+  kUpb_DecodeOption_DiscardUnknown = 8,
 };
 
 #define UPB_DECODE_MAXDEPTH(depth) ((depth) << 16)
@@ -38,6 +38,7 @@
 #include "upb/decode_fast.h"
 
 #include "upb/internal/decode.h"
+#include "upb/internal/packed_varint.h"
 
 /* Must be last. */
 #include "upb/port_def.inc"
@@ -99,12 +100,18 @@ static const char* fastdecode_dispatch(UPB_PARSE_PARAMS) {
   UPB_MUSTTAIL return fastdecode_tagdispatch(UPB_PARSE_ARGS);
 }
 
+// Three-byte tags share the dispatch slot of their first byte with one- and
+// two-byte tags.  The dispatch only XORs the first two tag bytes into |data|,
+// so the parser checks the third byte against bits 32-39 of |data|.  Oneofs
+// use those bits for the case offset, so there are no three-byte oneof parsers.
 UPB_FORCEINLINE
-static bool fastdecode_checktag(uint16_t data, int tagbytes) {
+static bool fastdecode_checktag(const char* ptr, uint64_t data, int tagbytes) {
   if (tagbytes == 1) {
     return (data & 0xff) == 0;
+  } else if (tagbytes == 2) {
+    return (uint16_t)data == 0;
   } else {
-    return data == 0;
+    return (uint16_t)data == 0 && (uint8_t)ptr[2] == (uint8_t)(data >> 32);
   }
 }
 
@@ -177,6 +184,8 @@ static const char* fastdecode_delimited(upb_Decoder* d, const char* ptr,
     }
     int delta = decode_pushlimit(d, ptr, len);
     ptr = func(d, ptr, ctx);
+    // A stray end-group tag stops the parse short of the limit.
+    if (!ptr || d->end_group != DECODE_NOGROUP) return NULL;
     decode_poplimit(d, ptr, delta);
   } else {
     // Fast case: Sub-message is <128 bytes and fits in the current buffer.
@@ -219,7 +228,8 @@ static void* fastdecode_resizearr(upb_Decoder* d, void* dst,
   if (UPB_UNLIKELY(dst == farr->end)) {
     size_t old_size = farr->arr->capacity;
     size_t old_bytes = old_size * valbytes;
-    size_t new_size = old_size * 2;
+    // A packed field with no elements may have left an empty array.
+    size_t new_size = UPB_MAX(old_size * 2, 8);
     size_t new_bytes = new_size * valbytes;
     char* old_ptr = _upb_array_ptr(farr->arr);
     char* new_ptr = upb_Arena_Realloc(&d->arena, old_ptr, old_bytes, new_bytes);
@@ -232,12 +242,32 @@ static void* fastdecode_resizearr(upb_Decoder* d, void* dst,
   return dst;
 }
 
+// Grows the array, if necessary, so that it has room for |n| more elements
+// after |dst|.
+static void* fastdecode_reservearr(upb_Decoder* d, void* dst,
+                                   fastdecode_arr* farr, int valbytes,
+                                   size_t n) {
+  if ((size_t)((char*)farr->end - (char*)dst) >= n * valbytes) return dst;
+  char* old_ptr = _upb_array_ptr(farr->arr);
+  size_t size = ((char*)dst - old_ptr) / valbytes;
+  if (!_upb_array_realloc(farr->arr, size + n, &d->arena)) {
+    fastdecode_err(d, kUpb_DecodeStatus_OutOfMemory);
+  }
+  char* new_ptr = _upb_array_ptr(farr->arr);
+  farr->end = new_ptr + farr->arr->capacity * valbytes;
+  return new_ptr + size * valbytes;
+}
+
 UPB_FORCEINLINE
-static bool fastdecode_tagmatch(uint32_t tag, uint64_t data, int tagbytes) {
+static bool fastdecode_tagmatch(const char* ptr, uint32_t tag, uint64_t data,
+                               int tagbytes) {
   if (tagbytes == 1) {
     return (uint8_t)tag == (uint8_t)data;
-  } else {
+  } else if (tagbytes == 2) {
     return (uint16_t)tag == (uint16_t)data;
+  } else {
+    return (uint16_t)tag == (uint16_t)data &&
+           (uint8_t)ptr[2] == (uint8_t)(data >> 32);
   }
 }
 
@@ -259,7 +289,7 @@ static fastdecode_nextret fastdecode_nextrepeated(upb_Decoder* d, void* dst,
 
   if (UPB_LIKELY(!decode_isdone(d, ptr))) {
     ret.tag = fastdecode_loadtag(*ptr);
-    if (fastdecode_tagmatch(ret.tag, data, tagbytes)) {
+    if (fastdecode_tagmatch(*ptr, ret.tag, data, tagbytes)) {
       ret.next = FD_NEXT_SAMEFIELD;
     } else {
       fastdecode_commitarr(dst, farr, valbytes);
@@ -314,7 +344,9 @@ static void* fastdecode_getfield(upb_Decoder* d, const char* ptr,
       }
       begin = _upb_array_ptr(farr->arr);
       farr->end = begin + (farr->arr->capacity * valbytes);
-      *data = fastdecode_loadtag(ptr);
+      // Keep the expected third byte of a three-byte tag (see
+      // fastdecode_checktag()) for matching the following tags.
+      *data = fastdecode_loadtag(ptr) | (*data & (0xffull << 32));
       return begin + (farr->arr->size * valbytes);
     }
     default:
@@ -323,17 +355,20 @@ static void* fastdecode_getfield(upb_Decoder* d, const char* ptr,
 }
 
 UPB_FORCEINLINE
-static bool fastdecode_flippacked(uint64_t* data, int tagbytes) {
-  *data ^= (0x2 ^ 0x0);  // Patch data to match packed wiretype.
-  return fastdecode_checktag(*data, tagbytes);
+static bool fastdecode_flippacked(const char* ptr, uint64_t* data,
+                                  int tagbytes, int wire_type) {
+  // Patch data to match the other of the packed/unpacked wire types.
+  *data ^= (kUpb_WireType_Delimited ^ wire_type);
+  return fastdecode_checktag(ptr, *data, tagbytes);
 }
 
-#define FASTDECODE_CHECKPACKED(tagbytes, card, func)                \
-  if (UPB_UNLIKELY(!fastdecode_checktag(data, tagbytes))) {         \
-    if (card == CARD_r && fastdecode_flippacked(&data, tagbytes)) { \
-      UPB_MUSTTAIL return func(UPB_PARSE_ARGS);                     \
-    }                                                               \
-    RETURN_GENERIC("packed check tag mismatch\n");                  \
+#define FASTDECODE_CHECKPACKED(tagbytes, card, func, wire_type)         \
+  if (UPB_UNLIKELY(!fastdecode_checktag(ptr, data, tagbytes))) {        \
+    if (card == CARD_r &&                                               \
+        fastdecode_flippacked(ptr, &data, tagbytes, wire_type)) {       \
+      UPB_MUSTTAIL return func(UPB_PARSE_ARGS);                         \
+    }                                                                   \
+    RETURN_GENERIC("packed check tag mismatch\n");                      \
   }
 
 /* varint fields **************************************************************/
@@ -384,7 +419,7 @@ done:
   void* dst;                                                                   \
   fastdecode_arr farr;                                                         \
                                                                                \
-  FASTDECODE_CHECKPACKED(tagbytes, card, packed);                              \
+  FASTDECODE_CHECKPACKED(tagbytes, card, packed, kUpb_WireType_Varint);        \
                                                                                \
   dst = fastdecode_getfield(d, ptr, msg, &data, &hasbits, &farr, valbytes,     \
                             card);                                             \
@@ -433,11 +468,23 @@ UPB_FORCEINLINE
 static const char* fastdecode_topackedvarint(upb_Decoder* d, const char* ptr,
                                              void* ctx) {
   fastdecode_varintdata* data = ctx;
-  void* dst = data->dst;
+  void* dst = fastdecode_reservearr(d, data->dst, &data->farr, data->valbytes,
+                                    decode_countvarints(d, ptr));
   uint64_t val;
 
   while (!decode_isdone(d, &ptr)) {
     dst = fastdecode_resizearr(d, dst, &data->farr, data->valbytes);
+    if (data->valbytes != 1 && d->limit_ptr - ptr >= 16) {
+      // Decode in bulk up to the end of the buffer or of the array's capacity.
+      size_t count;
+      size_t avail = ((char*)data->farr.end - (char*)dst) / data->valbytes;
+      ptr = _upb_DecodePackedVarints(ptr, d->limit_ptr, dst, avail,
+                                     data->valbytes == 4 ? 2 : 3,
+                                     data->zigzag, &count);
+      if (ptr == NULL) return NULL;
+      dst = (char*)dst + count * data->valbytes;
+      continue;
+    }
     ptr = fastdecode_varint64(ptr, &val);
     if (ptr == NULL) return NULL;
     val = fastdecode_munge(val, data->valbytes, data->zigzag);
@@ -453,7 +500,7 @@ static const char* fastdecode_topackedvarint(upb_Decoder* d, const char* ptr,
                                 valbytes, zigzag, unpacked)                  \
   fastdecode_varintdata ctx = {valbytes, zigzag};                            \
                                                                              \
-  FASTDECODE_CHECKPACKED(tagbytes, CARD_r, unpacked);                        \
+  FASTDECODE_CHECKPACKED(tagbytes, CARD_r, unpacked, kUpb_WireType_Varint);  \
                                                                              \
   ctx.dst = fastdecode_getfield(d, ptr, msg, &data, &hasbits, &ctx.farr,     \
                                 valbytes, CARD_r);                           \
@@ -485,7 +532,7 @@ static const char* fastdecode_topackedvarint(upb_Decoder* d, const char* ptr,
 #define v_ZZ false
 
 /* Generate all combinations:
- * {s,o,r,p} x {b1,v4,z4,v8,z8} x {1bt,2bt} */
+ * {s,o,r,p} x {b1,v4,z4,v8,z8} x {1bt,2bt} + {s,r,p} x {...} x {3bt} */
 
 #define F(card, type, valbytes, tagbytes)                                      \
   UPB_NOINLINE                                                                 \
@@ -511,6 +558,9 @@ TAGBYTES(s)
 TAGBYTES(o)
 TAGBYTES(r)
 TAGBYTES(p)
+TYPES(s, 3)
+TYPES(r, 3)
+TYPES(p, 3)
 
 #undef z_ZZ
 #undef b_ZZ
@@ -525,14 +575,195 @@ TAGBYTES(p)
 #undef FASTDECODE_PACKEDVARINT
 #undef FASTDECODE_VARINT
 
+/* closed enum fields *********************************************************/
+
+UPB_FORCEINLINE
+static const upb_MiniTable_Enum* fastdecode_subenum(intptr_t table,
+                                                    uint64_t data) {
+  uint8_t idx = data >> 16;
+  return decode_totablep(table)->subs[idx].subenum;
+}
+
+UPB_FORCEINLINE
+static uint32_t fastdecode_fieldnum(const char* tagp, int tagbytes) {
+  uint32_t tag = (uint8_t)tagp[0];
+  if (tagbytes >= 2) {
+    tag = (tag & 0x7f) | ((uint32_t)((uint8_t)tagp[1] & 0x7f) << 7);
+  }
+  if (tagbytes == 3) tag |= (uint32_t)(uint8_t)tagp[2] << 14;
+  return tag >> 3;
+}
+
+// Values covered by the enum's 64-bit mask are checked inline; anything else
+// goes to the out-of-line check, which adds unknown values to |msg|'s unknown
+// fields just like the generic parser does.
+UPB_FORCEINLINE
+static bool fastdecode_checkenum(upb_Decoder* d, upb_Message* msg,
+                                 const upb_MiniTable_Enum* e,
+                                 uint32_t field_number, uint64_t val) {
+  uint32_t v = val;
+  if (UPB_LIKELY(v < 64) && UPB_LIKELY((1ULL << v) & e->mask)) return true;
+  return decode_checkenum_slow(d, msg, e, field_number, v);
+}
+
+#define FASTDECODE_UNPACKEDENUM(d, ptr, msg, table, hasbits, data, tagbytes,   \
+                                card, packed)                                  \
+  const upb_MiniTable_Enum* e;                                                 \
+  uint64_t val;                                                                \
+  void* dst;                                                                   \
+  fastdecode_arr farr;                                                         \
+                                                                               \
+  FASTDECODE_CHECKPACKED(tagbytes, card, packed, kUpb_WireType_Varint);        \
+                                                                               \
+  e = fastdecode_subenum(table, data);                                         \
+                                                                               \
+  if (card != CARD_r) {                                                        \
+    /* The value must be checked before the hasbit or oneof case is set. */    \
+    uint32_t field_number = fastdecode_fieldnum(ptr, tagbytes);                \
+    ptr += tagbytes;                                                           \
+    ptr = fastdecode_varint64(ptr, &val);                                      \
+    if (ptr == NULL) return fastdecode_err(d, kUpb_DecodeStatus_Malformed);    \
+    if (fastdecode_checkenum(d, msg, e, field_number, val)) {                  \
+      dst = fastdecode_getfield(d, ptr, msg, &data, &hasbits, &farr, 4, card); \
+      memcpy(dst, &val, 4);                                                    \
+    }                                                                          \
+    UPB_MUSTTAIL return fastdecode_dispatch(UPB_PARSE_ARGS);                   \
+  }                                                                            \
+                                                                               \
+  dst = fastdecode_getfield(d, ptr, msg, &data, &hasbits, &farr, 4, card);     \
+  if (UPB_UNLIKELY(!dst)) {                                                    \
+    RETURN_GENERIC("need array resize\n");                                     \
+  }                                                                            \
+                                                                               \
+  again:                                                                       \
+  dst = fastdecode_resizearr(d, dst, &farr, 4);                                \
+  {                                                                            \
+    uint32_t field_number = fastdecode_fieldnum(ptr, tagbytes);                \
+    ptr += tagbytes;                                                           \
+    ptr = fastdecode_varint64(ptr, &val);                                      \
+    if (ptr == NULL) return fastdecode_err(d, kUpb_DecodeStatus_Malformed);    \
+    if (fastdecode_checkenum(d, msg, e, field_number, val)) {                  \
+      memcpy(dst, &val, 4);                                                    \
+      dst = (char*)dst + 4;                                                    \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  /* Like fastdecode_nextrepeated(), but |dst| is already one past the last    \
+   * element, since unknown values are not stored. */                          \
+  if (UPB_LIKELY(!decode_isdone(d, &ptr))) {                                   \
+    uint32_t tag = fastdecode_loadtag(ptr);                                    \
+    if (fastdecode_tagmatch(ptr, tag, data, tagbytes)) goto again;             \
+    fastdecode_commitarr(dst, &farr, 4);                                       \
+    data = tag;                                                                \
+    UPB_MUSTTAIL return fastdecode_tagdispatch(UPB_PARSE_ARGS);                \
+  }                                                                            \
+  fastdecode_commitarr(dst, &farr, 4);                                         \
+  return ptr;
+
+typedef struct {
+  const upb_MiniTable_Enum* e;
+  upb_Message* msg;
+  uint32_t field_number;
+  void* dst;
+  fastdecode_arr farr;
+} fastdecode_enumdata;
+
+UPB_FORCEINLINE
+static const char* fastdecode_topackedenum(upb_Decoder* d, const char* ptr,
+                                           void* ctx) {
+  fastdecode_enumdata* data = ctx;
+  void* dst = data->dst;
+  uint64_t val;
+
+  while (!decode_isdone(d, &ptr)) {
+    dst = fastdecode_resizearr(d, dst, &data->farr, 4);
+    ptr = fastdecode_varint64(ptr, &val);
+    if (ptr == NULL) return NULL;
+    if (fastdecode_checkenum(d, data->msg, data->e, data->field_number, val)) {
+      memcpy(dst, &val, 4);
+      dst = (char*)dst + 4;
+    }
+  }
+
+  fastdecode_commitarr(dst, &data->farr, 4);
+  return ptr;
+}
+
+#define FASTDECODE_PACKEDENUM(d, ptr, msg, table, hasbits, data, tagbytes,  \
+                              unpacked)                                     \
+  fastdecode_enumdata ctx;                                                  \
+                                                                            \
+  FASTDECODE_CHECKPACKED(tagbytes, CARD_r, unpacked, kUpb_WireType_Varint); \
+                                                                            \
+  ctx.e = fastdecode_subenum(table, data);                                  \
+  ctx.msg = msg;                                                            \
+  ctx.field_number = fastdecode_fieldnum(ptr, tagbytes);                    \
+  ctx.dst = fastdecode_getfield(d, ptr, msg, &data, &hasbits, &ctx.farr, 4, \
+                                CARD_r);                                    \
+  if (UPB_UNLIKELY(!ctx.dst)) {                                             \
+    RETURN_GENERIC("need array resize\n");                                  \
+  }                                                                         \
+                                                                            \
+  ptr += tagbytes;                                                          \
+  ptr = fastdecode_delimited(d, ptr, &fastdecode_topackedenum, &ctx);       \
+                                                                            \
+  if (UPB_UNLIKELY(ptr == NULL)) {                                          \
+    return fastdecode_err(d, kUpb_DecodeStatus_Malformed);                  \
+  }                                                                         \
+                                                                            \
+  UPB_MUSTTAIL return fastdecode_dispatch(d, ptr, msg, table, hasbits, 0);
+
+#define FASTDECODE_ENUM(d, ptr, msg, table, hasbits, data, tagbytes, card, \
+                        unpacked, packed)                                  \
+  if (card == CARD_p) {                                                    \
+    FASTDECODE_PACKEDENUM(d, ptr, msg, table, hasbits, data, tagbytes,     \
+                          unpacked);                                       \
+  } else {                                                                 \
+    FASTDECODE_UNPACKEDENUM(d, ptr, msg, table, hasbits, data, tagbytes,   \
+                            card, packed);                                 \
+  }
+
+/* Generate all combinations:
+ * {s,o,r,p} x {e4} x {1bt,2bt} + {s,r,p} x {e4} x {3bt} */
+
+#define F(card, tagbytes)                                        \
+  UPB_NOINLINE                                                   \
+  const char* upb_p##card##e4_##tagbytes##bt(UPB_PARSE_PARAMS) { \
+    FASTDECODE_ENUM(d, ptr, msg, table, hasbits, data, tagbytes, \
+                    CARD_##card, upb_pre4_##tagbytes##bt,        \
+                    upb_ppe4_##tagbytes##bt);                    \
+  }
+
+#define TAGBYTES(card) \
+  F(card, 1)           \
+  F(card, 2)
+
+TAGBYTES(s)
+TAGBYTES(o)
+TAGBYTES(r)
+TAGBYTES(p)
+F(s, 3)
+F(r, 3)
+F(p, 3)
+
+#undef F
+#undef TAGBYTES
+#undef FASTDECODE_UNPACKEDENUM
+#undef FASTDECODE_PACKEDENUM
+#undef FASTDECODE_ENUM
+
 /* fixed fields ***************************************************************/
 
+#define FASTDECODE_FIXEDWIRETYPE(valbytes) \
+  ((valbytes) == 4 ? kUpb_WireType_32Bit : kUpb_WireType_64Bit)
+
 #define FASTDECODE_UNPACKEDFIXED(d, ptr, msg, table, hasbits, data, tagbytes, \
                                  valbytes, card, packed)                      \
   void* dst;                                                                  \
   fastdecode_arr farr;                                                        \
                                                                               \
-  FASTDECODE_CHECKPACKED(tagbytes, card, packed)                              \
+  FASTDECODE_CHECKPACKED(tagbytes, card, packed,                              \
+                         FASTDECODE_FIXEDWIRETYPE(valbytes))                  \
                                                                               \
   dst = fastdecode_getfield(d, ptr, msg, &data, &hasbits, &farr, valbytes,    \
                             card);                                            \
@@ -570,13 +801,15 @@ TAGBYTES(p)
 
 #define FASTDECODE_PACKEDFIXED(d, ptr, msg, table, hasbits, data, tagbytes, \
                                valbytes, unpacked)                          \
-  FASTDECODE_CHECKPACKED(tagbytes, CARD_r, unpacked)                        \
+  FASTDECODE_CHECKPACKED(tagbytes, CARD_r, unpacked,                        \
+                         FASTDECODE_FIXEDWIRETYPE(valbytes))                \
                                                                             \
   ptr += tagbytes;                                                          \
   int size = (uint8_t)ptr[0];                                               \
   ptr++;                                                                    \
   if (size & 0x80) {                                                        \
     ptr = fastdecode_longsize(ptr, &size);                                  \
+    if (!ptr) return fastdecode_err(d, kUpb_DecodeStatus_Malformed);        \
   }                                                                         \
                                                                             \
   if (UPB_UNLIKELY(fastdecode_boundscheck(ptr, size, d->limit_ptr) ||       \
@@ -588,6 +821,7 @@ TAGBYTES(p)
   upb_Array* arr = *arr_p;                                                  \
   uint8_t elem_size_lg2 = __builtin_ctz(valbytes);                          \
   int elems = size / valbytes;                                              \
+  size_t old_size = 0;                                                      \
                                                                             \
   if (UPB_LIKELY(!arr)) {                                                   \
     *arr_p = arr = _upb_Array_New(&d->arena, elems, elem_size_lg2);         \
@@ -595,12 +829,16 @@ TAGBYTES(p)
       return fastdecode_err(d, kUpb_DecodeStatus_Malformed);                \
     }                                                                       \
   } else {                                                                  \
-    _upb_Array_Resize(arr, elems, &d->arena);                               \
+    /* Packed fields may be split; append to what is already there. */     \
+    old_size = arr->size;                                                   \
+    if (!_upb_array_reserve(arr, old_size + elems, &d->arena)) {            \
+      return fastdecode_err(d, kUpb_DecodeStatus_OutOfMemory);              \
+    }                                                                       \
   }                                                                         \
                                                                             \
-  char* dst = _upb_array_ptr(arr);                                          \
+  char* dst = (char*)_upb_array_ptr(arr) + (old_size << elem_size_lg2);     \
   memcpy(dst, ptr, size);                                                   \
-  arr->size = elems;                                                        \
+  arr->size = old_size + elems;                                             \
                                                                             \
   ptr += size;                                                              \
   UPB_MUSTTAIL return fastdecode_dispatch(UPB_PARSE_ARGS);
@@ -616,14 +854,14 @@ TAGBYTES(p)
   }
 
 /* Generate all combinations:
- * {s,o,r,p} x {f4,f8} x {1bt,2bt} */
+ * {s,o,r,p} x {f4,f8} x {1bt,2bt} + {s,r,p} x {f4,f8} x {3bt} */
 
 #define F(card, valbytes, tagbytes)                                         \
   UPB_NOINLINE                                                              \
   const char* upb_p##card##f##valbytes##_##tagbytes##bt(UPB_PARSE_PARAMS) { \
     FASTDECODE_FIXED(d, ptr, msg, table, hasbits, data, tagbytes, valbytes, \
-                     CARD_##card, upb_ppf##valbytes##_##tagbytes##bt,       \
-                     upb_prf##valbytes##_##tagbytes##bt);                   \
+                     CARD_##card, upb_prf##valbytes##_##tagbytes##bt,       \
+                     upb_ppf##valbytes##_##tagbytes##bt);                   \
   }
 
 #define TYPES(card, tagbytes) \
@@ -638,12 +876,16 @@ TAGBYTES(s)
 TAGBYTES(o)
 TAGBYTES(r)
 TAGBYTES(p)
+TYPES(s, 3)
+TYPES(r, 3)
+TYPES(p, 3)
 
 #undef F
 #undef TYPES
 #undef TAGBYTES
 #undef FASTDECODE_UNPACKEDFIXED
 #undef FASTDECODE_PACKEDFIXED
+#undef FASTDECODE_FIXEDWIRETYPE
 
 /* string fields **************************************************************/
 
@@ -669,6 +911,7 @@ static const char* fastdecode_verifyutf8(upb_Decoder* d, const char* ptr,
   ptr++;                                                                       \
   if (size & 0x80) {                                                           \
     ptr = fastdecode_longsize(ptr, &size);                                     \
+    if (!ptr) return fastdecode_err(d, kUpb_DecodeStatus_Malformed);           \
   }                                                                            \
                                                                                \
   if (UPB_UNLIKELY(fastdecode_boundscheck(ptr, size, d->limit_ptr))) {         \
@@ -734,7 +977,7 @@ static void fastdecode_docopy(upb_Decoder* d, const char* ptr, uint32_t size,
   char* buf;                                                                  \
                                                                               \
   UPB_ASSERT((d->options & kUpb_DecodeOption_AliasString) == 0);              \
-  UPB_ASSERT(fastdecode_checktag(data, tagbytes));                            \
+  UPB_ASSERT(fastdecode_checktag(ptr, data, tagbytes));                       \
                                                                               \
   dst = fastdecode_getfield(d, ptr, msg, &data, &hasbits, &farr,              \
                             sizeof(upb_StringView), card);                    \
@@ -755,6 +998,7 @@ static void fastdecode_docopy(upb_Decoder* d, const char* ptr, uint32_t size,
   if (UPB_LIKELY(size <= 15 - tagbytes)) {                                    \
     if (arena_has < 16) goto longstr;                                         \
     d->arena.head.ptr += 16;                                                  \
+    UPB_UNPOISON_MEMORY_REGION(buf, 16);                                      \
     memcpy(buf, ptr - tagbytes - 1, 16);                                      \
     dst->data = buf + tagbytes + 1;                                           \
   } else if (UPB_LIKELY(size <= 32)) {                                        \
@@ -816,7 +1060,7 @@ static void fastdecode_docopy(upb_Decoder* d, const char* ptr, uint32_t size,
   fastdecode_arr farr;                                                         \
   int64_t size;                                                                \
                                                                                \
-  if (UPB_UNLIKELY(!fastdecode_checktag(data, tagbytes))) {                    \
+  if (UPB_UNLIKELY(!fastdecode_checktag(ptr, data, tagbytes))) {               \
     RETURN_GENERIC("string field tag mismatch\n");                             \
   }                                                                            \
                                                                                \
@@ -838,6 +1082,9 @@ static void fastdecode_docopy(upb_Decoder* d, const char* ptr, uint32_t size,
   dst->size = size;                                                            \
                                                                                \
   if (UPB_UNLIKELY(fastdecode_boundscheck(ptr, size, d->end))) {               \
+    if (card == CARD_r) {                                                      \
+      fastdecode_commitarr(dst + 1, &farr, sizeof(upb_StringView));            \
+    }                                                                          \
     ptr--;                                                                     \
     if (validate_utf8) {                                                       \
       return fastdecode_longstring_utf8(d, ptr, msg, table, hasbits,           \
@@ -884,7 +1131,7 @@ static void fastdecode_docopy(upb_Decoder* d, const char* ptr, uint32_t size,
   UPB_MUSTTAIL return fastdecode_dispatch(UPB_PARSE_ARGS);
 
 /* Generate all combinations:
- * {p,c} x {s,o,r} x {s, b} x {1bt,2bt} */
+ * {p,c} x {s,o,r} x {s, b} x {1bt,2bt} + {p,c} x {s,r} x {s, b} x {3bt} */
 
 #define s_VALIDATE true
 #define b_VALIDATE false
@@ -912,6 +1159,8 @@ static void fastdecode_docopy(upb_Decoder* d, const char* ptr, uint32_t size,
 TAGBYTES(s)
 TAGBYTES(o)
 TAGBYTES(r)
+UTF8(s, 3)
+UTF8(r, 3)
 
 #undef s_VALIDATE
 #undef b_VALIDATE
@@ -960,7 +1209,7 @@ static const char* fastdecode_tosubmsg(upb_Decoder* d, const char* ptr,
 #define FASTDECODE_SUBMSG(d, ptr, msg, table, hasbits, data, tagbytes,    \
                           msg_ceil_bytes, card)                           \
                                                                           \
-  if (UPB_UNLIKELY(!fastdecode_checktag(data, tagbytes))) {               \
+  if (UPB_UNLIKELY(!fastdecode_checktag(ptr, data, tagbytes))) {          \
     RETURN_GENERIC("submessage field tag mismatch\n");                    \
   }                                                                       \
                                                                           \
@@ -979,6 +1228,15 @@ static const char* fastdecode_tosubmsg(upb_Decoder* d, const char* ptr,
     RETURN_GENERIC("submessage doesn't have fast tables.");               \
   }                                                                       \
                                                                           \
+  if (card == CARD_o) {                                                   \
+    /* The slot may hold another member of the oneof. */                  \
+    uint16_t case_ofs = data >> 32;                                       \
+    uint32_t* oneof_case = UPB_PTR_AT(msg, case_ofs, uint32_t);           \
+    if (*oneof_case != (uint8_t)(data >> 24)) {                           \
+      *(upb_Message**)fastdecode_fieldmem(msg, data) = NULL;              \
+    }                                                                     \
+  }                                                                       \
+                                                                          \
   dst = fastdecode_getfield(d, ptr, msg, &data, &hasbits, &farr,          \
                             sizeof(upb_Message*), card);                  \
                                                                           \
@@ -1046,10 +1304,538 @@ static const char* fastdecode_tosubmsg(upb_Decoder* d, const char* ptr,
 TAGBYTES(s)
 TAGBYTES(o)
 TAGBYTES(r)
+SIZES(s, 3)
+SIZES(r, 3)
 
 #undef TAGBYTES
 #undef SIZES
 #undef F
 #undef FASTDECODE_SUBMSG
 
+/* map fields *****************************************************************/
+
+// The fast map parsers only handle the canonical encoding of an entry: the key
+// followed by the value, nothing else, with the whole entry inside the current
+// buffer.  Anything else (missing, repeated or unknown fields in the entry)
+// goes to the generic parser.  The entry is scanned before any memory is
+// allocated, so falling back is always possible.
+
+// Reads a map key or value in place: varints are stored in |*val|, strings and
+// sub-messages are returned in |*str| as a view of the input.  Returns NULL if
+// the field isn't the expected one or doesn't end within |end|.
+UPB_FORCEINLINE
+static const char* fastdecode_mapfield(const char* ptr, const char* end,
+                                       uint8_t tag, bool delimited,
+                                       uint64_t* val, upb_StringView* str) {
+  if (ptr >= end || (uint8_t)ptr[0] != tag) return NULL;
+  ptr++;
+  if (!delimited) {
+    ptr = fastdecode_varint64(ptr, val);
+    return ptr && ptr <= end ? ptr : NULL;
+  }
+  int size = (uint8_t)ptr[0];
+  ptr++;
+  if (size & 0x80) {
+    ptr = fastdecode_longsize(ptr, &size);
+    if (!ptr) return NULL;
+  }
+  if (size > end - ptr) return NULL;
+  str->data = ptr;
+  str->size = size;
+  return ptr + size;
+}
+
+UPB_FORCEINLINE
+static void fastdecode_mapstr(upb_Decoder* d, upb_StringView* str,
+                              bool validate_utf8) {
+  if (validate_utf8 && !decode_verifyutf8_inl(str->data, str->size)) {
+    fastdecode_err(d, kUpb_DecodeStatus_BadUtf8);
+  }
+  if ((d->options & kUpb_DecodeOption_AliasString) == 0) {
+    char* data = upb_Arena_Malloc(&d->arena, str->size);
+    if (!data) fastdecode_err(d, kUpb_DecodeStatus_OutOfMemory);
+    memcpy(data, str->data, str->size);
+    str->data = data;
+  }
+}
+
+UPB_FORCEINLINE
+static const char* fastdecode_mapsubmsg(upb_Decoder* d, upb_StringView data,
+                                        fastdecode_submsgdata* submsg) {
+  // The entry is inside the current buffer, so limit/limit_ptr can be saved
+  // verbatim, as in the fast case of fastdecode_delimited().
+  const char* saved_limit_ptr = d->limit_ptr;
+  int saved_limit = d->limit;
+  d->limit_ptr = data.data + data.size;
+  d->limit = d->limit_ptr - d->end;
+  const char* ptr = fastdecode_tosubmsg(d, data.data, submsg);
+  d->limit_ptr = saved_limit_ptr;
+  d->limit = saved_limit;
+  return ptr;
+}
+
+#define FASTDECODE_MAP(d, ptr, msg, table, hasbits, data, tagbytes, ktype,    \
+                       vtype)                                                 \
+  const char* p = ptr + tagbytes;                                             \
+  const char* entry_end;                                                      \
+  int entry_size;                                                             \
+  uint64_t key_val = 0;                                                       \
+  uint64_t val_val = 0;                                                       \
+  upb_StringView key_str;                                                     \
+  upb_StringView val_str;                                                     \
+  upb_Message* val_msg;                                                       \
+  upb_Map** map_p;                                                            \
+  upb_Map* map;                                                               \
+  const upb_MiniTable* val_table = NULL;                                      \
+                                                                              \
+  if (UPB_UNLIKELY(!fastdecode_checktag(ptr, data, tagbytes))) {              \
+    RETURN_GENERIC("map field tag mismatch\n");                               \
+  }                                                                           \
+                                                                              \
+  entry_size = (uint8_t)p[0];                                                 \
+  p++;                                                                        \
+  if (entry_size & 0x80) {                                                    \
+    p = fastdecode_longsize(p, &entry_size);                                  \
+    if (!p) return fastdecode_err(d, kUpb_DecodeStatus_Malformed);            \
+  }                                                                           \
+  if (fastdecode_boundscheck2(p, entry_size, d->limit_ptr)) {                 \
+    RETURN_GENERIC("map entry exceeds buffer\n");                             \
+  }                                                                           \
+  entry_end = p + entry_size;                                                 \
+                                                                              \
+  p = fastdecode_mapfield(p, entry_end, ktype##_DELIM ? 0x0a : 0x08,          \
+                          ktype##_DELIM, &key_val, &key_str);                 \
+  if (p) {                                                                    \
+    p = fastdecode_mapfield(p, entry_end, vtype##_DELIM ? 0x12 : 0x10,        \
+                            vtype##_DELIM, &val_val, &val_str);               \
+  }                                                                           \
+  if (UPB_UNLIKELY(p != entry_end)) {                                         \
+    RETURN_GENERIC("non-canonical map entry\n");                              \
+  }                                                                           \
+                                                                              \
+  if (vtype##_MSG) {                                                          \
+    const upb_MiniTable* tablep = decode_totablep(table);                     \
+    const upb_MiniTable* entry = tablep->subs[(data >> 16) & 0xff].submsg;    \
+    val_table = entry->subs[0].submsg;                                        \
+    /* Entry and value each count towards the depth limit. */                 \
+    if (val_table->table_mask == (uint8_t)-1 || d->depth <= 2) {              \
+      RETURN_GENERIC("map value can't be parsed fast\n");                     \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  map_p = fastdecode_fieldmem(msg, data);                                     \
+  map = *map_p;                                                               \
+  if (UPB_UNLIKELY(!map)) {                                                   \
+    map = _upb_Map_New(&d->arena, ktype##_MAPSIZE, vtype##_MAPSIZE);          \
+    if (!map) return fastdecode_err(d, kUpb_DecodeStatus_OutOfMemory);        \
+    *map_p = map;                                                             \
+  }                                                                           \
+                                                                              \
+  if (ktype##_DELIM) fastdecode_mapstr(d, &key_str, ktype##_UTF8);            \
+  if (vtype##_MSG) {                                                          \
+    val_msg = _upb_Message_New_inl(val_table, &d->arena);                     \
+    if (!val_msg) return fastdecode_err(d, kUpb_DecodeStatus_OutOfMemory);    \
+    fastdecode_submsgdata submsg = {decode_totable(val_table), val_msg};      \
+    d->depth -= 2;                                                            \
+    p = fastdecode_mapsubmsg(d, val_str, &submsg);                            \
+    d->depth += 2;                                                            \
+    if (UPB_UNLIKELY(p != entry_end || d->end_group != DECODE_NOGROUP)) {     \
+      return fastdecode_err(d, kUpb_DecodeStatus_Malformed);                  \
+    }                                                                         \
+  } else if (vtype##_DELIM) {                                                 \
+    fastdecode_mapstr(d, &val_str, vtype##_UTF8);                             \
+  }                                                                           \
+                                                                              \
+  UPB_ASSERT(map->key_size == ktype##_MAPSIZE);                               \
+  UPB_ASSERT(map->val_size == vtype##_MAPSIZE);                               \
+  if (_upb_Map_Insert(map,                                                    \
+                      ktype##_DELIM ? (void*)&key_str : (void*)&key_val,      \
+                      ktype##_MAPSIZE,                                        \
+                      vtype##_MSG     ? (void*)&val_msg                       \
+                      : vtype##_DELIM ? (void*)&val_str                       \
+                                      : (void*)&val_val,                      \
+                      vtype##_MAPSIZE,                                        \
+                      &d->arena) == _kUpb_MapInsertStatus_OutOfMemory) {      \
+    return fastdecode_err(d, kUpb_DecodeStatus_OutOfMemory);                  \
+  }                                                                           \
+                                                                              \
+  ptr = entry_end;                                                            \
+  UPB_MUSTTAIL return fastdecode_dispatch(UPB_PARSE_ARGS);
+
+// Per-type properties of map keys and values.  4-byte varints are stored by
+// copying the low bytes of the 64-bit value, which is fine on the little-endian
+// platforms that have UPB_FASTTABLE.
+#define v4_DELIM false
+#define v4_UTF8 false
+#define v4_MSG false
+#define v4_MAPSIZE 4
+#define v8_DELIM false
+#define v8_UTF8 false
+#define v8_MSG false
+#define v8_MAPSIZE 8
+#define s_DELIM true
+#define s_UTF8 true
+#define s_MSG false
+#define s_MAPSIZE UPB_MAPTYPE_STRING
+#define b_DELIM true
+#define b_UTF8 false
+#define b_MSG false
+#define b_MAPSIZE UPB_MAPTYPE_STRING
+#define m_DELIM true
+#define m_UTF8 false
+#define m_MSG true
+#define m_MAPSIZE sizeof(void*)
+
+/* Generate all combinations:
+ * {v4,v8,s,b} x {v4,v8,s,b,m} x {1bt,2bt,3bt} */
+
+#define F(ktype, vtype, tagbytes)                                             \
+  UPB_NOINLINE                                                                \
+  const char* upb_pM##ktype##_##vtype##_##tagbytes##bt(UPB_PARSE_PARAMS) {    \
+    FASTDECODE_MAP(d, ptr, msg, table, hasbits, data, tagbytes, ktype, vtype) \
+  }
+
+#define VALUES(ktype, tagbytes) \
+  F(ktype, v4, tagbytes)        \
+  F(ktype, v8, tagbytes)        \
+  F(ktype, s, tagbytes)         \
+  F(ktype, b, tagbytes)         \
+  F(ktype, m, tagbytes)
+
+#define KEYS(tagbytes) \
+  VALUES(v4, tagbytes) \
+  VALUES(v8, tagbytes) \
+  VALUES(s, tagbytes)  \
+  VALUES(b, tagbytes)
+
+KEYS(1)
+KEYS(2)
+KEYS(3)
+
+#undef v4_DELIM
+#undef v4_UTF8
+#undef v4_MSG
+#undef v4_MAPSIZE
+#undef v8_DELIM
+#undef v8_UTF8
+#undef v8_MSG
+#undef v8_MAPSIZE
+#undef s_DELIM
+#undef s_UTF8
+#undef s_MSG
+#undef s_MAPSIZE
+#undef b_DELIM
+#undef b_UTF8
+#undef b_MSG
+#undef b_MAPSIZE
+#undef m_DELIM
+#undef m_UTF8
+#undef m_MSG
+#undef m_MAPSIZE
+#undef F
+#undef VALUES
+#undef KEYS
+#undef FASTDECODE_MAP
+
+
+/* runtime tables *************************************************************/
+
+// These mirror FastDecodeTable() and TryFillTableEntry() in
+// upbc/protoc-gen-upb.cc, which build the fast tables of generated code.
+
+typedef enum {
+  FASTTYPE_b1 = 0,
+  FASTTYPE_v4 = 1,
+  FASTTYPE_v8 = 2,
+  FASTTYPE_z4 = 3,
+  FASTTYPE_z8 = 4,
+  FASTTYPE_e4 = 5,
+  FASTTYPE_f4 = 6,
+  FASTTYPE_f8 = 7,
+  FASTTYPE_s = 8,
+  FASTTYPE_b = 9,
+  FASTTYPE_m = 10,
+  FASTTYPE_none = -1
+} upb_fasttype;
+
+// Parsers by tag length; there are no three-byte oneof parsers.
+#define TAGS(prefix, suffix) \
+  { &prefix##_1bt##suffix, &prefix##_2bt##suffix, &prefix##_3bt##suffix }
+#define TAGS12(prefix, suffix) \
+  { &prefix##_1bt##suffix, &prefix##_2bt##suffix, NULL }
+
+#define SCALARS(card, tags)                                          \
+  {                                                                  \
+    tags(upb_p##card##b1, ), tags(upb_p##card##v4, ),                \
+        tags(upb_p##card##v8, ), tags(upb_p##card##z4, ),            \
+        tags(upb_p##card##z8, ), tags(upb_p##card##e4, ),            \
+        tags(upb_p##card##f4, ), tags(upb_p##card##f8, )             \
+  }
+
+// Indexed by [upb_card][upb_fasttype][tag length - 1].
+static _upb_FieldParser* const fastdecode_scalarparsers[4][8][3] = {
+    SCALARS(s, TAGS),
+    SCALARS(o, TAGS12),
+    SCALARS(r, TAGS),
+    SCALARS(p, TAGS),
+};
+
+// Indexed by [upb_card][upb_fasttype - FASTTYPE_s][tag length - 1].
+static _upb_FieldParser* const fastdecode_delimparsers[3][3][3] = {
+    {TAGS(upb_pss, ), TAGS(upb_psb, ), TAGS(upb_psm, _maxmaxb)},
+    {TAGS12(upb_pos, ), TAGS12(upb_pob, ), TAGS12(upb_pom, _maxmaxb)},
+    {TAGS(upb_prs, ), TAGS(upb_prb, ), TAGS(upb_prm, _maxmaxb)},
+};
+
+#define VALUES(ktype)                                          \
+  {                                                            \
+    TAGS(upb_pM##ktype##_v4, ), TAGS(upb_pM##ktype##_v8, ),    \
+        TAGS(upb_pM##ktype##_s, ), TAGS(upb_pM##ktype##_b, ), \
+        TAGS(upb_pM##ktype##_m, )                              \
+  }
+
+// Indexed by [key][value][tag length - 1], where key and value are the
+// upb_fasttype of v4, v8, s, b and m, renumbered from zero.
+static _upb_FieldParser* const fastdecode_mapparsers[4][5][3] = {
+    VALUES(v4),
+    VALUES(v8),
+    VALUES(s),
+    VALUES(b),
+};
+
+#undef TAGS
+#undef TAGS12
+#undef SCALARS
+#undef VALUES
+
+static upb_fasttype fastdecode_fasttype(upb_FieldType type) {
+  switch (type) {
+    case kUpb_FieldType_Bool:
+      return FASTTYPE_b1;
+    case kUpb_FieldType_Int32:
+    case kUpb_FieldType_UInt32:
+      return FASTTYPE_v4;
+    case kUpb_FieldType_Int64:
+    case kUpb_FieldType_UInt64:
+      return FASTTYPE_v8;
+    case kUpb_FieldType_SInt32:
+      return FASTTYPE_z4;
+    case kUpb_FieldType_SInt64:
+      return FASTTYPE_z8;
+    case kUpb_FieldType_Enum:
+      // Only closed enums have this type; open enums are plain int32 fields.
+      return FASTTYPE_e4;
+    case kUpb_FieldType_Fixed32:
+    case kUpb_FieldType_SFixed32:
+    case kUpb_FieldType_Float:
+      return FASTTYPE_f4;
+    case kUpb_FieldType_Fixed64:
+    case kUpb_FieldType_SFixed64:
+    case kUpb_FieldType_Double:
+      return FASTTYPE_f8;
+    case kUpb_FieldType_String:
+      return FASTTYPE_s;
+    case kUpb_FieldType_Bytes:
+      return FASTTYPE_b;
+    case kUpb_FieldType_Message:
+      return FASTTYPE_m;
+    default:
+      return FASTTYPE_none;  // Groups are not supported yet.
+  }
+}
+
+// Returns the index of a map key or value type in fastdecode_mapparsers, or
+// -1 if the fast map parsers don't handle it.
+static int fastdecode_maptype(upb_FieldType type) {
+  switch (fastdecode_fasttype(type)) {
+    case FASTTYPE_v4:
+      return 0;
+    case FASTTYPE_v8:
+      return 1;
+    case FASTTYPE_s:
+      return 2;
+    case FASTTYPE_b:
+      return 3;
+    case FASTTYPE_m:
+      return 4;
+    default:
+      return -1;
+  }
+}
+
+// Returns the field's tag as it appears on the wire, in the low bytes.
+static uint64_t fastdecode_encodedtag(const upb_MiniTable_Field* f) {
+  upb_WireType wire_type;
+  switch (f->descriptortype) {
+    case kUpb_FieldType_Fixed32:
+    case kUpb_FieldType_SFixed32:
+    case kUpb_FieldType_Float:
+      wire_type = kUpb_WireType_32Bit;
+      break;
+    case kUpb_FieldType_Fixed64:
+    case kUpb_FieldType_SFixed64:
+    case kUpb_FieldType_Double:
+      wire_type = kUpb_WireType_64Bit;
+      break;
+    case kUpb_FieldType_String:
+    case kUpb_FieldType_Bytes:
+    case kUpb_FieldType_Message:
+      wire_type = kUpb_WireType_Delimited;
+      break;
+    case kUpb_FieldType_Group:
+      wire_type = kUpb_WireType_StartGroup;
+      break;
+    default:
+      wire_type = kUpb_WireType_Varint;
+      break;
+  }
+  if (f->mode & kUpb_LabelFlags_IsPacked) wire_type = kUpb_WireType_Delimited;
+
+  uint32_t tag = (f->number << 3) | wire_type;
+  uint64_t ret = 0;
+  int shift = 0;
+  while (tag >= 0x80) {
+    ret |= (uint64_t)((tag & 0x7f) | 0x80) << shift;
+    tag >>= 7;
+    shift += 8;
+  }
+  return ret | (uint64_t)tag << shift;
+}
+
+// Returns the expected tag as it is stored in the fast table data.  The first
+// two bytes are XOR'd with the tag by the dispatch; the third byte of a
+// three-byte tag is checked by the parser itself from bits 32-39.
+static uint64_t fastdecode_tagdata(uint64_t tag) {
+  return (tag & 0xffff) | (tag >> 16) << 32;
+}
+
+static bool fastdecode_fillentry(const upb_MiniTable* l,
+                                 const upb_MiniTable_Field* f, uint64_t tag,
+                                 _upb_FastTable_Entry* ent) {
+  int tagbytes = tag > 0xffff ? 3 : tag > 0xff ? 2 : 1;
+  uint64_t data = (uint64_t)f->offset << 48 | fastdecode_tagdata(tag);
+  _upb_FieldParser* parser;
+
+  // The fast parsers would parse lazy fields eagerly.
+  if (f->mode & kUpb_LabelFlags_IsLazy) return false;
+
+  if (upb_FieldMode_Get(f) == kUpb_FieldMode_Map) {
+    // Same data layout as other fields, but maps have no hasbit.  The
+    // sub-table index refers to the map entry.
+    const upb_MiniTable* entry = l->subs[f->submsg_index].submsg;
+    if (!entry || f->submsg_index > 255) return false;
+    int key = fastdecode_maptype(entry->fields[0].descriptortype);
+    int val = fastdecode_maptype(entry->fields[1].descriptortype);
+    if (key < 0 || key == 4 || val < 0) return false;
+    ent->field_parser = fastdecode_mapparsers[key][val][tagbytes - 1];
+    ent->field_data = data | (uint64_t)f->submsg_index << 16;
+    return true;
+  }
+
+  upb_fasttype type = fastdecode_fasttype(f->descriptortype);
+  upb_card card;
+  if (type == FASTTYPE_none) return false;
+  if (upb_FieldMode_Get(f) == kUpb_FieldMode_Array) {
+    card = f->mode & kUpb_LabelFlags_IsPacked ? CARD_p : CARD_r;
+  } else {
+    card = f->presence < 0 ? CARD_o : CARD_s;
+  }
+
+  if (type < FASTTYPE_s) {
+    parser = fastdecode_scalarparsers[card][type][tagbytes - 1];
+  } else if (card != CARD_p) {
+    parser = fastdecode_delimparsers[card][type - FASTTYPE_s][tagbytes - 1];
+  } else {
+    return false;
+  }
+  if (!parser) return false;
+
+  if (card == CARD_o) {
+    // |presence| is the field number, which is also the oneof case.
+    uint64_t case_offset = ~f->presence;
+    if (case_offset > 0xffff || f->number > 255) return false;
+    data |= (uint64_t)f->number << 24 | case_offset << 32;
+  } else {
+    uint64_t hasbit_index = 63;  // No hasbit (set a high, unused bit).
+    if (f->presence > 0) {
+      hasbit_index = f->presence;
+      if (hasbit_index > 31) return false;
+    }
+    data |= hasbit_index << 24;
+  }
+
+  if (type == FASTTYPE_e4 || type == FASTTYPE_m) {
+    // Sub-messages are always parsed with the "max" size ceiling, since their
+    // MiniTables are only linked after this one is built.
+    if (f->submsg_index > 255) return false;
+    data |= (uint64_t)f->submsg_index << 16;
+  }
+
+  ent->field_parser = parser;
+  ent->field_data = data;
+  return true;
+}
+
+static bool fastdecode_hotter(const upb_MiniTable* l,
+                              const upb_MiniTable_Field* a,
+                              const upb_MiniTable_Field* b) {
+  // Required fields come first, then fields by number, as in upbc.
+  bool a_req = a->presence > 0 && a->presence <= l->required_count;
+  bool b_req = b->presence > 0 && b->presence <= l->required_count;
+  if (a_req != b_req) return a_req;
+  return a->number < b->number;
+}
+
+int _upb_FastDecoder_BuildTable(const upb_MiniTable* l,
+                                _upb_FastTable_Entry* table) {
+  const upb_MiniTable_Field* owners[UPB_FASTTABLE_MAXSIZE];
+  int size = 0;
+
+  for (int i = 0; i < l->field_count; i++) {
+    const upb_MiniTable_Field* f = &l->fields[i];
+    _upb_FastTable_Entry ent;
+    uint64_t tag = fastdecode_encodedtag(f);
+    // Tag must fit within a three-byte varint.
+    if (tag > 0x7fffff) continue;
+    int slot = (tag & 0xf8) >> 3;
+    if (!fastdecode_fillentry(l, f, tag, &ent)) continue;
+
+    while (slot >= size) {
+      int new_size = UPB_MAX(1, size * 2);
+      for (int j = size; j < new_size; j++) {
+        table[j].field_parser = &fastdecode_generic;
+        table[j].field_data = 0;
+        owners[j] = NULL;
+      }
+      size = new_size;
+    }
+    // A hotter field may already have filled this slot.
+    if (owners[slot] && fastdecode_hotter(l, owners[slot], f)) continue;
+    table[slot] = ent;
+    owners[slot] = f;
+  }
+
+  return size;
+}
+
+void _upb_FastDecoder_UpdateField(upb_MiniTable* l,
+                                  const upb_MiniTable_Field* f) {
+  if (l->table_mask == (uint8_t)-1) return;
+  uint64_t tag = fastdecode_encodedtag(f);
+  if (tag > 0x7fffff) return;
+  size_t slot = (tag & 0xf8) >> 3;
+  if (slot > (size_t)(l->table_mask >> 3)) return;
+
+  _upb_FastTable_Entry* ent = &l->fasttable[slot];
+  if (ent->field_parser != &fastdecode_generic) {
+    // The slot may belong to another field.
+    uint64_t mask = tag > 0xffff ? 0xff0000ffff : 0xffff;
+    if ((ent->field_data & mask) != fastdecode_tagdata(tag)) return;
+  }
+  if (!fastdecode_fillentry(l, f, tag, ent)) {
+    ent->field_parser = &fastdecode_generic;
+    ent->field_data = 0;
+  }
+}
+
 #endif /* UPB_FASTTABLE */
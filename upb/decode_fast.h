@@ -42,6 +42,9 @@
 //   - 'o' for oneof
 //   - 'r' for non-packed repeated
 //   - 'p' for packed repeated
+//   - 'M' for map, followed by the key type, '_' and the value type, so
+//     upb_pMs_m_1bt() parses a map<string, SomeMessage> with a one-byte tag.
+//     Keys are 'v4', 'v8', 's' or 'b'; values can also be 'm'.
 //
 // In position 3 (type):
 //   - 'b1' for bool
@@ -49,6 +52,7 @@
 //   - 'v8' for 8-byte varint
 //   - 'z4' for zig-zag-encoded 4-byte varint
 //   - 'z8' for zig-zag-encoded 8-byte varint
+//   - 'e4' for closed enum (4-byte varint checked against the enum's values)
 //   - 'f4' for 4-byte fixed
 //   - 'f8' for 8-byte fixed
 //   - 'm' for sub-message
@@ -58,11 +62,13 @@
 // In position 4 (tag length):
 //   - '1' for one-byte tags (field numbers 1-15)
 //   - '2' for two-byte tags (field numbers 16-2048)
+//   - '3' for three-byte tags (field numbers 2048-262143), which are not
+//     supported for oneofs
 
 #ifndef UPB_DECODE_FAST_H_
 #define UPB_DECODE_FAST_H_
 
-#include "upb/msg.h"
+#include "upb/msg_internal.h"
 
 // Must be last.
 #include "upb/port_def.inc"
@@ -79,6 +85,25 @@ const char* fastdecode_generic(struct upb_Decoder* d, const char* ptr,
                                upb_Message* msg, intptr_t table,
                                uint64_t hasbits, uint64_t data);
 
+// Fast tables for MiniTables built at runtime (see upb/mini_table.h).
+//
+// _upb_FastDecoder_BuildTable() fills |table|, which must have room for
+// UPB_FASTTABLE_MAXSIZE entries, with the fast parsers for the fields of |l|.
+// It returns the number of entries used, which is a power of two; if it is
+// less than two, |l| should not get a fast table at all.
+//
+// _upb_FastDecoder_UpdateField() refreshes the entry of |f| in the fast table
+// of |l| after its sub-message was linked, since only then do we know if a
+// message field is a map.
+//
+// Both are only defined if UPB_FASTTABLE is set.
+#define UPB_FASTTABLE_MAXSIZE 32
+
+int _upb_FastDecoder_BuildTable(const upb_MiniTable* l,
+                                _upb_FastTable_Entry* table);
+void _upb_FastDecoder_UpdateField(upb_MiniTable* l,
+                                  const upb_MiniTable_Field* f);
+
 #define UPB_PARSE_PARAMS                                                    \
   struct upb_Decoder *d, const char *ptr, upb_Message *msg, intptr_t table, \
       uint64_t hasbits, uint64_t data
@@ -94,6 +119,7 @@ const char* fastdecode_generic(struct upb_Decoder* d, const char* ptr,
   F(card, v, 8, tagbytes)     \
   F(card, z, 4, tagbytes)     \
   F(card, z, 8, tagbytes)     \
+  F(card, e, 4, tagbytes)     \
   F(card, f, 4, tagbytes)     \
   F(card, f, 8, tagbytes)
 
@@ -105,6 +131,9 @@ TAGBYTES(s)
 TAGBYTES(o)
 TAGBYTES(r)
 TAGBYTES(p)
+TYPES(s, 3)
+TYPES(r, 3)
+TYPES(p, 3)
 
 #undef F
 #undef TYPES
@@ -127,6 +156,8 @@ TAGBYTES(p)
 TAGBYTES(s)
 TAGBYTES(o)
 TAGBYTES(r)
+UTF8(s, 3)
+UTF8(r, 3)
 
 #undef F
 #undef TAGBYTES
@@ -150,11 +181,39 @@ TAGBYTES(r)
 TAGBYTES(s)
 TAGBYTES(o)
 TAGBYTES(r)
+SIZES(s, 3)
+SIZES(r, 3)
 
 #undef TAGBYTES
 #undef SIZES
 #undef F
 
+/* map fields *****************************************************************/
+
+#define F(ktype, vtype, tagbytes) \
+  const char* upb_pM##ktype##_##vtype##_##tagbytes##bt(UPB_PARSE_PARAMS);
+
+#define VALUES(ktype, tagbytes) \
+  F(ktype, v4, tagbytes)        \
+  F(ktype, v8, tagbytes)        \
+  F(ktype, s, tagbytes)         \
+  F(ktype, b, tagbytes)         \
+  F(ktype, m, tagbytes)
+
+#define KEYS(tagbytes) \
+  VALUES(v4, tagbytes) \
+  VALUES(v8, tagbytes) \
+  VALUES(s, tagbytes)  \
+  VALUES(b, tagbytes)
+
+KEYS(1)
+KEYS(2)
+KEYS(3)
+
+#undef KEYS
+#undef VALUES
+#undef F
+
 #undef UPB_PARSE_PARAMS
 
 #ifdef __cplusplus
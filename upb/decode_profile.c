@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "upb/decode_profile.h"
+
+#include "upb/internal/decode.h"
+
+// Must be last.
+#include "upb/port_def.inc"
+
+upb_DecodeProfile* upb_DecodeProfile_New(uint32_t sample_every) {
+  upb_Arena* arena = upb_Arena_New();
+  upb_DecodeProfile* p;
+  if (!arena) return NULL;
+  p = upb_Arena_Malloc(arena, sizeof(*p));
+  if (!p || !upb_inttable_init(&p->tables, arena)) {
+    upb_Arena_Free(arena);
+    return NULL;
+  }
+  p->arena = arena;
+  p->sample_every = UPB_MAX(sample_every, 1);
+  p->countdown = 0;
+  return p;
+}
+
+void upb_DecodeProfile_Free(upb_DecodeProfile* p) { upb_Arena_Free(p->arena); }
+
+uint64_t upb_DecodeProfile_FieldCount(const upb_DecodeProfile* p,
+                                      const upb_MiniTable* l,
+                                      uint32_t field_number) {
+  upb_value v;
+  if (!upb_inttable_lookup(&p->tables, (uintptr_t)l, &v)) return 0;
+  if (!upb_inttable_lookup(upb_value_getptr(v), field_number, &v)) return 0;
+  return upb_value_getuint64(v);
+}
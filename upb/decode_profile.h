@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * upb_DecodeProfile: counting how often each field appears on the wire.
+ */
+
+#ifndef UPB_DECODE_PROFILE_H_
+#define UPB_DECODE_PROFILE_H_
+
+#include "upb/decode.h"
+
+// Must be last.
+#include "upb/port_def.inc"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Per-field occurrence counts, gathered from a sample of parses.  The counts
+ * can be written out with upb_DecodeProfile_ToText() (see
+ * upb/util/decode_profile.h) and fed back to protoc-gen-upb with its
+ * `profile=<file>` option, which then orders fast table slots, hasbits and
+ * field offsets by how often the fields really occur instead of guessing
+ * from field numbers:
+ *
+ *   upb_DecodeProfile* p = upb_DecodeProfile_New(100);
+ *   for (each payload) {
+ *     status = upb_DecodeProfiled(buf, size, msg, layout, NULL, 0, arena, p);
+ *   }
+ *   upb_DecodeProfile_ToText(p, msgdef, text, sizeof(text));
+ *   upb_DecodeProfile_Free(p);
+ *
+ * A profile is not thread-safe: it must not be used by concurrent parses. */
+typedef struct upb_DecodeProfile upb_DecodeProfile;
+
+/* Creates an empty profile that samples one in every |sample_every| parses
+ * (every parse if it is 0 or 1).  Returns NULL if out of memory. */
+upb_DecodeProfile* upb_DecodeProfile_New(uint32_t sample_every);
+void upb_DecodeProfile_Free(upb_DecodeProfile* p);
+
+/* Returns how many times |field_number| was seen in messages of type |l| in
+ * the sampled parses.  Unknown fields are counted too. */
+uint64_t upb_DecodeProfile_FieldCount(const upb_DecodeProfile* p,
+                                      const upb_MiniTable* l,
+                                      uint32_t field_number);
+
+/* Like upb_Decode(), but if this parse is sampled, also counts the fields it
+ * sees in |p|.  Sampled parses use neither fast tables nor lazy parsing, so
+ * that every field is seen; the others run at full speed.  If memory runs
+ * out, counts are lost but the parse carries on. */
+upb_DecodeStatus upb_DecodeProfiled(const char* buf, size_t size,
+                                    upb_Message* msg, const upb_MiniTable* l,
+                                    const upb_ExtensionRegistry* extreg,
+                                    int options, upb_Arena* arena,
+                                    upb_DecodeProfile* p);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#include "upb/port_undef.inc"
+
+#endif /* UPB_DECODE_PROFILE_H_ */
@@ -0,0 +1,168 @@
+// Copyright (c) 2009-2021, Google LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Google LLC nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "upb/decode_profile.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "upb/mini_table_test_util.hpp"
+#include "upb/wire_test_util.hpp"
+
+namespace {
+
+using upb::test::Delimited;
+using upb::test::Group;
+using upb::test::Varint;
+using upb::test::VarintField;
+
+class DecodeProfileTest : public upb::test::MiniTableTest {
+ protected:
+  // message Event {
+  //   int64 timestamp = 1;
+  //   string name = 2;
+  //   repeated Attr attrs = 3;
+  //   repeated int32 samples = 4 [packed = true];
+  //   group Debug = 5 { string note = 1; }
+  //   Event parent = 6;
+  // }
+  // message Attr {
+  //   string key = 1;
+  //   int64 value = 2;
+  // }
+  void SetUp() override {
+    upb::MtDataEncoder e;
+    e.StartMessage(0);
+    e.PutField(kUpb_FieldType_Int64, 1, 0);
+    e.PutField(kUpb_FieldType_String, 2, 0);
+    e.PutField(kUpb_FieldType_Message, 3, kUpb_FieldModifier_IsRepeated);
+    e.PutField(kUpb_FieldType_Int32, 4,
+               kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked);
+    e.PutField(kUpb_FieldType_Group, 5, 0);
+    e.PutField(kUpb_FieldType_Message, 6, 0);
+    table_ = Build(e);
+
+    upb::MtDataEncoder attr;
+    attr.StartMessage(0);
+    attr.PutField(kUpb_FieldType_String, 1, 0);
+    attr.PutField(kUpb_FieldType_Int64, 2, 0);
+    attr_ = Build(attr);
+
+    upb::MtDataEncoder debug;
+    debug.StartMessage(0);
+    debug.PutField(kUpb_FieldType_String, 1, 0);
+    debug_ = Build(debug);
+
+    Link(table_, 3, attr_);
+    Link(table_, 5, debug_);
+    Link(table_, 6, table_);
+  }
+
+  static std::string Payload() {
+    std::string ret = VarintField(1, 1000) + VarintField(1, 1001);
+    ret += Delimited(2, "click");
+    ret += Delimited(3, Delimited(1, "x") + VarintField(2, 1));
+    ret += Delimited(3, Delimited(1, "y") + VarintField(2, 2));
+    ret += Delimited(3, Delimited(1, "z"));
+    ret += Delimited(4, Varint(1) + Varint(2) + Varint(3));
+    ret += Group(5, Delimited(1, "note"));
+    ret += Delimited(6, VarintField(1, 999));
+    ret += VarintField(97, 1);  // Unknown.
+    return ret;
+  }
+
+  upb_DecodeStatus Decode(const std::string& buf, upb_DecodeProfile* p,
+                          int options = 0) {
+    upb_Message* msg = _upb_Message_New(table_, arena_.ptr());
+    return upb_DecodeProfiled(buf.data(), buf.size(), msg, table_, nullptr,
+                              options, arena_.ptr(), p);
+  }
+
+  upb_MiniTable* attr_;
+  upb_MiniTable* debug_;
+};
+
+TEST_F(DecodeProfileTest, CountsEveryField) {
+  upb_DecodeProfile* p = upb_DecodeProfile_New(0);
+  ASSERT_NE(nullptr, p);
+  ASSERT_EQ(kUpb_DecodeStatus_Ok, Decode(Payload(), p));
+
+  // Fields are counted once per occurrence in any message of their type,
+  // however deeply nested; a packed array counts once.
+  EXPECT_EQ(3, upb_DecodeProfile_FieldCount(p, table_, 1));
+  EXPECT_EQ(1, upb_DecodeProfile_FieldCount(p, table_, 2));
+  EXPECT_EQ(3, upb_DecodeProfile_FieldCount(p, table_, 3));
+  EXPECT_EQ(1, upb_DecodeProfile_FieldCount(p, table_, 4));
+  EXPECT_EQ(1, upb_DecodeProfile_FieldCount(p, table_, 5));
+  EXPECT_EQ(1, upb_DecodeProfile_FieldCount(p, table_, 6));
+  EXPECT_EQ(1, upb_DecodeProfile_FieldCount(p, table_, 97));
+  EXPECT_EQ(0, upb_DecodeProfile_FieldCount(p, table_, 7));
+  EXPECT_EQ(3, upb_DecodeProfile_FieldCount(p, attr_, 1));
+  EXPECT_EQ(2, upb_DecodeProfile_FieldCount(p, attr_, 2));
+  EXPECT_EQ(1, upb_DecodeProfile_FieldCount(p, debug_, 1));
+  upb_DecodeProfile_Free(p);
+}
+
+TEST_F(DecodeProfileTest, SameResultAsDecode) {
+  upb_DecodeProfile* p = upb_DecodeProfile_New(1);
+  ASSERT_NE(nullptr, p);
+  for (int options : {0, (int)kUpb_DecodeOption_AliasString,
+                      (int)kUpb_DecodeOption_Lazy}) {
+    std::string buf = Payload();
+    upb_Message* msg = _upb_Message_New(table_, arena_.ptr());
+    ASSERT_EQ(kUpb_DecodeStatus_Ok,
+              upb_DecodeProfiled(buf.data(), buf.size(), msg, table_, nullptr,
+                                 options, arena_.ptr(), p));
+    EXPECT_EQ(Encode(Parse(table_, buf, options), table_,
+                     kUpb_EncodeOption_Deterministic),
+              Encode(msg, table_, kUpb_EncodeOption_Deterministic));
+  }
+  EXPECT_EQ(9, upb_DecodeProfile_FieldCount(p, table_, 1));
+  upb_DecodeProfile_Free(p);
+}
+
+TEST_F(DecodeProfileTest, Sampling) {
+  upb_DecodeProfile* p = upb_DecodeProfile_New(4);
+  ASSERT_NE(nullptr, p);
+  std::string buf = VarintField(1, 1);
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(kUpb_DecodeStatus_Ok, Decode(buf, p));
+  }
+  // Parses 0, 4 and 8 are sampled.
+  EXPECT_EQ(3, upb_DecodeProfile_FieldCount(p, table_, 1));
+  upb_DecodeProfile_Free(p);
+}
+
+TEST_F(DecodeProfileTest, FailedParseKeepsCounts) {
+  upb_DecodeProfile* p = upb_DecodeProfile_New(1);
+  ASSERT_NE(nullptr, p);
+  std::string buf = VarintField(1, 1) + Delimited(2, "truncated");
+  buf.resize(buf.size() - 1);
+  EXPECT_EQ(kUpb_DecodeStatus_Malformed, Decode(buf, p));
+  EXPECT_EQ(1, upb_DecodeProfile_FieldCount(p, table_, 1));
+  upb_DecodeProfile_Free(p);
+}
+
+}  // namespace
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "upb/decode_projection.h"
+
+#include <string.h>
+
+#include "upb/internal/decode.h"
+
+// Must be last.
+#include "upb/port_def.inc"
+
+upb_DecodeProjection* upb_DecodeProjection_New(const upb_MiniTable* l,
+                                               upb_Arena* arena) {
+  upb_DecodeProjection* p = upb_Arena_Malloc(arena, sizeof(*p));
+  size_t words = (l->field_count + 63) / 64;
+  if (!p) return NULL;
+  p->table = l;
+  p->children = NULL;
+  p->selected = upb_Arena_Malloc(arena, UPB_MAX(words, 1) * sizeof(uint64_t));
+  if (!p->selected) return NULL;
+  memset(p->selected, 0, UPB_MAX(words, 1) * sizeof(uint64_t));
+  return p;
+}
+
+static bool upb_DecodeProjection_CanDescend(const upb_MiniTable_Field* f) {
+  return (f->descriptortype == kUpb_FieldType_Message ||
+          f->descriptortype == kUpb_FieldType_Group) &&
+         upb_FieldMode_Get(f) != kUpb_FieldMode_Map;
+}
+
+bool upb_DecodeProjection_AddPath(upb_DecodeProjection* p,
+                                  const uint32_t* path, size_t len,
+                                  upb_Arena* arena) {
+  if (len == 0) return false;
+  for (; len > 0; path++, len--) {
+    const upb_MiniTable* l = p->table;
+    size_t i = 0;
+    while (i < l->field_count && l->fields[i].number != *path) i++;
+    if (i == l->field_count) return false;
+
+    const upb_MiniTable_Field* f = &l->fields[i];
+    bool whole = (p->selected[i / 64] >> (i % 64)) & 1 &&
+                 !(p->children && p->children[i]);
+    p->selected[i / 64] |= 1ULL << (i % 64);
+    if (len == 1) {
+      // Selecting the whole field overrides any narrower paths into it.
+      if (p->children) p->children[i] = NULL;
+      return true;
+    }
+
+    if (!upb_DecodeProjection_CanDescend(f)) return false;
+    const upb_MiniTable* sub = l->subs[f->submsg_index].submsg;
+    if (!sub) return false;
+    if (whole) return true;  // Already selected in full.
+    if (!p->children) {
+      size_t bytes = l->field_count * sizeof(*p->children);
+      p->children = upb_Arena_Malloc(arena, bytes);
+      if (!p->children) return false;
+      memset(p->children, 0, bytes);
+    }
+    if (!p->children[i]) {
+      p->children[i] = upb_DecodeProjection_New(sub, arena);
+      if (!p->children[i]) return false;
+    }
+    p = p->children[i];
+  }
+  return true;
+}
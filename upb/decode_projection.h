@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * upb_DecodeProjection: parsing only some of a message's fields.
+ */
+
+#ifndef UPB_DECODE_PROJECTION_H_
+#define UPB_DECODE_PROJECTION_H_
+
+#include "upb/decode.h"
+
+// Must be last.
+#include "upb/port_def.inc"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A set of fields to parse, given as paths of field numbers from a root
+ * message.  For example, to parse only `header.timestamp` (fields 1 and 3)
+ * and `payload` (field 7) out of a large record:
+ *
+ *   upb_DecodeProjection* p = upb_DecodeProjection_New(layout, arena);
+ *   const uint32_t ts[] = {1, 3}, payload[] = {7};
+ *   upb_DecodeProjection_AddPath(p, ts, 2, arena);
+ *   upb_DecodeProjection_AddPath(p, payload, 1, arena);
+ *   status = upb_DecodeProjected(buf, size, msg, p, NULL, 0, arena);
+ *
+ * The fields that are not selected are skipped on the wire: no sub-messages,
+ * arrays, maps or unknown-field storage are created for them, so they read as
+ * if they were absent.  A path that ends at a message field selects all of
+ * it.  Once built, a projection can be shared by any number of parses,
+ * including concurrent ones. */
+typedef struct upb_DecodeProjection upb_DecodeProjection;
+
+/* Creates an empty projection (which selects nothing) for messages of type
+ * |l|.  Returns NULL if out of memory. */
+upb_DecodeProjection* upb_DecodeProjection_New(const upb_MiniTable* l,
+                                               upb_Arena* arena);
+
+/* Selects the field reached by following the |len| field numbers in |path|.
+ * Every field along the path except the last must be a singular or repeated
+ * message (or group) field whose sub-message MiniTable is linked; map fields
+ * can only be selected whole.  Returns false if a path is invalid or memory
+ * runs out. */
+bool upb_DecodeProjection_AddPath(upb_DecodeProjection* p,
+                                  const uint32_t* path, size_t len,
+                                  upb_Arena* arena);
+
+/* Like upb_Decode() into a message of the projection's type, but parses only
+ * the selected fields.  Extensions and unknown fields are skipped too, except
+ * inside message fields that are selected whole.  Lazy fields that are
+ * selected through a longer path are parsed eagerly.
+ * kUpb_DecodeOption_CheckRequired is ignored, since skipped fields would read
+ * as missing. */
+upb_DecodeStatus upb_DecodeProjected(const char* buf, size_t size,
+                                     upb_Message* msg,
+                                     const upb_DecodeProjection* p,
+                                     const upb_ExtensionRegistry* extreg,
+                                     int options, upb_Arena* arena);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#include "upb/port_undef.inc"
+
+#endif /* UPB_DECODE_PROJECTION_H_ */
@@ -0,0 +1,246 @@
+// Copyright (c) 2009-2021, Google LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Google LLC nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "upb/decode_projection.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "upb/mini_table_test_util.hpp"
+#include "upb/wire_test_util.hpp"
+
+namespace {
+
+using upb::test::Delimited;
+using upb::test::Group;
+using upb::test::Tag;
+using upb::test::Varint;
+using upb::test::VarintField;
+
+class DecodeProjectionTest : public upb::test::MiniTableTest {
+ protected:
+  // message Record {
+  //   Header header = 1 [lazy = true];
+  //   bytes payload = 2;
+  //   repeated Label labels = 3;
+  //   group Trailer = 4 { int32 checksum = 1; string note = 2; }
+  // }
+  // message Header {
+  //   int64 id = 1;
+  //   string source = 2;
+  //   int64 timestamp = 3;
+  //   Header parent = 4;
+  // }
+  // message Label {
+  //   string key = 1;
+  //   string value = 2;
+  // }
+  void SetUp() override {
+    upb::MtDataEncoder e;
+    e.StartMessage(0);
+    e.PutField(kUpb_FieldType_Message, 1, kUpb_FieldModifier_IsLazy);
+    e.PutField(kUpb_FieldType_Bytes, 2, 0);
+    e.PutField(kUpb_FieldType_Message, 3, kUpb_FieldModifier_IsRepeated);
+    e.PutField(kUpb_FieldType_Group, 4, 0);
+    table_ = Build(e);
+
+    upb::MtDataEncoder header;
+    header.StartMessage(0);
+    header.PutField(kUpb_FieldType_Int64, 1, 0);
+    header.PutField(kUpb_FieldType_String, 2, 0);
+    header.PutField(kUpb_FieldType_Int64, 3, 0);
+    header.PutField(kUpb_FieldType_Message, 4, 0);
+    upb_MiniTable* header_table = Build(header);
+    Link(header_table, 4, header_table);
+
+    upb::MtDataEncoder pair;
+    pair.StartMessage(0);
+    pair.PutField(kUpb_FieldType_String, 1, 0);
+    pair.PutField(kUpb_FieldType_String, 2, 0);
+    upb::MtDataEncoder trailer;
+    trailer.StartMessage(0);
+    trailer.PutField(kUpb_FieldType_Int32, 1, 0);
+    trailer.PutField(kUpb_FieldType_String, 2, 0);
+
+    Link(table_, 1, header_table);
+    Link(table_, 3, Build(pair));
+    Link(table_, 4, Build(trailer));
+  }
+
+  static std::string Header() {
+    return VarintField(1, 42) + Delimited(2, std::string(300, 's')) +
+           VarintField(3, 1650000000) +
+           Delimited(4, VarintField(1, 41) + Delimited(2, "parent"));
+  }
+
+  static std::string Labels() {
+    std::string ret;
+    for (int i = 0; i < 3; i++) {
+      ret += Delimited(3, Delimited(1, std::string(1, 'k' + i)) +
+                              Delimited(2, "v"));
+    }
+    return ret;
+  }
+
+  static std::string Payload() {
+    std::string ret = Delimited(1, Header());
+    ret += Delimited(2, std::string(1000, 'p'));
+    ret += Labels();
+    ret += Group(4, VarintField(1, 7) + Delimited(2, "ok"));
+    ret += Delimited(97, std::string(100, 'u'));  // Unknown.
+    return ret;
+  }
+
+  upb_DecodeProjection* Projection(
+      const std::vector<std::vector<uint32_t>>& paths) {
+    upb_DecodeProjection* p = upb_DecodeProjection_New(table_, arena_.ptr());
+    EXPECT_NE(nullptr, p);
+    for (const auto& path : paths) {
+      EXPECT_TRUE(upb_DecodeProjection_AddPath(p, path.data(), path.size(),
+                                               arena_.ptr()));
+    }
+    return p;
+  }
+
+  // Returns the re-encoded result of a full parse of |payload|.
+  std::string Decode(const std::string& payload) {
+    return Encode(Parse(table_, payload), table_);
+  }
+
+  std::string DecodeProjected(const std::string& payload,
+                              const upb_DecodeProjection* p,
+                              upb_DecodeStatus* status, int options = 0) {
+    upb_Message* msg = _upb_Message_New(table_, arena_.ptr());
+    *status = upb_DecodeProjected(payload.data(), payload.size(), msg, p,
+                                  nullptr, options, arena_.ptr());
+    return Encode(msg, table_);
+  }
+};
+
+TEST_F(DecodeProjectionTest, Scalar) {
+  upb_DecodeStatus status;
+  EXPECT_EQ(Delimited(2, std::string(1000, 'p')),
+            DecodeProjected(Payload(), Projection({{2}}), &status));
+  EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+}
+
+TEST_F(DecodeProjectionTest, NothingSelected) {
+  upb_Message* msg = _upb_Message_New(table_, arena_.ptr());
+  std::string payload = Payload();
+  ASSERT_EQ(kUpb_DecodeStatus_Ok,
+            upb_DecodeProjected(payload.data(), payload.size(), msg,
+                                Projection({}), nullptr, 0, arena_.ptr()));
+  EXPECT_EQ("", Encode(msg, table_));
+  // Unknown fields are skipped rather than preserved.
+  size_t len;
+  upb_Message_GetUnknown(msg, &len);
+  EXPECT_EQ(0, len);
+}
+
+TEST_F(DecodeProjectionTest, WholeMessage) {
+  upb_DecodeStatus status;
+  EXPECT_EQ(Decode(Delimited(1, Header())),
+            DecodeProjected(Payload(), Projection({{1}}), &status));
+  EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+
+  EXPECT_EQ(Decode(Labels()),
+            DecodeProjected(Payload(), Projection({{3}}), &status));
+  EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+
+  // A whole selection wins over a narrower one, in either order.
+  EXPECT_EQ(Decode(Delimited(1, Header())),
+            DecodeProjected(Payload(), Projection({{1, 3}, {1}}), &status));
+  EXPECT_EQ(Decode(Delimited(1, Header())),
+            DecodeProjected(Payload(), Projection({{1}, {1, 3}}), &status));
+}
+
+TEST_F(DecodeProjectionTest, Nested) {
+  upb_DecodeStatus status;
+  EXPECT_EQ(Decode(Delimited(1, VarintField(3, 1650000000)) +
+                   Delimited(2, std::string(1000, 'p'))),
+            DecodeProjected(Payload(), Projection({{1, 3}, {2}}), &status));
+  EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+
+  EXPECT_EQ(Decode(Delimited(1, Delimited(4, Delimited(2, "parent")))),
+            DecodeProjected(Payload(), Projection({{1, 4, 2}}), &status));
+  EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+
+  std::string keys;
+  for (int i = 0; i < 3; i++) {
+    keys += Delimited(3, Delimited(1, std::string(1, 'k' + i)));
+  }
+  EXPECT_EQ(Decode(keys),
+            DecodeProjected(Payload(), Projection({{3, 1}}), &status));
+  EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+
+  EXPECT_EQ(Decode(Group(4, VarintField(1, 7))),
+            DecodeProjected(Payload(), Projection({{4, 1}}), &status));
+  EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+}
+
+TEST_F(DecodeProjectionTest, Lazy) {
+  upb_DecodeStatus status;
+  int options = kUpb_DecodeOption_Lazy;
+  // A path into the lazy header parses it.
+  EXPECT_EQ(Decode(Delimited(1, VarintField(1, 42))),
+            DecodeProjected(Payload(), Projection({{1, 1}}), &status,
+                            options));
+  EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+  // Fields out of order only survive re-encoding if the header stays lazy.
+  std::string unordered = Delimited(1, VarintField(3, 5) + VarintField(1, 6));
+  EXPECT_EQ(unordered, DecodeProjected(unordered + Delimited(2, "p"),
+                                       Projection({{1}}), &status, options));
+  EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+}
+
+TEST_F(DecodeProjectionTest, Malformed) {
+  upb_DecodeStatus status;
+  upb_DecodeProjection* p = Projection({{2}});
+  // Skipped fields are still checked against their enclosing message.
+  DecodeProjected(Tag(1, kUpb_WireType_Delimited) + Varint(3) +
+                      Delimited(2, "too long"),
+                  p, &status);
+  EXPECT_EQ(kUpb_DecodeStatus_Malformed, status);
+  DecodeProjected(VarintField(0, 1), p, &status);
+  EXPECT_EQ(kUpb_DecodeStatus_Malformed, status);
+  DecodeProjected(Delimited(2, "truncated").substr(0, 5), p, &status);
+  EXPECT_EQ(kUpb_DecodeStatus_Malformed, status);
+}
+
+TEST_F(DecodeProjectionTest, InvalidPath) {
+  upb_DecodeProjection* p = upb_DecodeProjection_New(table_, arena_.ptr());
+  const uint32_t unknown[] = {6};
+  const uint32_t through_scalar[] = {2, 1};
+  const uint32_t through_unknown[] = {1, 9};
+  EXPECT_FALSE(upb_DecodeProjection_AddPath(p, unknown, 1, arena_.ptr()));
+  EXPECT_FALSE(
+      upb_DecodeProjection_AddPath(p, through_scalar, 2, arena_.ptr()));
+  EXPECT_FALSE(
+      upb_DecodeProjection_AddPath(p, through_unknown, 2, arena_.ptr()));
+  EXPECT_FALSE(upb_DecodeProjection_AddPath(p, unknown, 0, arena_.ptr()));
+}
+
+}  // namespace
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "upb/decode_stats.h"
+
+#include <string.h>
+
+#include "upb/internal/decode.h"
+
+// Must be last.
+#include "upb/port_def.inc"
+
+bool upb_DecodeStats_Enabled(void) { return UPB_DECODE_STATS; }
+
+upb_DecodeStats* upb_DecodeStats_New(void) {
+  upb_Arena* arena = upb_Arena_New();
+  upb_DecodeStats* s;
+  if (!arena) return NULL;
+  s = upb_Arena_Malloc(arena, sizeof(*s));
+  if (!s || !upb_inttable_init(&s->tables, arena)) {
+    upb_Arena_Free(arena);
+    return NULL;
+  }
+  s->arena = arena;
+  return s;
+}
+
+void upb_DecodeStats_Free(upb_DecodeStats* s) { upb_Arena_Free(s->arena); }
+
+void upb_DecodeStats_Reset(upb_DecodeStats* s) {
+  uintptr_t key;
+  upb_value val;
+  intptr_t iter = UPB_INTTABLE_BEGIN;
+  while (upb_inttable_next2(&s->tables, &key, &val, &iter)) {
+    memset(upb_value_getptr(val), 0, sizeof(upb_DecodeCounters));
+  }
+}
+
+void upb_DecodeStats_Get(const upb_DecodeStats* s, const upb_MiniTable* l,
+                         upb_DecodeCounters* c) {
+  upb_value v;
+  if (upb_inttable_lookup(&s->tables, (uintptr_t)l, &v)) {
+    memcpy(c, upb_value_getptr(v), sizeof(*c));
+  } else {
+    memset(c, 0, sizeof(*c));
+  }
+}
+
+bool upb_DecodeStats_Next(const upb_DecodeStats* s, const upb_MiniTable** l,
+                          upb_DecodeCounters* c, size_t* iter) {
+  uintptr_t key;
+  upb_value val;
+  intptr_t i = (intptr_t)*iter;
+  if (!upb_inttable_next2(&s->tables, &key, &val, &i)) return false;
+  *iter = (size_t)i;
+  *l = (const upb_MiniTable*)key;
+  memcpy(c, upb_value_getptr(val), sizeof(*c));
+  return true;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * upb_DecodeStats: counting how often the decoder takes its fast and slow
+ * paths, per message type.
+ */
+
+#ifndef UPB_DECODE_STATS_H_
+#define UPB_DECODE_STATS_H_
+
+#include "upb/decode.h"
+
+// Must be last.
+#include "upb/port_def.inc"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Counters for one message type.  A field whose tag the fast decoder can't
+ * handle is counted as a dispatch, then as a fallback and then as a slow
+ * field. */
+typedef struct {
+  /* Tags looked up in the fast table.  Consecutive elements of a repeated
+   * field are parsed in one go and count once. */
+  uint64_t fast_dispatches;
+
+  /* Fast table fallbacks because the tag's slot has no parser: the field's
+   * type or tag size is not supported, or it lost its slot to a hotter field.
+   * Unknown fields fall back this way too. */
+  uint64_t fallback_noparser;
+
+  /* Fast table fallbacks from a parser that couldn't take the field: the slot
+   * belongs to another field or wire type (a tag collision), or the value
+   * needs a case the parser bails on (eg. a submessage without a fast table, a
+   * map entry that is not canonical). */
+  uint64_t fallback_bailed;
+
+  /* Fields parsed by the generic decoder, including fallbacks. */
+  uint64_t slow_fields;
+
+  /* Times the decoder copied the last bytes of the input into its patch buffer
+   * (see decode_isdonefallback()).  Counted against the message type whose
+   * field was read last. */
+  uint64_t buffer_flips;
+
+  /* Fields the message type doesn't know. */
+  uint64_t unknown_fields;
+} upb_DecodeCounters;
+
+/* Counters for every message type seen by upb_DecodeWithStats():
+ *
+ *   upb_DecodeStats* s = upb_DecodeStats_New();
+ *   for (each payload) {
+ *     status = upb_DecodeWithStats(buf, size, msg, layout, NULL, 0, arena, s);
+ *   }
+ *
+ *   const upb_MiniTable* l;
+ *   upb_DecodeCounters c;
+ *   size_t iter = kUpb_DecodeStats_Begin;
+ *   while (upb_DecodeStats_Next(s, &l, &c, &iter)) {
+ *     // ...
+ *   }
+ *   upb_DecodeStats_Free(s);
+ *
+ * Counting costs a table lookup per field, so it is only compiled in when upb
+ * is built with UPB_ENABLE_DECODE_STATS.  Otherwise upb_DecodeWithStats() is
+ * just upb_Decode() and no counters are ever recorded.
+ *
+ * Stats are not thread-safe: they must not be used by concurrent parses. */
+typedef struct upb_DecodeStats upb_DecodeStats;
+
+#define kUpb_DecodeStats_Begin ((size_t)-1)
+
+/* Returns true if upb was built with UPB_ENABLE_DECODE_STATS. */
+bool upb_DecodeStats_Enabled(void);
+
+/* Returns NULL if out of memory. */
+upb_DecodeStats* upb_DecodeStats_New(void);
+void upb_DecodeStats_Free(upb_DecodeStats* s);
+
+/* Sets every counter back to zero. */
+void upb_DecodeStats_Reset(upb_DecodeStats* s);
+
+/* Copies the counters for |l| into |*c|, which are all zero if no field of
+ * that type has been seen. */
+void upb_DecodeStats_Get(const upb_DecodeStats* s, const upb_MiniTable* l,
+                         upb_DecodeCounters* c);
+
+/* Advances to the next message type that has counters, returning false once
+ * there are no more.  Iteration order is unspecified. */
+bool upb_DecodeStats_Next(const upb_DecodeStats* s, const upb_MiniTable** l,
+                          upb_DecodeCounters* c, size_t* iter);
+
+/* Like upb_Decode(), but also counts the paths taken in |s|.  If memory runs
+ * out, counts are lost but the parse carries on. */
+upb_DecodeStatus upb_DecodeWithStats(const char* buf, size_t size,
+                                     upb_Message* msg, const upb_MiniTable* l,
+                                     const upb_ExtensionRegistry* extreg,
+                                     int options, upb_Arena* arena,
+                                     upb_DecodeStats* s);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#include "upb/port_undef.inc"
+
+#endif /* UPB_DECODE_STATS_H_ */
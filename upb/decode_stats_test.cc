@@ -0,0 +1,142 @@
+// Copyright (c) 2009-2021, Google LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Google LLC nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "upb/decode_stats.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "upb/mini_table.hpp"
+#include "upb/msg_internal.h"
+#include "upb/upb.hpp"
+#include "upb/wire_test_util.hpp"
+
+namespace {
+
+using upb::test::Delimited;
+using upb::test::VarintField;
+
+class DecodeStatsTest : public testing::Test {
+ protected:
+  // message M {
+  //   int32 i = 1;
+  //   M sub = 4;
+  // }
+  void SetUp() override {
+    upb::MtDataEncoder e;
+    e.StartMessage(0);
+    e.PutField(kUpb_FieldType_Int32, 1, 0);
+    e.PutField(kUpb_FieldType_Message, 4, 0);
+    upb_Status status;
+    table_ = upb_MiniTable_Build(e.data().data(), e.data().size(),
+                                 kUpb_MiniTablePlatform_Native, arena_.ptr(),
+                                 &status);
+    ASSERT_NE(nullptr, table_);
+    upb_MiniTable_SetSubMessage(table_,
+                                const_cast<upb_MiniTable_Field*>(
+                                    upb_MiniTable_FindFieldByNumber(table_, 4)),
+                                table_);
+    stats_ = upb_DecodeStats_New();
+    ASSERT_NE(nullptr, stats_);
+  }
+
+  void TearDown() override { upb_DecodeStats_Free(stats_); }
+
+  void Decode(const std::string& buf) {
+    upb_Message* msg = _upb_Message_New(table_, arena_.ptr());
+    ASSERT_EQ(kUpb_DecodeStatus_Ok,
+              upb_DecodeWithStats(buf.data(), buf.size(), msg, table_, nullptr,
+                                  0, arena_.ptr(), stats_));
+  }
+
+  bool HasFastTable() const { return table_->table_mask != (uint8_t)-1; }
+
+  upb::Arena arena_;
+  upb_MiniTable* table_;
+  upb_DecodeStats* stats_;
+};
+
+TEST_F(DecodeStatsTest, Counts) {
+  if (!upb_DecodeStats_Enabled()) GTEST_SKIP() << "built without stats";
+
+  // 20 bytes of known fields, so the parse flips to the patch buffer once.
+  // Field 2's tag has an empty fast table slot, field 9's shares the slot of
+  // field 1.
+  std::string buf;
+  for (int i = 0; i < 10; i++) buf += VarintField(1, i);
+  buf += VarintField(2, 1) + VarintField(9, 1);
+  Decode(buf);
+
+  upb_DecodeCounters c;
+  upb_DecodeStats_Get(stats_, table_, &c);
+  EXPECT_EQ(2, c.unknown_fields);
+  EXPECT_EQ(1, c.buffer_flips);
+  if (HasFastTable()) {
+    EXPECT_EQ(12, c.fast_dispatches);
+    EXPECT_EQ(1, c.fallback_noparser);
+    EXPECT_EQ(1, c.fallback_bailed);
+    EXPECT_EQ(2, c.slow_fields);
+  } else {
+    EXPECT_EQ(0, c.fast_dispatches);
+    EXPECT_EQ(0, c.fallback_noparser);
+    EXPECT_EQ(0, c.fallback_bailed);
+    EXPECT_EQ(12, c.slow_fields);
+  }
+}
+
+TEST_F(DecodeStatsTest, IterateAndReset) {
+  if (!upb_DecodeStats_Enabled()) GTEST_SKIP() << "built without stats";
+
+  std::string sub = VarintField(1, 1) + VarintField(99, 1);
+  Decode(Delimited(4, sub));
+  Decode(VarintField(99, 1));
+
+  const upb_MiniTable* l;
+  upb_DecodeCounters c;
+  size_t iter = kUpb_DecodeStats_Begin;
+  ASSERT_TRUE(upb_DecodeStats_Next(stats_, &l, &c, &iter));
+  EXPECT_EQ(table_, l);
+  EXPECT_EQ(2, c.unknown_fields);
+  EXPECT_FALSE(upb_DecodeStats_Next(stats_, &l, &c, &iter));
+
+  upb_DecodeStats_Reset(stats_);
+  upb_DecodeStats_Get(stats_, table_, &c);
+  EXPECT_EQ(0, c.unknown_fields);
+  EXPECT_EQ(0, c.slow_fields);
+}
+
+TEST_F(DecodeStatsTest, Disabled) {
+  if (upb_DecodeStats_Enabled()) GTEST_SKIP() << "built with stats";
+
+  Decode(VarintField(1, 1) + VarintField(99, 1));
+  const upb_MiniTable* l;
+  upb_DecodeCounters c;
+  size_t iter = kUpb_DecodeStats_Begin;
+  EXPECT_FALSE(upb_DecodeStats_Next(stats_, &l, &c, &iter));
+  upb_DecodeStats_Get(stats_, table_, &c);
+  EXPECT_EQ(0, c.unknown_fields);
+}
+
+}  // namespace
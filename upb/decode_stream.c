@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "upb/decode_stream.h"
+
+#include <string.h>
+
+#include "upb/msg_internal.h"
+
+// Must be last.
+#include "upb/port_def.inc"
+
+/* upb_Decode() needs all of its input in one buffer, and cannot stop in the
+ * middle of a field.  But decoding a message in pieces that each consist of
+ * whole fields has the same effect as decoding it in one go, and so does
+ * decoding a singular sub-message in pieces, since repeated occurrences of a
+ * singular message field are merged.
+ *
+ * So for every chunk we find the longest run of complete fields and decode it
+ * in place with upb_Decode().  If the next field is cut off by the end of the
+ * chunk and it is a singular sub-message, we descend into it: the sub-message
+ * is created by decoding the field with an empty payload, and its own fields
+ * are then decoded in the same way.  Any other field that is cut off is copied
+ * to a carry buffer and completed from the following chunk(s). */
+
+enum {
+  /* How deep we will descend into sub-messages that span chunks.  Deeper
+   * sub-messages are buffered. */
+  kUpb_StreamDecoder_MaxFrames = 16,
+
+  /* Enough input to read any field header: a 5-byte tag and a 10-byte length
+   * (or varint value). */
+  kUpb_StreamDecoder_MaxHeader = 16,
+};
+
+typedef enum {
+  kUpb_StreamScan_Complete,
+  kUpb_StreamScan_Partial,
+  kUpb_StreamScan_Malformed,
+} upb_StreamScan;
+
+typedef struct {
+  upb_Message* msg;
+  const upb_MiniTable* table;
+  size_t remaining; /* Bytes left in this message, SIZE_MAX for the top. */
+} upb_StreamDecoder_Frame;
+
+struct upb_StreamDecoder {
+  const upb_ExtensionRegistry* extreg;
+  upb_Arena* arena;
+  int options; /* Without depth or kUpb_DecodeOption_CheckRequired. */
+  int max_depth;
+  bool check_required;
+  upb_DecodeStatus status;
+
+  /* The partial field that the last chunk ended with.  If carry_need is
+   * non-zero, it is the total length of that field. */
+  char* carry;
+  size_t carry_len;
+  size_t carry_size;
+  size_t carry_need;
+
+  int frame_count;
+  upb_StreamDecoder_Frame frames[kUpb_StreamDecoder_MaxFrames];
+};
+
+static upb_StreamScan stream_readvarint(const char** ptr, const char* end,
+                                        uint64_t* val) {
+  const char* p = *ptr;
+  uint64_t ret = 0;
+  for (int i = 0; i < 10; i++) {
+    if (p == end) return kUpb_StreamScan_Partial;
+    uint8_t byte = *p++;
+    ret |= (uint64_t)(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80)) {
+      *ptr = p;
+      *val = ret;
+      return kUpb_StreamScan_Complete;
+    }
+  }
+  return kUpb_StreamScan_Malformed;
+}
+
+/* Finds the extent of the field starting at |ptr|.  On success, |*len| is its
+ * total length.  If the field is delimited and its header is complete,
+ * |*hdr_len| is the length of the tag and length, and |*len| is set even if
+ * the field is cut off. */
+static upb_StreamScan stream_scanfield(const char* ptr, const char* end,
+                                       uint32_t* number, size_t* hdr_len,
+                                       size_t* len) {
+  const char* start = ptr;
+  int group_depth = 0;
+  bool first = true;
+  *hdr_len = 0;
+  *len = 0;
+
+  do {
+    uint64_t tag, val;
+    upb_StreamScan r = stream_readvarint(&ptr, end, &tag);
+    if (r != kUpb_StreamScan_Complete) return r;
+    uint32_t field_number = (uint32_t)(tag >> 3);
+    if (tag > UINT32_MAX || field_number == 0) {
+      return kUpb_StreamScan_Malformed;
+    }
+    if (first) *number = field_number;
+
+    switch (tag & 7) {
+      case kUpb_WireType_Varint:
+        r = stream_readvarint(&ptr, end, &val);
+        if (r != kUpb_StreamScan_Complete) return r;
+        break;
+      case kUpb_WireType_64Bit:
+        if (end - ptr < 8) return kUpb_StreamScan_Partial;
+        ptr += 8;
+        break;
+      case kUpb_WireType_32Bit:
+        if (end - ptr < 4) return kUpb_StreamScan_Partial;
+        ptr += 4;
+        break;
+      case kUpb_WireType_Delimited:
+        r = stream_readvarint(&ptr, end, &val);
+        if (r != kUpb_StreamScan_Complete) return r;
+        if (val > INT32_MAX) return kUpb_StreamScan_Malformed;
+        if (first) {
+          *hdr_len = ptr - start;
+          *len = *hdr_len + (size_t)val;
+        }
+        if ((uint64_t)(end - ptr) < val) return kUpb_StreamScan_Partial;
+        ptr += val;
+        break;
+      case kUpb_WireType_StartGroup:
+        group_depth++;
+        break;
+      case kUpb_WireType_EndGroup:
+        if (group_depth == 0) return kUpb_StreamScan_Malformed;
+        group_depth--;
+        break;
+      default:
+        return kUpb_StreamScan_Malformed;
+    }
+    first = false;
+  } while (group_depth > 0);
+
+  *len = ptr - start;
+  return kUpb_StreamScan_Complete;
+}
+
+/* Returns the field for |number| if it is a singular sub-message that we can
+ * decode incrementally.  With kUpb_DecodeOption_Lazy, a lazy field holds a
+ * tagged _upb_LazyMessage rather than a message we could decode into, so it
+ * is carried whole and left to upb_Decode(). */
+static const upb_MiniTable_Field* stream_findsubmsg(const upb_MiniTable* l,
+                                                    uint32_t number,
+                                                    int options) {
+  for (int i = 0; i < l->field_count; i++) {
+    const upb_MiniTable_Field* field = &l->fields[i];
+    if (field->number != number) continue;
+    if (field->descriptortype != kUpb_FieldType_Message ||
+        upb_FieldMode_Get(field) != kUpb_FieldMode_Scalar ||
+        !l->subs[field->submsg_index].submsg) {
+      return NULL;
+    }
+    if ((field->mode & kUpb_LabelFlags_IsLazy) &&
+        (options & kUpb_DecodeOption_Lazy)) {
+      return NULL;
+    }
+    return field;
+  }
+  return NULL;
+}
+
+static bool stream_decode(upb_StreamDecoder* d, const char* buf, size_t size,
+                          int frame, int options) {
+  upb_StreamDecoder_Frame* f = &d->frames[frame];
+  /* A frame's content is parsed with the depth budget that upb_Decode() would
+   * have left at that point.  We never descend so far that this reaches zero,
+   * which upb_Decode() would take to mean the default. */
+  int depth = d->max_depth - frame;
+  UPB_ASSERT(depth > 0);
+  d->status = upb_Decode(buf, size, f->msg, f->table, d->extreg,
+                         options | UPB_DECODE_MAXDEPTH(depth), d->arena);
+  return d->status == kUpb_DecodeStatus_Ok;
+}
+
+/* Creates (or finds) the sub-message for |field| in the current frame, and
+ * pushes a frame for its |size| bytes of content. */
+static bool stream_descend(upb_StreamDecoder* d,
+                           const upb_MiniTable_Field* field, size_t size) {
+  upb_StreamDecoder_Frame* f = &d->frames[d->frame_count - 1];
+  char buf[6];
+  char* ptr = buf;
+  uint32_t tag = (field->number << 3) | kUpb_WireType_Delimited;
+  while (tag >= 0x80) {
+    *ptr++ = (char)((tag & 0x7f) | 0x80);
+    tag >>= 7;
+  }
+  *ptr++ = (char)tag;
+  *ptr++ = 0; /* Empty payload. */
+
+  /* This sets presence (or the oneof case) just like the full field would. */
+  if (!stream_decode(d, buf, ptr - buf, d->frame_count - 1, d->options)) {
+    return false;
+  }
+
+  upb_StreamDecoder_Frame* sub = &d->frames[d->frame_count++];
+  sub->msg = *UPB_PTR_AT(f->msg, field->offset, upb_Message*);
+  sub->table = f->table->subs[field->submsg_index].submsg;
+  sub->remaining = size;
+  UPB_ASSERT(sub->msg);
+  return true;
+}
+
+/* Decodes as much of |buf| as possible, and returns how many bytes that was.
+ * The rest is the start of a field that is cut off; |*need| is set to the
+ * total length of that field if known, else 0.  Returns SIZE_MAX on error. */
+static size_t stream_process(upb_StreamDecoder* d, const char* buf,
+                             size_t size, size_t* need) {
+  size_t consumed = 0;
+  *need = 0;
+
+  while (true) {
+    upb_StreamDecoder_Frame* f = &d->frames[d->frame_count - 1];
+    if (f->remaining == 0) {
+      /* Only sub-messages have a limit; this one is done. */
+      d->frame_count--;
+      continue;
+    }
+
+    const char* ptr = buf + consumed;
+    size_t avail = UPB_MIN(size - consumed, f->remaining);
+    bool frame_ends = f->remaining <= size - consumed;
+    const char* end = ptr + avail;
+    const char* run_end = ptr;
+    upb_StreamScan r = kUpb_StreamScan_Complete;
+    uint32_t number = 0;
+    size_t hdr_len = 0, len = 0;
+
+    while (run_end < end) {
+      r = stream_scanfield(run_end, end, &number, &hdr_len, &len);
+      if (r != kUpb_StreamScan_Complete) break;
+      run_end += len;
+    }
+
+    size_t run = run_end - ptr;
+    if (r == kUpb_StreamScan_Malformed || (run < avail && frame_ends)) {
+      /* Bad field, or one that overflows its sub-message. */
+      d->status = kUpb_DecodeStatus_Malformed;
+      return SIZE_MAX;
+    }
+    if (run && !stream_decode(d, ptr, run, d->frame_count - 1, d->options)) {
+      return SIZE_MAX;
+    }
+    consumed += run;
+    if (f->remaining != SIZE_MAX) f->remaining -= run;
+
+    if (run == avail) {
+      if (consumed == size) return consumed;
+      continue; /* End of a sub-message. */
+    }
+
+    /* The next field is cut off by the end of the input. */
+    if (len > f->remaining) {
+      d->status = kUpb_DecodeStatus_Malformed;
+      return SIZE_MAX;
+    }
+
+    const upb_MiniTable_Field* field;
+    if (hdr_len && d->frame_count < kUpb_StreamDecoder_MaxFrames &&
+        d->frame_count < d->max_depth &&
+        (field = stream_findsubmsg(f->table, number, d->options))) {
+      if (f->remaining != SIZE_MAX) f->remaining -= len;
+      consumed += hdr_len;
+      if (!stream_descend(d, field, len - hdr_len)) return SIZE_MAX;
+      continue;
+    }
+
+    *need = len;
+    return consumed;
+  }
+}
+
+static bool stream_append(upb_StreamDecoder* d, const char* buf, size_t size) {
+  if (!size) return true;
+  if (d->carry_size - d->carry_len < size) {
+    size_t new_size = UPB_MAX(d->carry_size * 2, d->carry_len + size);
+    new_size = UPB_MAX(new_size, 128);
+    /* Not upb_Arena_Realloc(), since d->carry may point into the middle of a
+     * previous buffer (see stream_consumecarry()). */
+    char* carry = upb_Arena_Malloc(d->arena, new_size);
+    if (!carry) {
+      d->status = kUpb_DecodeStatus_OutOfMemory;
+      return false;
+    }
+    if (d->carry_len) memcpy(carry, d->carry, d->carry_len);
+    d->carry = carry;
+    d->carry_size = new_size;
+  }
+  memcpy(d->carry + d->carry_len, buf, size);
+  d->carry_len += size;
+  return true;
+}
+
+/* Removes the first |n| bytes of the carry buffer, which have been decoded. */
+static void stream_consumecarry(upb_StreamDecoder* d, size_t n) {
+  if (!n) return;
+  d->carry_len -= n;
+  if (d->options & kUpb_DecodeOption_AliasString) {
+    /* Strings may point into what we just decoded, so leave it alone. */
+    d->carry += n;
+    d->carry_size -= n;
+  } else {
+    memmove(d->carry, d->carry + n, d->carry_len);
+  }
+}
+
+upb_StreamDecoder* upb_StreamDecoder_New(upb_Message* msg,
+                                         const upb_MiniTable* l,
+                                         const upb_ExtensionRegistry* extreg,
+                                         int options, upb_Arena* arena) {
+  upb_StreamDecoder* d = upb_Arena_Malloc(arena, sizeof(*d));
+  if (!d) return NULL;
+
+  unsigned depth = (unsigned)options >> 16;
+  d->extreg = extreg;
+  d->arena = arena;
+  d->options = options & 0xffff & ~kUpb_DecodeOption_CheckRequired;
+  d->max_depth = depth ? depth : 64;
+  d->check_required = options & kUpb_DecodeOption_CheckRequired;
+  d->status = kUpb_DecodeStatus_Ok;
+  d->carry = NULL;
+  d->carry_len = 0;
+  d->carry_size = 0;
+  d->carry_need = 0;
+  d->frame_count = 1;
+  d->frames[0].msg = msg;
+  d->frames[0].table = l;
+  d->frames[0].remaining = SIZE_MAX;
+  return d;
+}
+
+upb_DecodeStatus upb_StreamDecoder_Feed(upb_StreamDecoder* d, const char* buf,
+                                        size_t size) {
+  if (d->status != kUpb_DecodeStatus_Ok) return d->status;
+
+  while (d->carry_len) {
+    if (!size) return kUpb_DecodeStatus_Ok;
+
+    /* Top up the carried field with just enough input to complete it, or to
+     * find out how long it is.  We can only tell where a group ends by
+     * scanning it, so a group takes everything. */
+    size_t want;
+    if (d->carry_need) {
+      want = d->carry_need - d->carry_len;
+    } else if (d->carry_len < kUpb_StreamDecoder_MaxHeader) {
+      want = kUpb_StreamDecoder_MaxHeader - d->carry_len;
+    } else {
+      want = size;
+    }
+    want = UPB_MIN(want, size);
+    UPB_ASSERT(want > 0);
+    if (!stream_append(d, buf, want)) return d->status;
+    buf += want;
+    size -= want;
+
+    size_t n = stream_process(d, d->carry, d->carry_len, &d->carry_need);
+    if (n == SIZE_MAX) return d->status;
+    stream_consumecarry(d, n);
+  }
+
+  size_t n = stream_process(d, buf, size, &d->carry_need);
+  if (n == SIZE_MAX) return d->status;
+  stream_append(d, buf + n, size - n);
+  return d->status;
+}
+
+upb_DecodeStatus upb_StreamDecoder_Finish(upb_StreamDecoder* d) {
+  if (d->status != kUpb_DecodeStatus_Ok) return d->status;
+
+  /* Pop sub-messages that ended exactly at the end of the input. */
+  while (d->frame_count > 1 && d->frames[d->frame_count - 1].remaining == 0) {
+    d->frame_count--;
+  }
+
+  if (d->carry_len || d->frame_count > 1) {
+    d->status = kUpb_DecodeStatus_Malformed;
+  } else if (d->check_required) {
+    /* An empty parse checks the top-level message and nothing else. */
+    stream_decode(d, NULL, 0, 0,
+                  d->options | kUpb_DecodeOption_CheckRequired);
+  }
+  return d->status;
+}
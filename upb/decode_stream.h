@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * upb_StreamDecoder: parsing a message that arrives in chunks.
+ */
+
+#ifndef UPB_DECODE_STREAM_H_
+#define UPB_DECODE_STREAM_H_
+
+#include "upb/decode.h"
+
+// Must be last.
+#include "upb/port_def.inc"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Decodes a message whose serialized form arrives in chunks (eg. from a
+ * socket), without first gathering it into one contiguous buffer:
+ *
+ *   upb_StreamDecoder* d =
+ *       upb_StreamDecoder_New(msg, layout, NULL, 0, arena);
+ *   while ((n = read(fd, buf, sizeof(buf))) > 0) {
+ *     if (upb_StreamDecoder_Feed(d, buf, n) != kUpb_DecodeStatus_Ok) break;
+ *   }
+ *   status = upb_StreamDecoder_Finish(d);
+ *
+ * The result is the same as calling upb_Decode() on the concatenation of all
+ * the chunks.  Complete fields are decoded straight out of each chunk, and
+ * singular sub-message fields that span chunks are decoded incrementally, so
+ * parsing overlaps with receiving.  Only other fields that are cut off by the
+ * end of a chunk (eg. a long string) are copied, into a buffer in the arena,
+ * until the rest of them arrives.
+ *
+ * With kUpb_DecodeOption_AliasString, strings may alias the chunks, which must
+ * then outlive the message.  kUpb_DecodeOption_CheckRequired only checks the
+ * top-level message. */
+typedef struct upb_StreamDecoder upb_StreamDecoder;
+
+/* Creates a decoder that parses into |msg|.  The arguments are as for
+ * upb_Decode().  The decoder is allocated from |arena| and does not need to be
+ * freed.  Returns NULL if out of memory. */
+upb_StreamDecoder* upb_StreamDecoder_New(upb_Message* msg,
+                                         const upb_MiniTable* l,
+                                         const upb_ExtensionRegistry* extreg,
+                                         int options, upb_Arena* arena);
+
+/* Parses the next |size| bytes of input; |buf| need not outlive the call
+ * unless strings are aliased.  Returns kUpb_DecodeStatus_Ok if more input can
+ * be accepted.  Any error is sticky: later calls return it again. */
+upb_DecodeStatus upb_StreamDecoder_Feed(upb_StreamDecoder* d, const char* buf,
+                                        size_t size);
+
+/* Signals the end of the input.  Returns kUpb_DecodeStatus_Malformed if the
+ * input ended in the middle of a field. */
+upb_DecodeStatus upb_StreamDecoder_Finish(upb_StreamDecoder* d);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#include "upb/port_undef.inc"
+
+#endif /* UPB_DECODE_STREAM_H_ */
@@ -0,0 +1,261 @@
+// Copyright (c) 2009-2021, Google LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Google LLC nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "upb/decode_stream.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "upb/mini_table_accessors.h"
+#include "upb/mini_table_test_util.hpp"
+#include "upb/wire_test_util.hpp"
+
+namespace {
+
+using upb::test::Delimited;
+using upb::test::Group;
+using upb::test::Tag;
+using upb::test::Varint;
+using upb::test::VarintField;
+
+class StreamDecoderTest : public upb::test::MiniTableTest {
+ protected:
+  // message M {
+  //   int32 i = 1;
+  //   string s = 2;
+  //   M sub = 3;
+  //   repeated M subs = 4;
+  //   group G = 5 { <fields of M> }
+  // }
+  void SetUp() override {
+    upb::MtDataEncoder e;
+    e.StartMessage(0);
+    e.PutField(kUpb_FieldType_Int32, 1, 0);
+    e.PutField(kUpb_FieldType_String, 2, 0);
+    e.PutField(kUpb_FieldType_Message, 3, 0);
+    e.PutField(kUpb_FieldType_Message, 4, kUpb_FieldModifier_IsRepeated);
+    e.PutField(kUpb_FieldType_Group, 5, 0);
+    table_ = Build(e);
+    ASSERT_NE(nullptr, table_);
+    for (uint32_t i = 3; i <= 5; i++) Link(table_, i, table_);
+  }
+
+  static std::string Payload() {
+    std::string inner = VarintField(1, 7) +
+                        Delimited(2, std::string(300, 'a')) +
+                        Delimited(3, Delimited(2, "nested"));
+    std::string ret = VarintField(1, 150) + Delimited(2, "hello");
+    ret += Delimited(3, inner);
+    for (int i = 0; i < 3; i++) {
+      ret += Delimited(4, Delimited(2, std::string(50 + i, 'b' + i)));
+    }
+    ret += Group(5, VarintField(1, 3) + Delimited(2, "in group"));
+    // Unknown fields.
+    ret += Tag(99, kUpb_WireType_32Bit) + "abcd";
+    ret += Tag(98, kUpb_WireType_64Bit) + "12345678";
+    ret += Delimited(97, std::string(100, 'u'));
+    // Merges into the first occurrence.
+    ret += Delimited(3, VarintField(1, 8));
+    return ret;
+  }
+
+  // Decodes |payload| in one go, and returns the re-encoded result.
+  std::string Decode(const std::string& payload, int options,
+                     upb_DecodeStatus* status) {
+    upb_Message* msg = _upb_Message_New(table_, arena_.ptr());
+    *status = upb_Decode(payload.data(), payload.size(), msg, table_, nullptr,
+                         options, arena_.ptr());
+    return Encode(msg, table_);
+  }
+
+  // Like Decode(), but feeds |payload| to a upb_StreamDecoder in chunks,
+  // split at each of |splits| (which must be increasing).
+  std::string StreamDecode(const std::string& payload,
+                           const std::vector<size_t>& splits, int options,
+                           upb_DecodeStatus* status) {
+    upb_Message* msg = _upb_Message_New(table_, arena_.ptr());
+    upb_StreamDecoder* d =
+        upb_StreamDecoder_New(msg, table_, nullptr, options, arena_.ptr());
+    size_t start = 0;
+    *status = kUpb_DecodeStatus_Ok;
+    for (size_t i = 0; i <= splits.size(); i++) {
+      size_t end = i < splits.size() ? splits[i] : payload.size();
+      // Copy each chunk so that reading past it is caught by ASAN.
+      std::string chunk = payload.substr(start, end - start);
+      upb_DecodeStatus s =
+          upb_StreamDecoder_Feed(d, chunk.data(), chunk.size());
+      if (s != kUpb_DecodeStatus_Ok) {
+        *status = s;
+        return Encode(msg, table_);
+      }
+      start = end;
+    }
+    *status = upb_StreamDecoder_Finish(d);
+    return Encode(msg, table_);
+  }
+
+  std::string StreamDecode(const std::string& payload, size_t chunk_size,
+                           int options, upb_DecodeStatus* status) {
+    std::vector<size_t> splits;
+    for (size_t i = chunk_size; i < payload.size(); i += chunk_size) {
+      splits.push_back(i);
+    }
+    return StreamDecode(payload, splits, options, status);
+  }
+};
+
+TEST_F(StreamDecoderTest, MatchesDecode) {
+  std::string payload = Payload();
+  upb_DecodeStatus status;
+  std::string expected = Decode(payload, 0, &status);
+  ASSERT_EQ(kUpb_DecodeStatus_Ok, status);
+
+  for (size_t chunk_size : {1, 2, 3, 5, 7, 16, 17, 100, 4096}) {
+    SCOPED_TRACE(chunk_size);
+    EXPECT_EQ(expected, StreamDecode(payload, chunk_size, 0, &status));
+    EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+  }
+
+  for (size_t split = 0; split <= payload.size(); split++) {
+    SCOPED_TRACE(split);
+    EXPECT_EQ(expected,
+              StreamDecode(payload, std::vector<size_t>{split}, 0, &status));
+    EXPECT_EQ(kUpb_DecodeStatus_Ok, status);
+  }
+}
+
+TEST_F(StreamDecoderTest, AliasString) {
+  std::string payload = Payload();
+  upb_DecodeStatus status;
+  std::string expected = Decode(payload, 0, &status);
+  for (size_t chunk_size : {1, 7, 100}) {
+    SCOPED_TRACE(chunk_size);
+    // Strings alias either the payload or, if they were split between chunks,
+    // the decoder's carry buffer.
+    upb_Message* msg = _upb_Message_New(table_, arena_.ptr());
+    upb_StreamDecoder* d = upb_StreamDecoder_New(
+        msg, table_, nullptr, kUpb_DecodeOption_AliasString, arena_.ptr());
+    for (size_t i = 0; i < payload.size(); i += chunk_size) {
+      size_t size = std::min(chunk_size, payload.size() - i);
+      ASSERT_EQ(kUpb_DecodeStatus_Ok,
+                upb_StreamDecoder_Feed(d, payload.data() + i, size));
+    }
+    ASSERT_EQ(kUpb_DecodeStatus_Ok, upb_StreamDecoder_Finish(d));
+    EXPECT_EQ(expected, Encode(msg, table_));
+  }
+}
+
+TEST_F(StreamDecoderTest, Truncated) {
+  std::string payload = Payload();
+  upb_DecodeStatus status;
+  for (size_t size : {size_t{1}, size_t{20}, payload.size() - 1}) {
+    SCOPED_TRACE(size);
+    StreamDecode(payload.substr(0, size), 3, 0, &status);
+    EXPECT_EQ(kUpb_DecodeStatus_Malformed, status);
+  }
+}
+
+TEST_F(StreamDecoderTest, Malformed) {
+  // A field that overruns its sub-message.
+  std::string payload = Tag(3, kUpb_WireType_Delimited) + Varint(3) +
+                        Delimited(2, "too long");
+  upb_DecodeStatus status;
+  Decode(payload, 0, &status);
+  EXPECT_EQ(kUpb_DecodeStatus_Malformed, status);
+  for (size_t chunk_size : {1, 4, 100}) {
+    StreamDecode(payload, chunk_size, 0, &status);
+    EXPECT_EQ(kUpb_DecodeStatus_Malformed, status);
+  }
+
+  // Field number zero.
+  StreamDecode(VarintField(0, 1), 1, 0, &status);
+  EXPECT_EQ(kUpb_DecodeStatus_Malformed, status);
+}
+
+TEST_F(StreamDecoderTest, MaxDepth) {
+  std::string payload = VarintField(1, 1);
+  for (int i = 0; i < 10; i++) payload = Delimited(3, payload);
+
+  for (int depth : {5, 10, 11}) {
+    SCOPED_TRACE(depth);
+    upb_DecodeStatus expected;
+    Decode(payload, UPB_DECODE_MAXDEPTH(depth), &expected);
+    for (size_t chunk_size : {1, 3, 100}) {
+      upb_DecodeStatus status;
+      StreamDecode(payload, chunk_size, UPB_DECODE_MAXDEPTH(depth), &status);
+      EXPECT_EQ(expected, status);
+    }
+  }
+}
+
+class StreamDecoderLazyTest : public upb::test::MiniTableTest {};
+
+// message Outer {
+//   Inner sub = 1 [lazy = true];
+// }
+// message Inner {
+//   int32 i = 1;
+//   string s = 2;
+// }
+TEST_F(StreamDecoderLazyTest, SmallFeeds) {
+  upb::MtDataEncoder e;
+  ASSERT_TRUE(e.StartMessage(0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Message, 1, kUpb_FieldModifier_IsLazy));
+  upb_MiniTable* table = Build(e);
+  ASSERT_NE(nullptr, table);
+  upb::MtDataEncoder sub_e;
+  ASSERT_TRUE(sub_e.StartMessage(0));
+  ASSERT_TRUE(sub_e.PutField(kUpb_FieldType_Int32, 1, 0));
+  ASSERT_TRUE(sub_e.PutField(kUpb_FieldType_String, 2, 0));
+  upb_MiniTable* sub = Build(sub_e);
+  ASSERT_NE(nullptr, sub);
+  Link(table, 1, sub);
+  const upb_MiniTable_Field* field = &table->fields[0];
+
+  // The sub-message is split across feeds, so it cannot be decoded in place.
+  const std::string payload =
+      Delimited(1, VarintField(1, 20) + Delimited(2, std::string(40, 'x')));
+  for (size_t chunk_size : {1, 3, 7}) {
+    SCOPED_TRACE(chunk_size);
+    upb_Message* msg = _upb_Message_New(table, arena_.ptr());
+    upb_StreamDecoder* d = upb_StreamDecoder_New(
+        msg, table, nullptr, kUpb_DecodeOption_Lazy, arena_.ptr());
+    for (size_t i = 0; i < payload.size(); i += chunk_size) {
+      size_t size = std::min(chunk_size, payload.size() - i);
+      ASSERT_EQ(kUpb_DecodeStatus_Ok,
+                upb_StreamDecoder_Feed(d, payload.data() + i, size));
+    }
+    ASSERT_EQ(kUpb_DecodeStatus_Ok, upb_StreamDecoder_Finish(d));
+
+    const upb_Message* sub_msg = upb_MiniTable_GetMessage(msg, field);
+    ASSERT_NE(nullptr, sub_msg);
+    EXPECT_EQ(20, upb_MiniTable_GetInt32(sub_msg, &sub->fields[0]));
+    EXPECT_EQ(payload, Encode(msg, table));
+  }
+}
+
+}  // namespace
@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "upb/decode_fast.h"
 #include "upb/mini_table.h"
 #include "upb/reflection.h"
 
@@ -82,6 +83,7 @@ struct upb_FieldDef {
   bool has_default;
   bool is_extension_;
   bool packed_;
+  bool lazy_;
   bool proto3_optional_;
   bool has_json_name_;
   upb_FieldType type_;
@@ -546,6 +548,12 @@ bool upb_FieldDef_IsExtension(const upb_FieldDef* f) {
 
 bool upb_FieldDef_IsPacked(const upb_FieldDef* f) { return f->packed_; }
 
+bool upb_FieldDef_IsLazy(const upb_FieldDef* f) {
+  /* upb only parses singular, non-extension message fields lazily. */
+  return f->lazy_ && f->type_ == kUpb_FieldType_Message &&
+         f->label_ != kUpb_Label_Repeated && !f->is_extension_;
+}
+
 const char* upb_FieldDef_Name(const upb_FieldDef* f) {
   return shortdefname(f->full_name);
 }
@@ -1477,8 +1485,19 @@ static void fill_fieldlayout(upb_MiniTable_Field* field,
   if (upb_FieldDef_IsExtension(f)) {
     field->mode |= kUpb_LabelFlags_IsExtension;
   }
+
+  if (upb_FieldDef_IsLazy(f)) {
+    field->mode |= kUpb_LabelFlags_IsLazy;
+  }
 }
 
+/* Layouts have room for the largest fast table make_fasttables() can build. */
+#if UPB_FASTTABLE
+#define UPB_DEF_FASTTABLE_SIZE UPB_FASTTABLE_MAXSIZE
+#else
+#define UPB_DEF_FASTTABLE_SIZE 1
+#endif
+
 /* This function is the dynamic equivalent of message_layout.{cc,h} in upbc.
  * It computes a dynamic layout for all of the fields in |m|. */
 static void make_layout(symtab_addctx* ctx, const upb_MessageDef* m) {
@@ -1521,8 +1540,8 @@ static void make_layout(symtab_addctx* ctx, const upb_MessageDef* m) {
     l->ext = kUpb_ExtMode_NonExtendable;
   }
 
-  /* TODO(haberman): initialize fast tables so that reflection-based parsing
-   * can get the same speeds as linked-in types. */
+  /* The real fast table is built by make_fasttables() once the layouts of all
+   * messages in the file are known. */
   l->fasttable[0].field_parser = &fastdecode_generic;
   l->fasttable[0].field_data = 0;
 
@@ -1676,6 +1695,28 @@ static void make_layout(symtab_addctx* ctx, const upb_MessageDef* m) {
   assign_layout_indices(m, l, fields);
 }
 
+#if UPB_FASTTABLE
+/* Builds the fast tables of |m| and its nested messages, so that
+ * reflection-based parsing gets the same speeds as linked-in types.  This
+ * must run after make_layout(), since map fields need the layout of their
+ * entry. */
+static void make_fasttables(const upb_MessageDef* m) {
+  upb_MiniTable* l = (upb_MiniTable*)m->layout;
+  _upb_FastTable_Entry* table = l->fasttable;
+  int size = _upb_FastDecoder_BuildTable(l, table);
+  if (size > 1) {
+    l->table_mask = (size - 1) << 3;
+  } else {
+    table[0].field_parser = &fastdecode_generic;
+    table[0].field_data = 0;
+  }
+
+  for (int i = 0; i < m->nested_msg_count; i++) {
+    make_fasttables(&m->nested_msgs[i]);
+  }
+}
+#endif
+
 static char* strviewdup(symtab_addctx* ctx, upb_StringView view) {
   char* ret = upb_strdup2(view.data, view.size, ctx->arena);
   CHK_OOM(ret);
@@ -2391,6 +2432,8 @@ static void create_fielddef(
                  f->label_ == kUpb_Label_Repeated &&
                  f->file->syntax == kUpb_Syntax_Proto3;
   }
+
+  f->lazy_ = google_protobuf_FieldOptions_lazy(f->opts);
 }
 
 static void create_service(
@@ -2630,8 +2673,9 @@ static void create_msgdef(symtab_addctx* ctx, const char* prefix,
     UPB_ASSERT(n_field == m->layout->field_count);
   } else {
     /* Allocate now (to allow cross-linking), populate later. */
-    m->layout =
-        symtab_alloc(ctx, sizeof(*m->layout) + sizeof(_upb_FastTable_Entry));
+    m->layout = symtab_alloc(
+        ctx, sizeof(*m->layout) +
+                 UPB_DEF_FASTTABLE_SIZE * sizeof(_upb_FastTable_Entry));
   }
 
   SET_OPTIONS(m->opts, DescriptorProto, MessageOptions, msg_proto);
@@ -3046,6 +3090,14 @@ static void build_filedef(
     resolve_msgdef(ctx, (upb_MessageDef*)&file->top_lvl_msgs[i]);
   }
 
+#if UPB_FASTTABLE
+  if (!ctx->layout) {
+    for (i = 0; i < (size_t)file->top_lvl_msg_count; i++) {
+      make_fasttables(&file->top_lvl_msgs[i]);
+    }
+  }
+#endif
+
   if (file->ext_count) {
     CHK_OOM(_upb_extreg_add(ctx->symtab->extreg, file->ext_layouts,
                             file->ext_count));
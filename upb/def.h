@@ -108,6 +108,7 @@ const char* upb_FieldDef_JsonName(const upb_FieldDef* f);
 bool upb_FieldDef_HasJsonName(const upb_FieldDef* f);
 bool upb_FieldDef_IsExtension(const upb_FieldDef* f);
 bool upb_FieldDef_IsPacked(const upb_FieldDef* f);
+bool upb_FieldDef_IsLazy(const upb_FieldDef* f);
 const upb_FileDef* upb_FieldDef_File(const upb_FieldDef* f);
 const upb_MessageDef* upb_FieldDef_ContainingType(const upb_FieldDef* f);
 const upb_MessageDef* upb_FieldDef_ExtensionScope(const upb_FieldDef* f);
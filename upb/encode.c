@@ -32,7 +32,9 @@
 #include <setjmp.h>
 #include <string.h>
 
+#include "upb/decode.h"
 #include "upb/extension_registry.h"
+#include "upb/internal/packed_varint.h"
 #include "upb/msg_internal.h"
 #include "upb/upb.h"
 
@@ -60,6 +62,20 @@ static uint64_t encode_zz64(int64_t n) {
   return ((uint64_t)n << 1) ^ (n >> 63);
 }
 
+/* A lazy sub-message that was never read is normally copied out as the bytes
+ * it was decoded from.  These options depend on its unknown fields, map order
+ * and required fields, so under them it is parsed (in place, as reading it
+ * would) and encoded like any other sub-message.  The same goes when it was
+ * decoded with kUpb_DecodeOption_DiscardUnknown, since the bytes still hold
+ * the unknown fields that option drops. */
+static bool encode_resolvelazy(int options, const upb_Message* submsg) {
+  const _upb_LazyMessage* lazy = _upb_Message_GetLazy(submsg);
+  return (options & (kUpb_EncodeOption_Deterministic |
+                     kUpb_EncodeOption_SkipUnknown |
+                     kUpb_EncodeOption_CheckRequired)) ||
+         (lazy->options & kUpb_DecodeOption_DiscardUnknown);
+}
+
 typedef struct {
   jmp_buf err;
   upb_alloc* alloc;
@@ -85,7 +101,12 @@ UPB_NOINLINE
 static void encode_growbuffer(upb_encstate* e, size_t bytes) {
   size_t old_size = e->limit - e->buf;
   size_t new_size = upb_roundup_pow2(bytes + (e->limit - e->ptr));
-  char* new_buf = upb_realloc(e->alloc, e->buf, old_size, new_size);
+  char* new_buf;
+
+  /* A buffer supplied by the caller cannot grow. */
+  if (!e->alloc) encode_err(e, kUpb_EncodeStatus_BufferTooSmall);
+
+  new_buf = upb_realloc(e->alloc, e->buf, old_size, new_size);
 
   if (!new_buf) encode_err(e, kUpb_EncodeStatus_OutOfMemory);
 
@@ -135,6 +156,14 @@ static void encode_longvarint(upb_encstate* e, uint64_t val) {
   size_t len;
   char* start;
 
+  if (UPB_UNLIKELY((size_t)(e->ptr - e->buf) < UPB_PB_VARINT_MAX_LEN)) {
+    /* Reserve only what the varint needs, so that a buffer from the caller is
+     * not reported as too small when the varint would fit. */
+    char buf[UPB_PB_VARINT_MAX_LEN];
+    encode_bytes(e, buf, encode_varint64(val, buf));
+    return;
+  }
+
   encode_reserve(e, UPB_PB_VARINT_MAX_LEN);
   len = encode_varint64(val, e->ptr);
   start = e->ptr + UPB_PB_VARINT_MAX_LEN - len;
@@ -272,6 +301,19 @@ static void encode_scalar(upb_encstate* e, const void* _field_mem,
       if (submsg == NULL) {
         return;
       }
+      if (UPB_UNLIKELY(_upb_Message_IsLazy(submsg))) {
+        if (encode_resolvelazy(e->options, submsg)) {
+          submsg = _upb_Message_ResolveLazy((upb_Message**)field_mem);
+          if (!submsg) encode_err(e, kUpb_EncodeStatus_OutOfMemory);
+        } else {
+          /* Never read since it was decoded: emit the raw bytes unchanged. */
+          const _upb_LazyMessage* lazy = _upb_Message_GetLazy(submsg);
+          encode_bytes(e, lazy->data.data, lazy->data.size);
+          encode_varint(e, lazy->data.size);
+          wire_type = kUpb_WireType_Delimited;
+          break;
+        }
+      }
       if (--e->depth == 0) encode_err(e, kUpb_EncodeStatus_MaxDepthExceeded);
       encode_message(e, submsg, subm, &size);
       encode_varint(e, size);
@@ -287,6 +329,16 @@ static void encode_scalar(upb_encstate* e, const void* _field_mem,
   encode_tag(e, f->number, wire_type);
 }
 
+/* Writes the elements of a packed varint array in one go.  Sizing first lets
+ * the elements be encoded front to back into space reserved up front. */
+static void encode_packedvarints(upb_encstate* e, const upb_Array* arr,
+                                 int lg2, upb_PackedVarint_Mode mode) {
+  const void* data = _upb_array_constptr(arr);
+  size_t size = _upb_PackedVarintsSize(data, arr->size, lg2, mode);
+  encode_reserve(e, size);
+  _upb_EncodePackedVarints(data, arr->size, lg2, mode, e->ptr, size);
+}
+
 static void encode_array(upb_encstate* e, const upb_Message* msg,
                          const upb_MiniTable_Sub* subs,
                          const upb_MiniTable_Field* f) {
@@ -311,6 +363,12 @@ static void encode_array(upb_encstate* e, const upb_Message* msg,
   }                                                                      \
   break;
 
+#define PACKED_CASE(lg2, mode)               \
+  if (packed) {                              \
+    encode_packedvarints(e, arr, lg2, mode); \
+    break;                                   \
+  }
+
 #define TAG(wire_type) (packed ? 0 : (f->number << 3 | wire_type))
 
   switch (f->descriptortype) {
@@ -330,17 +388,22 @@ static void encode_array(upb_encstate* e, const upb_Message* msg,
       break;
     case kUpb_FieldType_Int64:
     case kUpb_FieldType_UInt64:
+      PACKED_CASE(3, kUpb_PackedVarint_ZeroExtend);
       VARINT_CASE(uint64_t, *ptr);
     case kUpb_FieldType_UInt32:
+      PACKED_CASE(2, kUpb_PackedVarint_ZeroExtend);
       VARINT_CASE(uint32_t, *ptr);
     case kUpb_FieldType_Int32:
     case kUpb_FieldType_Enum:
+      PACKED_CASE(2, kUpb_PackedVarint_SignExtend);
       VARINT_CASE(int32_t, (int64_t)*ptr);
     case kUpb_FieldType_Bool:
       VARINT_CASE(bool, *ptr);
     case kUpb_FieldType_SInt32:
+      PACKED_CASE(2, kUpb_PackedVarint_ZigZag);
       VARINT_CASE(int32_t, encode_zz32(*ptr));
     case kUpb_FieldType_SInt64:
+      PACKED_CASE(3, kUpb_PackedVarint_ZigZag);
       VARINT_CASE(int64_t, encode_zz64(*ptr));
     case kUpb_FieldType_String:
     case kUpb_FieldType_Bytes: {
@@ -386,6 +449,7 @@ static void encode_array(upb_encstate* e, const upb_Message* msg,
     }
   }
 #undef VARINT_CASE
+#undef PACKED_CASE
 
   if (packed) {
     encode_varint(e, e->limit - e->ptr - pre_len);
@@ -418,8 +482,10 @@ static void encode_map(upb_encstate* e, const upb_Message* msg,
 
   if (e->options & kUpb_EncodeOption_Deterministic) {
     _upb_sortedmap sorted;
-    _upb_mapsorter_pushmap(&e->sorter, layout->fields[0].descriptortype, map,
-                           &sorted);
+    if (!_upb_mapsorter_pushmap(&e->sorter, layout->fields[0].descriptortype,
+                                map, &sorted)) {
+      encode_err(e, kUpb_EncodeStatus_OutOfMemory);
+    }
     upb_MapEntry ent;
     while (_upb_sortedmap_next(&e->sorter, map, &sorted, &ent)) {
       encode_mapentry(e, f->number, layout, &ent);
@@ -573,9 +639,12 @@ static void encode_message(upb_encstate* e, const upb_Message* msg,
   *size = (e->limit - e->ptr) - pre_len;
 }
 
-upb_EncodeStatus upb_Encode(const void* msg, const upb_MiniTable* l,
-                            int options, upb_Arena* arena, char** buf,
-                            size_t* size) {
+/* Encodes into |arena| with |sorter|, which is left holding whatever buffers it
+ * grew so that the caller can reuse or free them. */
+static upb_EncodeStatus encode_toarena(const void* msg, const upb_MiniTable* l,
+                                       int options, upb_Arena* arena,
+                                       _upb_mapsorter* sorter, char** buf,
+                                       size_t* size) {
   upb_encstate e;
   unsigned depth = (unsigned)options >> 16;
 
@@ -585,7 +654,8 @@ upb_EncodeStatus upb_Encode(const void* msg, const upb_MiniTable* l,
   e.ptr = NULL;
   e.depth = depth ? depth : 64;
   e.options = options;
-  _upb_mapsorter_init(&e.sorter);
+  e.sorter = *sorter;
+  e.sorter.size = 0;
 
   upb_EncodeStatus status = UPB_SETJMP(e.err);
 
@@ -608,6 +678,871 @@ upb_EncodeStatus upb_Encode(const void* msg, const upb_MiniTable* l,
     *size = 0;
   }
 
+  *sorter = e.sorter;
+  return status;
+}
+
+upb_EncodeStatus upb_Encode(const void* msg, const upb_MiniTable* l,
+                            int options, upb_Arena* arena, char** buf,
+                            size_t* size) {
+  _upb_mapsorter sorter;
+  _upb_mapsorter_init(&sorter, arena);
+  upb_EncodeStatus status =
+      encode_toarena(msg, l, options, arena, &sorter, buf, size);
+  _upb_mapsorter_destroy(&sorter);
+  return status;
+}
+
+struct upb_EncodeSorter {
+  _upb_mapsorter sorter;
+};
+
+upb_EncodeSorter* upb_EncodeSorter_New(upb_Arena* arena) {
+  upb_EncodeSorter* s = upb_Arena_Malloc(arena, sizeof(*s));
+  if (!s) return NULL;
+  _upb_mapsorter_init(&s->sorter, arena);
+  return s;
+}
+
+upb_EncodeStatus upb_EncodeWithSorter(const void* msg, const upb_MiniTable* l,
+                                      int options, upb_Arena* arena,
+                                      upb_EncodeSorter* sorter, char** buf,
+                                      size_t* size) {
+  return encode_toarena(msg, l, options, arena, &sorter->sorter, buf, size);
+}
+
+upb_EncodeStatus upb_EncodeToBuffer(const void* msg, const upb_MiniTable* l,
+                                    int options, char* buf, size_t capacity,
+                                    size_t* size) {
+  upb_encstate e;
+  unsigned depth = (unsigned)options >> 16;
+
+  e.alloc = NULL;
+  e.buf = buf;
+  e.limit = capacity ? buf + capacity : buf;
+  e.ptr = e.limit;
+  e.depth = depth ? depth : 64;
+  e.options = options;
+  _upb_mapsorter_init(&e.sorter, NULL);
+
+  upb_EncodeStatus status = UPB_SETJMP(e.err);
+
+  if (status == kUpb_EncodeStatus_Ok) {
+    /* We encode backwards from the end of the buffer, so the result has to be
+     * moved to the front once. */
+    encode_message(&e, msg, l, size);
+    *size = e.limit - e.ptr;
+    if (*size) memmove(buf, e.ptr, *size);
+  } else if (status == kUpb_EncodeStatus_BufferTooSmall) {
+    /* Report how much room it would have taken, unless the rest of the
+     * message would have failed anyway. */
+    upb_EncodeStatus size_status = upb_Message_ByteSize(msg, l, options, size);
+    if (size_status != kUpb_EncodeStatus_Ok) status = size_status;
+  } else {
+    *size = 0;
+  }
+
+  _upb_mapsorter_destroy(&e.sorter);
+  return status;
+}
+
+/* Sizing and forward encoding ************************************************/
+
+/* upb_Message_ByteSize() and upb_EncodeCached() share a walk over the message
+ * that visits everything in the order it appears on the wire.  When sizing, the
+ * walk only counts bytes, recording the length of each delimited sub-message,
+ * map entry and packed array in the cache as it goes.  When encoding, it writes
+ * forwards and reads those lengths back in the same order, so every length can
+ * be written before the data it covers. */
+
+struct upb_EncodeSizeCache {
+  size_t* sizes;
+  size_t count;
+  size_t total;
+  int options;
+};
+
+typedef struct {
+  jmp_buf err;
+  upb_Arena* arena;
+  char *buf, *ptr, *limit; /* Output, when not sizing. */
+  size_t bytes;            /* Bytes counted, when sizing. */
+  size_t flushed;          /* Bytes already passed to the sink or segments. */
+  upb_EncodeSinkFunc* sink;
+  void* closure;
+  size_t threshold;  /* Data at least this long is referenced, not copied. */
+  size_t refs;       /* Pieces of data referenced, when sizing. */
+  size_t referenced; /* Bytes referenced, when sizing. */
+  upb_EncodeSegment* segs;
+  size_t seg_count;
+  size_t seg_cap;
+  upb_EncodeSizeCache* cache;
+  size_t next; /* Index of the next cache entry to fill or read. */
+  size_t cap;  /* Capacity of cache->sizes, when sizing. */
+  int options;
+  int depth;
+  bool sizing;
+  _upb_mapsorter sorter;
+} upb_fwdstate;
+
+/* The start of a delimited region, returned by fwd_startlen(). */
+typedef struct {
+  size_t start;
+  size_t slot;
+} upb_fwdlen;
+
+UPB_NORETURN static void fwd_err(upb_fwdstate* e, upb_EncodeStatus s) {
+  UPB_LONGJMP(e->err, s);
+}
+
+UPB_FORCEINLINE
+static size_t encode_varintsize(uint64_t val) {
+#ifdef __GNUC__
+  /* Each byte holds 7 bits: (bits * 9 + 64) / 64 == ceil(bits / 7). */
+  int bits = 64 - __builtin_clzll(val | 1);
+  return (bits * 9 + 64) / 64;
+#else
+  size_t ret = 1;
+  while (val >= 128) {
+    val >>= 7;
+    ret++;
+  }
+  return ret;
+#endif
+}
+
+static size_t fwd_pos(const upb_fwdstate* e) {
+  return e->sizing ? e->bytes : e->flushed + (size_t)(e->ptr - e->buf);
+}
+
+static void fwd_send(upb_fwdstate* e, const char* data, size_t len) {
+  if (!e->sink(e->closure, data, len)) fwd_err(e, kUpb_EncodeStatus_SinkFailed);
+  e->flushed += len;
+}
+
+static void fwd_flush(upb_fwdstate* e) {
+  if (e->ptr == e->buf) return;
+  fwd_send(e, e->buf, e->ptr - e->buf);
+  e->ptr = e->buf;
+}
+
+/* Writes bytes that do not fit in the rest of the buffer.  With a sink we top
+ * up the buffer and flush it; data too large for the buffer goes to the sink
+ * directly instead of being copied through it. */
+UPB_NOINLINE
+static void fwd_overflow(upb_fwdstate* e, const char* data, size_t len) {
+  size_t avail = e->limit - e->ptr;
+  if (!e->sink) fwd_err(e, kUpb_EncodeStatus_SizeMismatch);
+  if (avail) memcpy(e->ptr, data, avail);
+  e->ptr += avail;
+  data += avail;
+  len -= avail;
+  fwd_flush(e);
+  if (len >= (size_t)(e->limit - e->buf)) {
+    fwd_send(e, data, len);
+  } else {
+    memcpy(e->ptr, data, len);
+    e->ptr += len;
+  }
+}
+
+UPB_FORCEINLINE
+static void fwd_bytes(upb_fwdstate* e, const void* data, size_t len) {
+  if (e->sizing) {
+    e->bytes += len;
+    return;
+  }
+  if (len == 0) return; /* memcpy() with zero size is UB */
+  if (UPB_UNLIKELY((size_t)(e->limit - e->ptr) < len)) {
+    fwd_overflow(e, data, len);
+    return;
+  }
+  memcpy(e->ptr, data, len);
+  e->ptr += len;
+}
+
+static void fwd_addsegment(upb_fwdstate* e, const char* data, size_t len) {
+  if (e->seg_count == e->seg_cap) fwd_err(e, kUpb_EncodeStatus_SizeMismatch);
+  e->segs[e->seg_count].data = data;
+  e->segs[e->seg_count].size = len;
+  e->seg_count++;
+  e->flushed += len;
+}
+
+/* Ends the segment being copied into the buffer, if it has any data. */
+static void fwd_cutsegment(upb_fwdstate* e) {
+  if (e->ptr == e->buf) return;
+  fwd_addsegment(e, e->buf, e->ptr - e->buf);
+  e->buf = e->ptr;
+}
+
+/* Writes data that lives in the message, like the contents of a string.  When
+ * encoding to segments, data of at least |e->threshold| bytes gets a segment
+ * of its own that points at the message instead of being copied. */
+static void fwd_data(upb_fwdstate* e, const char* data, size_t len) {
+  if (len < e->threshold || len == 0) {
+    fwd_bytes(e, data, len);
+  } else if (e->sizing) {
+    e->bytes += len;
+    e->refs++;
+    e->referenced += len;
+  } else {
+    fwd_cutsegment(e);
+    fwd_addsegment(e, data, len);
+  }
+}
+
+UPB_FORCEINLINE
+static void fwd_varint(upb_fwdstate* e, uint64_t val) {
+  char buf[UPB_PB_VARINT_MAX_LEN];
+  if (e->sizing) {
+    e->bytes += encode_varintsize(val);
+  } else if (val < 128 && e->ptr != e->limit) {
+    *e->ptr++ = val;
+  } else if (e->limit - e->ptr >= UPB_PB_VARINT_MAX_LEN) {
+    e->ptr += encode_varint64(val, e->ptr);
+  } else {
+    fwd_bytes(e, buf, encode_varint64(val, buf));
+  }
+}
+
+static void fwd_fixed32(upb_fwdstate* e, uint32_t val) {
+  val = _upb_BigEndian_Swap32(val);
+  fwd_bytes(e, &val, sizeof(uint32_t));
+}
+
+static void fwd_fixed64(upb_fwdstate* e, uint64_t val) {
+  val = _upb_BigEndian_Swap64(val);
+  fwd_bytes(e, &val, sizeof(uint64_t));
+}
+
+static void fwd_tag(upb_fwdstate* e, uint32_t field_number,
+                    uint8_t wire_type) {
+  fwd_varint(e, (field_number << 3) | wire_type);
+}
+
+/* Starts a region that is prefixed with its length.  When encoding, writes the
+ * length that was cached for it. */
+static upb_fwdlen fwd_startlen(upb_fwdstate* e) {
+  upb_fwdlen ret;
+  ret.slot = e->next++;
+  if (e->sizing) {
+    if (e->cache && ret.slot == e->cap) {
+      size_t old = e->cap * sizeof(size_t);
+      e->cap *= 2;
+      e->cache->sizes = upb_Arena_Realloc(e->arena, e->cache->sizes, old,
+                                          e->cap * sizeof(size_t));
+      if (!e->cache->sizes) fwd_err(e, kUpb_EncodeStatus_OutOfMemory);
+    }
+  } else {
+    if (ret.slot >= e->cache->count) {
+      fwd_err(e, kUpb_EncodeStatus_SizeMismatch);
+    }
+    fwd_varint(e, e->cache->sizes[ret.slot]);
+  }
+  ret.start = fwd_pos(e);
+  return ret;
+}
+
+/* Ends the region: when sizing, records its length and counts the prefix. */
+static void fwd_endlen(upb_fwdstate* e, upb_fwdlen len) {
+  size_t size = fwd_pos(e) - len.start;
+  if (e->sizing) {
+    if (e->cache) e->cache->sizes[len.slot] = size;
+    e->bytes += encode_varintsize(size);
+  } else if (size != e->cache->sizes[len.slot]) {
+    fwd_err(e, kUpb_EncodeStatus_SizeMismatch);
+  }
+}
+
+static void fwd_message(upb_fwdstate* e, const upb_Message* msg,
+                        const upb_MiniTable* m);
+
+static void fwd_submessage(upb_fwdstate* e, const upb_Message* msg,
+                           const upb_MiniTable* m) {
+  upb_fwdlen len;
+  if (UPB_UNLIKELY(_upb_Message_IsLazy(msg))) {
+    /* Never read since it was decoded: emit the raw bytes unchanged. */
+    const _upb_LazyMessage* lazy = _upb_Message_GetLazy(msg);
+    fwd_varint(e, lazy->data.size);
+    fwd_data(e, lazy->data.data, lazy->data.size);
+    return;
+  }
+  if (--e->depth == 0) fwd_err(e, kUpb_EncodeStatus_MaxDepthExceeded);
+  len = fwd_startlen(e);
+  fwd_message(e, msg, m);
+  fwd_endlen(e, len);
+  e->depth++;
+}
+
+static void fwd_group(upb_fwdstate* e, const upb_Message* msg,
+                      const upb_MiniTable* m, uint32_t number) {
+  if (--e->depth == 0) fwd_err(e, kUpb_EncodeStatus_MaxDepthExceeded);
+  fwd_tag(e, number, kUpb_WireType_StartGroup);
+  fwd_message(e, msg, m);
+  fwd_tag(e, number, kUpb_WireType_EndGroup);
+  e->depth++;
+}
+
+static void fwd_scalar(upb_fwdstate* e, const void* _field_mem,
+                       const upb_MiniTable_Sub* subs,
+                       const upb_MiniTable_Field* f) {
+  const char* field_mem = _field_mem;
+
+#define CASE(ctype, type, wtype, encodeval) \
+  {                                         \
+    ctype val = *(ctype*)field_mem;         \
+    fwd_tag(e, f->number, wtype);           \
+    fwd_##type(e, encodeval);               \
+    break;                                  \
+  }
+
+  switch (f->descriptortype) {
+    case kUpb_FieldType_Double: {
+      uint64_t u64;
+      memcpy(&u64, field_mem, sizeof(uint64_t));
+      fwd_tag(e, f->number, kUpb_WireType_64Bit);
+      fwd_fixed64(e, u64);
+      break;
+    }
+    case kUpb_FieldType_Float: {
+      uint32_t u32;
+      memcpy(&u32, field_mem, sizeof(uint32_t));
+      fwd_tag(e, f->number, kUpb_WireType_32Bit);
+      fwd_fixed32(e, u32);
+      break;
+    }
+    case kUpb_FieldType_Int64:
+    case kUpb_FieldType_UInt64:
+      CASE(uint64_t, varint, kUpb_WireType_Varint, val);
+    case kUpb_FieldType_UInt32:
+      CASE(uint32_t, varint, kUpb_WireType_Varint, val);
+    case kUpb_FieldType_Int32:
+    case kUpb_FieldType_Enum:
+      CASE(int32_t, varint, kUpb_WireType_Varint, (int64_t)val);
+    case kUpb_FieldType_SFixed64:
+    case kUpb_FieldType_Fixed64:
+      CASE(uint64_t, fixed64, kUpb_WireType_64Bit, val);
+    case kUpb_FieldType_Fixed32:
+    case kUpb_FieldType_SFixed32:
+      CASE(uint32_t, fixed32, kUpb_WireType_32Bit, val);
+    case kUpb_FieldType_Bool:
+      CASE(bool, varint, kUpb_WireType_Varint, val);
+    case kUpb_FieldType_SInt32:
+      CASE(int32_t, varint, kUpb_WireType_Varint, encode_zz32(val));
+    case kUpb_FieldType_SInt64:
+      CASE(int64_t, varint, kUpb_WireType_Varint, encode_zz64(val));
+    case kUpb_FieldType_String:
+    case kUpb_FieldType_Bytes: {
+      upb_StringView view = *(upb_StringView*)field_mem;
+      fwd_tag(e, f->number, kUpb_WireType_Delimited);
+      fwd_varint(e, view.size);
+      fwd_data(e, view.data, view.size);
+      break;
+    }
+    case kUpb_FieldType_Group: {
+      void* submsg = *(void**)field_mem;
+      if (submsg == NULL) return;
+      fwd_group(e, submsg, subs[f->submsg_index].submsg, f->number);
+      break;
+    }
+    case kUpb_FieldType_Message: {
+      void* submsg = *(void**)field_mem;
+      if (submsg == NULL) return;
+      if (UPB_UNLIKELY(_upb_Message_IsLazy(submsg)) &&
+          encode_resolvelazy(e->options, submsg)) {
+        submsg = _upb_Message_ResolveLazy((upb_Message**)field_mem);
+        if (!submsg) fwd_err(e, kUpb_EncodeStatus_OutOfMemory);
+      }
+      fwd_tag(e, f->number, kUpb_WireType_Delimited);
+      fwd_submessage(e, submsg, subs[f->submsg_index].submsg);
+      break;
+    }
+    default:
+      UPB_UNREACHABLE();
+  }
+#undef CASE
+}
+
+static void fwd_fixedarray(upb_fwdstate* e, const upb_Array* arr,
+                           size_t elem_size, uint32_t tag) {
+  const char* ptr = _upb_array_constptr(arr);
+  const char* end = ptr + arr->size * elem_size;
+
+  if (!tag && (e->sizing || _upb_IsLittleEndian())) {
+    fwd_bytes(e, ptr, end - ptr);
+    return;
+  }
+
+  for (; ptr != end; ptr += elem_size) {
+    if (tag) fwd_varint(e, tag);
+    if (elem_size == 4) {
+      uint32_t val;
+      memcpy(&val, ptr, sizeof(val));
+      fwd_fixed32(e, val);
+    } else {
+      uint64_t val;
+      UPB_ASSERT(elem_size == 8);
+      memcpy(&val, ptr, sizeof(val));
+      fwd_fixed64(e, val);
+    }
+  }
+}
+
+/* Writes the elements of a packed varint array in one go if they fit in the
+ * current buffer.  Returns false if the caller has to write them one by one
+ * through fwd_varint() instead. */
+static bool fwd_packedvarints(upb_fwdstate* e, const upb_Array* arr, int lg2,
+                              upb_PackedVarint_Mode mode) {
+  const void* data = _upb_array_constptr(arr);
+  size_t size = _upb_PackedVarintsSize(data, arr->size, lg2, mode);
+  if (e->sizing) {
+    e->bytes += size;
+  } else if ((size_t)(e->limit - e->ptr) >= size) {
+    _upb_EncodePackedVarints(data, arr->size, lg2, mode, e->ptr, size);
+    e->ptr += size;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void fwd_array(upb_fwdstate* e, const upb_Message* msg,
+                      const upb_MiniTable_Sub* subs,
+                      const upb_MiniTable_Field* f) {
+  const upb_Array* arr = *UPB_PTR_AT(msg, f->offset, upb_Array*);
+  bool packed = f->mode & kUpb_LabelFlags_IsPacked;
+  upb_fwdlen len;
+
+  if (arr == NULL || arr->size == 0) {
+    return;
+  }
+
+  if (packed) {
+    fwd_tag(e, f->number, kUpb_WireType_Delimited);
+    len = fwd_startlen(e);
+  }
+
+#define VARINT_CASE(ctype, encode)                                       \
+  {                                                                      \
+    const ctype* ptr = _upb_array_constptr(arr);                         \
+    const ctype* end = ptr + arr->size;                                  \
+    uint32_t tag = packed ? 0 : (f->number << 3) | kUpb_WireType_Varint; \
+    for (; ptr != end; ptr++) {                                          \
+      if (tag) fwd_varint(e, tag);                                       \
+      fwd_varint(e, encode);                                             \
+    }                                                                    \
+  }                                                                      \
+  break;
+
+#define PACKED_CASE(lg2, mode) \
+  if (packed && fwd_packedvarints(e, arr, lg2, mode)) break;
+
+#define TAG(wire_type) (packed ? 0 : (f->number << 3 | wire_type))
+
+  switch (f->descriptortype) {
+    case kUpb_FieldType_Double:
+      fwd_fixedarray(e, arr, sizeof(double), TAG(kUpb_WireType_64Bit));
+      break;
+    case kUpb_FieldType_Float:
+      fwd_fixedarray(e, arr, sizeof(float), TAG(kUpb_WireType_32Bit));
+      break;
+    case kUpb_FieldType_SFixed64:
+    case kUpb_FieldType_Fixed64:
+      fwd_fixedarray(e, arr, sizeof(uint64_t), TAG(kUpb_WireType_64Bit));
+      break;
+    case kUpb_FieldType_Fixed32:
+    case kUpb_FieldType_SFixed32:
+      fwd_fixedarray(e, arr, sizeof(uint32_t), TAG(kUpb_WireType_32Bit));
+      break;
+    case kUpb_FieldType_Int64:
+    case kUpb_FieldType_UInt64:
+      PACKED_CASE(3, kUpb_PackedVarint_ZeroExtend);
+      VARINT_CASE(uint64_t, *ptr);
+    case kUpb_FieldType_UInt32:
+      PACKED_CASE(2, kUpb_PackedVarint_ZeroExtend);
+      VARINT_CASE(uint32_t, *ptr);
+    case kUpb_FieldType_Int32:
+    case kUpb_FieldType_Enum:
+      PACKED_CASE(2, kUpb_PackedVarint_SignExtend);
+      VARINT_CASE(int32_t, (int64_t)*ptr);
+    case kUpb_FieldType_Bool:
+      VARINT_CASE(bool, *ptr);
+    case kUpb_FieldType_SInt32:
+      PACKED_CASE(2, kUpb_PackedVarint_ZigZag);
+      VARINT_CASE(int32_t, encode_zz32(*ptr));
+    case kUpb_FieldType_SInt64:
+      PACKED_CASE(3, kUpb_PackedVarint_ZigZag);
+      VARINT_CASE(int64_t, encode_zz64(*ptr));
+    case kUpb_FieldType_String:
+    case kUpb_FieldType_Bytes: {
+      const upb_StringView* ptr = _upb_array_constptr(arr);
+      const upb_StringView* end = ptr + arr->size;
+      for (; ptr != end; ptr++) {
+        fwd_tag(e, f->number, kUpb_WireType_Delimited);
+        fwd_varint(e, ptr->size);
+        fwd_data(e, ptr->data, ptr->size);
+      }
+      return;
+    }
+    case kUpb_FieldType_Group: {
+      const void* const* ptr = _upb_array_constptr(arr);
+      const void* const* end = ptr + arr->size;
+      const upb_MiniTable* subm = subs[f->submsg_index].submsg;
+      for (; ptr != end; ptr++) {
+        fwd_group(e, *ptr, subm, f->number);
+      }
+      return;
+    }
+    case kUpb_FieldType_Message: {
+      const void* const* ptr = _upb_array_constptr(arr);
+      const void* const* end = ptr + arr->size;
+      const upb_MiniTable* subm = subs[f->submsg_index].submsg;
+      for (; ptr != end; ptr++) {
+        fwd_tag(e, f->number, kUpb_WireType_Delimited);
+        fwd_submessage(e, *ptr, subm);
+      }
+      return;
+    }
+  }
+#undef VARINT_CASE
+#undef PACKED_CASE
+#undef TAG
+
+  if (packed) fwd_endlen(e, len);
+}
+
+static void fwd_mapentry(upb_fwdstate* e, uint32_t number,
+                         const upb_MiniTable* layout,
+                         const upb_MapEntry* ent) {
+  upb_fwdlen len;
+  fwd_tag(e, number, kUpb_WireType_Delimited);
+  len = fwd_startlen(e);
+  fwd_scalar(e, &ent->k, layout->subs, &layout->fields[0]);
+  fwd_scalar(e, &ent->v, layout->subs, &layout->fields[1]);
+  fwd_endlen(e, len);
+}
+
+static void fwd_map(upb_fwdstate* e, const upb_Message* msg,
+                    const upb_MiniTable_Sub* subs,
+                    const upb_MiniTable_Field* f) {
+  const upb_Map* map = *UPB_PTR_AT(msg, f->offset, const upb_Map*);
+  const upb_MiniTable* layout = subs[f->submsg_index].submsg;
+  UPB_ASSERT(layout->field_count == 2);
+
+  if (map == NULL) return;
+
+  /* A size on its own does not depend on the order of the entries. */
+  if ((e->options & kUpb_EncodeOption_Deterministic) && e->cache) {
+    /* upb_Encode() writes the sorted entries backwards, so we walk them from
+     * the end to produce the same bytes. */
+    _upb_sortedmap sorted;
+    int i;
+    if (!_upb_mapsorter_pushmap(&e->sorter, layout->fields[0].descriptortype,
+                                map, &sorted)) {
+      fwd_err(e, kUpb_EncodeStatus_OutOfMemory);
+    }
+    for (i = sorted.end; i > sorted.start;) {
+      const upb_tabent* tabent = e->sorter.entries[--i];
+      upb_value val = {tabent->val.val};
+      upb_MapEntry ent;
+      _upb_map_fromkey(upb_tabstrview(tabent->key), &ent.k, map->key_size);
+      _upb_map_fromvalue(val, &ent.v, map->val_size);
+      fwd_mapentry(e, f->number, layout, &ent);
+    }
+    _upb_mapsorter_popmap(&e->sorter, &sorted);
+  } else {
+    upb_strtable_iter i;
+    upb_strtable_begin(&i, &map->table);
+    for (; !upb_strtable_done(&i); upb_strtable_next(&i)) {
+      upb_StringView key = upb_strtable_iter_key(&i);
+      const upb_value val = upb_strtable_iter_value(&i);
+      upb_MapEntry ent;
+      _upb_map_fromkey(key, &ent.k, map->key_size);
+      _upb_map_fromvalue(val, &ent.v, map->val_size);
+      fwd_mapentry(e, f->number, layout, &ent);
+    }
+  }
+}
+
+static void fwd_field(upb_fwdstate* e, const upb_Message* msg,
+                      const upb_MiniTable_Sub* subs,
+                      const upb_MiniTable_Field* field) {
+  switch (upb_FieldMode_Get(field)) {
+    case kUpb_FieldMode_Array:
+      fwd_array(e, msg, subs, field);
+      break;
+    case kUpb_FieldMode_Map:
+      fwd_map(e, msg, subs, field);
+      break;
+    case kUpb_FieldMode_Scalar:
+      fwd_scalar(e, UPB_PTR_AT(msg, field->offset, void), subs, field);
+      break;
+    default:
+      UPB_UNREACHABLE();
+  }
+}
+
+static void fwd_msgset_item(upb_fwdstate* e,
+                            const upb_Message_Extension* ext) {
+  upb_fwdlen len;
+  fwd_tag(e, 1, kUpb_WireType_StartGroup);
+  fwd_tag(e, 2, kUpb_WireType_Varint);
+  fwd_varint(e, ext->ext->field.number);
+  fwd_tag(e, 3, kUpb_WireType_Delimited);
+  len = fwd_startlen(e);
+  fwd_message(e, ext->data.ptr, ext->ext->sub.submsg);
+  fwd_endlen(e, len);
+  fwd_tag(e, 1, kUpb_WireType_EndGroup);
+}
+
+static void fwd_message(upb_fwdstate* e, const upb_Message* msg,
+                        const upb_MiniTable* m) {
+  if ((e->options & kUpb_EncodeOption_CheckRequired) && m->required_count) {
+    uint64_t msg_head;
+    memcpy(&msg_head, msg, 8);
+    msg_head = _upb_BigEndian_Swap64(msg_head);
+    if (upb_MiniTable_requiredmask(m) & ~msg_head) {
+      fwd_err(e, kUpb_EncodeStatus_MissingRequired);
+    }
+  }
+
+  if (m->field_count) {
+    const upb_MiniTable_Field* f = &m->fields[0];
+    const upb_MiniTable_Field* end = &m->fields[m->field_count];
+    for (; f != end; f++) {
+      if (encode_shouldencode(NULL, msg, m->subs, f)) {
+        fwd_field(e, msg, m->subs, f);
+      }
+    }
+  }
+
+  if (m->ext != kUpb_ExtMode_NonExtendable) {
+    /* upb_Encode() emits the extensions in reverse. */
+    size_t ext_count;
+    const upb_Message_Extension* ext = _upb_Message_Getexts(msg, &ext_count);
+    const upb_Message_Extension* ext_end = ext + ext_count;
+    while (ext_end != ext) {
+      ext_end--;
+      if (UPB_UNLIKELY(m->ext == kUpb_ExtMode_IsMessageSet)) {
+        fwd_msgset_item(e, ext_end);
+      } else {
+        fwd_field(e, &ext_end->data, &ext_end->ext->sub, &ext_end->ext->field);
+      }
+    }
+  }
+
+  if ((e->options & kUpb_EncodeOption_SkipUnknown) == 0) {
+    size_t unknown_size;
+    const char* unknown = upb_Message_GetUnknown(msg, &unknown_size);
+
+    if (unknown) {
+      fwd_data(e, unknown, unknown_size);
+    }
+  }
+}
+
+static void fwd_init(upb_fwdstate* e, int options, upb_Arena* arena,
+                     bool sizing) {
+  unsigned depth = (unsigned)options >> 16;
+  e->arena = arena;
+  e->buf = NULL;
+  e->ptr = NULL;
+  e->limit = NULL;
+  e->bytes = 0;
+  e->flushed = 0;
+  e->sink = NULL;
+  e->closure = NULL;
+  e->threshold = SIZE_MAX;
+  e->refs = 0;
+  e->referenced = 0;
+  e->segs = NULL;
+  e->seg_count = 0;
+  e->seg_cap = 0;
+  e->cache = NULL;
+  e->next = 0;
+  e->cap = 0;
+  e->options = options;
+  e->depth = depth ? depth : 64;
+  e->sizing = sizing;
+  _upb_mapsorter_init(&e->sorter, arena);
+}
+
+upb_EncodeStatus upb_Message_ByteSize(const void* msg, const upb_MiniTable* l,
+                                      int options, size_t* size) {
+  upb_fwdstate e;
+  fwd_init(&e, options, NULL, true);
+
+  upb_EncodeStatus status = UPB_SETJMP(e.err);
+
+  if (status == kUpb_EncodeStatus_Ok) {
+    fwd_message(&e, msg, l);
+    *size = e.bytes;
+  } else {
+    *size = 0;
+  }
+
+  _upb_mapsorter_destroy(&e.sorter);
+  return status;
+}
+
+/* Sizes |msg| into a new cache allocated from the state's arena. */
+static upb_EncodeStatus fwd_measure(upb_fwdstate* e, const void* msg,
+                                    const upb_MiniTable* l) {
+  e->cap = 16;
+  e->cache = upb_Arena_Malloc(e->arena, sizeof(*e->cache));
+  if (e->cache) {
+    e->cache->sizes = upb_Arena_Malloc(e->arena, e->cap * sizeof(size_t));
+  }
+  if (!e->cache || !e->cache->sizes) return kUpb_EncodeStatus_OutOfMemory;
+
+  upb_EncodeStatus status = UPB_SETJMP(e->err);
+
+  if (status == kUpb_EncodeStatus_Ok) {
+    fwd_message(e, msg, l);
+    e->cache->count = e->next;
+    e->cache->total = e->bytes;
+    e->cache->options = e->options;
+  }
+
+  return status;
+}
+
+upb_EncodeStatus upb_Message_ByteSizeCached(const void* msg,
+                                            const upb_MiniTable* l,
+                                            int options, upb_Arena* arena,
+                                            upb_EncodeSizeCache** cache,
+                                            size_t* size) {
+  upb_fwdstate e;
+  fwd_init(&e, options, arena, true);
+
+  upb_EncodeStatus status = fwd_measure(&e, msg, l);
+
+  if (status == kUpb_EncodeStatus_Ok) {
+    *cache = e.cache;
+    *size = e.bytes;
+  } else {
+    *cache = NULL;
+    *size = 0;
+  }
+
+  _upb_mapsorter_destroy(&e.sorter);
+  return status;
+}
+
+upb_EncodeStatus upb_EncodeCached(const void* msg, const upb_MiniTable* l,
+                                  const upb_EncodeSizeCache* cache,
+                                  upb_Arena* arena, char** buf, size_t* size) {
+  upb_fwdstate e;
+  fwd_init(&e, cache->options, arena, false);
+  e.cache = (upb_EncodeSizeCache*)cache;
+
+  upb_EncodeStatus status = UPB_SETJMP(e.err);
+
+  if (status == kUpb_EncodeStatus_Ok) {
+    if (cache->total == 0) {
+      static char ch;
+      *buf = &ch;
+      *size = 0;
+    } else {
+      e.buf = upb_Arena_Malloc(arena, cache->total);
+      if (!e.buf) fwd_err(&e, kUpb_EncodeStatus_OutOfMemory);
+      e.ptr = e.buf;
+      e.limit = e.buf + cache->total;
+      fwd_message(&e, msg, l);
+      if (fwd_pos(&e) != cache->total || e.next != cache->count) {
+        fwd_err(&e, kUpb_EncodeStatus_SizeMismatch);
+      }
+      *buf = e.buf;
+      *size = cache->total;
+    }
+  } else {
+    *buf = NULL;
+    *size = 0;
+  }
+
+  _upb_mapsorter_destroy(&e.sorter);
+  return status;
+}
+
+upb_EncodeStatus upb_EncodeToSink(const void* msg, const upb_MiniTable* l,
+                                  int options, upb_Arena* arena, char* buf,
+                                  size_t buf_size, upb_EncodeSinkFunc* sink,
+                                  void* closure) {
+  upb_fwdstate s;
+  upb_fwdstate e;
+
+  fwd_init(&s, options, arena, true);
+  upb_EncodeStatus status = fwd_measure(&s, msg, l);
+  if (status != kUpb_EncodeStatus_Ok) return status;
+
+  /* The second pass sorts the same maps again, so it keeps the buffers the
+   * first pass already grew. */
+  fwd_init(&e, options, arena, false);
+  e.sorter = s.sorter;
+  e.cache = s.cache;
+  e.buf = buf;
+  e.ptr = buf;
+  e.limit = buf_size ? buf + buf_size : buf;
+  e.sink = sink;
+  e.closure = closure;
+
+  status = UPB_SETJMP(e.err);
+
+  if (status == kUpb_EncodeStatus_Ok) {
+    fwd_message(&e, msg, l);
+    fwd_flush(&e);
+    UPB_ASSERT(e.flushed == s.bytes && e.next == s.cache->count);
+  }
+
+  _upb_mapsorter_destroy(&e.sorter);
+  return status;
+}
+
+upb_EncodeStatus upb_EncodeToSegments(const void* msg, const upb_MiniTable* l,
+                                      int options, size_t threshold,
+                                      upb_Arena* arena,
+                                      upb_EncodeSegment** segments,
+                                      size_t* count) {
+  upb_fwdstate s;
+  upb_fwdstate e;
+  size_t copied;
+
+  *segments = NULL;
+  *count = 0;
+
+  /* The first pass also tells us how much we will copy and how many segments
+   * we need: one per referenced piece of data, plus one before each of those
+   * and one at the end for the copied data in between. */
+  fwd_init(&s, options, arena, true);
+  s.threshold = threshold;
+  upb_EncodeStatus status = fwd_measure(&s, msg, l);
+  if (status != kUpb_EncodeStatus_Ok) return status;
+
+  fwd_init(&e, options, arena, false);
+  e.sorter = s.sorter;
+  e.cache = s.cache;
+  e.threshold = threshold;
+  copied = s.bytes - s.referenced;
+  e.seg_cap = 2 * s.refs + 1;
+  e.segs = upb_Arena_Malloc(arena, e.seg_cap * sizeof(upb_EncodeSegment));
+  if (copied) e.buf = upb_Arena_Malloc(arena, copied);
+  if (!e.segs || (copied && !e.buf)) return kUpb_EncodeStatus_OutOfMemory;
+  e.ptr = e.buf;
+  e.limit = copied ? e.buf + copied : e.buf;
+
+  status = UPB_SETJMP(e.err);
+
+  if (status == kUpb_EncodeStatus_Ok) {
+    fwd_message(&e, msg, l);
+    fwd_cutsegment(&e);
+    if (e.flushed != s.bytes || e.next != e.cache->count) {
+      fwd_err(&e, kUpb_EncodeStatus_SizeMismatch);
+    }
+    *segments = e.segs;
+    *count = e.seg_count;
+  }
+
   _upb_mapsorter_destroy(&e.sorter);
   return status;
 }
@@ -46,8 +46,10 @@ enum {
    * instances of this binary. There are no guarantees across different
    * binary builds.
    *
-   * If your proto contains maps, the encoder will need to malloc()/free()
-   * memory during encode. */
+   * If your proto contains maps, the encoder sorts their entries using memory
+   * from the encode arena, or from the upb_EncodeSorter passed to
+   * upb_EncodeWithSorter().  Functions that take no arena malloc()/free() that
+   * memory instead. */
   kUpb_EncodeOption_Deterministic = 1,
 
   /* When set, unknown fields are not printed. */
@@ -66,12 +68,102 @@ typedef enum {
 
   // kUpb_EncodeOption_CheckRequired failed but the parse otherwise succeeded.
   kUpb_EncodeStatus_MissingRequired = 3,
+
+  // The message changed after its sizes were cached.
+  kUpb_EncodeStatus_SizeMismatch = 4,
+
+  // The output did not fit in the buffer passed to upb_EncodeToBuffer().
+  kUpb_EncodeStatus_BufferTooSmall = 5,
+
+  // The sink passed to upb_EncodeToSink() returned false.
+  kUpb_EncodeStatus_SinkFailed = 6,
 } upb_EncodeStatus;
 
 upb_EncodeStatus upb_Encode(const void* msg, const upb_MiniTable* l,
                             int options, upb_Arena* arena, char** buf,
                             size_t* size);
 
+/* Buffers for sorting map entries under kUpb_EncodeOption_Deterministic that a
+ * series of encodes can share.  upb_Encode() allocates them from the encode
+ * arena on every call.  With upb_EncodeWithSorter() they come from the
+ * sorter's own |arena| instead, and are only grown when a map is larger than
+ * any seen before.  |arena| must outlive the sorter.  A sorter must not be
+ * used by concurrent encodes.  Returns NULL if out of memory. */
+typedef struct upb_EncodeSorter upb_EncodeSorter;
+upb_EncodeSorter* upb_EncodeSorter_New(upb_Arena* arena);
+
+/* Like upb_Encode(), but sorts maps with |sorter|. */
+upb_EncodeStatus upb_EncodeWithSorter(const void* msg, const upb_MiniTable* l,
+                                      int options, upb_Arena* arena,
+                                      upb_EncodeSorter* sorter, char** buf,
+                                      size_t* size);
+
+/* Encodes into the caller's |buf| of |capacity| bytes instead of allocating,
+ * leaving the output at the start of |buf|.  If it does not fit, returns
+ * kUpb_EncodeStatus_BufferTooSmall and sets |*size| to the capacity needed. */
+upb_EncodeStatus upb_EncodeToBuffer(const void* msg, const upb_MiniTable* l,
+                                    int options, char* buf, size_t capacity,
+                                    size_t* size);
+
+/* Receives the output of upb_EncodeToSink() in order.  Returns false to stop
+ * the encode. */
+typedef bool upb_EncodeSinkFunc(void* closure, const char* data, size_t size);
+
+/* Encodes front to back, handing the output to |sink| in chunks of |buf_size|
+ * bytes built in |buf|.  Most of a string too large for |buf| goes to the sink
+ * straight from the message, without being copied.  The message is measured
+ * first with upb_Message_ByteSizeCached(), whose cache is allocated from
+ * |arena|. */
+upb_EncodeStatus upb_EncodeToSink(const void* msg, const upb_MiniTable* l,
+                                  int options, upb_Arena* arena, char* buf,
+                                  size_t buf_size, upb_EncodeSinkFunc* sink,
+                                  void* closure);
+
+/* A piece of encoded output from upb_EncodeToSegments(). */
+typedef struct {
+  const char* data;
+  size_t size;
+} upb_EncodeSegment;
+
+/* Encodes |msg| as a list of segments to be written out in order, for example
+ * with writev().  Strings, bytes and other data of at least |threshold| bytes
+ * are not copied: their segments point into |msg|, so the output is only valid
+ * while |msg| is alive and unchanged.  Everything else is copied into one
+ * buffer allocated from |arena|, which also holds the segment array. */
+upb_EncodeStatus upb_EncodeToSegments(const void* msg, const upb_MiniTable* l,
+                                      int options, size_t threshold,
+                                      upb_Arena* arena,
+                                      upb_EncodeSegment** segments,
+                                      size_t* count);
+
+/* Computes the number of bytes upb_Encode() would produce for |msg| with the
+ * same options, without serializing it.  Fails in the same cases as
+ * upb_Encode(), except that it never runs out of memory. */
+upb_EncodeStatus upb_Message_ByteSize(const void* msg, const upb_MiniTable* l,
+                                      int options, size_t* size);
+
+/* The lengths of all the delimited sub-messages, map entries and packed arrays
+ * in a message, recorded by upb_Message_ByteSizeCached(). */
+typedef struct upb_EncodeSizeCache upb_EncodeSizeCache;
+
+/* Like upb_Message_ByteSize(), but also records the lengths that an encoder
+ * writing front to back needs to know in advance.  The cache is allocated from
+ * |arena| and stays valid only as long as |msg| is not modified. */
+upb_EncodeStatus upb_Message_ByteSizeCached(const void* msg,
+                                            const upb_MiniTable* l,
+                                            int options, upb_Arena* arena,
+                                            upb_EncodeSizeCache** cache,
+                                            size_t* size);
+
+/* Encodes |msg| with the options and sizes recorded in |cache|, into a buffer
+ * of exactly the right size.  The output is the same as upb_Encode()'s, except
+ * that map entries may be in a different order unless the encode is
+ * deterministic.  Returns kUpb_EncodeStatus_SizeMismatch if |msg| no longer
+ * matches the cache. */
+upb_EncodeStatus upb_EncodeCached(const void* msg, const upb_MiniTable* l,
+                                  const upb_EncodeSizeCache* cache,
+                                  upb_Arena* arena, char** buf, size_t* size);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
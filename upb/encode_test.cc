@@ -0,0 +1,495 @@
+// Copyright (c) 2009-2021, Google LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Google LLC nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "upb/encode.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "upb/mini_table_test_util.hpp"
+#include "upb/wire_test_util.hpp"
+
+namespace {
+
+using upb::test::Delimited;
+using upb::test::Fixed32Field;
+using upb::test::Group;
+using upb::test::Tag;
+using upb::test::Varint;
+using upb::test::VarintField;
+
+class EncodeTest : public upb::test::MiniTableTest {
+ protected:
+  // message M {
+  //   int32 i = 1;
+  //   string s = 2;
+  //   M sub = 3;
+  //   repeated M subs = 4;
+  //   group G = 5 { <fields of M> }
+  //   repeated int64 packed = 6 [packed = true];
+  //   repeated fixed32 unpacked = 7;
+  //   repeated double doubles = 8 [packed = true];
+  //   map<string, M> msg_map = 9;
+  //   map<int32, int32> int_map = 10;
+  //   sint64 z = 11;
+  //   repeated string strs = 12;
+  //   required int32 req = 13;  // Only with BuildTable(true).
+  // }
+  upb_MiniTable* BuildTable(bool lazy, bool required = false) {
+    upb::MtDataEncoder e;
+    e.StartMessage(0);
+    e.PutField(kUpb_FieldType_Int32, 1, 0);
+    e.PutField(kUpb_FieldType_String, 2, 0);
+    e.PutField(kUpb_FieldType_Message, 3, lazy ? kUpb_FieldModifier_IsLazy : 0);
+    e.PutField(kUpb_FieldType_Message, 4, kUpb_FieldModifier_IsRepeated);
+    e.PutField(kUpb_FieldType_Group, 5, 0);
+    e.PutField(kUpb_FieldType_Int64, 6,
+               kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked);
+    e.PutField(kUpb_FieldType_Fixed32, 7, kUpb_FieldModifier_IsRepeated);
+    e.PutField(kUpb_FieldType_Double, 8,
+               kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked);
+    e.PutField(kUpb_FieldType_Message, 9, kUpb_FieldModifier_IsRepeated);
+    e.PutField(kUpb_FieldType_Message, 10, kUpb_FieldModifier_IsRepeated);
+    e.PutField(kUpb_FieldType_SInt64, 11, 0);
+    e.PutField(kUpb_FieldType_String, 12, kUpb_FieldModifier_IsRepeated);
+    if (required) {
+      e.PutField(kUpb_FieldType_Int32, 13, kUpb_FieldModifier_IsRequired);
+    }
+    upb_MiniTable* table = Build(e);
+    for (uint32_t i = 3; i <= 5; i++) Link(table, i, table);
+    upb_MiniTable* msg_entry = upb_MiniTable_BuildMapEntry(
+        kUpb_FieldType_String, kUpb_FieldType_Message, false,
+        kUpb_MiniTablePlatform_Native, arena_.ptr());
+    Link(msg_entry, 2, table);
+    Link(table, 9, msg_entry);
+    upb_MiniTable* int_entry = upb_MiniTable_BuildMapEntry(
+        kUpb_FieldType_Int32, kUpb_FieldType_Int32, false,
+        kUpb_MiniTablePlatform_Native, arena_.ptr());
+    Link(table, 10, int_entry);
+    return table;
+  }
+
+  static std::string Payload() {
+    std::string inner = VarintField(1, 7) +
+                        Delimited(2, std::string(300, 'a')) +
+                        Delimited(3, Delimited(2, "nested"));
+    std::string ret = VarintField(1, 150) + Delimited(2, "hello");
+    ret += Delimited(3, inner);
+    for (int i = 0; i < 3; i++) {
+      ret += Delimited(4, Delimited(2, std::string(50 + i, 'b' + i)));
+    }
+    ret += Group(5, VarintField(1, 3) + Delimited(2, "in group"));
+    std::string packed;
+    for (int i = 0; i < 64; i += 5) packed += Varint(1ull << i);
+    packed += Varint(static_cast<uint64_t>(-1));
+    ret += Delimited(6, packed);
+    for (uint32_t i = 0; i < 4; i++) ret += Fixed32Field(7, i * 1000);
+    ret += Delimited(8, std::string(8 * 20, '\x40'));
+    for (int i = 0; i < 5; i++) {
+      std::string key = Delimited(1, "key" + std::to_string(i * 7 % 5));
+      ret += Delimited(9, key + Delimited(2, VarintField(1, i)));
+      ret += Delimited(10, VarintField(1, i * 1000) + VarintField(2, i));
+    }
+    ret += VarintField(11, 12345678901ull);
+    for (int i = 0; i < 3; i++) ret += Delimited(12, std::string(i * 200, 's'));
+    // Unknown fields.
+    ret += Tag(99, kUpb_WireType_32Bit) + "abcd";
+    ret += Delimited(97, std::string(100, 'u'));
+    return ret;
+  }
+
+  std::string EncodeCached(const upb_Message* msg, const upb_MiniTable* table,
+                           int options) {
+    upb_EncodeSizeCache* cache;
+    size_t cached_size;
+    EXPECT_EQ(kUpb_EncodeStatus_Ok,
+              upb_Message_ByteSizeCached(msg, table, options, arena_.ptr(),
+                                         &cache, &cached_size));
+    char* buf;
+    size_t size;
+    EXPECT_EQ(kUpb_EncodeStatus_Ok,
+              upb_EncodeCached(msg, table, cache, arena_.ptr(), &buf, &size));
+    EXPECT_EQ(cached_size, size);
+    return std::string(buf, size);
+  }
+};
+
+TEST_F(EncodeTest, ByteSizeMatchesEncode) {
+  upb_MiniTable* table = BuildTable(false);
+  upb_Message* msg = Parse(table, Payload());
+  for (int options : {0, (int)kUpb_EncodeOption_Deterministic,
+                      (int)kUpb_EncodeOption_SkipUnknown}) {
+    size_t size;
+    ASSERT_EQ(kUpb_EncodeStatus_Ok,
+              upb_Message_ByteSize(msg, table, options, &size));
+    EXPECT_EQ(Encode(msg, table, options).size(), size) << options;
+  }
+
+  upb_Message* empty = _upb_Message_New(table, arena_.ptr());
+  size_t size;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok, upb_Message_ByteSize(empty, table, 0, &size));
+  EXPECT_EQ(0, size);
+}
+
+TEST_F(EncodeTest, CachedEncodeMatchesEncode) {
+  upb_MiniTable* table = BuildTable(false);
+  upb_Message* msg = Parse(table, Payload());
+  int options = kUpb_EncodeOption_Deterministic;
+  EXPECT_EQ(Encode(msg, table, options), EncodeCached(msg, table, options));
+  options |= kUpb_EncodeOption_SkipUnknown;
+  EXPECT_EQ(Encode(msg, table, options), EncodeCached(msg, table, options));
+
+  // Without kUpb_EncodeOption_Deterministic only the order of map entries may
+  // differ, so the output parses back to the same message.
+  std::string cached = EncodeCached(msg, table, 0);
+  EXPECT_EQ(Encode(msg, table, 0).size(), cached.size());
+  EXPECT_EQ(Encode(msg, table, kUpb_EncodeOption_Deterministic),
+            Encode(Parse(table, cached), table,
+                   kUpb_EncodeOption_Deterministic));
+}
+
+TEST_F(EncodeTest, LazySubMessage) {
+  upb_MiniTable* table = BuildTable(true);
+  upb_Message* msg = Parse(table, Payload(), kUpb_DecodeOption_Lazy);
+  upb_Message* sub;
+  memcpy(&sub,
+         reinterpret_cast<char*>(msg) +
+             upb_MiniTable_FindFieldByNumber(table, 3)->offset,
+         sizeof(sub));
+  ASSERT_TRUE(_upb_Message_IsLazy(sub));
+  int options = kUpb_EncodeOption_Deterministic;
+  size_t size;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Message_ByteSize(msg, table, options, &size));
+  std::string expected = Encode(msg, table, options);
+  EXPECT_EQ(expected.size(), size);
+  EXPECT_EQ(expected, EncodeCached(msg, table, options));
+}
+
+// An option that looks inside a lazy sub-message gives the same output as if
+// the sub-message had been parsed eagerly, from every encoder.
+TEST_F(EncodeTest, LazySkipUnknown) {
+  upb_MiniTable* table = BuildTable(true);
+  std::string payload =
+      Delimited(3, VarintField(1, 2) + Delimited(97, "unknown"));
+  int options = kUpb_EncodeOption_SkipUnknown;
+  std::string expected = Encode(Parse(table, payload), table, options);
+  EXPECT_EQ(Delimited(3, VarintField(1, 2)), expected);
+
+  size_t size;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Message_ByteSize(Parse(table, payload, kUpb_DecodeOption_Lazy),
+                                 table, options, &size));
+  EXPECT_EQ(expected.size(), size);
+  EXPECT_EQ(expected, Encode(Parse(table, payload, kUpb_DecodeOption_Lazy),
+                             table, options));
+  EXPECT_EQ(expected,
+            EncodeCached(Parse(table, payload, kUpb_DecodeOption_Lazy), table,
+                         options));
+}
+
+TEST_F(EncodeTest, LazyDeterministic) {
+  upb_MiniTable* table = BuildTable(true);
+  std::string sub;
+  for (int key : {1, 3, 2}) {
+    sub += Delimited(10, VarintField(1, key) + VarintField(2, key));
+  }
+  std::string payload = Delimited(3, sub);
+  int options = kUpb_EncodeOption_Deterministic;
+  std::string expected = Encode(Parse(table, payload), table, options);
+  EXPECT_NE(payload, expected);
+
+  size_t size;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Message_ByteSize(Parse(table, payload, kUpb_DecodeOption_Lazy),
+                                 table, options, &size));
+  EXPECT_EQ(expected.size(), size);
+  EXPECT_EQ(expected, Encode(Parse(table, payload, kUpb_DecodeOption_Lazy),
+                             table, options));
+  EXPECT_EQ(expected,
+            EncodeCached(Parse(table, payload, kUpb_DecodeOption_Lazy), table,
+                         options));
+}
+
+TEST_F(EncodeTest, LazyCheckRequired) {
+  upb_MiniTable* table = BuildTable(true, true);
+  int options = kUpb_EncodeOption_CheckRequired;
+  char* buf;
+  size_t size;
+
+  // The sub-message is missing its required field.
+  std::string payload = VarintField(13, 1) + Delimited(3, VarintField(1, 2));
+  EXPECT_EQ(kUpb_EncodeStatus_MissingRequired,
+            upb_Encode(Parse(table, payload, kUpb_DecodeOption_Lazy), table,
+                       options, arena_.ptr(), &buf, &size));
+  EXPECT_EQ(kUpb_EncodeStatus_MissingRequired,
+            upb_Message_ByteSize(Parse(table, payload, kUpb_DecodeOption_Lazy),
+                                 table, options, &size));
+
+  payload = Delimited(3, VarintField(13, 2)) + VarintField(13, 1);
+  EXPECT_EQ(payload, Encode(Parse(table, payload, kUpb_DecodeOption_Lazy),
+                            table, options));
+}
+
+TEST_F(EncodeTest, SizeMismatch) {
+  upb_MiniTable* table = BuildTable(false);
+  upb_Message* msg = Parse(table, Payload());
+  upb_EncodeSizeCache* cache;
+  size_t size;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Message_ByteSizeCached(msg, table, 0, arena_.ptr(), &cache,
+                                       &size));
+
+  // Growing and shrinking a sub-message are both caught.
+  for (const std::string& change :
+       {Delimited(3, Delimited(2, std::string(1000, 'x'))),
+        Delimited(3, Delimited(2, ""))}) {
+    upb_Message* changed = Parse(table, Payload() + change);
+    char* buf;
+    EXPECT_EQ(kUpb_EncodeStatus_SizeMismatch,
+              upb_EncodeCached(changed, table, cache, arena_.ptr(), &buf,
+                               &size));
+    EXPECT_EQ(nullptr, buf);
+  }
+}
+
+TEST_F(EncodeTest, ByteSizeErrors) {
+  upb_MiniTable* table = BuildTable(false, true);
+  upb_Message* msg = Parse(table, Payload());
+  size_t size;
+  EXPECT_EQ(kUpb_EncodeStatus_MissingRequired,
+            upb_Message_ByteSize(msg, table, kUpb_EncodeOption_CheckRequired,
+                                 &size));
+  EXPECT_EQ(kUpb_EncodeStatus_Ok, upb_Message_ByteSize(msg, table, 0, &size));
+
+  std::string deep = VarintField(1, 1);
+  for (int i = 0; i < 10; i++) deep = Delimited(3, deep);
+  msg = Parse(table, deep);
+  EXPECT_EQ(kUpb_EncodeStatus_MaxDepthExceeded,
+            upb_Message_ByteSize(msg, table, UPB_ENCODE_MAXDEPTH(5), &size));
+  char* buf;
+  EXPECT_EQ(kUpb_EncodeStatus_MaxDepthExceeded,
+            upb_Encode(msg, table, UPB_ENCODE_MAXDEPTH(5), arena_.ptr(), &buf,
+                       &size));
+  EXPECT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Message_ByteSize(msg, table, UPB_ENCODE_MAXDEPTH(20), &size));
+  EXPECT_EQ(deep.size(), size);
+}
+
+TEST_F(EncodeTest, EncodeToBuffer) {
+  upb_MiniTable* table = BuildTable(false);
+  upb_Message* msg = Parse(table, Payload());
+  std::string expected = Encode(msg, table, 0);
+
+  std::vector<char> buf(expected.size());
+  size_t size;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok, upb_EncodeToBuffer(msg, table, 0, buf.data(),
+                                                     buf.size(), &size));
+  EXPECT_EQ(expected, std::string(buf.data(), size));
+
+  for (size_t capacity : {size_t{0}, size_t{1}, expected.size() - 1}) {
+    std::vector<char> small(capacity);
+    EXPECT_EQ(kUpb_EncodeStatus_BufferTooSmall,
+              upb_EncodeToBuffer(msg, table, 0, small.data(), capacity, &size));
+    EXPECT_EQ(expected.size(), size);
+  }
+
+  upb_Message* empty = _upb_Message_New(table, arena_.ptr());
+  EXPECT_EQ(kUpb_EncodeStatus_Ok,
+            upb_EncodeToBuffer(empty, table, 0, nullptr, 0, &size));
+  EXPECT_EQ(0, size);
+}
+
+struct SinkOutput {
+  std::string data;
+  std::vector<size_t> chunks;
+  size_t fail_after = SIZE_MAX;
+};
+
+bool AppendToSink(void* closure, const char* data, size_t size) {
+  SinkOutput* out = static_cast<SinkOutput*>(closure);
+  if (out->chunks.size() == out->fail_after) return false;
+  out->data.append(data, size);
+  out->chunks.push_back(size);
+  return true;
+}
+
+TEST_F(EncodeTest, EncodeToSink) {
+  upb_MiniTable* table = BuildTable(false);
+  upb_Message* msg = Parse(table, Payload());
+  int options = kUpb_EncodeOption_Deterministic;
+  std::string expected = Encode(msg, table, options);
+
+  for (size_t chunk_size : {1, 7, 64, 100000}) {
+    std::vector<char> buf(chunk_size);
+    SinkOutput out;
+    ASSERT_EQ(kUpb_EncodeStatus_Ok,
+              upb_EncodeToSink(msg, table, options, arena_.ptr(), buf.data(),
+                               buf.size(), &AppendToSink, &out));
+    EXPECT_EQ(expected, out.data) << chunk_size;
+    // Every chunk but the last fills the buffer, except where a long string
+    // was passed through on its own.
+    for (size_t i = 0; i + 1 < out.chunks.size(); i++) {
+      EXPECT_GE(out.chunks[i], chunk_size);
+    }
+  }
+
+  std::vector<char> buf(64);
+  SinkOutput out;
+  out.fail_after = 2;
+  EXPECT_EQ(kUpb_EncodeStatus_SinkFailed,
+            upb_EncodeToSink(msg, table, options, arena_.ptr(), buf.data(),
+                             buf.size(), &AppendToSink, &out));
+}
+
+TEST_F(EncodeTest, EncodeToSegments) {
+  upb_MiniTable* table = BuildTable(true);
+  std::string payload = Payload();
+  upb_Message* msg =
+      Parse(table, payload,
+            kUpb_DecodeOption_AliasString | kUpb_DecodeOption_Lazy);
+  int options = kUpb_EncodeOption_Deterministic;
+  std::string expected = Encode(msg, table, options);
+
+  for (size_t threshold : {size_t{0}, size_t{100}, size_t{300}, SIZE_MAX}) {
+    upb_EncodeSegment* segments;
+    size_t count;
+    ASSERT_EQ(kUpb_EncodeStatus_Ok,
+              upb_EncodeToSegments(msg, table, options, threshold,
+                                   arena_.ptr(), &segments, &count));
+    std::string joined;
+    size_t referenced = 0;
+    for (size_t i = 0; i < count; i++) {
+      EXPECT_NE(0, segments[i].size);
+      joined.append(segments[i].data, segments[i].size);
+      // Aliased strings, the lazy sub-message and the unknown fields all
+      // point into the payload.
+      if (segments[i].data >= payload.data() &&
+          segments[i].data < payload.data() + payload.size()) {
+        EXPECT_GE(segments[i].size, threshold);
+        referenced++;
+      }
+    }
+    EXPECT_EQ(expected, joined) << threshold;
+    if (threshold == 300) {
+      // The 300-byte string is inside the lazy sub-message, which is
+      // referenced as a whole, like the 400-byte repeated string.
+      EXPECT_EQ(2, referenced);
+    }
+    if (threshold == SIZE_MAX) {
+      EXPECT_EQ(1, count);
+    }
+  }
+
+  upb_Message* empty = _upb_Message_New(table, arena_.ptr());
+  upb_EncodeSegment* segments;
+  size_t count;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_EncodeToSegments(empty, table, 0, 0, arena_.ptr(), &segments,
+                                 &count));
+  EXPECT_EQ(0, count);
+}
+
+TEST_F(EncodeTest, DeterministicMapOrder) {
+  upb_MiniTable* table = BuildTable(false);
+  int options = kUpb_EncodeOption_Deterministic;
+
+  // Enough entries to take the radix and merge sorts rather than the
+  // insertion sort used for small maps.
+  std::vector<int32_t> keys;
+  uint32_t x = 1;
+  for (int i = 0; i < 500; i++) {
+    x = x * 1103515245 + 12345;
+    int32_t key = static_cast<int32_t>(x) >> (i % 24);
+    if (key != 0) keys.push_back(key);
+  }
+  auto add_entries = [](std::string* out, int32_t key) {
+    *out += Delimited(9, Delimited(1, "k" + std::to_string(key % 977)));
+    *out += Delimited(10, VarintField(1, key) + VarintField(2, 1));
+  };
+  std::string forward, backward;
+  for (size_t i = 0; i < keys.size(); i++) {
+    add_entries(&forward, keys[i]);
+    add_entries(&backward, keys[keys.size() - i - 1]);
+  }
+
+  std::string encoded = Encode(Parse(table, forward), table, options);
+  EXPECT_EQ(encoded, Encode(Parse(table, backward), table, options));
+
+  // Integer keys come out in descending order, after the string-keyed map.
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  std::string int_map;
+  for (auto it = keys.rbegin(); it != keys.rend(); ++it) {
+    int_map += Delimited(10, VarintField(1, *it) + VarintField(2, 1));
+  }
+  ASSERT_GE(encoded.size(), int_map.size());
+  EXPECT_EQ(int_map, encoded.substr(encoded.size() - int_map.size()));
+
+  // Without an arena the sorter falls back to malloc().
+  std::vector<char> buf(encoded.size());
+  size_t size;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_EncodeToBuffer(Parse(table, backward), table, options,
+                               buf.data(), buf.size(), &size));
+  EXPECT_EQ(encoded, std::string(buf.data(), size));
+}
+
+TEST_F(EncodeTest, ReusedSorter) {
+  upb_MiniTable* table = BuildTable(false);
+  int options = kUpb_EncodeOption_Deterministic;
+  std::string payload;
+  for (int32_t key = 300; key > 0; key--) {
+    payload += Delimited(9, Delimited(1, "k" + std::to_string(key)));
+    payload += Delimited(10, VarintField(1, key) + VarintField(2, 1));
+  }
+  upb_Message* msg = Parse(table, payload);
+  std::string expected = Encode(msg, table, options);
+
+  upb::Arena sorter_arena;
+  upb_EncodeSorter* sorter = upb_EncodeSorter_New(sorter_arena.ptr());
+  ASSERT_NE(nullptr, sorter);
+  size_t grown = 0;
+  for (int i = 0; i < 3; i++) {
+    upb::Arena arena;
+    char* buf;
+    size_t size;
+    ASSERT_EQ(kUpb_EncodeStatus_Ok,
+              upb_EncodeWithSorter(msg, table, options, arena.ptr(), sorter,
+                                   &buf, &size));
+    EXPECT_EQ(expected, std::string(buf, size));
+    // Later encodes of the same maps reuse the buffers grown by the first.
+    upb_ArenaStats stats;
+    upb_Arena_GetStats(sorter_arena.ptr(), &stats);
+    if (i == 0) grown = stats.space_used;
+    EXPECT_EQ(grown, stats.space_used);
+  }
+}
+
+}  // namespace
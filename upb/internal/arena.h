@@ -29,6 +29,7 @@
 #define UPB_INTERNAL_ARENA_H_
 
 #include "upb/arena.h"
+#include "upb/internal/atomic.h"
 
 // Must be last.
 #include "upb/port_def.inc"
@@ -41,26 +42,125 @@ typedef struct mem_block mem_block;
 
 struct upb_Arena {
   _upb_ArenaHead head;
-  /* Stores cleanup metadata for this arena.
-   * - a pointer to the current cleanup counter.
-   * - a boolean indicating if there is an unowned initial block.  */
-  uintptr_t cleanup_metadata;
+  /* Pointer to the cleanup counter of the current block (NULL if the current
+   * block is an unowned initial block). */
+  uint32_t* cleanups;
 
   /* Allocator to allocate arena blocks.  We are responsible for freeing these
-   * when we are destroyed. */
-  upb_alloc* block_alloc;
+   * when we are destroyed.  The low bit indicates whether there is an unowned
+   * initial block.  It never changes after init, so it is safe to read from
+   * any thread. */
+  uintptr_t block_alloc;
   uint32_t last_size;
 
+  /* Growth policy (see upb_ArenaGrowthPolicy), SIZE_MAX when unset. */
+  size_t max_block_size;
+  size_t large_alloc_threshold;
+
   /* When multiple arenas are fused together, each arena points to a parent
    * arena (root points to itself). The root tracks how many live arenas
-   * reference it. */
-  uint32_t refcount; /* Only used when a->parent == a */
-  struct upb_Arena* parent;
+   * reference it.
+   *
+   * The low bit is tagged:
+   *   0: pointer to parent
+   *   1: count, left shifted by one
+   *
+   * Since fuse and free may be called from any thread, this is only ever
+   * accessed atomically. */
+  UPB_ATOMIC(uintptr_t) parent_or_count;
+
+  /* All arenas that are fused together are in a singly-linked list, so that
+   * the last one to be freed can free all of the others. */
+  UPB_ATOMIC(struct upb_Arena*) next; /* NULL at end of list. */
+
+  /* The last element of the linked list.  This is only an optimization so that
+   * fuse does not have to walk the whole list.  Only significant for a root;
+   * it may be stale, but following `next` from it always reaches the tail. */
+  UPB_ATOMIC(struct upb_Arena*) tail; /* == self when no other members. */
+
+  /* Linked list of this arena's blocks to free/cleanup.  Only touched by the
+   * thread that owns this arena, until the whole fused group is freed. */
+  mem_block* freelist;
+
+  /* Blocks retained by the last upb_Arena_Reset(), largest first.  They stay
+   * on this list when they are put back into use, so that upb_Arena_Rollback()
+   * can tell them apart from newly allocated blocks. */
+  mem_block* retained;
+
+  /* The first block of `retained` that has not been put back into use yet.
+   * These hold no data or cleanups, but we still own them. */
+  mem_block* spare;
 
-  /* Linked list of blocks to free/cleanup. */
-  mem_block *freelist, *freelist_tail;
+  /* Start of the unowned initial block, if any. */
+  char* initial_block;
+
+  /* Space accounting for this arena, only updated when a block is allocated
+   * or released.  Only written by the owning thread, but read by any thread
+   * that sums them over a fused group.
+   * - space_allocated: bytes of blocks obtained from block_alloc.
+   * - space_wasted: bytes left unused at the end of blocks we moved on from.
+   * - block_count: number of blocks obtained from block_alloc. */
+  UPB_ATOMIC(size_t) space_allocated;
+  UPB_ATOMIC(size_t) space_wasted;
+  UPB_ATOMIC(size_t) block_count;
+
+  /* The most space the fused group may obtain from its block allocators
+   * (SIZE_MAX if unlimited).  Only significant for a root. */
+  UPB_ATOMIC(size_t) max_space;
 };
 
+/* The decoder works on a copy of the arena that lives in its own state, so that
+ * the hot allocation fields stay close to the rest of the decoder state.
+ *
+ * The union-find fields of the original may be concurrently modified by a fuse
+ * on another thread, so they are not copied.  Instead the copy's parent is the
+ * original, and the copy's space accounting starts from zero and is added to
+ * the original's when swapped out. */
+UPB_INLINE void _upb_Arena_SwapIn(upb_Arena* des, upb_Arena* src) {
+  des->head = src->head;
+  des->cleanups = src->cleanups;
+  des->block_alloc = src->block_alloc;
+  des->last_size = src->last_size;
+  des->max_block_size = src->max_block_size;
+  des->large_alloc_threshold = src->large_alloc_threshold;
+  des->freelist = src->freelist;
+  des->retained = src->retained;
+  des->spare = src->spare;
+  des->initial_block = src->initial_block;
+  /* A pointer tag: arenas are aligned, so the low bit is clear. */
+  upb_Atomic_Init(&des->parent_or_count, (uintptr_t)src);
+  upb_Atomic_Init(&des->next, NULL);
+  upb_Atomic_Init(&des->tail, des);
+  upb_Atomic_Init(&des->space_allocated, 0);
+  upb_Atomic_Init(&des->space_wasted, 0);
+  upb_Atomic_Init(&des->block_count, 0);
+  upb_Atomic_Init(&des->max_space, SIZE_MAX);
+}
+
+UPB_INLINE void _upb_Arena_SwapOut(upb_Arena* des, upb_Arena* src) {
+  des->head = src->head;
+  des->cleanups = src->cleanups;
+  des->last_size = src->last_size;
+  des->freelist = src->freelist;
+  des->spare = src->spare;
+  /* Only the owning thread writes the counters (see arena_addspace()). */
+  upb_Atomic_Store(
+      &des->space_allocated,
+      upb_Atomic_Load(&des->space_allocated, memory_order_relaxed) +
+          upb_Atomic_Load(&src->space_allocated, memory_order_relaxed),
+      memory_order_relaxed);
+  upb_Atomic_Store(
+      &des->block_count,
+      upb_Atomic_Load(&des->block_count, memory_order_relaxed) +
+          upb_Atomic_Load(&src->block_count, memory_order_relaxed),
+      memory_order_relaxed);
+  upb_Atomic_Store(
+      &des->space_wasted,
+      upb_Atomic_Load(&des->space_wasted, memory_order_relaxed) +
+          upb_Atomic_Load(&src->space_wasted, memory_order_relaxed),
+      memory_order_relaxed);
+}
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -34,7 +34,12 @@
 #define UPB_INTERNAL_DECODE_H_
 
 #include "upb/decode.h"
+#include "upb/decode_profile.h"
+#include "upb/decode_projection.h"
+#include "upb/decode_stats.h"
 #include "upb/internal/arena.h"
+#include "upb/internal/packed_varint.h"
+#include "upb/internal/utf8.h"
 #include "upb/msg_internal.h"
 #include "third_party/utf8_range/utf8_range.h"
 
@@ -57,6 +62,13 @@ typedef struct upb_Decoder {
   bool missing_required;
   char patch[32];
   upb_Arena arena;
+  upb_Arena* user_arena; /* Arena passed to upb_Decode(), for lazy fields. */
+  const upb_DecodeProjection* proj; /* Fields to parse, NULL for all. */
+  upb_DecodeProfile* profile; /* Counts fields if this parse is sampled. */
+  upb_DecodeStats* stats;     /* Path counters, NULL if not wanted. */
+  const upb_MiniTable* stats_table;   /* Last table counted in |stats|, */
+  upb_DecodeCounters* stats_counters; /* and its counters. */
+  upb_Message* enum_dropped; /* Last message that discarded an enum value. */
   jmp_buf err;
 
 #ifndef NDEBUG
@@ -65,6 +77,46 @@ typedef struct upb_Decoder {
 #endif
 } upb_Decoder;
 
+/* See upb/decode_projection.h.  A field is parsed if its bit in |selected| is
+ * set; then if |children| is non-NULL and has an entry for it, only the fields
+ * selected by that entry are parsed inside it. */
+struct upb_DecodeProjection {
+  const upb_MiniTable* table;
+  uint64_t* selected;             /* One bit per field index. */
+  upb_DecodeProjection** children; /* Per field index, or NULL. */
+};
+
+/* See upb/decode_profile.h.  |tables| maps each upb_MiniTable* to an
+ * upb_inttable* of field number -> count, all allocated from |arena|. */
+struct upb_DecodeProfile {
+  upb_Arena* arena;
+  upb_inttable tables;
+  uint32_t sample_every;
+  uint32_t countdown; /* Parses left until the next sampled one. */
+};
+
+/* See upb/decode_stats.h.  |tables| maps each upb_MiniTable* to its
+ * upb_DecodeCounters*, all allocated from |arena|. */
+struct upb_DecodeStats {
+  upb_Arena* arena;
+  upb_inttable tables;
+};
+
+/* Adds one to the counter at offset |ofs| of |l|'s upb_DecodeCounters. */
+void decode_countstat(upb_Decoder* d, const upb_MiniTable* l, size_t ofs);
+
+/* Compiles to nothing unless UPB_ENABLE_DECODE_STATS is defined. */
+#if UPB_DECODE_STATS
+#define DECODE_STAT(d, l, counter)                                   \
+  do {                                                               \
+    if (UPB_UNLIKELY((d)->stats != NULL)) {                          \
+      decode_countstat(d, l, offsetof(upb_DecodeCounters, counter)); \
+    }                                                                \
+  } while (0)
+#else
+#define DECODE_STAT(d, l, counter)
+#endif
+
 /* Error function that will abort decoding with longjmp(). We can't declare this
  * UPB_NORETURN, even though it is appropriate, because if we do then compilers
  * will "helpfully" refuse to tailcall to it
@@ -80,6 +132,9 @@ UPB_INLINE
 bool decode_verifyutf8_inl(const char* ptr, int len) {
   const char* end = ptr + len;
 
+  // Long strings are worth a call into the vector kernels.
+  if (len >= 32) return _upb_Utf8_IsValid(ptr, len);
+
   // Check 8 bytes at a time for any non-ASCII char.
   while (end - ptr >= 8) {
     uint64_t data;
@@ -104,6 +159,13 @@ const char* decode_checkrequired(upb_Decoder* d, const char* ptr,
                                  const upb_Message* msg,
                                  const upb_MiniTable* l);
 
+/* Checks a closed enum value that is not covered by the enum's 64-bit mask.
+ * Returns false (after adding the value to the message's unknown fields) if
+ * the value is not a member of the enum. */
+bool decode_checkenum_slow(upb_Decoder* d, upb_Message* msg,
+                           const upb_MiniTable_Enum* e, uint32_t field_number,
+                           uint32_t v);
+
 /* x86-64 pointers always have the high 16 bits matching. So we can shift
  * left 8 and right 8 without loss of information. */
 UPB_INLINE intptr_t decode_totable(const upb_MiniTable* tablep) {
@@ -128,6 +190,9 @@ const char* decode_isdonefallback_inl(upb_Decoder* d, const char* ptr,
       }
       d->unknown = &d->patch[0] + overrun;
     }
+#if UPB_DECODE_STATS
+    if (d->stats_counters) d->stats_counters->buffer_flips++;
+#endif
     memset(d->patch + 16, 0, 16);
     memcpy(d->patch, d->end, 16);
     ptr = &d->patch[0] + overrun;
@@ -169,6 +234,7 @@ const char* fastdecode_tagdispatch(upb_Decoder* d, const char* ptr,
   size_t idx = tag & mask;
   UPB_ASSUME((idx & 7) == 0);
   idx >>= 3;
+  DECODE_STAT(d, table_p, fast_dispatches);
   data = table_p->fasttable[idx].field_data ^ tag;
   UPB_MUSTTAIL return table_p->fasttable[idx].field_parser(d, ptr, msg, table,
                                                            hasbits, data);
@@ -204,6 +270,14 @@ UPB_INLINE void decode_poplimit(upb_Decoder* d, const char* ptr,
   decode_checklimit(d);
 }
 
+/* Counts the varints of the current packed field that end in the readable part
+ * of the buffer, so that the array can be sized for all of them at once rather
+ * than grown repeatedly (leaving the old copies behind in the arena). */
+UPB_INLINE size_t decode_countvarints(upb_Decoder* d, const char* ptr) {
+  const char* end = d->end + UPB_MIN(d->limit, 16);
+  return ptr < end ? _upb_CountPackedVarints(ptr, end - ptr) : 0;
+}
+
 #include "upb/port_undef.inc"
 
 #endif /* UPB_INTERNAL_DECODE_H_ */
@@ -0,0 +1,636 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "upb/internal/packed_varint.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define UPB_PACKED_VARINT_X86 1
+#else
+#define UPB_PACKED_VARINT_X86 0
+#endif
+
+// Must be last.
+#include "upb/port_def.inc"
+
+/* Decodes one varint of up to ten bytes, accepting the same inputs as
+ * decode_longvarint64() in decode.c. */
+UPB_FORCEINLINE
+static const char* upb_DecodeVarint(const char* ptr, uint64_t* val) {
+  uint64_t byte = (uint8_t)*ptr;
+  if (UPB_LIKELY((byte & 0x80) == 0)) {
+    *val = byte;
+    return ptr + 1;
+  }
+  uint64_t v = byte;
+  for (int i = 1; i < 10; i++) {
+    byte = (uint8_t)ptr[i];
+    v += (byte - 1) << (i * 7);
+    if (!(byte & 0x80)) {
+      *val = v;
+      return ptr + i + 1;
+    }
+  }
+  return NULL;
+}
+
+UPB_FORCEINLINE
+static void upb_StoreVarint(void* out, size_t i, uint64_t val, int lg2,
+                            bool zigzag) {
+  if (lg2 == 2) {
+    uint32_t n = val;
+    if (zigzag) n = (n >> 1) ^ -(n & 1);
+    memcpy((char*)out + i * 4, &n, 4);
+  } else {
+    if (zigzag) val = (val >> 1) ^ -(val & 1);
+    memcpy((char*)out + i * 8, &val, 8);
+  }
+}
+
+/* Decodes one varint at a time, continuing from |*count| values. */
+UPB_FORCEINLINE
+static const char* upb_DecodePackedVarints_Scalar(const char* ptr,
+                                                  const char* end, void* out,
+                                                  size_t max, int lg2,
+                                                  bool zigzag, size_t* count) {
+  size_t n = *count;
+  while (n < max && ptr < end) {
+    uint64_t val;
+    ptr = upb_DecodeVarint(ptr, &val);
+    if (!ptr) return NULL;
+    upb_StoreVarint(out, n++, val, lg2, zigzag);
+  }
+  *count = n;
+  return ptr;
+}
+
+/* Counts the bytes without a continuation bit, eight at a time. */
+UPB_FORCEINLINE
+static size_t upb_CountPackedVarints_Scalar(const char* ptr, size_t size) {
+  size_t n = 0;
+  for (; size >= 8; ptr += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, ptr, 8);
+    /* Sums the eight 0/1 terminator flags into the top byte. */
+    word = (~word >> 7) & 0x0101010101010101ULL;
+    n += (word * 0x0101010101010101ULL) >> 56;
+  }
+  for (; size; ptr++, size--) n += (uint8_t)*ptr < 0x80;
+  return n;
+}
+
+/* Loads element |i| and widens it to the value that gets encoded. */
+UPB_FORCEINLINE
+static uint64_t upb_LoadVarintValue(const void* in, size_t i, int lg2,
+                                    upb_PackedVarint_Mode mode) {
+  if (lg2 == 2) {
+    uint32_t v;
+    memcpy(&v, (const char*)in + i * 4, 4);
+    if (mode == kUpb_PackedVarint_ZigZag) {
+      return (v << 1) ^ (uint32_t)((int32_t)v >> 31);
+    }
+    if (mode == kUpb_PackedVarint_SignExtend) return (int64_t)(int32_t)v;
+    return v;
+  } else {
+    uint64_t v;
+    memcpy(&v, (const char*)in + i * 8, 8);
+    if (mode == kUpb_PackedVarint_ZigZag) {
+      return (v << 1) ^ (uint64_t)((int64_t)v >> 63);
+    }
+    return v;
+  }
+}
+
+UPB_FORCEINLINE
+static size_t upb_VarintSize(uint64_t val) {
+#ifdef __GNUC__
+  /* Each byte holds 7 bits: (bits * 9 + 64) / 64 == ceil(bits / 7). */
+  int bits = 64 - __builtin_clzll(val | 1);
+  return (bits * 9 + 64) / 64;
+#else
+  size_t ret = 1;
+  while (val >= 128) {
+    val >>= 7;
+    ret++;
+  }
+  return ret;
+#endif
+}
+
+UPB_FORCEINLINE
+static char* upb_EncodeVarint(char* ptr, uint64_t val) {
+  do {
+    uint8_t byte = val & 0x7fU;
+    val >>= 7;
+    if (val) byte |= 0x80U;
+    *ptr++ = byte;
+  } while (val);
+  return ptr;
+}
+
+/* Sizes elements [i, n) one at a time. */
+UPB_FORCEINLINE
+static size_t upb_PackedVarintsSize_Scalar(const void* in, size_t i, size_t n,
+                                           int lg2,
+                                           upb_PackedVarint_Mode mode) {
+  size_t size = 0;
+  for (; i < n; i++) {
+    size += upb_VarintSize(upb_LoadVarintValue(in, i, lg2, mode));
+  }
+  return size;
+}
+
+/* Encodes elements [i, n) one at a time. */
+UPB_FORCEINLINE
+static char* upb_EncodePackedVarints_Scalar(const void* in, size_t i,
+                                            size_t n, int lg2,
+                                            upb_PackedVarint_Mode mode,
+                                            char* out) {
+  for (; i < n; i++) {
+    out = upb_EncodeVarint(out, upb_LoadVarintValue(in, i, lg2, mode));
+  }
+  return out;
+}
+
+#if UPB_PACKED_VARINT_X86
+
+/* The SIMD kernels below work on blocks of 16 or 32 bytes.  A block without
+ * any continuation bits holds that many one-byte varints, which are widened
+ * and stored with a few vector instructions.  Otherwise the SSE4.1 kernel
+ * falls back to decoding the block one varint at a time, while the AVX2 kernel
+ * uses the block's continuation mask to find the length of each varint and
+ * gathers its 7-bit groups with pext. */
+
+#define UPB_TARGET_SSE4 __attribute__((target("sse4.1")))
+#define UPB_TARGET_AVX2 __attribute__((target("avx2,bmi2,popcnt")))
+
+UPB_FORCEINLINE UPB_TARGET_SSE4 static __m128i upb_ZigZag_Sse4(__m128i v,
+                                                               int lg2) {
+  if (lg2 == 2) {
+    __m128i neg = _mm_sub_epi32(_mm_setzero_si128(),
+                                _mm_and_si128(v, _mm_set1_epi32(1)));
+    return _mm_xor_si128(_mm_srli_epi32(v, 1), neg);
+  } else {
+    __m128i neg = _mm_sub_epi64(_mm_setzero_si128(),
+                                _mm_and_si128(v, _mm_set1_epi64x(1)));
+    return _mm_xor_si128(_mm_srli_epi64(v, 1), neg);
+  }
+}
+
+/* Widens and stores 16 one-byte varints. */
+UPB_FORCEINLINE UPB_TARGET_SSE4 static void upb_StoreBytes_Sse4(
+    __m128i bytes, char* dst, int lg2, bool zigzag) {
+  for (int i = 0; i < (lg2 == 2 ? 4 : 8); i++) {
+    __m128i v = lg2 == 2 ? _mm_cvtepu8_epi32(bytes) : _mm_cvtepu8_epi64(bytes);
+    if (zigzag) v = upb_ZigZag_Sse4(v, lg2);
+    _mm_storeu_si128((__m128i*)(dst + 16 * i), v);
+    bytes = lg2 == 2 ? _mm_srli_si128(bytes, 4) : _mm_srli_si128(bytes, 2);
+  }
+}
+
+UPB_FORCEINLINE UPB_TARGET_SSE4 static const char*
+upb_DecodePackedVarints_Sse4Impl(const char* ptr, const char* end, void* out,
+                                 size_t max, int lg2, bool zigzag,
+                                 size_t* count) {
+  size_t n = 0;
+  while (end - ptr >= 16 && max - n >= 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)ptr);
+    uint32_t mask = _mm_movemask_epi8(bytes);
+    if (mask == 0) {
+      upb_StoreBytes_Sse4(bytes, (char*)out + (n << lg2), lg2, zigzag);
+      ptr += 16;
+      n += 16;
+    } else {
+      const char* block_end = ptr + 16;
+      do {
+        uint64_t val;
+        ptr = upb_DecodeVarint(ptr, &val);
+        if (!ptr) return NULL;
+        upb_StoreVarint(out, n++, val, lg2, zigzag);
+      } while (ptr < block_end);
+    }
+  }
+  *count = n;
+  return upb_DecodePackedVarints_Scalar(ptr, end, out, max, lg2, zigzag,
+                                        count);
+}
+
+UPB_NOINLINE UPB_TARGET_SSE4 static const char* upb_DecodePackedVarints_Sse4(
+    const char* ptr, const char* end, void* out, size_t max, int lg2,
+    bool zigzag, size_t* count) {
+  // Instantiate the kernel for each element type.
+  if (lg2 == 2) {
+    return zigzag ? upb_DecodePackedVarints_Sse4Impl(ptr, end, out, max, 2,
+                                                     true, count)
+                  : upb_DecodePackedVarints_Sse4Impl(ptr, end, out, max, 2,
+                                                     false, count);
+  } else {
+    return zigzag ? upb_DecodePackedVarints_Sse4Impl(ptr, end, out, max, 3,
+                                                     true, count)
+                  : upb_DecodePackedVarints_Sse4Impl(ptr, end, out, max, 3,
+                                                     false, count);
+  }
+}
+
+/* Decodes the varints that start in the |size|-byte block at |block|, whose
+ * continuation bits are |mask|.  Each clear bit in |mask| ends a varint, so
+ * walking them gives every length without a dependency on the previous
+ * varint's decoded position. */
+UPB_FORCEINLINE UPB_TARGET_AVX2 static const char* upb_DecodeVarintBlock(
+    const char* block, int size, uint32_t mask, void* out, size_t* n, int lg2,
+    bool zigzag) {
+  uint32_t ends = ~mask & (uint32_t)((1ULL << size) - 1);
+  size_t i = *n;
+  int start = 0;
+  while (ends) {
+    int last = __builtin_ctz(ends);
+    int len = last - start + 1;
+    uint64_t val;
+    ends &= ends - 1;
+    if (UPB_LIKELY(len <= 8)) {
+      uint64_t word;
+      memcpy(&word, block + start, 8);
+      val = _pext_u64(word, 0x7f7f7f7f7f7f7f7fULL >> (64 - 8 * len));
+    } else if (!upb_DecodeVarint(block + start, &val)) {
+      return NULL;
+    }
+    upb_StoreVarint(out, i++, val, lg2, zigzag);
+    start = last + 1;
+  }
+  if (start < size) {
+    /* The last varint continues past the end of the block. */
+    uint64_t val;
+    const char* ptr = upb_DecodeVarint(block + start, &val);
+    if (!ptr) return NULL;
+    upb_StoreVarint(out, i++, val, lg2, zigzag);
+    *n = i;
+    return ptr;
+  }
+  *n = i;
+  return block + size;
+}
+
+UPB_FORCEINLINE UPB_TARGET_AVX2 static __m256i upb_ZigZag_Avx2(__m256i v,
+                                                               int lg2) {
+  if (lg2 == 2) {
+    __m256i neg = _mm256_sub_epi32(_mm256_setzero_si256(),
+                                   _mm256_and_si256(v, _mm256_set1_epi32(1)));
+    return _mm256_xor_si256(_mm256_srli_epi32(v, 1), neg);
+  } else {
+    __m256i neg = _mm256_sub_epi64(
+        _mm256_setzero_si256(), _mm256_and_si256(v, _mm256_set1_epi64x(1)));
+    return _mm256_xor_si256(_mm256_srli_epi64(v, 1), neg);
+  }
+}
+
+/* Widens and stores the 32 one-byte varints at |src|. */
+UPB_FORCEINLINE UPB_TARGET_AVX2 static void upb_StoreBytes_Avx2(
+    const char* src, char* dst, int lg2, bool zigzag) {
+  int per_vec = lg2 == 2 ? 8 : 4;
+  for (int i = 0; i < 32 / per_vec; i++) {
+    __m256i v;
+    if (lg2 == 2) {
+      v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)src));
+    } else {
+      int32_t four;
+      memcpy(&four, src, 4);
+      v = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(four));
+    }
+    if (zigzag) v = upb_ZigZag_Avx2(v, lg2);
+    _mm256_storeu_si256((__m256i*)dst, v);
+    src += per_vec;
+    dst += 32;
+  }
+}
+
+UPB_FORCEINLINE UPB_TARGET_AVX2 static const char*
+upb_DecodePackedVarints_Avx2Impl(const char* ptr, const char* end, void* out,
+                                 size_t max, int lg2, bool zigzag,
+                                 size_t* count) {
+  size_t n = 0;
+  while (end - ptr >= 32 && max - n >= 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)ptr);
+    uint32_t mask = _mm256_movemask_epi8(bytes);
+    if (mask == 0) {
+      upb_StoreBytes_Avx2(ptr, (char*)out + (n << lg2), lg2, zigzag);
+      ptr += 32;
+      n += 32;
+    } else {
+      ptr = upb_DecodeVarintBlock(ptr, 32, mask, out, &n, lg2, zigzag);
+      if (!ptr) return NULL;
+    }
+  }
+  *count = n;
+  return upb_DecodePackedVarints_Scalar(ptr, end, out, max, lg2, zigzag,
+                                        count);
+}
+
+UPB_NOINLINE UPB_TARGET_AVX2 static const char* upb_DecodePackedVarints_Avx2(
+    const char* ptr, const char* end, void* out, size_t max, int lg2,
+    bool zigzag, size_t* count) {
+  // Instantiate the kernel for each element type.
+  if (lg2 == 2) {
+    return zigzag ? upb_DecodePackedVarints_Avx2Impl(ptr, end, out, max, 2,
+                                                     true, count)
+                  : upb_DecodePackedVarints_Avx2Impl(ptr, end, out, max, 2,
+                                                     false, count);
+  } else {
+    return zigzag ? upb_DecodePackedVarints_Avx2Impl(ptr, end, out, max, 3,
+                                                     true, count)
+                  : upb_DecodePackedVarints_Avx2Impl(ptr, end, out, max, 3,
+                                                     false, count);
+  }
+}
+
+UPB_NOINLINE UPB_TARGET_AVX2 static size_t upb_CountPackedVarints_Avx2(
+    const char* ptr, size_t size) {
+  size_t n = 0;
+  for (; size >= 32; ptr += 32, size -= 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)ptr);
+    n += 32 - __builtin_popcount(_mm256_movemask_epi8(bytes));
+  }
+  return n + upb_CountPackedVarints_Scalar(ptr, size);
+}
+
+
+/* The encoding kernels work on blocks of 32 elements.  When every element of
+ * a block encodes to a single byte, the block is narrowed to 32 bytes and
+ * stored at once.  Otherwise each varint is spread into its 7-bit groups with
+ * pdep and stored as one 8-byte word, which the next varint overwrites. */
+
+/* Loads eight 32-bit or four 64-bit elements, zigzag-encoded if asked.  Sign
+ * extension does not change the low 32 bits, so it is left to the callers. */
+UPB_FORCEINLINE UPB_TARGET_AVX2 static __m256i upb_LoadVarintValues_Avx2(
+    const char* src, int lg2, upb_PackedVarint_Mode mode) {
+  __m256i v = _mm256_loadu_si256((const __m256i*)src);
+  if (mode == kUpb_PackedVarint_ZigZag) {
+    __m256i sign = lg2 == 2 ? _mm256_srai_epi32(v, 31)
+                            : _mm256_cmpgt_epi64(_mm256_setzero_si256(), v);
+    v = _mm256_xor_si256(lg2 == 2 ? _mm256_slli_epi32(v, 1)
+                                  : _mm256_slli_epi64(v, 1),
+                         sign);
+  }
+  return v;
+}
+
+/* Returns true if all 32 elements of the block at |src| are below 128, and if
+ * so stores them as bytes at |out|. */
+UPB_FORCEINLINE UPB_TARGET_AVX2 static bool upb_StoreSmallBlock_Avx2(
+    const char* src, int lg2, upb_PackedVarint_Mode mode, char* out) {
+  __m256i v[8];
+  __m256i any = _mm256_setzero_si256();
+  int vecs = lg2 == 2 ? 4 : 8;
+  for (int i = 0; i < vecs; i++) {
+    v[i] = upb_LoadVarintValues_Avx2(src + 32 * i, lg2, mode);
+    any = _mm256_or_si256(any, v[i]);
+  }
+  __m256i high = lg2 == 2 ? _mm256_set1_epi32(~0x7f)
+                          : _mm256_set1_epi64x(~0x7fLL);
+  if (!_mm256_testz_si256(any, high)) return false;
+
+  if (lg2 == 3) {
+    /* Gather the low halves of each pair of vectors into one. */
+    const __m256i lows = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    for (int i = 0; i < 4; i++) {
+      __m256i a = _mm256_permutevar8x32_epi32(v[2 * i], lows);
+      __m256i b = _mm256_permutevar8x32_epi32(v[2 * i + 1], lows);
+      v[i] = _mm256_permute2x128_si256(a, b, 0x20);
+    }
+  }
+
+  /* The packs work within 128-bit lanes, so the result holds four elements
+   * of each input vector per lane; the permute restores their order. */
+  __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(v[0], v[1]),
+                                      _mm256_packus_epi32(v[2], v[3]));
+  bytes = _mm256_permutevar8x32_epi32(
+      bytes, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+  _mm256_storeu_si256((__m256i*)out, bytes);
+  return true;
+}
+
+UPB_FORCEINLINE UPB_TARGET_AVX2 static int upb_HorizontalSum_Avx2(__m256i v) {
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v),
+                              _mm256_extracti128_si256(v, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+  return _mm_cvtsi128_si32(sum);
+}
+
+UPB_FORCEINLINE UPB_TARGET_AVX2 static size_t upb_PackedVarintsSize_Avx2Impl(
+    const void* in, size_t n, int lg2, upb_PackedVarint_Mode mode) {
+  size_t size = 0;
+  size_t i = 0;
+  for (; n - i >= 32; i += 32) {
+    const char* src = (const char*)in + (i << lg2);
+    if (lg2 == 2) {
+      /* Each length is one plus the number of 7-bit boundaries the value
+       * reaches, counted with unsigned compares. */
+      __m256i extra = _mm256_setzero_si256();
+      for (int j = 0; j < 4; j++) {
+        __m256i v = upb_LoadVarintValues_Avx2(src + 32 * j, 2, mode);
+        for (int k = 1; k <= 4; k++) {
+          __m256i limit = _mm256_set1_epi32(1U << (7 * k));
+          __m256i ge = _mm256_cmpeq_epi32(_mm256_max_epu32(v, limit), v);
+          extra = _mm256_sub_epi32(extra, ge);
+        }
+        if (mode == kUpb_PackedVarint_SignExtend) {
+          /* Negative values already counted five bytes and take ten. */
+          extra = _mm256_add_epi32(
+              extra, _mm256_and_si256(_mm256_srai_epi32(v, 31),
+                                      _mm256_set1_epi32(5)));
+        }
+      }
+      size += 32 + upb_HorizontalSum_Avx2(extra);
+    } else {
+      __m256i any = _mm256_setzero_si256();
+      for (int j = 0; j < 8; j++) {
+        any = _mm256_or_si256(any,
+                              upb_LoadVarintValues_Avx2(src + 32 * j, 3, mode));
+      }
+      if (_mm256_testz_si256(any, _mm256_set1_epi64x(~0x7fLL))) {
+        size += 32;
+      } else {
+        size += upb_PackedVarintsSize_Scalar(in, i, i + 32, 3, mode);
+      }
+    }
+  }
+  return size + upb_PackedVarintsSize_Scalar(in, i, n, lg2, mode);
+}
+
+/* Writes one varint, as a single store if it fits in eight bytes and eight
+ * bytes are left before |end|. */
+UPB_FORCEINLINE UPB_TARGET_AVX2 static char* upb_EncodeVarint_Bmi2(
+    char* out, const char* end, uint64_t val) {
+  if (UPB_LIKELY(val < (1ULL << 56) && end - out >= 8)) {
+    size_t len = upb_VarintSize(val);
+    uint64_t word = _pdep_u64(val, 0x7f7f7f7f7f7f7f7fULL) |
+                    (0x8080808080808080ULL & ((1ULL << (8 * len - 8)) - 1));
+    memcpy(out, &word, 8);
+    return out + len;
+  }
+  return upb_EncodeVarint(out, val);
+}
+
+UPB_FORCEINLINE UPB_TARGET_AVX2 static void upb_EncodePackedVarints_Avx2Impl(
+    const void* in, size_t n, int lg2, upb_PackedVarint_Mode mode, char* out,
+    size_t size) {
+  const char* end = out + size;
+  size_t i = 0;
+  while (n - i >= 32) {
+    const char* src = (const char*)in + (i << lg2);
+    if (upb_StoreSmallBlock_Avx2(src, lg2, mode, out)) {
+      out += 32;
+      i += 32;
+      continue;
+    }
+    for (size_t block_end = i + 32; i < block_end; i++) {
+      out = upb_EncodeVarint_Bmi2(out, end,
+                                  upb_LoadVarintValue(in, i, lg2, mode));
+    }
+  }
+  for (; i < n; i++) {
+    out = upb_EncodeVarint_Bmi2(out, end,
+                                upb_LoadVarintValue(in, i, lg2, mode));
+  }
+  UPB_ASSERT(out == end);
+}
+
+UPB_NOINLINE UPB_TARGET_AVX2 static size_t upb_PackedVarintsSize_Avx2(
+    const void* in, size_t n, int lg2, upb_PackedVarint_Mode mode) {
+  // Instantiate the kernel for each element type.
+  if (lg2 == 3) {
+    return mode == kUpb_PackedVarint_ZigZag
+               ? upb_PackedVarintsSize_Avx2Impl(in, n, 3,
+                                                kUpb_PackedVarint_ZigZag)
+               : upb_PackedVarintsSize_Avx2Impl(in, n, 3,
+                                                kUpb_PackedVarint_ZeroExtend);
+  }
+  switch (mode) {
+    case kUpb_PackedVarint_ZeroExtend:
+      return upb_PackedVarintsSize_Avx2Impl(in, n, 2,
+                                            kUpb_PackedVarint_ZeroExtend);
+    case kUpb_PackedVarint_SignExtend:
+      return upb_PackedVarintsSize_Avx2Impl(in, n, 2,
+                                            kUpb_PackedVarint_SignExtend);
+    default:
+      return upb_PackedVarintsSize_Avx2Impl(in, n, 2,
+                                            kUpb_PackedVarint_ZigZag);
+  }
+}
+
+UPB_NOINLINE UPB_TARGET_AVX2 static void upb_EncodePackedVarints_Avx2(
+    const void* in, size_t n, int lg2, upb_PackedVarint_Mode mode, char* out,
+    size_t size) {
+  // Instantiate the kernel for each element type.
+  if (lg2 == 3) {
+    if (mode == kUpb_PackedVarint_ZigZag) {
+      upb_EncodePackedVarints_Avx2Impl(in, n, 3, kUpb_PackedVarint_ZigZag,
+                                       out, size);
+    } else {
+      upb_EncodePackedVarints_Avx2Impl(in, n, 3, kUpb_PackedVarint_ZeroExtend,
+                                       out, size);
+    }
+    return;
+  }
+  switch (mode) {
+    case kUpb_PackedVarint_ZeroExtend:
+      upb_EncodePackedVarints_Avx2Impl(in, n, 2, kUpb_PackedVarint_ZeroExtend,
+                                       out, size);
+      break;
+    case kUpb_PackedVarint_SignExtend:
+      upb_EncodePackedVarints_Avx2Impl(in, n, 2, kUpb_PackedVarint_SignExtend,
+                                       out, size);
+      break;
+    default:
+      upb_EncodePackedVarints_Avx2Impl(in, n, 2, kUpb_PackedVarint_ZigZag, out,
+                                       size);
+      break;
+  }
+}
+
+#undef UPB_TARGET_SSE4
+#undef UPB_TARGET_AVX2
+
+#endif /* UPB_PACKED_VARINT_X86 */
+
+const char* _upb_DecodePackedVarints(const char* ptr, const char* end,
+                                     void* out, size_t max, int lg2,
+                                     bool zigzag, size_t* count) {
+  UPB_ASSERT(lg2 == 2 || lg2 == 3);
+#if UPB_PACKED_VARINT_X86
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+    return upb_DecodePackedVarints_Avx2(ptr, end, out, max, lg2, zigzag,
+                                        count);
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return upb_DecodePackedVarints_Sse4(ptr, end, out, max, lg2, zigzag,
+                                        count);
+  }
+#endif
+  *count = 0;
+  return upb_DecodePackedVarints_Scalar(ptr, end, out, max, lg2, zigzag,
+                                        count);
+}
+
+size_t _upb_CountPackedVarints(const char* ptr, size_t size) {
+#if UPB_PACKED_VARINT_X86
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+    return upb_CountPackedVarints_Avx2(ptr, size);
+  }
+#endif
+  return upb_CountPackedVarints_Scalar(ptr, size);
+}
+
+size_t _upb_PackedVarintsSize(const void* in, size_t n, int lg2,
+                              upb_PackedVarint_Mode mode) {
+  UPB_ASSERT(lg2 == 2 || lg2 == 3);
+#if UPB_PACKED_VARINT_X86
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+    return upb_PackedVarintsSize_Avx2(in, n, lg2, mode);
+  }
+#endif
+  return upb_PackedVarintsSize_Scalar(in, 0, n, lg2, mode);
+}
+
+void _upb_EncodePackedVarints(const void* in, size_t n, int lg2,
+                              upb_PackedVarint_Mode mode, char* out,
+                              size_t size) {
+  UPB_ASSERT(lg2 == 2 || lg2 == 3);
+#if UPB_PACKED_VARINT_X86
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+    upb_EncodePackedVarints_Avx2(in, n, lg2, mode, out, size);
+    return;
+  }
+#endif
+  char* end = upb_EncodePackedVarints_Scalar(in, 0, n, lg2, mode, out);
+  UPB_ASSERT(end == out + size);
+  UPB_UNUSED(end);
+  UPB_UNUSED(size);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Bulk decoding and encoding of packed varint fields.  Decoding is shared
+ * between decode.c and decode_fast.c, encoding is used by encode.c.
+ */
+
+#ifndef UPB_INTERNAL_PACKED_VARINT_H_
+#define UPB_INTERNAL_PACKED_VARINT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Must be last.
+#include "upb/port_def.inc"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Decodes the varints that start in [ptr, end) into |out| as 32-bit (lg2 == 2)
+ * or 64-bit (lg2 == 3) integers, zigzag-decoding them if |zigzag| is set, and
+ * stops early once |max| values have been stored.  Like the rest of the
+ * decoder this may read up to 16 bytes past |end|, and the last varint may
+ * end there.
+ *
+ * Returns the position after the last decoded varint and sets |*count| to the
+ * number of values stored, or returns NULL if a varint is longer than ten
+ * bytes.  On x86-64 this uses AVX2 and BMI2, or SSE4.1, when the CPU supports
+ * them. */
+const char* _upb_DecodePackedVarints(const char* ptr, const char* end,
+                                     void* out, size_t max, int lg2,
+                                     bool zigzag, size_t* count);
+
+/* Returns the number of varints that end in [ptr, ptr + size), which is the
+ * number of bytes there without a continuation bit.  Used to size arrays
+ * before decoding into them. */
+size_t _upb_CountPackedVarints(const char* ptr, size_t size);
+
+/* How each element is turned into the 64-bit value that gets encoded. */
+typedef enum {
+  kUpb_PackedVarint_ZeroExtend = 0, /* uint32, and 64-bit values as-is. */
+  kUpb_PackedVarint_SignExtend = 1, /* int32 and enum: negatives take 10. */
+  kUpb_PackedVarint_ZigZag = 2,     /* sint32 and sint64. */
+} upb_PackedVarint_Mode;
+
+/* Returns the number of bytes the |n| 32-bit (lg2 == 2) or 64-bit (lg2 == 3)
+ * integers at |in| take when encoded as varints. */
+size_t _upb_PackedVarintsSize(const void* in, size_t n, int lg2,
+                              upb_PackedVarint_Mode mode);
+
+/* Encodes the |n| integers at |in| as consecutive varints at |out|.  |size|
+ * must be what _upb_PackedVarintsSize() returned for the same arguments, and
+ * nothing is written past |out + size|.  On x86-64 this uses AVX2 and BMI2
+ * when the CPU supports them. */
+void _upb_EncodePackedVarints(const void* in, size_t n, int lg2,
+                              upb_PackedVarint_Mode mode, char* out,
+                              size_t size);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#include "upb/port_undef.inc"
+
+#endif /* UPB_INTERNAL_PACKED_VARINT_H_ */
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "upb/internal/utf8.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "third_party/utf8_range/utf8_range.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define UPB_UTF8_X86 1
+#else
+#define UPB_UTF8_X86 0
+#endif
+
+// Must be last.
+#include "upb/port_def.inc"
+
+static bool upb_Utf8_IsValid_Scalar(const char* ptr, size_t len) {
+  const char* end = ptr + len;
+
+  // Check 8 bytes at a time for any non-ASCII char.
+  while (end - ptr >= 8) {
+    uint64_t data;
+    memcpy(&data, ptr, 8);
+    if (data & 0x8080808080808080) break;
+    ptr += 8;
+  }
+
+  // Check one byte at a time for non-ASCII.
+  while (ptr < end) {
+    if (*ptr & 0x80) {
+      return utf8_range2((const unsigned char*)ptr, end - ptr) == 0;
+    }
+    ptr++;
+  }
+
+  return true;
+}
+
+#if UPB_UTF8_X86
+
+/* The vector kernels run the range algorithm of
+ * third_party/utf8_range/range2-sse.c on 32 or 64 bytes at a time, with the
+ * same tables (see there for how they work).  Each byte gets an index into
+ * |upb_Utf8_RangeMin| and |upb_Utf8_RangeMax| from its own high nibble and the
+ * three bytes before it, and must lie between the two.
+ *
+ * Two additions make them cheaper on real strings:
+ *   - A block without any non-ASCII byte skips the range check; it is only
+ *     wrong if the block before it ended in the middle of a character.
+ *   - The last, partial block is zero-padded rather than handed to
+ *     utf8_naive().  A zero byte is never a continuation byte, so a
+ *     character cut off by the end of the string is still caught. */
+
+static const int8_t upb_Utf8_FirstLen[16] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 3,
+};
+
+static const int8_t upb_Utf8_FirstRange[16] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 8, 8, 8,
+};
+
+static const uint8_t upb_Utf8_RangeMin[16] = {
+    0x00, 0x80, 0x80, 0x80, 0xA0, 0x80, 0x90, 0x80,
+    0xC2, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F,
+};
+
+static const uint8_t upb_Utf8_RangeMax[16] = {
+    0x7F, 0xBF, 0xBF, 0xBF, 0xBF, 0x9F, 0xBF, 0x8F,
+    0xF4, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+static const int8_t upb_Utf8_DfEe[16] = {
+    0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 0,
+};
+
+static const int8_t upb_Utf8_EfFe[16] = {
+    0, 3, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+/* Subtracting this from a block (with unsigned saturation) leaves a nonzero
+ * byte iff one of its last three bytes starts a character that doesn't fit:
+ * a lead byte of 2+ bytes last, 3+ bytes second to last or 4 bytes third to
+ * last.  The AVX2 kernel uses the last 32 bytes. */
+static const uint8_t upb_Utf8_IncompleteMax[64] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+
+#define UPB_TARGET_AVX2 __attribute__((target("avx2")))
+#define UPB_TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512bw")))
+
+/* The bytes |n| positions before those of |cur|, taking the last |n| bytes of
+ * the previous block |prev|.  alignr only shifts within 128-bit lanes, so the
+ * lanes are first lined up with a permute. */
+#define UPB_UTF8_PREV_AVX2(cur, prev, n) \
+  _mm256_alignr_epi8(cur, _mm256_permute2x128_si256(prev, cur, 0x21), 16 - (n))
+
+#define UPB_UTF8_PREV_AVX512(cur, prev, lanes, n)                      \
+  _mm512_alignr_epi8(cur, _mm512_permutex2var_epi64(prev, lanes, cur), \
+                     16 - (n))
+
+#define UPB_UTF8_TABLE_AVX2(t) \
+  _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(t)))
+
+#define UPB_UTF8_TABLE_AVX512(t) \
+  _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)(t)))
+
+UPB_NOINLINE UPB_TARGET_AVX2 static bool upb_Utf8_IsValid_Avx2(const char* ptr,
+                                                              size_t len) {
+  const __m256i first_len_tbl = UPB_UTF8_TABLE_AVX2(upb_Utf8_FirstLen);
+  const __m256i first_range_tbl = UPB_UTF8_TABLE_AVX2(upb_Utf8_FirstRange);
+  const __m256i range_min_tbl = UPB_UTF8_TABLE_AVX2(upb_Utf8_RangeMin);
+  const __m256i range_max_tbl = UPB_UTF8_TABLE_AVX2(upb_Utf8_RangeMax);
+  const __m256i df_ee_tbl = UPB_UTF8_TABLE_AVX2(upb_Utf8_DfEe);
+  const __m256i ef_fe_tbl = UPB_UTF8_TABLE_AVX2(upb_Utf8_EfFe);
+  const __m256i incomplete_max =
+      _mm256_loadu_si256((const __m256i*)(upb_Utf8_IncompleteMax + 32));
+  __m256i prev_input = _mm256_setzero_si256();
+  __m256i prev_first_len = _mm256_setzero_si256();
+  __m256i error = _mm256_setzero_si256();
+
+  for (;;) {
+    __m256i input;
+    if (len >= 32) {
+      input = _mm256_loadu_si256((const __m256i*)ptr);
+    } else {
+      char tail[32] = {0};
+      memcpy(tail, ptr, len);
+      input = _mm256_loadu_si256((const __m256i*)tail);
+    }
+
+    if (_mm256_movemask_epi8(input) == 0) {
+      error = _mm256_or_si256(error,
+                              _mm256_subs_epu8(prev_input, incomplete_max));
+      prev_first_len = _mm256_setzero_si256();
+    } else {
+      __m256i high_nibbles = _mm256_and_si256(_mm256_srli_epi16(input, 4),
+                                              _mm256_set1_epi8(0x0F));
+      __m256i first_len = _mm256_shuffle_epi8(first_len_tbl, high_nibbles);
+      __m256i range = _mm256_shuffle_epi8(first_range_tbl, high_nibbles);
+      __m256i tmp;
+
+      range = _mm256_or_si256(
+          range, UPB_UTF8_PREV_AVX2(first_len, prev_first_len, 1));
+      tmp = UPB_UTF8_PREV_AVX2(first_len, prev_first_len, 2);
+      range = _mm256_or_si256(range,
+                              _mm256_subs_epu8(tmp, _mm256_set1_epi8(1)));
+      tmp = UPB_UTF8_PREV_AVX2(first_len, prev_first_len, 3);
+      range = _mm256_or_si256(range,
+                              _mm256_subs_epu8(tmp, _mm256_set1_epi8(2)));
+
+      // Second bytes after E0, ED, F0 and F4 have narrower ranges.
+      __m256i pos = _mm256_sub_epi8(UPB_UTF8_PREV_AVX2(input, prev_input, 1),
+                                    _mm256_set1_epi8((char)0xEF));
+      tmp = _mm256_subs_epu8(pos, _mm256_set1_epi8((char)0xF0));
+      __m256i range2 = _mm256_shuffle_epi8(df_ee_tbl, tmp);
+      tmp = _mm256_adds_epu8(pos, _mm256_set1_epi8(0x70));
+      range2 = _mm256_add_epi8(range2, _mm256_shuffle_epi8(ef_fe_tbl, tmp));
+      range = _mm256_add_epi8(range, range2);
+
+      __m256i minv = _mm256_shuffle_epi8(range_min_tbl, range);
+      __m256i maxv = _mm256_shuffle_epi8(range_max_tbl, range);
+      error = _mm256_or_si256(error, _mm256_cmpgt_epi8(minv, input));
+      error = _mm256_or_si256(error, _mm256_cmpgt_epi8(input, maxv));
+      prev_first_len = first_len;
+    }
+
+    prev_input = input;
+    if (len < 32) break;
+    ptr += 32;
+    len -= 32;
+  }
+
+  return _mm256_testz_si256(error, error);
+}
+
+UPB_NOINLINE UPB_TARGET_AVX512 static bool upb_Utf8_IsValid_Avx512(
+    const char* ptr, size_t len) {
+  const __m512i first_len_tbl = UPB_UTF8_TABLE_AVX512(upb_Utf8_FirstLen);
+  const __m512i first_range_tbl = UPB_UTF8_TABLE_AVX512(upb_Utf8_FirstRange);
+  const __m512i range_min_tbl = UPB_UTF8_TABLE_AVX512(upb_Utf8_RangeMin);
+  const __m512i range_max_tbl = UPB_UTF8_TABLE_AVX512(upb_Utf8_RangeMax);
+  const __m512i df_ee_tbl = UPB_UTF8_TABLE_AVX512(upb_Utf8_DfEe);
+  const __m512i ef_fe_tbl = UPB_UTF8_TABLE_AVX512(upb_Utf8_EfFe);
+  const __m512i incomplete_max =
+      _mm512_loadu_si512((const void*)upb_Utf8_IncompleteMax);
+  // 64-bit lanes 6-7 of the previous block, then 0-5 of the current one.
+  const __m512i lanes = _mm512_set_epi64(13, 12, 11, 10, 9, 8, 7, 6);
+  __m512i prev_input = _mm512_setzero_si512();
+  __m512i prev_first_len = _mm512_setzero_si512();
+  __mmask64 error = 0;
+
+  for (;;) {
+    // The last block is loaded under a mask, which zeroes the other bytes
+    // without touching memory past the end.
+    __mmask64 load = len >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << len) - 1;
+    __m512i input = _mm512_maskz_loadu_epi8(load, ptr);
+
+    if (_mm512_movepi8_mask(input) == 0) {
+      __m512i tmp = _mm512_subs_epu8(prev_input, incomplete_max);
+      error |= _mm512_test_epi8_mask(tmp, tmp);
+      prev_first_len = _mm512_setzero_si512();
+    } else {
+      __m512i high_nibbles = _mm512_and_si512(_mm512_srli_epi16(input, 4),
+                                              _mm512_set1_epi8(0x0F));
+      __m512i first_len = _mm512_shuffle_epi8(first_len_tbl, high_nibbles);
+      __m512i range = _mm512_shuffle_epi8(first_range_tbl, high_nibbles);
+      __m512i tmp;
+
+      range = _mm512_or_si512(
+          range, UPB_UTF8_PREV_AVX512(first_len, prev_first_len, lanes, 1));
+      tmp = UPB_UTF8_PREV_AVX512(first_len, prev_first_len, lanes, 2);
+      range = _mm512_or_si512(range,
+                              _mm512_subs_epu8(tmp, _mm512_set1_epi8(1)));
+      tmp = UPB_UTF8_PREV_AVX512(first_len, prev_first_len, lanes, 3);
+      range = _mm512_or_si512(range,
+                              _mm512_subs_epu8(tmp, _mm512_set1_epi8(2)));
+
+      // Second bytes after E0, ED, F0 and F4 have narrower ranges.
+      __m512i pos =
+          _mm512_sub_epi8(UPB_UTF8_PREV_AVX512(input, prev_input, lanes, 1),
+                          _mm512_set1_epi8((char)0xEF));
+      tmp = _mm512_subs_epu8(pos, _mm512_set1_epi8((char)0xF0));
+      __m512i range2 = _mm512_shuffle_epi8(df_ee_tbl, tmp);
+      tmp = _mm512_adds_epu8(pos, _mm512_set1_epi8(0x70));
+      range2 = _mm512_add_epi8(range2, _mm512_shuffle_epi8(ef_fe_tbl, tmp));
+      range = _mm512_add_epi8(range, range2);
+
+      __m512i minv = _mm512_shuffle_epi8(range_min_tbl, range);
+      __m512i maxv = _mm512_shuffle_epi8(range_max_tbl, range);
+      error |= _mm512_cmpgt_epi8_mask(minv, input);
+      error |= _mm512_cmpgt_epi8_mask(input, maxv);
+      prev_first_len = first_len;
+    }
+
+    prev_input = input;
+    if (len < 64) break;
+    ptr += 64;
+    len -= 64;
+  }
+
+  return error == 0;
+}
+
+#undef UPB_UTF8_PREV_AVX2
+#undef UPB_UTF8_PREV_AVX512
+#undef UPB_UTF8_TABLE_AVX2
+#undef UPB_UTF8_TABLE_AVX512
+#undef UPB_TARGET_AVX2
+#undef UPB_TARGET_AVX512
+
+#endif /* UPB_UTF8_X86 */
+
+bool _upb_Utf8_IsValid(const char* ptr, size_t len) {
+#if UPB_UTF8_X86
+  if (__builtin_cpu_supports("avx512bw")) {
+    return upb_Utf8_IsValid_Avx512(ptr, len);
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return upb_Utf8_IsValid_Avx2(ptr, len);
+  }
+#endif
+  return upb_Utf8_IsValid_Scalar(ptr, len);
+}
@@ -102,6 +102,9 @@ static uint64_t upb_Field_Modifier(const upb_FieldDef* f) {
   if (upb_FieldDef_IsRequired(f)) {
     out |= kUpb_FieldModifier_IsRequired;
   }
+  if (upb_FieldDef_IsLazy(f)) {
+    out |= kUpb_FieldModifier_IsLazy;
+  }
   return out;
 }
 
@@ -29,7 +29,9 @@
 
 #include <inttypes.h>
 #include <setjmp.h>
+#include <string.h>
 
+#include "upb/decode_fast.h"
 #include "upb/msg_internal.h"
 #include "upb/upb.h"
 
@@ -65,6 +67,7 @@ typedef enum {
   // upb only.
   kUpb_EncodedFieldModifier_IsProto3Singular = 1 << 2,
   kUpb_EncodedFieldModifier_IsRequired = 1 << 3,
+  kUpb_EncodedFieldModifier_IsLazy = 1 << 4,
 } upb_EncodedFieldModifier;
 
 enum {
@@ -264,6 +267,9 @@ char* upb_MtDataEncoder_PutField(upb_MtDataEncoder* e, char* ptr,
   if (field_mod & kUpb_FieldModifier_IsRequired) {
     encoded_modifiers |= kUpb_EncodedFieldModifier_IsRequired;
   }
+  if (field_mod & kUpb_FieldModifier_IsLazy) {
+    encoded_modifiers |= kUpb_EncodedFieldModifier_IsLazy;
+  }
   return upb_MtDataEncoder_PutModifier(e, ptr, encoded_modifiers);
 }
 
@@ -575,6 +581,17 @@ static void upb_MtDecoder_ModifyField(upb_MtDecoder* d,
   if (required) {
     field->offset = kRequiredPresence;
   }
+
+  if (field_modifiers & kUpb_EncodedFieldModifier_IsLazy) {
+    // Only singular sub-message fields of messages (not extensions).
+    if (!d->table || field->descriptortype != kUpb_FieldType_Message ||
+        upb_FieldMode_Get(field) != kUpb_FieldMode_Scalar) {
+      upb_MtDecoder_ErrorFormat(
+          d, "Invalid lazy modifier for field %" PRIu32, field->number);
+      UPB_UNREACHABLE();
+    }
+    field->mode |= kUpb_LabelFlags_IsLazy;
+  }
 }
 
 static void upb_MtDecoder_PushItem(upb_MtDecoder* d, upb_LayoutItem item) {
@@ -926,6 +943,32 @@ static void upb_MtDecoder_AssignOffsets(upb_MtDecoder* d) {
   d->table->size = UPB_ALIGN_UP(d->table->size, 8);
 }
 
+// Returns a copy of |t| with a fast table (see upb/decode_fast.h), or |t|
+// itself if none of its fields can be parsed fast.  Returns NULL if out of
+// memory.
+static upb_MiniTable* upb_MiniTable_AddFastTable(upb_MiniTable* t,
+                                                 upb_MiniTablePlatform platform,
+                                                 upb_Arena* arena) {
+#if UPB_FASTTABLE
+  _upb_FastTable_Entry table[UPB_FASTTABLE_MAXSIZE];
+  if (platform != kUpb_MiniTablePlatform_Native) return t;
+  int size = _upb_FastDecoder_BuildTable(t, table);
+  if (size < 2) return t;
+
+  upb_MiniTable* ret =
+      upb_Arena_Malloc(arena, sizeof(*ret) + size * sizeof(table[0]));
+  if (!ret) return NULL;
+  memcpy(ret, t, sizeof(*ret));
+  memcpy(ret->fasttable, table, size * sizeof(table[0]));
+  ret->table_mask = (size - 1) << 3;
+  return ret;
+#else
+  UPB_UNUSED(platform);
+  UPB_UNUSED(arena);
+  return t;
+#endif
+}
+
 upb_MiniTable* upb_MiniTable_BuildWithBuf(const char* data, size_t len,
                                           upb_MiniTablePlatform platform,
                                           upb_Arena* arena, void** buf,
@@ -955,13 +998,15 @@ upb_MiniTable* upb_MiniTable_BuildWithBuf(const char* data, size_t len,
   decoder.table->field_count = 0;
   decoder.table->ext = kUpb_ExtMode_NonExtendable;
   decoder.table->dense_below = 0;
-  decoder.table->table_mask = 0;
+  decoder.table->table_mask = (uint8_t)-1;
   decoder.table->required_count = 0;
 
   upb_MtDecoder_ParseMessage(&decoder, data, len);
   upb_MtDecoder_AssignHasbits(decoder.table);
   upb_MtDecoder_SortLayoutItems(&decoder);
   upb_MtDecoder_AssignOffsets(&decoder);
+  decoder.table = upb_MiniTable_AddFastTable(decoder.table, platform, arena);
+  upb_MtDecoder_CheckOutOfMemory(&decoder, decoder.table);
 
 done:
   *buf = decoder.vec.data;
@@ -978,7 +1023,7 @@ upb_MiniTable* upb_MiniTable_BuildMessageSet(upb_MiniTablePlatform platform,
   ret->field_count = 0;
   ret->ext = kUpb_ExtMode_IsMessageSet;
   ret->dense_below = 0;
-  ret->table_mask = 0;
+  ret->table_mask = (uint8_t)-1;
   ret->required_count = 0;
   return ret;
 }
@@ -1019,11 +1064,11 @@ upb_MiniTable* upb_MiniTable_BuildMapEntry(upb_FieldType key_type,
   ret->field_count = 2;
   ret->ext = kUpb_ExtMode_NonExtendable | kUpb_ExtMode_IsMapEntry;
   ret->dense_below = 2;
-  ret->table_mask = 0;
+  ret->table_mask = (uint8_t)-1;
   ret->required_count = 0;
   ret->subs = subs;
   ret->fields = fields;
-  return ret;
+  return upb_MiniTable_AddFastTable(ret, platform, arena);
 }
 
 static bool upb_MiniTable_BuildEnumValue(upb_MtDecoder* d,
@@ -1129,12 +1174,16 @@ void upb_MiniTable_SetSubMessage(upb_MiniTable* table,
   UPB_ASSERT((uintptr_t)table->fields <= (uintptr_t)field &&
              (uintptr_t)field <
                  (uintptr_t)(table->fields + table->field_count));
+  upb_MiniTable_Sub* table_sub = (void*)&table->subs[field->submsg_index];
+  table_sub->submsg = sub;
   if (sub->ext & kUpb_ExtMode_IsMapEntry) {
     field->mode =
         (kUpb_FieldRep_Pointer << kUpb_FieldRep_Shift) | kUpb_FieldMode_Map;
+#if UPB_FASTTABLE
+    // The fast table entry was built for a repeated message field.
+    _upb_FastDecoder_UpdateField(table, field);
+#endif
   }
-  upb_MiniTable_Sub* table_sub = (void*)&table->subs[field->submsg_index];
-  table_sub->submsg = sub;
 }
 
 void upb_MiniTable_SetSubEnum(upb_MiniTable* table, upb_MiniTable_Field* field,
@@ -74,6 +74,7 @@ typedef enum {
   kUpb_FieldModifier_IsClosedEnum = 1 << 2,
   kUpb_FieldModifier_IsProto3Singular = 1 << 3,
   kUpb_FieldModifier_IsRequired = 1 << 4,
+  kUpb_FieldModifier_IsLazy = 1 << 5,  // Singular message fields only.
 } kUpb_FieldModifier;
 
 typedef struct {
@@ -189,7 +189,7 @@ UPB_INLINE const upb_Message* upb_MiniTable_GetMessage(
     const upb_Message* msg, const upb_MiniTable_Field* field) {
   UPB_ASSERT(field->descriptortype == kUpb_FieldType_Message ||
              field->descriptortype == kUpb_FieldType_Group);
-  return *UPB_PTR_AT(msg, field->offset, const upb_Message*);
+  return _upb_Message_GetSubMessage(msg, field->offset);
 }
 
 UPB_INLINE void upb_MiniTable_SetMessage(upb_Message* msg,
@@ -206,7 +206,7 @@ UPB_INLINE upb_Message* upb_MiniTable_GetMutableMessage(
     const upb_MiniTable_Field* field, upb_Arena* arena) {
   UPB_ASSERT(field->descriptortype == kUpb_FieldType_Message ||
              field->descriptortype == kUpb_FieldType_Group);
-  upb_Message* sub_message = *UPB_PTR_AT(msg, field->offset, upb_Message*);
+  upb_Message* sub_message = _upb_Message_GetSubMessage(msg, field->offset);
   if (!sub_message) {
     sub_message =
         _upb_Message_New(mini_table->subs[field->submsg_index].submsg, arena);
@@ -31,6 +31,9 @@
 #include "gmock/gmock.h"
 #include "google/protobuf/descriptor.h"
 #include "gtest/gtest.h"
+#include "upb/decode.h"
+#include "upb/encode.h"
+#include "upb/mini_table_accessors.h"
 #include "upb/msg_internal.h"
 #include "upb/upb.hpp"
 
@@ -244,3 +247,372 @@ TEST_P(MiniTableTest, Extendible) {
   ASSERT_NE(nullptr, table);
   EXPECT_EQ(kUpb_ExtMode_Extendable, table->ext & kUpb_ExtMode_Extendable);
 }
+
+TEST_P(MiniTableTest, LazyModifier) {
+  upb::Arena arena;
+  upb::MtDataEncoder e;
+  ASSERT_TRUE(e.StartMessage(0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Message, 1, kUpb_FieldModifier_IsLazy));
+  upb::Status status;
+  upb_MiniTable* table = upb_MiniTable_Build(
+      e.data().data(), e.data().size(), GetParam(), arena.ptr(), status.ptr());
+  ASSERT_NE(nullptr, table);
+  EXPECT_TRUE(table->fields[0].mode & kUpb_LabelFlags_IsLazy);
+
+  // Only singular sub-message fields can be lazy.
+  upb::MtDataEncoder e2;
+  ASSERT_TRUE(e2.StartMessage(0));
+  ASSERT_TRUE(e2.PutField(kUpb_FieldType_Int32, 1, kUpb_FieldModifier_IsLazy));
+  table = upb_MiniTable_Build(e2.data().data(), e2.data().size(), GetParam(),
+                              arena.ptr(), status.ptr());
+  EXPECT_EQ(nullptr, table);
+}
+
+static bool IsUnparsed(const upb_Message* msg,
+                       const upb_MiniTable_Field* field) {
+  upb_Message* sub;
+  memcpy(&sub, reinterpret_cast<const char*>(msg) + field->offset,
+         sizeof(sub));
+  return _upb_Message_IsLazy(sub);
+}
+
+TEST(MiniTableLazyTest, DecodeLazy) {
+  upb::Arena arena;
+  upb::Status status;
+  upb::MtDataEncoder e;
+  ASSERT_TRUE(e.StartMessage(0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Message, 1, kUpb_FieldModifier_IsLazy));
+  upb_MiniTable* table =
+      upb_MiniTable_Build(e.data().data(), e.data().size(),
+                          kUpb_MiniTablePlatform_Native, arena.ptr(),
+                          status.ptr());
+  ASSERT_NE(nullptr, table);
+  upb::MtDataEncoder sub_e;
+  ASSERT_TRUE(sub_e.StartMessage(0));
+  ASSERT_TRUE(sub_e.PutField(kUpb_FieldType_Int32, 1, 0));
+  upb_MiniTable* sub =
+      upb_MiniTable_Build(sub_e.data().data(), sub_e.data().size(),
+                          kUpb_MiniTablePlatform_Native, arena.ptr(),
+                          status.ptr());
+  ASSERT_NE(nullptr, sub);
+  upb_MiniTable_Field* field =
+      const_cast<upb_MiniTable_Field*>(&table->fields[0]);
+  upb_MiniTable_SetSubMessage(table, field, sub);
+
+  // The overlong varint for 42 only survives if the bytes are not re-encoded.
+  const std::string payload("\x0a\x03\x08\xaa\x00", 5);
+  upb_Message* msg = _upb_Message_New(table, arena.ptr());
+  ASSERT_EQ(kUpb_DecodeStatus_Ok,
+            upb_Decode(payload.data(), payload.size(), msg, table, NULL,
+                       kUpb_DecodeOption_Lazy, arena.ptr()));
+  EXPECT_TRUE(IsUnparsed(msg, field));
+  char* buf;
+  size_t size;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Encode(msg, table, 0, arena.ptr(), &buf, &size));
+  EXPECT_EQ(payload, std::string(buf, size));
+
+  // Merging into an unparsed field keeps it unparsed.
+  const std::string payload2("\x0a\x02\x08\x07", 4);
+  ASSERT_EQ(kUpb_DecodeStatus_Ok,
+            upb_Decode(payload2.data(), payload2.size(), msg, table, NULL,
+                       kUpb_DecodeOption_Lazy, arena.ptr()));
+  EXPECT_TRUE(IsUnparsed(msg, field));
+
+  // The first read parses the field, after which it encodes normally.
+  const upb_Message* sub_msg = upb_MiniTable_GetMessage(msg, field);
+  ASSERT_NE(nullptr, sub_msg);
+  EXPECT_FALSE(_upb_Message_IsLazy(sub_msg));
+  EXPECT_EQ(sub_msg, upb_MiniTable_GetMessage(msg, field));
+  EXPECT_EQ(7, upb_MiniTable_GetInt32(sub_msg, &sub->fields[0]));
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Encode(msg, table, 0, arena.ptr(), &buf, &size));
+  EXPECT_EQ(std::string("\x0a\x02\x08\x07", 4), std::string(buf, size));
+}
+
+TEST(MiniTableLazyTest, DecodeLazyMalformed) {
+  upb::Arena arena;
+  upb::Status status;
+  upb::MtDataEncoder e;
+  ASSERT_TRUE(e.StartMessage(0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Message, 1, kUpb_FieldModifier_IsLazy));
+  upb_MiniTable* table =
+      upb_MiniTable_Build(e.data().data(), e.data().size(),
+                          kUpb_MiniTablePlatform_Native, arena.ptr(),
+                          status.ptr());
+  ASSERT_NE(nullptr, table);
+  upb_MiniTable_Field* field =
+      const_cast<upb_MiniTable_Field*>(&table->fields[0]);
+  upb_MiniTable_SetSubMessage(table, field, table);
+
+  // The error is only found on first access, which yields an empty message.
+  const std::string payload("\x0a\x04\x0a\x05\x08\x01", 6);
+  upb_Message* msg = _upb_Message_New(table, arena.ptr());
+  ASSERT_EQ(kUpb_DecodeStatus_Ok,
+            upb_Decode(payload.data(), payload.size(), msg, table, NULL,
+                       kUpb_DecodeOption_Lazy, arena.ptr()));
+  const upb_Message* sub_msg = upb_MiniTable_GetMessage(msg, field);
+  ASSERT_NE(nullptr, sub_msg);
+  EXPECT_EQ(nullptr, upb_MiniTable_GetMessage(sub_msg, field));
+}
+
+TEST(MiniTableDiscardUnknownTest, Decode) {
+  upb::Arena arena;
+  upb::Status status;
+  upb::MtDataEncoder enum_e;
+  enum_e.StartEnum();
+  enum_e.PutEnumValue(0);
+  enum_e.PutEnumValue(1);
+  enum_e.EndEnum();
+  upb_MiniTable_Enum* enum_table = upb_MiniTable_BuildEnum(
+      enum_e.data().data(), enum_e.data().size(), arena.ptr(), status.ptr());
+  ASSERT_NE(nullptr, enum_table);
+
+  // message M {
+  //   int32 i = 1;
+  //   E e = 2;
+  //   map<int32, E> m = 3;
+  // }
+  upb::MtDataEncoder e;
+  ASSERT_TRUE(e.StartMessage(0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Int32, 1, 0));
+  ASSERT_TRUE(
+      e.PutField(kUpb_FieldType_Enum, 2, kUpb_FieldModifier_IsClosedEnum));
+  ASSERT_TRUE(
+      e.PutField(kUpb_FieldType_Message, 3, kUpb_FieldModifier_IsRepeated));
+  upb_MiniTable* table =
+      upb_MiniTable_Build(e.data().data(), e.data().size(),
+                          kUpb_MiniTablePlatform_Native, arena.ptr(),
+                          status.ptr());
+  ASSERT_NE(nullptr, table);
+  upb_MiniTable* entry = upb_MiniTable_BuildMapEntry(
+      kUpb_FieldType_Int32, kUpb_FieldType_Enum, false,
+      kUpb_MiniTablePlatform_Native, arena.ptr());
+  ASSERT_NE(nullptr, entry);
+  upb_MiniTable_SetSubEnum(
+      entry, const_cast<upb_MiniTable_Field*>(&entry->fields[1]), enum_table);
+  upb_MiniTable_SetSubEnum(
+      table, const_cast<upb_MiniTable_Field*>(&table->fields[1]), enum_table);
+  upb_MiniTable_SetSubMessage(
+      table, const_cast<upb_MiniTable_Field*>(&table->fields[2]), entry);
+
+  const std::string payload(
+      "\x08\x01"                          // i: 1
+      "\x10\x05"                          // e: unknown enum value
+      "\x10\x01"                          // e: 1
+      "\x1a\x04\x08\x01\x10\x01"          // m: {1: 1}
+      "\x1a\x04\x08\x02\x10\x05"          // m: {2: unknown enum value}
+      "\x1a\x06\x08\x03\x10\x00\x18\x07"  // m: {3: 0}, unknown field 3
+      "\x98\x06\x01",                     // unknown field 99
+      29);
+  upb_Message* msg = _upb_Message_New(table, arena.ptr());
+  ASSERT_EQ(kUpb_DecodeStatus_Ok,
+            upb_Decode(payload.data(), payload.size(), msg, table, NULL,
+                       kUpb_DecodeOption_DiscardUnknown, arena.ptr()));
+  size_t len;
+  upb_Message_GetUnknown(msg, &len);
+  EXPECT_EQ(0, len);
+  EXPECT_EQ(1, upb_MiniTable_GetInt32(msg, &table->fields[0]));
+  EXPECT_EQ(1, upb_MiniTable_GetEnum(msg, &table->fields[1]));
+
+  size_t ofs = table->fields[2].offset;
+  EXPECT_EQ(2, _upb_msg_map_size(msg, ofs));
+  int32_t val;
+  int32_t key = 1;
+  EXPECT_TRUE(_upb_msg_map_get(msg, ofs, &key, 4, &val, 4));
+  EXPECT_EQ(1, val);
+  key = 2;
+  EXPECT_FALSE(_upb_msg_map_get(msg, ofs, &key, 4, &val, 4));
+  key = 3;
+  EXPECT_TRUE(_upb_msg_map_get(msg, ofs, &key, 4, &val, 4));
+  EXPECT_EQ(0, val);
+}
+
+TEST(MiniTableDiscardUnknownTest, Lazy) {
+  upb::Arena arena;
+  upb::Status status;
+  upb::MtDataEncoder e;
+  ASSERT_TRUE(e.StartMessage(0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Message, 1, kUpb_FieldModifier_IsLazy));
+  upb_MiniTable* table =
+      upb_MiniTable_Build(e.data().data(), e.data().size(),
+                          kUpb_MiniTablePlatform_Native, arena.ptr(),
+                          status.ptr());
+  ASSERT_NE(nullptr, table);
+  upb::MtDataEncoder sub_e;
+  ASSERT_TRUE(sub_e.StartMessage(0));
+  ASSERT_TRUE(sub_e.PutField(kUpb_FieldType_Int32, 1, 0));
+  upb_MiniTable* sub =
+      upb_MiniTable_Build(sub_e.data().data(), sub_e.data().size(),
+                          kUpb_MiniTablePlatform_Native, arena.ptr(),
+                          status.ptr());
+  ASSERT_NE(nullptr, sub);
+  upb_MiniTable_Field* field =
+      const_cast<upb_MiniTable_Field*>(&table->fields[0]);
+  upb_MiniTable_SetSubMessage(table, field, sub);
+
+  const std::string payload(
+      "\x0a\x05\x08\x05\x98\x06\x07"  // 1: {1: 5, unknown field 99}
+      "\x10\x01",                    // unknown field 2
+      9);
+  upb_Message* eager = _upb_Message_New(table, arena.ptr());
+  ASSERT_EQ(kUpb_DecodeStatus_Ok,
+            upb_Decode(payload.data(), payload.size(), eager, table, NULL,
+                       kUpb_DecodeOption_DiscardUnknown, arena.ptr()));
+  char* buf;
+  size_t size;
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Encode(eager, table, 0, arena.ptr(), &buf, &size));
+  const std::string expected(buf, size);
+  EXPECT_EQ(std::string("\x0a\x02\x08\x05", 4), expected);
+
+  // An unread lazy field encodes as if it had been parsed eagerly.
+  upb_Message* msg = _upb_Message_New(table, arena.ptr());
+  ASSERT_EQ(kUpb_DecodeStatus_Ok,
+            upb_Decode(payload.data(), payload.size(), msg, table, NULL,
+                       kUpb_DecodeOption_Lazy |
+                           kUpb_DecodeOption_DiscardUnknown,
+                       arena.ptr()));
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Encode(msg, table, 0, arena.ptr(), &buf, &size));
+  EXPECT_EQ(expected, std::string(buf, size));
+
+  // So does one that is parsed by reading it.
+  msg = _upb_Message_New(table, arena.ptr());
+  ASSERT_EQ(kUpb_DecodeStatus_Ok,
+            upb_Decode(payload.data(), payload.size(), msg, table, NULL,
+                       kUpb_DecodeOption_Lazy |
+                           kUpb_DecodeOption_DiscardUnknown,
+                       arena.ptr()));
+  EXPECT_TRUE(IsUnparsed(msg, field));
+  const upb_Message* sub_msg = upb_MiniTable_GetMessage(msg, field);
+  ASSERT_NE(nullptr, sub_msg);
+  upb_Message_GetUnknown(sub_msg, &size);
+  EXPECT_EQ(0, size);
+  EXPECT_EQ(5, upb_MiniTable_GetInt32(sub_msg, &sub->fields[0]));
+  ASSERT_EQ(kUpb_EncodeStatus_Ok,
+            upb_Encode(msg, table, 0, arena.ptr(), &buf, &size));
+  EXPECT_EQ(expected, std::string(buf, size));
+}
+
+TEST(MiniTableFastTableTest, Decode) {
+  upb::Arena arena;
+  upb::Status status;
+  // message M {
+  //   int32 i = 1;
+  //   repeated bytes s = 2;
+  //   repeated fixed32 p = 3 [packed = true];
+  //   repeated fixed32 u = 4 [packed = false];
+  //   oneof o {
+  //     M m = 5;
+  //     int64 n = 6;
+  //   }
+  //   int32 far = 3000;
+  // }
+  upb::MtDataEncoder e;
+  ASSERT_TRUE(e.StartMessage(0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Int32, 1, 0));
+  ASSERT_TRUE(
+      e.PutField(kUpb_FieldType_Bytes, 2, kUpb_FieldModifier_IsRepeated));
+  ASSERT_TRUE(e.PutField(
+      kUpb_FieldType_Fixed32, 3,
+      kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked));
+  ASSERT_TRUE(
+      e.PutField(kUpb_FieldType_Fixed32, 4, kUpb_FieldModifier_IsRepeated));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Message, 5, 0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Int64, 6, 0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Int32, 3000, 0));
+  ASSERT_TRUE(e.StartOneof());
+  ASSERT_TRUE(e.PutOneofField(5));
+  ASSERT_TRUE(e.PutOneofField(6));
+  upb_MiniTable* table =
+      upb_MiniTable_Build(e.data().data(), e.data().size(),
+                          kUpb_MiniTablePlatform_Native, arena.ptr(),
+                          status.ptr());
+  ASSERT_NE(nullptr, table);
+  upb_MiniTable_SetSubMessage(
+      table, const_cast<upb_MiniTable_Field*>(&table->fields[4]), table);
+
+  std::string payload(
+      "\x30\x07"                          // n: 7
+      "\x2a\x02\x08\x05"                  // m: {i: 5}
+      "\x1a\x04\x01\x00\x00\x00"          // p: [1]
+      "\x1a\x04\x02\x00\x00\x00"          // p: [2], appended
+      "\x18\x03"                          // p as a varint: unknown
+      "\x22\x00"                          // u: []
+      "\x25\x03\x00\x00\x00"              // u: 3
+      "\x12\x01\x61",                     // s: "a"
+      30);
+  payload += "\x12\x80\x01" + std::string(128, 'b');  // s: long string
+  payload += "\xc0\xbb\x01\x09";                      // far: 9
+  upb_Message* msg = _upb_Message_New(table, arena.ptr());
+  ASSERT_EQ(kUpb_DecodeStatus_Ok,
+            upb_Decode(payload.data(), payload.size(), msg, table, NULL,
+                       kUpb_DecodeOption_AliasString, arena.ptr()));
+
+  const upb_Message* sub = upb_MiniTable_GetMessage(msg, &table->fields[4]);
+  ASSERT_NE(nullptr, sub);
+  EXPECT_EQ(5, upb_MiniTable_GetInt32(sub, &table->fields[0]));
+  EXPECT_EQ(9, upb_MiniTable_GetInt32(msg, &table->fields[6]));
+
+  const upb_Array* arr = upb_MiniTable_GetArray(msg, &table->fields[2]);
+  ASSERT_NE(nullptr, arr);
+  ASSERT_EQ(2, arr->size);
+  EXPECT_EQ(1, static_cast<const uint32_t*>(_upb_array_constptr(arr))[0]);
+  EXPECT_EQ(2, static_cast<const uint32_t*>(_upb_array_constptr(arr))[1]);
+
+  arr = upb_MiniTable_GetArray(msg, &table->fields[3]);
+  ASSERT_NE(nullptr, arr);
+  ASSERT_EQ(1, arr->size);
+  EXPECT_EQ(3, static_cast<const uint32_t*>(_upb_array_constptr(arr))[0]);
+
+  arr = upb_MiniTable_GetArray(msg, &table->fields[1]);
+  ASSERT_NE(nullptr, arr);
+  ASSERT_EQ(2, arr->size);
+  const upb_StringView* strs =
+      static_cast<const upb_StringView*>(_upb_array_constptr(arr));
+  EXPECT_EQ("a", std::string(strs[0].data, strs[0].size));
+  EXPECT_EQ(std::string(128, 'b'), std::string(strs[1].data, strs[1].size));
+
+  size_t len;
+  const char* unknown = upb_Message_GetUnknown(msg, &len);
+  EXPECT_EQ(std::string("\x18\x03"), std::string(unknown, len));
+}
+
+TEST(MiniTableFastTableTest, Malformed) {
+  upb::Arena arena;
+  upb::Status status;
+  // message M {
+  //   string s = 1;
+  //   repeated fixed32 p = 2 [packed = true];
+  //   M m = 3;
+  // }
+  upb::MtDataEncoder e;
+  ASSERT_TRUE(e.StartMessage(0));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_String, 1, 0));
+  ASSERT_TRUE(e.PutField(
+      kUpb_FieldType_Fixed32, 2,
+      kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked));
+  ASSERT_TRUE(e.PutField(kUpb_FieldType_Message, 3, 0));
+  upb_MiniTable* table =
+      upb_MiniTable_Build(e.data().data(), e.data().size(),
+                          kUpb_MiniTablePlatform_Native, arena.ptr(),
+                          status.ptr());
+  ASSERT_NE(nullptr, table);
+  upb_MiniTable_SetSubMessage(
+      table, const_cast<upb_MiniTable_Field*>(&table->fields[2]), table);
+
+  // Lengths that overflow an int.
+  const std::string too_long("\xff\xff\xff\xff\x7f\x61", 6);
+  // A stray end-group tag in a sub-message that takes the slow path of
+  // fastdecode_delimited(), since it is over 127 bytes long.
+  const std::string stray_end_group =
+      "\x1a\x82\x01\x24\x0a\x7f" + std::string(127, 'x');
+  for (const std::string& payload :
+       {"\x0a" + too_long, "\x12" + too_long, stray_end_group}) {
+    upb_Message* msg = _upb_Message_New(table, arena.ptr());
+    EXPECT_EQ(kUpb_DecodeStatus_Malformed,
+              upb_Decode(payload.data(), payload.size(), msg, table, NULL, 0,
+                         arena.ptr()));
+  }
+}
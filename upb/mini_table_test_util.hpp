@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* A base fixture for tests that build MiniTables at runtime and parse and
+ * re-encode hand-assembled payloads with them. */
+
+#ifndef UPB_MINI_TABLE_TEST_UTIL_HPP_
+#define UPB_MINI_TABLE_TEST_UTIL_HPP_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "upb/decode.h"
+#include "upb/encode.h"
+#include "upb/mini_table.hpp"
+#include "upb/msg_internal.h"
+#include "upb/upb.hpp"
+
+namespace upb {
+namespace test {
+
+// Subclasses describe their schema in a comment and build it into table_ in
+// SetUp().  Everything is allocated from arena_.
+class MiniTableTest : public testing::Test {
+ protected:
+  upb_MiniTable* Build(const upb::MtDataEncoder& e) {
+    upb::Status status;
+    upb_MiniTable* table = upb_MiniTable_Build(
+        e.data().data(), e.data().size(), kUpb_MiniTablePlatform_Native,
+        arena_.ptr(), status.ptr());
+    EXPECT_NE(nullptr, table) << status.error_message();
+    return table;
+  }
+
+  // Sets the sub-message table of field |number| in |table|.
+  static void Link(upb_MiniTable* table, uint32_t number,
+                   const upb_MiniTable* sub) {
+    upb_MiniTable_SetSubMessage(table,
+                                const_cast<upb_MiniTable_Field*>(
+                                    upb_MiniTable_FindFieldByNumber(table,
+                                                                    number)),
+                                sub);
+  }
+
+  upb_Message* Parse(const upb_MiniTable* table, const std::string& payload,
+                     int options = 0) {
+    upb_Message* msg = _upb_Message_New(table, arena_.ptr());
+    EXPECT_EQ(kUpb_DecodeStatus_Ok,
+              upb_Decode(payload.data(), payload.size(), msg, table, nullptr,
+                         options, arena_.ptr()));
+    return msg;
+  }
+
+  std::string Encode(const upb_Message* msg, const upb_MiniTable* table,
+                     int options = 0) {
+    char* buf;
+    size_t size;
+    EXPECT_EQ(kUpb_EncodeStatus_Ok,
+              upb_Encode(msg, table, options, arena_.ptr(), &buf, &size));
+    return std::string(buf, size);
+  }
+
+  upb::Arena arena_;
+  upb_MiniTable* table_ = nullptr;
+};
+
+}  // namespace test
+}  // namespace upb
+
+#endif /* UPB_MINI_TABLE_TEST_UTIL_HPP_ */
@@ -247,58 +247,195 @@ upb_Map* _upb_Map_New(upb_Arena* a, size_t key_size, size_t value_size) {
   return map;
 }
 
-static void _upb_mapsorter_getkeys(const void* _a, const void* _b, void* a_key,
-                                   void* b_key, size_t size) {
-  const upb_tabent* const* a = _a;
-  const upb_tabent* const* b = _b;
-  upb_StringView a_tabkey = upb_tabstrview((*a)->key);
-  upb_StringView b_tabkey = upb_tabstrview((*b)->key);
-  _upb_map_fromkey(a_tabkey, a_key, size);
-  _upb_map_fromkey(b_tabkey, b_key, size);
+/* Integer keys are mapped to unsigned values with the same order, so that
+ * every integer type can share one radix sort. */
+typedef struct {
+  uint64_t key;
+  const upb_tabent* ent;
+} _upb_sortint;
+
+typedef struct {
+  upb_StringView key;
+  const upb_tabent* ent;
+} _upb_sortstr;
+
+/* Small maps are not worth the histogram passes of the radix sort. */
+#define UPB_MAPSORTER_SMALL 16
+
+static void _upb_mapsorter_insertint(_upb_sortint* a, size_t n) {
+  for (size_t i = 1; i < n; i++) {
+    _upb_sortint x = a[i];
+    size_t j = i;
+    for (; j > 0 && a[j - 1].key > x.key; j--) a[j] = a[j - 1];
+    a[j] = x;
+  }
 }
 
-#define UPB_COMPARE_INTEGERS(a, b) ((a) < (b) ? -1 : ((a) == (b) ? 0 : 1))
+/* LSD radix sort over the low |bytes| bytes of the keys.  Returns whichever of
+ * |a| and |tmp| holds the result. */
+static _upb_sortint* _upb_mapsorter_radix(_upb_sortint* a, _upb_sortint* tmp,
+                                          size_t n, int bytes) {
+  uint32_t counts[8][256];
+  memset(counts, 0, bytes * sizeof(counts[0]));
+
+  for (size_t i = 0; i < n; i++) {
+    uint64_t key = a[i].key;
+    for (int b = 0; b < bytes; b++) {
+      counts[b][(key >> (b * 8)) & 0xff]++;
+    }
+  }
+
+  for (int b = 0; b < bytes; b++) {
+    uint32_t* count = counts[b];
+    int shift = b * 8;
+
+    /* Every key has the same byte here, so this pass would not move anything.
+     * This is the common case for the high bytes of small keys. */
+    if (count[(a[0].key >> shift) & 0xff] == n) continue;
+
+    uint32_t pos = 0;
+    for (int d = 0; d < 256; d++) {
+      uint32_t c = count[d];
+      count[d] = pos;
+      pos += c;
+    }
+    for (size_t i = 0; i < n; i++) {
+      tmp[count[(a[i].key >> shift) & 0xff]++] = a[i];
+    }
+    _upb_sortint* t = a;
+    a = tmp;
+    tmp = t;
+  }
 
-static int _upb_mapsorter_cmpi64(const void* _a, const void* _b) {
-  int64_t a, b;
-  _upb_mapsorter_getkeys(_a, _b, &a, &b, 8);
-  return UPB_COMPARE_INTEGERS(a, b);
+  return a;
 }
 
-static int _upb_mapsorter_cmpu64(const void* _a, const void* _b) {
-  uint64_t a, b;
-  _upb_mapsorter_getkeys(_a, _b, &a, &b, 8);
-  return UPB_COMPARE_INTEGERS(a, b);
+/* Orders strings the way the comparator this replaced did: by descending
+ * content, with a prefix before the longer strings it prefixes. */
+UPB_INLINE bool _upb_mapsorter_strless(upb_StringView a, upb_StringView b) {
+  int cmp = memcmp(a.data, b.data, UPB_MIN(a.size, b.size));
+  if (cmp) return cmp > 0;
+  return a.size < b.size;
 }
 
-static int _upb_mapsorter_cmpi32(const void* _a, const void* _b) {
-  int32_t a, b;
-  _upb_mapsorter_getkeys(_a, _b, &a, &b, 4);
-  return UPB_COMPARE_INTEGERS(a, b);
+static void _upb_mapsorter_insertstr(_upb_sortstr* a, size_t n) {
+  for (size_t i = 1; i < n; i++) {
+    _upb_sortstr x = a[i];
+    size_t j = i;
+    for (; j > 0 && _upb_mapsorter_strless(x.key, a[j - 1].key); j--) {
+      a[j] = a[j - 1];
+    }
+    a[j] = x;
+  }
 }
 
-static int _upb_mapsorter_cmpu32(const void* _a, const void* _b) {
-  uint32_t a, b;
-  _upb_mapsorter_getkeys(_a, _b, &a, &b, 4);
-  return UPB_COMPARE_INTEGERS(a, b);
+/* Bottom-up merge sort on runs sorted by insertion sort.  Returns whichever of
+ * |a| and |tmp| holds the result. */
+static _upb_sortstr* _upb_mapsorter_merge(_upb_sortstr* a, _upb_sortstr* tmp,
+                                          size_t n) {
+  for (size_t i = 0; i < n; i += UPB_MAPSORTER_SMALL) {
+    _upb_mapsorter_insertstr(&a[i], UPB_MIN(UPB_MAPSORTER_SMALL, n - i));
+  }
+
+  for (size_t width = UPB_MAPSORTER_SMALL; width < n; width *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * width) {
+      size_t mid = UPB_MIN(lo + width, n);
+      size_t hi = UPB_MIN(lo + 2 * width, n);
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) {
+        bool right = _upb_mapsorter_strless(a[j].key, a[i].key);
+        tmp[k++] = right ? a[j++] : a[i++];
+      }
+      while (i < mid) tmp[k++] = a[i++];
+      while (j < hi) tmp[k++] = a[j++];
+    }
+    _upb_sortstr* t = a;
+    a = tmp;
+    tmp = t;
+  }
+
+  return a;
 }
 
-static int _upb_mapsorter_cmpbool(const void* _a, const void* _b) {
-  bool a, b;
-  _upb_mapsorter_getkeys(_a, _b, &a, &b, 1);
-  return UPB_COMPARE_INTEGERS(a, b);
+static void _upb_mapsorter_sortint(upb_tabent const** entries, void* scratch,
+                                   size_t n, upb_FieldType key_type) {
+  _upb_sortint* keys = scratch;
+  uint64_t flip = 0;
+  int bytes;
+
+  switch (key_type) {
+    case kUpb_FieldType_Int64:
+    case kUpb_FieldType_SFixed64:
+    case kUpb_FieldType_SInt64:
+      flip = 1ULL << 63;
+      /* fallthrough */
+    case kUpb_FieldType_UInt64:
+    case kUpb_FieldType_Fixed64:
+      bytes = 8;
+      break;
+    case kUpb_FieldType_Int32:
+    case kUpb_FieldType_SInt32:
+    case kUpb_FieldType_SFixed32:
+    case kUpb_FieldType_Enum:
+      flip = 1U << 31;
+      /* fallthrough */
+    case kUpb_FieldType_UInt32:
+    case kUpb_FieldType_Fixed32:
+      bytes = 4;
+      break;
+    case kUpb_FieldType_Bool:
+      bytes = 1;
+      break;
+    default:
+      UPB_UNREACHABLE();
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    upb_StringView k = upb_tabstrview(entries[i]->key);
+    uint64_t key;
+    if (bytes == 8) {
+      memcpy(&key, k.data, 8);
+    } else if (bytes == 4) {
+      uint32_t key32;
+      memcpy(&key32, k.data, 4);
+      key = key32;
+    } else {
+      bool b;
+      memcpy(&b, k.data, 1);
+      key = b;
+    }
+    keys[i].key = key ^ flip;
+    keys[i].ent = entries[i];
+  }
+
+  if (n <= UPB_MAPSORTER_SMALL) {
+    _upb_mapsorter_insertint(keys, n);
+  } else {
+    keys = _upb_mapsorter_radix(keys, keys + n, n, bytes);
+  }
+
+  for (size_t i = 0; i < n; i++) entries[i] = keys[i].ent;
 }
 
-static int _upb_mapsorter_cmpstr(const void* _a, const void* _b) {
-  upb_StringView a, b;
-  _upb_mapsorter_getkeys(_a, _b, &a, &b, UPB_MAPTYPE_STRING);
-  size_t common_size = UPB_MIN(a.size, b.size);
-  int cmp = memcmp(a.data, b.data, common_size);
-  if (cmp) return -cmp;
-  return UPB_COMPARE_INTEGERS(a.size, b.size);
+static void _upb_mapsorter_sortstr(upb_tabent const** entries, void* scratch,
+                                   size_t n) {
+  _upb_sortstr* keys = scratch;
+
+  for (size_t i = 0; i < n; i++) {
+    keys[i].key = upb_tabstrview(entries[i]->key);
+    keys[i].ent = entries[i];
+  }
+
+  keys = _upb_mapsorter_merge(keys, keys + n, n);
+
+  for (size_t i = 0; i < n; i++) entries[i] = keys[i].ent;
 }
 
-#undef UPB_COMPARE_INTEGERS
+static void* _upb_mapsorter_realloc(_upb_mapsorter* s, void* ptr,
+                                    size_t oldsize, size_t size) {
+  if (s->arena) return upb_Arena_Realloc(s->arena, ptr, oldsize, size);
+  return realloc(ptr, size);
+}
 
 bool _upb_mapsorter_pushmap(_upb_mapsorter* s, upb_FieldType key_type,
                             const upb_Map* map, _upb_sortedmap* sorted) {
@@ -307,11 +444,16 @@ bool _upb_mapsorter_pushmap(_upb_mapsorter* s, upb_FieldType key_type,
   sorted->pos = sorted->start;
   sorted->end = sorted->start + map_size;
 
+  if (map_size == 0) return true;
+
   /* Grow s->entries if necessary. */
   if (sorted->end > s->cap) {
-    s->cap = _upb_Log2CeilingSize(sorted->end);
-    s->entries = realloc(s->entries, s->cap * sizeof(*s->entries));
-    if (!s->entries) return false;
+    int cap = _upb_Log2CeilingSize(sorted->end);
+    void* entries = _upb_mapsorter_realloc(
+        s, s->entries, s->cap * sizeof(*s->entries), cap * sizeof(*s->entries));
+    if (!entries) return false;
+    s->entries = entries;
+    s->cap = cap;
   }
 
   s->size = sorted->end;
@@ -328,41 +470,32 @@ bool _upb_mapsorter_pushmap(_upb_mapsorter* s, upb_FieldType key_type,
   }
   UPB_ASSERT(dst == &s->entries[sorted->end]);
 
-  /* Sort entries according to the key type. */
-
-  int (*compar)(const void*, const void*);
-
-  switch (key_type) {
-    case kUpb_FieldType_Int64:
-    case kUpb_FieldType_SFixed64:
-    case kUpb_FieldType_SInt64:
-      compar = _upb_mapsorter_cmpi64;
-      break;
-    case kUpb_FieldType_UInt64:
-    case kUpb_FieldType_Fixed64:
-      compar = _upb_mapsorter_cmpu64;
-      break;
-    case kUpb_FieldType_Int32:
-    case kUpb_FieldType_SInt32:
-    case kUpb_FieldType_SFixed32:
-    case kUpb_FieldType_Enum:
-      compar = _upb_mapsorter_cmpi32;
-      break;
-    case kUpb_FieldType_UInt32:
-    case kUpb_FieldType_Fixed32:
-      compar = _upb_mapsorter_cmpu32;
-      break;
-    case kUpb_FieldType_Bool:
-      compar = _upb_mapsorter_cmpbool;
-      break;
-    case kUpb_FieldType_String:
-    case kUpb_FieldType_Bytes:
-      compar = _upb_mapsorter_cmpstr;
-      break;
-    default:
-      UPB_UNREACHABLE();
+  if (map_size == 1) return true;
+
+  /* Room for the keys and the buffer the sort moves them through.  Nothing in
+   * it outlives this call, so the old contents need not be kept. */
+  size_t scratch_size = 2 * map_size * UPB_MAX(sizeof(_upb_sortint),
+                                               sizeof(_upb_sortstr));
+  if (scratch_size > s->scratch_size) {
+    void* scratch;
+    if (s->arena) {
+      scratch = upb_Arena_Malloc(s->arena, scratch_size);
+    } else {
+      free(s->scratch);
+      s->scratch_size = 0;
+      scratch = malloc(scratch_size);
+    }
+    if (!scratch) return false;
+    s->scratch = scratch;
+    s->scratch_size = scratch_size;
   }
 
-  qsort(&s->entries[sorted->start], map_size, sizeof(*s->entries), compar);
+  /* Sort entries according to the key type. */
+  upb_tabent const** entries = &s->entries[sorted->start];
+  if (key_type == kUpb_FieldType_String || key_type == kUpb_FieldType_Bytes) {
+    _upb_mapsorter_sortstr(entries, s->scratch, map_size);
+  } else {
+    _upb_mapsorter_sortint(entries, s->scratch, map_size, key_type);
+  }
   return true;
 }
@@ -93,6 +93,7 @@ typedef enum {
 typedef enum {
   kUpb_LabelFlags_IsPacked = 4,
   kUpb_LabelFlags_IsExtension = 8,
+  kUpb_LabelFlags_IsLazy = 16,  // See kUpb_DecodeOption_Lazy.
 } upb_LabelFlags;
 
 // Note: we sort by this number when calculating layout order.
@@ -286,6 +287,47 @@ UPB_INLINE upb_Message* _upb_Message_New_inl(const upb_MiniTable* l,
 /* Creates a new messages with the given layout on the given arena. */
 upb_Message* _upb_Message_New(const upb_MiniTable* l, upb_Arena* a);
 
+/** Lazy sub-messages *********************************************************/
+
+/* Until it is first read, a lazy sub-message field decoded with
+ * kUpb_DecodeOption_Lazy holds a pointer to one of these with the low bit set,
+ * in place of the upb_Message*. */
+typedef struct {
+  upb_StringView data; /* Serialized sub-message, without tag or length. */
+  const upb_MiniTable* table;
+  const upb_ExtensionRegistry* extreg;
+  upb_Arena* arena; /* Arena the sub-message will be parsed into. */
+  int options;      /* upb_Decode() options, including the remaining depth. */
+} _upb_LazyMessage;
+
+UPB_INLINE bool _upb_Message_IsLazy(const upb_Message* msg) {
+  return (uintptr_t)msg & 1;
+}
+
+UPB_INLINE _upb_LazyMessage* _upb_Message_GetLazy(const upb_Message* msg) {
+  UPB_ASSERT(_upb_Message_IsLazy(msg));
+  return (_upb_LazyMessage*)((uintptr_t)msg - 1);
+}
+
+UPB_INLINE upb_Message* _upb_Message_TagLazy(_upb_LazyMessage* lazy) {
+  return (upb_Message*)((uintptr_t)lazy | 1);
+}
+
+/* Parses the lazy sub-message stored in |*field| and replaces it with the
+ * result.  Returns NULL only if the arena is out of memory. */
+upb_Message* _upb_Message_ResolveLazy(upb_Message** field);
+
+/* Reads the sub-message field at |ofs|, parsing it first if it is lazy. */
+UPB_INLINE upb_Message* _upb_Message_GetSubMessage(const upb_Message* msg,
+                                                   size_t ofs) {
+  upb_Message** field = UPB_PTR_AT(msg, ofs, upb_Message*);
+  upb_Message* sub = *field;
+  if (UPB_UNLIKELY(_upb_Message_IsLazy(sub))) {
+    sub = _upb_Message_ResolveLazy(field);
+  }
+  return sub;
+}
+
 UPB_INLINE upb_Message_Internal* upb_Message_Getinternal(upb_Message* msg) {
   ptrdiff_t size = sizeof(upb_Message_Internal);
   return (upb_Message_Internal*)((char*)msg - size);
@@ -784,12 +826,19 @@ UPB_INLINE void _upb_msg_map_set_value(void* msg, const void* val,
 
 /* _upb_mapsorter sorts maps and provides ordered iteration over the entries.
  * Since maps can be recursive (map values can be messages which contain other
- * maps). _upb_mapsorter can contain a stack of maps. */
+ * maps). _upb_mapsorter can contain a stack of maps.
+ *
+ * If the sorter is given an arena, its buffers come from the arena and are
+ * never freed, so a sorter can be reused for any number of maps and encodes
+ * while the arena is alive.  Otherwise they are malloc()'d. */
 
 typedef struct {
   upb_tabent const** entries;
   int size;
   int cap;
+  void* scratch; /* Sort keys, only needed while a map is being sorted. */
+  size_t scratch_size;
+  upb_Arena* arena;
 } _upb_mapsorter;
 
 typedef struct {
@@ -798,14 +847,19 @@ typedef struct {
   int end;
 } _upb_sortedmap;
 
-UPB_INLINE void _upb_mapsorter_init(_upb_mapsorter* s) {
+UPB_INLINE void _upb_mapsorter_init(_upb_mapsorter* s, upb_Arena* arena) {
   s->entries = NULL;
   s->size = 0;
   s->cap = 0;
+  s->scratch = NULL;
+  s->scratch_size = 0;
+  s->arena = arena;
 }
 
 UPB_INLINE void _upb_mapsorter_destroy(_upb_mapsorter* s) {
+  if (s->arena) return;
   if (s->entries) free(s->entries);
+  if (s->scratch) free(s->scratch);
 }
 
 bool _upb_mapsorter_pushmap(_upb_mapsorter* s, upb_FieldType key_type,
@@ -220,6 +220,16 @@ TEST(MessageTest, UnknownMessageSet) {
   EXPECT_FALSE(upb_test_FakeMessageSet_Item_has_unknown_fixed64(items[0]));
   EXPECT_FALSE(upb_test_FakeMessageSet_Item_has_unknown_bytes(items[0]));
   EXPECT_FALSE(upb_test_FakeMessageSet_Item_has_unknowngroup(items[0]));
+
+  // With kUpb_DecodeOption_DiscardUnknown the unknown item is dropped.
+  serialized = upb_test_FakeMessageSet_serialize(fake, arena.ptr(), &size);
+  ASSERT_TRUE(serialized != nullptr);
+  message_set = upb_test_TestMessageSet_parse_ex(
+      serialized, size, upb_DefPool_ExtensionRegistry(defpool.ptr()),
+      kUpb_DecodeOption_DiscardUnknown, arena.ptr());
+  ASSERT_TRUE(message_set != nullptr);
+  upb_Message_GetUnknown(message_set, &size);
+  EXPECT_EQ(0, size);
 }
 
 TEST(MessageTest, Proto2Enum) {
@@ -0,0 +1,350 @@
+// Copyright (c) 2009-2021, Google LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Google LLC nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "upb/internal/packed_varint.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "upb/decode.h"
+#include "upb/encode.h"
+#include "upb/mini_table.hpp"
+#include "upb/msg_internal.h"
+#include "upb/upb.hpp"
+#include "upb/wire_test_util.hpp"
+
+namespace {
+
+using upb::test::Delimited;
+using upb::test::Varint;
+
+uint64_t ZigZag(uint64_t n, int lg2) {
+  if (lg2 == 2) {
+    uint32_t n32 = static_cast<uint32_t>(n);
+    return (n32 >> 1) ^ -(int32_t)(n32 & 1);
+  }
+  return (n >> 1) ^ -(int64_t)(n & 1);
+}
+
+// Returns a value whose varint encoding is |len| bytes long.
+uint64_t RandomValue(std::mt19937_64* rng, int len) {
+  if (len == 10) return (*rng)() | (1ULL << 63);
+  uint64_t min = len == 1 ? 0 : 1ULL << (7 * (len - 1));
+  uint64_t span = (1ULL << (7 * len)) - min;
+  return min + (*rng)() % span;
+}
+
+// Values with a mix of encoded lengths, biased towards short varints.
+std::vector<uint64_t> RandomValues(std::mt19937_64* rng, size_t n) {
+  std::vector<uint64_t> ret;
+  for (size_t i = 0; i < n; i++) {
+    int len = (*rng)() % 3 == 0 ? 1 + (*rng)() % 10 : 1 + (*rng)() % 2;
+    ret.push_back(RandomValue(rng, len));
+  }
+  return ret;
+}
+
+std::vector<uint64_t> Expected(const std::vector<uint64_t>& vals, int lg2,
+                               bool zigzag) {
+  std::vector<uint64_t> ret;
+  for (uint64_t v : vals) {
+    if (zigzag) v = ZigZag(v, lg2);
+    if (lg2 == 2) v = static_cast<uint32_t>(v);
+    ret.push_back(v);
+  }
+  return ret;
+}
+
+std::vector<uint64_t> Decode(const std::string& data, size_t max, int lg2,
+                             bool zigzag, size_t* consumed) {
+  // The kernel may read up to 16 bytes past the end.
+  std::string buf = data + std::string(16, '\0');
+  std::vector<char> out(max << lg2);
+  size_t count;
+  const char* end = _upb_DecodePackedVarints(
+      buf.data(), buf.data() + data.size(), out.data(), max, lg2, zigzag,
+      &count);
+  EXPECT_NE(nullptr, end);
+  if (!end) return {};
+  EXPECT_LE(count, max);
+  *consumed = end - buf.data();
+  std::vector<uint64_t> ret;
+  for (size_t i = 0; i < count; i++) {
+    if (lg2 == 2) {
+      uint32_t v;
+      memcpy(&v, &out[i * 4], 4);
+      ret.push_back(v);
+    } else {
+      uint64_t v;
+      memcpy(&v, &out[i * 8], 8);
+      ret.push_back(v);
+    }
+  }
+  return ret;
+}
+
+// The value _upb_EncodePackedVarints() should encode for element |v|.
+uint64_t Widen(uint64_t v, int lg2, upb_PackedVarint_Mode mode) {
+  if (lg2 == 2) {
+    uint32_t v32 = static_cast<uint32_t>(v);
+    int32_t s32 = static_cast<int32_t>(v32);
+    if (mode == kUpb_PackedVarint_ZigZag) {
+      return (v32 << 1) ^ static_cast<uint32_t>(s32 >> 31);
+    }
+    if (mode == kUpb_PackedVarint_SignExtend) {
+      return static_cast<uint64_t>(static_cast<int64_t>(s32));
+    }
+    return v32;
+  }
+  if (mode == kUpb_PackedVarint_ZigZag) {
+    return (v << 1) ^ static_cast<uint64_t>(static_cast<int64_t>(v) >> 63);
+  }
+  return v;
+}
+
+std::string Encode(const std::vector<uint64_t>& vals, int lg2,
+                   upb_PackedVarint_Mode mode) {
+  std::vector<char> in(vals.size() << lg2);
+  for (size_t i = 0; i < vals.size(); i++) {
+    memcpy(&in[i << lg2], &vals[i], 1 << lg2);
+  }
+  size_t size = _upb_PackedVarintsSize(in.data(), vals.size(), lg2, mode);
+  // Nothing may be written past the end.
+  std::string out(size + 16, 'x');
+  _upb_EncodePackedVarints(in.data(), vals.size(), lg2, mode, &out[0], size);
+  EXPECT_EQ(std::string(16, 'x'), out.substr(size));
+  return out.substr(0, size);
+}
+
+TEST(PackedVarintTest, MatchesScalar) {
+  std::mt19937_64 rng(0);
+  for (int lg2 = 2; lg2 <= 3; lg2++) {
+    for (bool zigzag : {false, true}) {
+      for (size_t n : {0, 1, 5, 16, 31, 32, 33, 100, 1000}) {
+        std::vector<uint64_t> vals = RandomValues(&rng, n);
+        std::string data;
+        for (uint64_t v : vals) data += Varint(v);
+        size_t consumed;
+        EXPECT_EQ(Expected(vals, lg2, zigzag),
+                  Decode(data, n + 8, lg2, zigzag, &consumed));
+        EXPECT_EQ(data.size(), consumed);
+      }
+    }
+  }
+}
+
+TEST(PackedVarintTest, AllLengths) {
+  std::mt19937_64 rng(1);
+  for (int len = 1; len <= 10; len++) {
+    std::vector<uint64_t> vals;
+    for (int i = 0; i < 64; i++) vals.push_back(RandomValue(&rng, len));
+    std::string data;
+    for (uint64_t v : vals) data += Varint(v);
+    for (int lg2 = 2; lg2 <= 3; lg2++) {
+      size_t consumed;
+      EXPECT_EQ(Expected(vals, lg2, false),
+                Decode(data, vals.size(), lg2, false, &consumed));
+      EXPECT_EQ(data.size(), consumed);
+    }
+  }
+}
+
+TEST(PackedVarintTest, StopsAtMax) {
+  std::mt19937_64 rng(2);
+  std::vector<uint64_t> vals = RandomValues(&rng, 200);
+  std::string data;
+  for (uint64_t v : vals) data += Varint(v);
+  for (size_t max : {1, 3, 17, 64, 150}) {
+    size_t consumed;
+    std::vector<uint64_t> got = Decode(data, max, 3, false, &consumed);
+    std::vector<uint64_t> want(vals.begin(), vals.begin() + max);
+    EXPECT_EQ(want, got);
+    std::string prefix;
+    for (uint64_t v : want) prefix += Varint(v);
+    EXPECT_EQ(prefix.size(), consumed);
+  }
+}
+
+TEST(PackedVarintTest, Malformed) {
+  // An 11-byte varint, after enough valid ones to reach the vector path.
+  for (int lg2 = 2; lg2 <= 3; lg2++) {
+    std::string data(40, '\x01');
+    data += std::string(10, '\x80') + '\x01';
+    data += std::string(40, '\x01');
+    std::string buf = data + std::string(16, '\0');
+    std::vector<char> out(data.size() << lg2);
+    size_t count;
+    EXPECT_EQ(nullptr, _upb_DecodePackedVarints(
+                           buf.data(), buf.data() + data.size(), out.data(),
+                           data.size(), lg2, false, &count));
+  }
+}
+
+TEST(PackedVarintTest, Count) {
+  std::mt19937_64 rng(4);
+  std::vector<uint64_t> vals = RandomValues(&rng, 300);
+  std::string data;
+  std::vector<size_t> ends;
+  for (uint64_t v : vals) {
+    data += Varint(v);
+    ends.push_back(data.size());
+  }
+  for (size_t size = 0; size <= data.size(); size++) {
+    size_t want = 0;
+    while (want < ends.size() && ends[want] <= size) want++;
+    EXPECT_EQ(want, _upb_CountPackedVarints(data.data(), size)) << size;
+  }
+}
+
+// The same kernels through upb_Decode(), for each integer width.
+TEST(PackedVarintTest, Decode) {
+  static const upb_FieldType kTypes[] = {
+      kUpb_FieldType_Int32,  kUpb_FieldType_UInt32, kUpb_FieldType_SInt32,
+      kUpb_FieldType_Int64,  kUpb_FieldType_UInt64, kUpb_FieldType_SInt64,
+  };
+  std::mt19937_64 rng(3);
+  for (upb_FieldType type : kTypes) {
+    upb::Arena arena;
+    upb::MtDataEncoder e;
+    e.StartMessage(0);
+    e.PutField(type, 1,
+               kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked);
+    upb_Status status;
+    upb_MiniTable* table = upb_MiniTable_Build(
+        e.data().data(), e.data().size(), kUpb_MiniTablePlatform_Native,
+        arena.ptr(), &status);
+    ASSERT_NE(nullptr, table);
+    int lg2 = type == kUpb_FieldType_Int64 || type == kUpb_FieldType_UInt64 ||
+                      type == kUpb_FieldType_SInt64
+                  ? 3
+                  : 2;
+    bool zigzag =
+        type == kUpb_FieldType_SInt32 || type == kUpb_FieldType_SInt64;
+
+    // Two occurrences of the field, which should be concatenated.
+    std::vector<uint64_t> vals = RandomValues(&rng, 500);
+    std::string payload;
+    for (size_t start : {0, 300}) {
+      std::string packed;
+      for (size_t i = start; i < (start ? vals.size() : 300); i++) {
+        packed += Varint(vals[i]);
+      }
+      payload += Delimited(1, packed);
+    }
+    upb_Message* msg = _upb_Message_New(table, arena.ptr());
+    ASSERT_EQ(kUpb_DecodeStatus_Ok,
+              upb_Decode(payload.data(), payload.size(), msg, table, nullptr,
+                         0, arena.ptr()));
+    const upb_MiniTable_Field* f = upb_MiniTable_FindFieldByNumber(table, 1);
+    const upb_Array* arr;
+    memcpy(&arr, reinterpret_cast<char*>(msg) + f->offset, sizeof(arr));
+    ASSERT_NE(nullptr, arr);
+    ASSERT_EQ(vals.size(), arr->size);
+    std::vector<uint64_t> got;
+    for (size_t i = 0; i < arr->size; i++) {
+      const char* p =
+          static_cast<const char*>(_upb_array_constptr(arr)) + (i << lg2);
+      uint64_t v = 0;
+      memcpy(&v, p, 1 << lg2);
+      got.push_back(v);
+    }
+    EXPECT_EQ(Expected(vals, lg2, zigzag), got) << "type " << type;
+  }
+}
+
+TEST(PackedVarintTest, Encode) {
+  std::mt19937_64 rng(5);
+  for (int lg2 = 2; lg2 <= 3; lg2++) {
+    for (upb_PackedVarint_Mode mode :
+         {kUpb_PackedVarint_ZeroExtend, kUpb_PackedVarint_SignExtend,
+          kUpb_PackedVarint_ZigZag}) {
+      for (size_t n : {0, 1, 5, 31, 32, 33, 64, 100, 1000}) {
+        // Mixed lengths, then only values that take one byte.
+        for (uint64_t small : {0, 64}) {
+          std::vector<uint64_t> vals = RandomValues(&rng, n);
+          if (small) {
+            for (uint64_t& v : vals) v %= small;
+          }
+          std::string want;
+          for (uint64_t v : vals) want += Varint(Widen(v, lg2, mode));
+          EXPECT_EQ(want, Encode(vals, lg2, mode))
+              << "lg2 " << lg2 << " mode " << mode << " n " << n;
+        }
+      }
+    }
+  }
+}
+
+// The encoding kernels through upb_Encode(), for each integer width.
+TEST(PackedVarintTest, RoundTrip) {
+  static const upb_FieldType kTypes[] = {
+      kUpb_FieldType_Int32,  kUpb_FieldType_UInt32, kUpb_FieldType_SInt32,
+      kUpb_FieldType_Int64,  kUpb_FieldType_UInt64, kUpb_FieldType_SInt64,
+  };
+  std::mt19937_64 rng(6);
+  for (upb_FieldType type : kTypes) {
+    upb::Arena arena;
+    upb::MtDataEncoder e;
+    e.StartMessage(0);
+    e.PutField(type, 1,
+               kUpb_FieldModifier_IsRepeated | kUpb_FieldModifier_IsPacked);
+    upb_Status status;
+    upb_MiniTable* table = upb_MiniTable_Build(
+        e.data().data(), e.data().size(), kUpb_MiniTablePlatform_Native,
+        arena.ptr(), &status);
+    ASSERT_NE(nullptr, table);
+
+    // Values that are already canonical for the type, so the encoding has to
+    // reproduce the payload exactly.
+    std::vector<uint64_t> vals = RandomValues(&rng, 500);
+    std::string packed;
+    for (uint64_t& v : vals) {
+      if (type == kUpb_FieldType_Int32) {
+        v = static_cast<uint64_t>(static_cast<int32_t>(v));
+      } else if (type == kUpb_FieldType_UInt32 ||
+                 type == kUpb_FieldType_SInt32) {
+        v = static_cast<uint32_t>(v);
+      }
+      packed += Varint(v);
+    }
+    std::string payload = Delimited(1, packed);
+    upb_Message* msg = _upb_Message_New(table, arena.ptr());
+    ASSERT_EQ(kUpb_DecodeStatus_Ok,
+              upb_Decode(payload.data(), payload.size(), msg, table, nullptr,
+                         0, arena.ptr()));
+    char* buf;
+    size_t size;
+    ASSERT_EQ(kUpb_EncodeStatus_Ok,
+              upb_Encode(msg, table, 0, arena.ptr(), &buf, &size));
+    EXPECT_EQ(payload, std::string(buf, size)) << "type " << type;
+  }
+}
+
+}  // namespace
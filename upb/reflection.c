@@ -74,6 +74,13 @@ static upb_MessageValue _upb_Message_Getraw(const upb_Message* msg,
   const upb_MiniTable_Field* field = upb_FieldDef_MiniTable(f);
   const char* mem = UPB_PTR_AT(msg, field->offset, char);
   upb_MessageValue val = {0};
+  /* Oneof members share storage, so only a set member can be lazy. */
+  if (UPB_UNLIKELY(field->mode & kUpb_LabelFlags_IsLazy) &&
+      (!in_oneof(field) ||
+       _upb_getoneofcase_field(msg, field) == field->number)) {
+    val.msg_val = _upb_Message_GetSubMessage(msg, field->offset);
+    return val;
+  }
   memcpy(&val, mem, get_field_size(field));
   return val;
 }
@@ -797,6 +797,92 @@ TEST(GeneratedCode, Int32Map) {
   upb_Arena_Free(arena);
 }
 
+TEST(GeneratedCode, ParseMaps) {
+  /* Includes an entry with the value before the key, which the fast parsers
+   * hand back to the generic decoder. */
+  const char data[] =
+      "\xaa\x04\x06\x0a\x01k\x12\x01v"
+      "\xaa\x04\x06\x12\x01w\x0a\x01j"
+      "\xc2\x03\x04\x08\x05\x10\x07"
+      "\xba\x04\x07\x0a\x01n\x12\x02\x08\x03";
+  upb_Arena* arena = upb_Arena_New();
+  protobuf_test_messages_proto3_TestAllTypesProto3* msg =
+      protobuf_test_messages_proto3_TestAllTypesProto3_parse(
+          data, sizeof(data) - 1, arena);
+  upb_StringView str;
+  int32_t val;
+  protobuf_test_messages_proto3_TestAllTypesProto3_NestedMessage* nested;
+  ASSERT_TRUE(msg != NULL);
+
+  EXPECT_EQ(
+      2,
+      protobuf_test_messages_proto3_TestAllTypesProto3_map_string_string_size(
+          msg));
+  EXPECT_TRUE(
+      protobuf_test_messages_proto3_TestAllTypesProto3_map_string_string_get(
+          msg, upb_StringView_FromString("k"), &str));
+  EXPECT_TRUE(upb_StringView_IsEqual(str, upb_StringView_FromString("v")));
+  EXPECT_TRUE(
+      protobuf_test_messages_proto3_TestAllTypesProto3_map_string_string_get(
+          msg, upb_StringView_FromString("j"), &str));
+  EXPECT_TRUE(upb_StringView_IsEqual(str, upb_StringView_FromString("w")));
+
+  EXPECT_TRUE(
+      protobuf_test_messages_proto3_TestAllTypesProto3_map_int32_int32_get(
+          msg, 5, &val));
+  EXPECT_EQ(7, val);
+
+  EXPECT_TRUE(
+      protobuf_test_messages_proto3_TestAllTypesProto3_map_string_nested_message_get(
+          msg, upb_StringView_FromString("n"), &nested));
+  EXPECT_EQ(
+      3, protobuf_test_messages_proto3_TestAllTypesProto3_NestedMessage_a(
+             nested));
+
+  upb_Arena_Free(arena);
+}
+
+TEST(GeneratedCode, ParseThreeByteTags) {
+  /* Tags that share a fasttable slot with a three-byte tag, but differ from it
+   * in the second or third byte, must fall back to the generic decoder. */
+  const char data[] =
+      "\x80\x01\x01"                     /* two_byte = 1 */
+      "\x80\x80\x01\x02"                 /* three_byte = 2 */
+      "\x80\x80\x02\x03"                 /* three_byte_third = 3 */
+      "\x8a\x01\x01" "a"                 /* two_byte_str = "a" */
+      "\x8a\x80\x01\x02" "bc"            /* three_byte_str = "bc" */
+      "\xa2\x80\x01\x02\x04\x05"         /* three_byte_packed: [4, 5] */
+      "\xa0\x80\x01\x06"                 /* three_byte_packed: 6 */
+      "\xaa\x80\x01\x04\x80\x80\x01\x07" /* three_byte_sub.three_byte = 7 */
+      "\x80\x01\x08";                    /* two_byte = 8 */
+  upb::Arena arena;
+  upb_test_ThreeByteTags* msg =
+      upb_test_ThreeByteTags_parse(data, sizeof(data) - 1, arena.ptr());
+  ASSERT_TRUE(msg != NULL);
+
+  EXPECT_EQ(8, upb_test_ThreeByteTags_two_byte(msg));
+  EXPECT_EQ(2, upb_test_ThreeByteTags_three_byte(msg));
+  EXPECT_EQ(3, upb_test_ThreeByteTags_three_byte_third(msg));
+  EXPECT_TRUE(upb_StringView_IsEqual(upb_test_ThreeByteTags_two_byte_str(msg),
+                                     upb_StringView_FromString("a")));
+  EXPECT_TRUE(
+      upb_StringView_IsEqual(upb_test_ThreeByteTags_three_byte_str(msg),
+                             upb_StringView_FromString("bc")));
+
+  size_t size;
+  const int32_t* elems = upb_test_ThreeByteTags_three_byte_packed(msg, &size);
+  ASSERT_EQ(3, size);
+  EXPECT_EQ(4, elems[0]);
+  EXPECT_EQ(5, elems[1]);
+  EXPECT_EQ(6, elems[2]);
+
+  const upb_test_ThreeByteTags* sub =
+      upb_test_ThreeByteTags_three_byte_sub(msg);
+  ASSERT_TRUE(sub != NULL);
+  EXPECT_EQ(7, upb_test_ThreeByteTags_three_byte(sub));
+  EXPECT_FALSE(upb_test_ThreeByteTags_has_two_byte(sub));
+}
+
 TEST(GeneratedCode, TestRepeated) {
   upb_Arena* arena = upb_Arena_New();
   protobuf_test_messages_proto3_TestAllTypesProto3* msg =
@@ -465,7 +465,7 @@ size_t upb_TextEncode(const upb_Message* msg, const upb_MessageDef* m,
   e.indent_depth = 0;
   e.options = options;
   e.ext_pool = ext_pool;
-  _upb_mapsorter_init(&e.sorter);
+  _upb_mapsorter_init(&e.sorter, NULL);
 
   txtenc_msg(&e, msg, m);
   _upb_mapsorter_destroy(&e.sorter);
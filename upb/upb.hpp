@@ -72,6 +72,9 @@ class Arena {
   Arena(char* initial_block, size_t size)
       : ptr_(upb_Arena_Init(initial_block, size, &upb_alloc_global),
              upb_Arena_Free) {}
+  explicit Arena(const upb_ArenaGrowthPolicy& policy)
+      : ptr_(upb_Arena_InitWithPolicy(nullptr, 0, &upb_alloc_global, &policy),
+             upb_Arena_Free) {}
 
   upb_Arena* ptr() { return ptr_.get(); }
 
@@ -92,6 +95,13 @@ class Arena {
 
   void Fuse(Arena& other) { upb_Arena_Fuse(ptr(), other.ptr()); }
 
+  // Frees everything allocated from the arena (running cleanups), but keeps
+  // up to `max_retained` bytes of blocks around for reuse.  Returns false if
+  // the arena has been fused, in which case it cannot be reset.
+  bool Reset(size_t max_retained = SIZE_MAX) {
+    return upb_Arena_Reset(ptr(), max_retained);
+  }
+
  private:
   std::unique_ptr<upb_Arena, decltype(&upb_Arena_Free)> ptr_;
 };
@@ -0,0 +1,189 @@
+// Copyright (c) 2009-2021, Google LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Google LLC nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "upb/internal/utf8.h"
+
+#include <stdint.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// A byte-at-a-time validator straight from Table 3-7 of the Unicode Standard.
+bool Reference(const std::string& s) {
+  size_t i = 0;
+  while (i < s.size()) {
+    uint8_t b = s[i];
+    int n;
+    uint8_t lo = 0x80, hi = 0xBF;
+    if (b < 0x80) {
+      i++;
+      continue;
+    } else if (b >= 0xC2 && b <= 0xDF) {
+      n = 1;
+    } else if (b >= 0xE0 && b <= 0xEF) {
+      n = 2;
+      if (b == 0xE0) lo = 0xA0;
+      if (b == 0xED) hi = 0x9F;
+    } else if (b >= 0xF0 && b <= 0xF4) {
+      n = 3;
+      if (b == 0xF0) lo = 0x90;
+      if (b == 0xF4) hi = 0x8F;
+    } else {
+      return false;
+    }
+    if (s.size() - i - 1 < static_cast<size_t>(n)) return false;
+    for (int j = 1; j <= n; j++) {
+      uint8_t c = s[i + j];
+      if (c < (j == 1 ? lo : 0x80) || c > (j == 1 ? hi : 0xBF)) return false;
+    }
+    i += n + 1;
+  }
+  return true;
+}
+
+std::string Encode(uint32_t cp) {
+  std::string ret;
+  if (cp < 0x80) {
+    ret.push_back(cp);
+  } else if (cp < 0x800) {
+    ret.push_back(0xC0 | (cp >> 6));
+    ret.push_back(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    ret.push_back(0xE0 | (cp >> 12));
+    ret.push_back(0x80 | ((cp >> 6) & 0x3F));
+    ret.push_back(0x80 | (cp & 0x3F));
+  } else {
+    ret.push_back(0xF0 | (cp >> 18));
+    ret.push_back(0x80 | ((cp >> 12) & 0x3F));
+    ret.push_back(0x80 | ((cp >> 6) & 0x3F));
+    ret.push_back(0x80 | (cp & 0x3F));
+  }
+  return ret;
+}
+
+// Valid text of at least |len| bytes, |ascii_pct| percent of it ASCII and the
+// rest spread over 2-, 3- and 4-byte characters (avoiding surrogates).
+std::string RandomText(std::mt19937* rng, size_t len, int ascii_pct) {
+  std::string ret;
+  while (ret.size() < len) {
+    uint32_t r = (*rng)();
+    if (static_cast<int>(r % 100) < ascii_pct) {
+      ret += Encode(0x20 + (r >> 8) % 0x5F);
+      continue;
+    }
+    switch ((r >> 8) % 3) {
+      case 0:
+        ret += Encode(0x80 + (r >> 10) % (0x800 - 0x80));
+        break;
+      case 1: {
+        uint32_t cp = 0x800 + (r >> 10) % (0x10000 - 0x800);
+        if (cp >= 0xD800 && cp <= 0xDFFF) cp -= 0x800;
+        ret += Encode(cp);
+        break;
+      }
+      default:
+        ret += Encode(0x10000 + (r >> 10) % (0x110000 - 0x10000));
+        break;
+    }
+  }
+  return ret;
+}
+
+bool IsValid(const std::string& s) {
+  // Copy to a buffer of the exact size, so that ASAN catches reads past the
+  // end.
+  std::vector<char> buf(s.begin(), s.end());
+  return _upb_Utf8_IsValid(buf.data(), buf.size());
+}
+
+TEST(Utf8Test, Valid) {
+  std::mt19937 rng(1);
+  for (int pct : {100, 90, 50, 0}) {
+    for (size_t len = 0; len < 300; len++) {
+      std::string s = RandomText(&rng, len, pct);
+      ASSERT_TRUE(Reference(s));
+      EXPECT_TRUE(IsValid(s)) << pct << " " << len;
+    }
+  }
+}
+
+TEST(Utf8Test, Invalid) {
+  const char* kBad[] = {
+      "\x80",              // Lone continuation byte.
+      "\xC0\x80",          // Overlong NUL.
+      "\xC1\xBF",          // Overlong 2-byte.
+      "\xE0\x9F\xBF",      // Overlong 3-byte.
+      "\xED\xA0\x80",      // Surrogate.
+      "\xF0\x8F\xBF\xBF",  // Overlong 4-byte.
+      "\xF4\x90\x80\x80",  // Past U+10FFFF.
+      "\xF5\x80\x80\x80",  // Lead byte past F4.
+      "\xFF",              // Never valid.
+      "\xC2",              // Truncated.
+      "\xE2\x82",          // Truncated.
+      "\xF0\x9F\x98",      // Truncated.
+      "\xC2\x41",          // Missing continuation.
+  };
+  // Put each sequence at every position of blocks of varying length, so that
+  // it straddles every vector boundary and the end of the string.
+  for (const char* bad : kBad) {
+    for (size_t len = 0; len < 140; len++) {
+      for (size_t pos = 0; pos <= len; pos++) {
+        std::string s =
+            std::string(pos, 'a') + bad + std::string(len - pos, 'a');
+        ASSERT_FALSE(Reference(s));
+        EXPECT_FALSE(IsValid(s)) << len << " " << pos;
+      }
+    }
+  }
+}
+
+TEST(Utf8Test, TruncatedAtEnd) {
+  std::string s =
+      std::string(61, 'a') + "\xF0\x9F\x98\x80" + std::string(60, 'b');
+  for (size_t len = 0; len <= s.size(); len++) {
+    std::string prefix = s.substr(0, len);
+    EXPECT_EQ(Reference(prefix), IsValid(prefix)) << len;
+  }
+}
+
+TEST(Utf8Test, MatchesReference) {
+  std::mt19937 rng(2);
+  for (int i = 0; i < 20000; i++) {
+    std::string s = RandomText(&rng, rng() % 200, rng() % 101);
+    // Flip a few random bytes.
+    int flips = rng() % 3;
+    for (int j = 0; j < flips && !s.empty(); j++) {
+      s[rng() % s.size()] = static_cast<char>(rng());
+    }
+    EXPECT_EQ(Reference(s), IsValid(s)) << i;
+  }
+}
+
+}  // namespace
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "upb/util/decode_profile.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "upb/internal/vsnprintf_compat.h"
+
+// Must be last.
+#include "upb/port_def.inc"
+
+typedef struct {
+  char* buf;
+  char* ptr;
+  char* end;
+  size_t overflow;
+} upb_PrintfAppender;
+
+UPB_PRINTF(2, 3)
+static void upb_DecodeProfile_Printf(upb_PrintfAppender* a, const char* fmt,
+                                     ...) {
+  size_t n;
+  size_t have = a->end - a->ptr;
+  va_list args;
+
+  va_start(args, fmt);
+  n = _upb_vsnprintf(a->ptr, have, fmt, args);
+  va_end(args);
+
+  if (UPB_LIKELY(have > n)) {
+    UPB_ASSERT(a->ptr);
+    a->ptr += n;
+  } else {
+    a->ptr = UPB_PTRADD(a->ptr, have);
+    a->overflow += (n - have);
+  }
+}
+
+static bool upb_DecodeProfile_Contains(const upb_MessageDef** msgs,
+                                       size_t count, const upb_MessageDef* m) {
+  for (size_t i = 0; i < count; i++) {
+    if (msgs[i] == m) return true;
+  }
+  return false;
+}
+
+size_t upb_DecodeProfile_ToText(const upb_DecodeProfile* p,
+                                const upb_MessageDef* m, char* buf,
+                                size_t size) {
+  upb_PrintfAppender a;
+  const upb_MessageDef** msgs = malloc(sizeof(*msgs));
+  size_t count = 1;
+  size_t cap = 1;
+  size_t ret;
+
+  if (!msgs) return SIZE_MAX;
+  msgs[0] = m;
+
+  a.buf = buf;
+  a.ptr = buf;
+  a.end = UPB_PTRADD(buf, size);
+  a.overflow = 0;
+
+  // Breadth-first over the message types, with `msgs` as both the queue and
+  // the set of types already seen.
+  for (size_t i = 0; i < count; i++) {
+    const upb_MessageDef* msg = msgs[i];
+    const upb_MiniTable* l = upb_MessageDef_MiniTable(msg);
+    int n = upb_MessageDef_FieldCount(msg);
+
+    for (int j = 0; j < n; j++) {
+      const upb_FieldDef* f = upb_MessageDef_Field(msg, j);
+      uint32_t number = upb_FieldDef_Number(f);
+      uint64_t hits = upb_DecodeProfile_FieldCount(p, l, number);
+      const upb_MessageDef* sub = upb_FieldDef_MessageSubDef(f);
+
+      if (hits) {
+        upb_DecodeProfile_Printf(&a, "%s %" PRIu32 " %" PRIu64 "\n",
+                                 upb_MessageDef_FullName(msg), number, hits);
+      }
+
+      if (!sub || upb_DecodeProfile_Contains(msgs, count, sub)) continue;
+      if (count == cap) {
+        const upb_MessageDef** grown = realloc(msgs, cap * 2 * sizeof(*msgs));
+        if (!grown) {
+          free(msgs);
+          return SIZE_MAX;
+        }
+        msgs = grown;
+        cap *= 2;
+      }
+      msgs[count++] = sub;
+    }
+  }
+  free(msgs);
+
+  ret = a.ptr - a.buf + a.overflow;
+  if (size > 0) {
+    if (a.ptr == a.end) a.ptr--;
+    *a.ptr = '\0';
+  }
+  return ret;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "upb/util/decode_profile.h"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "upb/def.hpp"
+#include "upb/upb.hpp"
+#include "upb/util/decode_profile_test.upb.h"
+#include "upb/util/decode_profile_test.upbdefs.h"
+
+std::string ProfileToText(const upb_DecodeProfile* p,
+                          const upb_MessageDef* m) {
+  size_t len = upb_DecodeProfile_ToText(p, m, NULL, 0);
+  std::vector<char> buf(len + 1);
+  EXPECT_EQ(len, upb_DecodeProfile_ToText(p, m, buf.data(), buf.size()));
+  std::string ret(buf.data());
+  EXPECT_EQ(len, ret.size());
+
+  // Ensure that we can have a short buffer and that it will be
+  // NULL-terminated.
+  char shortbuf[4];
+  EXPECT_EQ(len, upb_DecodeProfile_ToText(p, m, shortbuf, sizeof(shortbuf)));
+  EXPECT_EQ(ret.substr(0, sizeof(shortbuf) - 1), std::string(shortbuf));
+  return ret;
+}
+
+// message Profiled {
+//   optional int32 id = 1;
+//   optional string name = 2;
+//   repeated ProfiledChild children = 3;
+//   optional Profiled parent = 4;
+//   optional int64 unused = 5;
+// }
+//
+// message ProfiledChild {
+//   optional string key = 1;
+//   optional ProfiledGrandchild value = 2;
+// }
+TEST(DecodeProfileTest, ToText) {
+  upb::Arena arena;
+  upb::DefPool defpool;
+  upb::MessageDefPtr m(upb_util_test_Profiled_getmsgdef(defpool.ptr()));
+  upb_util_test_Profiled* msg = upb_util_test_Profiled_new(arena.ptr());
+  upb_util_test_Profiled_set_id(msg, 1);
+  upb_util_test_Profiled_set_name(msg, upb_StringView_FromString("a"));
+  upb_util_test_ProfiledChild* child =
+      upb_util_test_Profiled_add_children(msg, arena.ptr());
+  upb_util_test_ProfiledChild_set_key(child, upb_StringView_FromString("b"));
+  upb_util_test_ProfiledGrandchild_set_x(
+      upb_util_test_ProfiledChild_mutable_value(child, arena.ptr()), 2);
+  child = upb_util_test_Profiled_add_children(msg, arena.ptr());
+  upb_util_test_ProfiledChild_set_key(child, upb_StringView_FromString("c"));
+  upb_util_test_Profiled_set_id(
+      upb_util_test_Profiled_mutable_parent(msg, arena.ptr()), 3);
+  size_t size;
+  char* buf = upb_util_test_Profiled_serialize(msg, arena.ptr(), &size);
+  ASSERT_NE(nullptr, buf);
+
+  upb_DecodeProfile* p = upb_DecodeProfile_New(0);
+  ASSERT_NE(nullptr, p);
+  for (int i = 0; i < 2; i++) {
+    upb_Message* parsed = upb_util_test_Profiled_new(arena.ptr());
+    ASSERT_EQ(kUpb_DecodeStatus_Ok,
+              upb_DecodeProfiled(buf, size, parsed,
+                                 upb_MessageDef_MiniTable(m.ptr()), NULL, 0,
+                                 arena.ptr(), p));
+  }
+
+  // Every message type reachable from `m` is listed once, breadth first and
+  // in field order, and fields that were never seen are left out.
+  std::string text = ProfileToText(p, m.ptr());
+  EXPECT_EQ(
+      "upb_util_test.Profiled 1 4\n"
+      "upb_util_test.Profiled 2 2\n"
+      "upb_util_test.Profiled 3 4\n"
+      "upb_util_test.Profiled 4 2\n"
+      "upb_util_test.ProfiledChild 1 4\n"
+      "upb_util_test.ProfiledChild 2 2\n"
+      "upb_util_test.ProfiledGrandchild 1 2\n",
+      text);
+
+  // Reading the text back gives the counts in the profile.
+  std::istringstream in(text);
+  std::string name;
+  uint32_t number;
+  uint64_t count;
+  int lines = 0;
+  while (in >> name >> number >> count) {
+    upb::MessageDefPtr msgdef = defpool.FindMessageByName(name.c_str());
+    ASSERT_TRUE(msgdef);
+    EXPECT_EQ(count, upb_DecodeProfile_FieldCount(
+                         p, upb_MessageDef_MiniTable(msgdef.ptr()), number));
+    lines++;
+  }
+  EXPECT_TRUE(in.eof());
+  EXPECT_EQ(7, lines);
+
+  upb_DecodeProfile_Free(p);
+}
+
+TEST(DecodeProfileTest, Empty) {
+  upb::DefPool defpool;
+  upb::MessageDefPtr m(upb_util_test_Profiled_getmsgdef(defpool.ptr()));
+  upb_DecodeProfile* p = upb_DecodeProfile_New(0);
+  ASSERT_NE(nullptr, p);
+  EXPECT_EQ("", ProfileToText(p, m.ptr()));
+  upb_DecodeProfile_Free(p);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2009-2021, Google LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of Google LLC nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Helpers for hand-assembling wire-format payloads in tests. */
+
+#ifndef UPB_WIRE_TEST_UTIL_HPP_
+#define UPB_WIRE_TEST_UTIL_HPP_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "upb/upb.h"
+
+namespace upb {
+namespace test {
+
+inline std::string Varint(uint64_t val) {
+  std::string ret;
+  while (val >= 0x80) {
+    ret.push_back(static_cast<char>((val & 0x7f) | 0x80));
+    val >>= 7;
+  }
+  ret.push_back(static_cast<char>(val));
+  return ret;
+}
+
+inline std::string Tag(uint32_t field_number, upb_WireType wire_type) {
+  return Varint((field_number << 3) | wire_type);
+}
+
+inline std::string VarintField(uint32_t field_number, uint64_t val) {
+  return Tag(field_number, kUpb_WireType_Varint) + Varint(val);
+}
+
+inline std::string Delimited(uint32_t field_number, const std::string& data) {
+  return Tag(field_number, kUpb_WireType_Delimited) + Varint(data.size()) +
+         data;
+}
+
+inline std::string Group(uint32_t field_number, const std::string& body) {
+  return Tag(field_number, kUpb_WireType_StartGroup) + body +
+         Tag(field_number, kUpb_WireType_EndGroup);
+}
+
+inline std::string Fixed32Field(uint32_t field_number, uint32_t val) {
+  std::string ret = Tag(field_number, kUpb_WireType_32Bit);
+  for (int i = 0; i < 4; i++) ret.push_back(static_cast<char>(val >> (8 * i)));
+  return ret;
+}
+
+}  // namespace test
+}  // namespace upb
+
+#endif /* UPB_WIRE_TEST_UTIL_HPP_ */
@@ -0,0 +1,163 @@
+// Copyright (c) 2009-2021, Google LLC
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Google LLC nor the
+//       names of its contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL Google LLC BE LIABLE FOR ANY DIRECT,
+// INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Checks that the `profile=<file>` option of protoc-gen-upb lays out messages
+// by hotness.  The generator is run on profile_test.proto with several
+// profiles by the profile_test_gen rule, and this test inspects the tables it
+// wrote.
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+std::string ReadGenerated(const std::string& profile, const char* ext) {
+  std::string filename =
+      "upbc/profile_test/" + profile + "/upbc/profile_test.upb" + ext;
+  std::ifstream in(filename);
+  EXPECT_TRUE(in) << filename;
+  std::stringstream ret;
+  ret << in.rdbuf();
+  return ret.str();
+}
+
+// One entry of upbc_test_ProfileTest__fields, with the 64-bit values.
+struct Field {
+  int number;
+  int offset;
+  int presence;
+};
+
+std::vector<Field> ReadFields(const std::string& source) {
+  std::vector<Field> ret;
+  std::istringstream in(source);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.find("upbc_test_ProfileTest__fields[") != std::string::npos) break;
+  }
+  while (std::getline(in, line) && line != "};") {
+    Field f;
+    EXPECT_EQ(3, sscanf(line.c_str(),
+                        " {%d, UPB_SIZE(%*d, %d), UPB_SIZE(%*d, %d)",
+                        &f.number, &f.offset, &f.presence))
+        << line;
+    ret.push_back(f);
+  }
+  return ret;
+}
+
+// The data words of the fast table entries, by slot.
+std::vector<uint64_t> ReadFastTable(const std::string& source) {
+  std::vector<uint64_t> ret;
+  std::istringstream in(source);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.find("UPB_FASTTABLE_INIT({") != std::string::npos) break;
+  }
+  while (std::getline(in, line) && line != "  }),") {
+    uint64_t data;
+    EXPECT_EQ(1, sscanf(line.c_str(), " {0x%" SCNx64, &data)) << line;
+    ret.push_back(data);
+  }
+  return ret;
+}
+
+const Field& FindField(const std::vector<Field>& fields, int number) {
+  return *std::find_if(fields.begin(), fields.end(),
+                       [number](const Field& f) { return f.number == number; });
+}
+
+// Returns the field numbers ordered by `member`, lowest first.
+std::vector<int> OrderBy(std::vector<Field> fields, int Field::*member) {
+  std::sort(fields.begin(), fields.end(),
+            [member](const Field& a, const Field& b) {
+              return a.*member < b.*member;
+            });
+  std::vector<int> ret;
+  for (const auto& f : fields) ret.push_back(f.number);
+  return ret;
+}
+
+TEST(ProfileTest, NoMatchingEntriesChangesNothing) {
+  for (const char* ext : {".h", ".c"}) {
+    std::string none = ReadGenerated("none", ext);
+    EXPECT_FALSE(none.empty());
+    EXPECT_EQ(none, ReadGenerated("empty", ext));
+    EXPECT_EQ(none, ReadGenerated("unmatched", ext));
+  }
+}
+
+// profile_test_hot.txt makes field 33 the hottest, then field 3; the others
+// were never seen and keep their order by field number.
+TEST(ProfileTest, HotFieldsComeFirst) {
+  std::string none = ReadGenerated("none", ".c");
+  std::string hot = ReadGenerated("hot", ".c");
+  std::vector<Field> none_fields = ReadFields(none);
+  std::vector<Field> hot_fields = ReadFields(hot);
+  ASSERT_EQ(5, none_fields.size());
+  ASSERT_EQ(5, hot_fields.size());
+
+  // Without a profile lower field numbers are assumed to be hotter.
+  const std::vector<int> by_number = {1, 2, 3, 17, 33};
+  const std::vector<int> by_hotness = {33, 3, 1, 2, 17};
+  EXPECT_EQ(by_number, OrderBy(none_fields, &Field::presence));
+  EXPECT_EQ(by_number, OrderBy(none_fields, &Field::offset));
+  EXPECT_EQ(by_hotness, OrderBy(hot_fields, &Field::presence));
+  EXPECT_EQ(by_hotness, OrderBy(hot_fields, &Field::offset));
+
+  // The same hasbits and offsets are handed out, only to different fields.
+  std::vector<int> none_presence, hot_presence, none_offsets, hot_offsets;
+  for (int number : by_number) {
+    none_presence.push_back(FindField(none_fields, number).presence);
+    hot_presence.push_back(FindField(hot_fields, number).presence);
+    none_offsets.push_back(FindField(none_fields, number).offset);
+    hot_offsets.push_back(FindField(hot_fields, number).offset);
+  }
+  std::sort(hot_presence.begin(), hot_presence.end());
+  std::sort(hot_offsets.begin(), hot_offsets.end());
+  EXPECT_EQ(none_presence, hot_presence);
+  EXPECT_EQ(none_offsets, hot_offsets);
+}
+
+// Fields 17 and 33 both map to fast table slot 17, which goes to the hotter
+// one.  The low 16 bits of an entry are its expected tag.
+TEST(ProfileTest, HotFieldGetsSharedSlot) {
+  std::vector<uint64_t> none = ReadFastTable(ReadGenerated("none", ".c"));
+  std::vector<uint64_t> hot = ReadFastTable(ReadGenerated("hot", ".c"));
+  ASSERT_EQ(32, none.size());
+  ASSERT_EQ(32, hot.size());
+  EXPECT_EQ(0x0188, none[17] & 0xffff);  // Field 17, varint.
+  EXPECT_EQ(0x0288, hot[17] & 0xffff);   // Field 33, varint.
+}
+
+}  // namespace
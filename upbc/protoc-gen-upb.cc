@@ -23,7 +23,9 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <fstream>
 #include <memory>
+#include <sstream>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/container/flat_hash_set.h"
@@ -47,15 +49,64 @@ namespace {
 namespace protoc = ::google::protobuf::compiler;
 namespace protobuf = ::google::protobuf;
 
+// How many times each field was seen in sampled parses, keyed by message full
+// name and then field number.  See upb/util/decode_profile.h.
+using FieldProfile =
+    absl::flat_hash_map<std::string, absl::flat_hash_map<int, uint64_t>>;
+
+// Reads a profile written by upb_DecodeProfile_ToText(): one
+// "<message full name> <field number> <count>" per line.  Blank lines and
+// lines starting with '#' are ignored, and repeated entries are summed so that
+// several profiles can simply be concatenated.
+bool ReadFieldProfile(const std::string& filename, FieldProfile* profile,
+                      std::string* error) {
+  std::ifstream in(filename);
+  if (!in) {
+    *error = "Couldn't open profile: " + filename;
+    return false;
+  }
+  std::string line;
+  for (int line_number = 1; std::getline(in, line); line_number++) {
+    std::istringstream fields(line);
+    std::string name;
+    int number;
+    uint64_t count;
+    if (!(fields >> name) || name[0] == '#') continue;
+    if (!(fields >> number >> count) || !(fields >> std::ws).eof()) {
+      *error = absl::Substitute("$0:$1: malformed profile entry", filename,
+                                line_number);
+      return false;
+    }
+    (*profile)[name][number] += count;
+  }
+  return true;
+}
+
 // Returns fields in order of "hotness", eg. how frequently they appear in
-// serialized payloads. Ideally this will use a profile. When we don't have
-// that, we assume that fields with smaller numbers are used more frequently.
+// serialized payloads. If the profile has counts for this message we use
+// those. When we don't have them, we assume that required fields and fields
+// with smaller numbers are used more frequently.
 inline std::vector<const google::protobuf::FieldDescriptor*> FieldHotnessOrder(
-    const google::protobuf::Descriptor* message) {
+    const google::protobuf::Descriptor* message, const FieldProfile& profile) {
   std::vector<const google::protobuf::FieldDescriptor*> fields;
   for (int i = 0; i < message->field_count(); i++) {
     fields.push_back(message->field(i));
   }
+  auto it = profile.find(message->full_name());
+  if (it != profile.end()) {
+    const absl::flat_hash_map<int, uint64_t>& counts = it->second;
+    auto count = [&counts](const google::protobuf::FieldDescriptor* f) {
+      auto c = counts.find(f->number());
+      return c == counts.end() ? 0 : c->second;
+    };
+    std::sort(fields.begin(), fields.end(),
+              [&count](const google::protobuf::FieldDescriptor* a,
+                       const google::protobuf::FieldDescriptor* b) {
+                return std::make_pair(count(b), a->number()) <
+                       std::make_pair(count(a), b->number());
+              });
+    return fields;
+  }
   std::sort(fields.begin(), fields.end(),
             [](const google::protobuf::FieldDescriptor* a,
                const google::protobuf::FieldDescriptor* b) {
@@ -290,6 +341,13 @@ bool HasNonZeroDefault(const protobuf::FieldDescriptor* field) {
   return false;
 }
 
+// upb only parses singular, non-extension message fields lazily.
+bool IsLazy(const protobuf::FieldDescriptor* field) {
+  return field->options().lazy() &&
+         field->type() == protobuf::FieldDescriptor::TYPE_MESSAGE &&
+         !field->is_repeated() && !field->is_extension();
+}
+
 std::string FieldDefault(const protobuf::FieldDescriptor* field) {
   switch (field->cpp_type()) {
     case protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
@@ -341,8 +399,9 @@ std::string CTypeConst(const protobuf::FieldDescriptor* field) {
 class FilePlatformLayout {
  public:
   FilePlatformLayout(const protobuf::FileDescriptor* fd,
-                     upb_MiniTablePlatform platform)
-      : platform_(platform) {
+                     upb_MiniTablePlatform platform,
+                     const FieldProfile& profile)
+      : platform_(platform), profile_(profile) {
     BuildMiniTables(fd);
     BuildExtensions(fd);
   }
@@ -363,6 +422,7 @@ class FilePlatformLayout {
   void BuildExtensions(const protobuf::FileDescriptor* fd);
   upb_MiniTable* MakeMiniTable(const protobuf::Descriptor* m);
   upb_MiniTable* MakeRegularMiniTable(const protobuf::Descriptor* m);
+  void ApplyHotnessOrder(const protobuf::Descriptor* m, upb_MiniTable* mt);
   upb_MiniTable_Enum* MakeMiniTableEnum(const protobuf::EnumDescriptor* d);
   uint64_t GetMessageModifiers(const protobuf::Descriptor* m);
   uint64_t GetFieldModifiers(const protobuf::FieldDescriptor* f);
@@ -405,6 +465,7 @@ class FilePlatformLayout {
   EnumMap enum_map_;
   ExtensionMap extension_map_;
   upb_MiniTablePlatform platform_;
+  const FieldProfile& profile_;
 };
 
 upb_MiniTable* FilePlatformLayout::GetMiniTable(
@@ -587,9 +648,49 @@ upb_MiniTable* FilePlatformLayout::MakeRegularMiniTable(
     fprintf(stderr, "Error building mini-table: %s\n", status.error_message());
   }
   assert(ret);
+  ApplyHotnessOrder(m, ret);
   return ret;
 }
 
+// Mini descriptors can't express how hot each field is, so when we have a
+// profile for `m` we permute its table after building it: the hottest fields
+// get the lowest hasbits (the fast decoder can only set the first 32) and the
+// lowest offsets of their size class, so that they share cache lines.  Only
+// interchangeable slots are swapped: optional hasbits among themselves, and
+// the offsets of non-oneof fields with the same representation.
+void FilePlatformLayout::ApplyHotnessOrder(const protobuf::Descriptor* m,
+                                           upb_MiniTable* mt) {
+  if (profile_.find(m->full_name()) == profile_.end()) return;
+
+  std::vector<upb_MiniTable_Field*> fields;
+  std::vector<int16_t> hasbits;
+  std::vector<uint16_t> offsets[kUpb_FieldRep_Max + 1];
+  for (const auto* f : FieldHotnessOrder(m, profile_)) {
+    auto* mt_f = const_cast<upb_MiniTable_Field*>(
+        upb_MiniTable_FindFieldByNumber(mt, f->number()));
+    fields.push_back(mt_f);
+    if (mt_f->presence > mt->required_count) {
+      hasbits.push_back(mt_f->presence);
+    }
+    if (mt_f->presence >= 0) {
+      offsets[mt_f->mode >> kUpb_FieldRep_Shift].push_back(mt_f->offset);
+    }
+  }
+
+  std::sort(hasbits.begin(), hasbits.end());
+  for (auto& v : offsets) std::sort(v.begin(), v.end());
+
+  auto hasbit = hasbits.begin();
+  size_t next_offset[kUpb_FieldRep_Max + 1] = {0};
+  for (auto* mt_f : fields) {
+    if (mt_f->presence > mt->required_count) mt_f->presence = *hasbit++;
+    if (mt_f->presence >= 0) {
+      int rep = mt_f->mode >> kUpb_FieldRep_Shift;
+      mt_f->offset = offsets[rep][next_offset[rep]++];
+    }
+  }
+}
+
 upb_MiniTable_Enum* FilePlatformLayout::MakeMiniTableEnum(
     const protobuf::EnumDescriptor* d) {
   upb::Arena arena;
@@ -643,6 +744,7 @@ uint64_t FilePlatformLayout::GetFieldModifiers(
   if (f->is_optional() && !f->has_presence()) {
     ret |= kUpb_FieldModifier_IsProto3Singular;
   }
+  if (IsLazy(f)) ret |= kUpb_FieldModifier_IsLazy;
 
   return ret;
 }
@@ -654,12 +756,14 @@ uint64_t FilePlatformLayout::GetFieldModifiers(
 // FileLayout is a pair of platform layouts: one for 32-bit and one for 64-bit.
 class FileLayout {
  public:
-  FileLayout(const protobuf::FileDescriptor* fd)
+  FileLayout(const protobuf::FileDescriptor* fd, const FieldProfile& profile)
       : descriptor_(fd),
-        layout32_(fd, kUpb_MiniTablePlatform_32Bit),
-        layout64_(fd, kUpb_MiniTablePlatform_64Bit) {}
+        profile_(profile),
+        layout32_(fd, kUpb_MiniTablePlatform_32Bit, profile),
+        layout64_(fd, kUpb_MiniTablePlatform_64Bit, profile) {}
 
   const protobuf::FileDescriptor* descriptor() const { return descriptor_; }
+  const FieldProfile& profile() const { return profile_; }
 
   const upb_MiniTable* GetMiniTable32(const protobuf::Descriptor* m) const {
     return layout32_.GetMiniTable(m);
@@ -714,6 +818,7 @@ class FileLayout {
 
  private:
   const protobuf::FileDescriptor* descriptor_;
+  const FieldProfile& profile_;
   FilePlatformLayout layout32_;
   FilePlatformLayout layout64_;
 };
@@ -1055,6 +1160,21 @@ void GenerateRepeatedGetters(const protobuf::FieldDescriptor* field,
 void GenerateOneofGetters(const protobuf::FieldDescriptor* field,
                           const FileLayout& layout, absl::string_view msg_name,
                           Output& output) {
+  if (IsLazy(field)) {
+    output(
+        R"cc(
+          UPB_INLINE $0 $1_$2(const $1* msg) {
+            return *UPB_PTR_AT(msg, $4, int) == $5
+                       ? ($0)_upb_Message_GetSubMessage(msg, $3)
+                       : NULL;
+          }
+        )cc",
+        CTypeConst(field), msg_name, field->name(),
+        layout.GetFieldOffset(field),
+        layout.GetOneofCaseOffset(field->real_containing_oneof()),
+        field->number());
+    return;
+  }
   output(
       R"cc(
         UPB_INLINE $0 $1_$2(const $1* msg) {
@@ -1069,7 +1189,16 @@ void GenerateOneofGetters(const protobuf::FieldDescriptor* field,
 void GenerateScalarGetters(const protobuf::FieldDescriptor* field,
                            const FileLayout& layout, absl::string_view msg_name,
                            Output& output) {
-  if (HasNonZeroDefault(field)) {
+  if (IsLazy(field)) {
+    output(
+        R"cc(
+          UPB_INLINE $0 $1_$2(const $1* msg) {
+            return ($0)_upb_Message_GetSubMessage(msg, $3);
+          }
+        )cc",
+        CTypeConst(field), msg_name, field->name(),
+        layout.GetFieldOffset(field));
+  } else if (HasNonZeroDefault(field)) {
     output(
         R"cc(
           UPB_INLINE $0 $1_$2(const $1* msg) {
@@ -1464,19 +1593,78 @@ uint64_t GetEncodedTag(const protobuf::FieldDescriptor* field) {
 
 int GetTableSlot(const protobuf::FieldDescriptor* field) {
   uint64_t tag = GetEncodedTag(field);
-  if (tag > 0x7fff) {
-    // Tag must fit within a two-byte varint.
+  if (tag > 0x7fffff) {
+    // Tag must fit within a three-byte varint.
     return -1;
   }
   return (tag & 0xf8) >> 3;
 }
 
+// Returns the tag length suffix of the fast parser's name.
+std::string FastTagBytes(uint64_t expected_tag) {
+  if (expected_tag > 0xffff) return "3";
+  return expected_tag > 0xff ? "2" : "1";
+}
+
+// Returns the expected tag as it is stored in the fast table data.  The first
+// two bytes are XOR'd with the tag by the dispatch; the third byte of a
+// three-byte tag is checked by the parser itself from bits 32-39.
+uint64_t FastTagData(uint64_t expected_tag) {
+  return (expected_tag & 0xffff) | (expected_tag >> 16) << 32;
+}
+
+// Returns the fast parser's name for a map key or value type, or "" if the
+// fast map parsers don't handle it.
+std::string MapFastType(const upb_MiniTable_Field* f) {
+  switch (f->descriptortype) {
+    case kUpb_FieldType_Int32:
+    case kUpb_FieldType_UInt32:
+      return "v4";
+    case kUpb_FieldType_Int64:
+    case kUpb_FieldType_UInt64:
+      return "v8";
+    case kUpb_FieldType_String:
+      return "s";
+    case kUpb_FieldType_Bytes:
+      return "b";
+    case kUpb_FieldType_Message:
+      return "m";
+    default:
+      return "";
+  }
+}
+
+bool TryFillMapTableEntry(const FileLayout& layout,
+                          const protobuf::FieldDescriptor* field,
+                          const upb_MiniTable_Field* mt_f, TableEntry& ent) {
+  const upb_MiniTable* entry = layout.GetMiniTable64(field->message_type());
+  std::string key_type = MapFastType(&entry->fields[0]);
+  std::string val_type = MapFastType(&entry->fields[1]);
+  if (key_type.empty() || key_type == "m" || val_type.empty()) return false;
+
+  // Same data layout as other fields, but maps have no hasbit.  The sub-table
+  // index refers to the map entry.
+  uint64_t expected_tag = GetEncodedTag(field);
+  uint64_t idx = mt_f->submsg_index;
+  if (idx > 255) return false;
+  ent.first = absl::Substitute("upb_pM$0_$1_$2bt", key_type, val_type,
+                               FastTagBytes(expected_tag));
+  ent.second = static_cast<uint64_t>(mt_f->offset) << 48 | idx << 16 |
+               FastTagData(expected_tag);
+  return true;
+}
+
 bool TryFillTableEntry(const FileLayout& layout,
                        const protobuf::FieldDescriptor* field,
                        TableEntry& ent) {
   const upb_MiniTable* mt = layout.GetMiniTable64(field->containing_type());
   const upb_MiniTable_Field* mt_f =
       upb_MiniTable_FindFieldByNumber(mt, field->number());
+  // The fast parsers would parse lazy fields eagerly.
+  if (mt_f->mode & kUpb_LabelFlags_IsLazy) return false;
+  if (upb_FieldMode_Get(mt_f) == kUpb_FieldMode_Map) {
+    return TryFillMapTableEntry(layout, field, mt_f, ent);
+  }
   std::string type = "";
   std::string cardinality = "";
   switch (mt_f->descriptortype) {
@@ -1484,8 +1672,9 @@ bool TryFillTableEntry(const FileLayout& layout,
       type = "b1";
       break;
     case kUpb_FieldType_Enum:
-      // We don't have the means to test proto2 enum fields for valid values.
-      return false;
+      // Only closed enums have this type; open enums are plain int32 fields.
+      type = "e4";
+      break;
     case kUpb_FieldType_Int32:
     case kUpb_FieldType_UInt32:
       type = "v4";
@@ -1525,7 +1714,7 @@ bool TryFillTableEntry(const FileLayout& layout,
 
   switch (upb_FieldMode_Get(mt_f)) {
     case kUpb_FieldMode_Map:
-      return false;  // Not supported yet (ever?).
+      return false;  // Handled by TryFillMapTableEntry() above.
     case kUpb_FieldMode_Array:
       if (mt_f->mode & kUpb_LabelFlags_IsPacked) {
         cardinality = "p";
@@ -1552,13 +1741,17 @@ bool TryFillTableEntry(const FileLayout& layout,
   // |--------|--------|--------|--------|--------|--------|--------|--------|
   //
   // - |presence| is either hasbit index or field number for oneofs.
+  // - For three-byte tags, the low byte of |case offset| holds the third tag
+  //   byte, so these can't be oneofs.
 
-  uint64_t data = static_cast<uint64_t>(mt_f->offset) << 48 | expected_tag;
+  uint64_t data =
+      static_cast<uint64_t>(mt_f->offset) << 48 | FastTagData(expected_tag);
 
   if (field->is_repeated()) {
     // No hasbit/oneof-related fields.
   }
   if (field->real_containing_oneof()) {
+    if (expected_tag > 0xffff) return false;
     size_t case_offset = ~mt_f->presence;
     if (case_offset > 0xffff) return false;
     assert(field->number() < 256);
@@ -1573,6 +1766,13 @@ bool TryFillTableEntry(const FileLayout& layout,
     data |= hasbit_index << 24;
   }
 
+  if (mt_f->descriptortype == kUpb_FieldType_Enum) {
+    // The enum parsers find the upb_MiniTable_Enum through the submsg index.
+    uint64_t idx = mt_f->submsg_index;
+    if (idx > 255) return false;
+    data |= idx << 16;
+  }
+
   if (field->cpp_type() == protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
     uint64_t idx = mt_f->submsg_index;
     if (idx > 255) return false;
@@ -1597,11 +1797,11 @@ bool TryFillTableEntry(const FileLayout& layout,
       }
     }
     ent.first = absl::Substitute("upb_p$0$1_$2bt_max$3b", cardinality, type,
-                                 expected_tag > 0xff ? "2" : "1", size_ceil);
+                                 FastTagBytes(expected_tag), size_ceil);
 
   } else {
     ent.first = absl::Substitute("upb_p$0$1_$2bt", cardinality, type,
-                                 expected_tag > 0xff ? "2" : "1");
+                                 FastTagBytes(expected_tag));
   }
   ent.second = data;
   return true;
@@ -1610,7 +1810,7 @@ bool TryFillTableEntry(const FileLayout& layout,
 std::vector<TableEntry> FastDecodeTable(const protobuf::Descriptor* message,
                                         const FileLayout& layout) {
   std::vector<TableEntry> table;
-  for (const auto field : FieldHotnessOrder(message)) {
+  for (const auto field : FieldHotnessOrder(message, layout.profile())) {
     TableEntry ent;
     int slot = GetTableSlot(field);
     // std::cerr << "table slot: " << field->number() << ": " << slot << "\n";
@@ -1664,6 +1864,10 @@ std::string GetModeInit(uint8_t mode) {
     absl::StrAppend(&ret, " | kUpb_LabelFlags_IsExtension");
   }
 
+  if (mode & kUpb_LabelFlags_IsLazy) {
+    absl::StrAppend(&ret, " | kUpb_LabelFlags_IsLazy");
+  }
+
   std::string rep;
   switch (mode >> kUpb_FieldRep_Shift) {
     case kUpb_FieldRep_1Byte:
@@ -1963,19 +2167,22 @@ bool Generator::Generate(const protobuf::FileDescriptor* file,
                          protoc::GeneratorContext* context,
                          std::string* error) const {
   bool fasttable_enabled = false;
+  FieldProfile profile;
   std::vector<std::pair<std::string, std::string>> params;
   google::protobuf::compiler::ParseGeneratorParameter(parameter, &params);
 
   for (const auto& pair : params) {
     if (pair.first == "fasttable") {
       fasttable_enabled = true;
+    } else if (pair.first == "profile") {
+      if (!ReadFieldProfile(pair.second, &profile, error)) return false;
     } else {
       *error = "Unknown parameter: " + pair.first;
       return false;
     }
   }
 
-  FileLayout layout(file);
+  FileLayout layout(file, profile);
 
   std::unique_ptr<protobuf::io::ZeroCopyOutputStream> h_output_stream(
       context->Open(HeaderFilename(file)));